@@ -26,6 +26,8 @@
 #include <UIKit/UIKit.hpp>
 #include <MetalKit/MetalKit.hpp>
 
+#include "../benchmark/benchmark.hpp"
+
 #pragma region Declarations {
 
 class Renderer
@@ -33,7 +35,8 @@ class Renderer
     public:
         Renderer( MTL::Device* pDevice );
         ~Renderer();
-        void draw( MTK::View* pView );
+        void draw( FrameTarget* pTarget );
+        void waitForIdle();
 
     private:
         MTL::Device* _pDevice;
@@ -82,6 +85,14 @@ int main( int argc, char* argv[] )
 {
     NS::AutoreleasePool* pAutoreleasePool = NS::AutoreleasePool::alloc()->init();
 
+    benchmark::Options options;
+    if ( benchmark::parseOptions( argc, argv, &options ) )
+    {
+        int result = benchmark::run< Renderer >( options, "00-window", MTL::PixelFormatInvalid, MTL::ClearColor::Make( 1.0, 0.0, 0.0, 1.0 ) );
+        pAutoreleasePool->release();
+        return result;
+    }
+
     MyAppDelegate del;
     UI::ApplicationMain(argc, argv, &del);
 
@@ -159,7 +170,8 @@ MyMTKViewDelegate::~MyMTKViewDelegate()
 
 void MyMTKViewDelegate::drawInMTKView( MTK::View* pView )
 {
-    _pRenderer->draw( pView );
+    ViewTarget target( pView );
+    _pRenderer->draw( &target );
 }
 
 #pragma endregion ViewDelegate }
@@ -180,18 +192,29 @@ Renderer::~Renderer()
     _pDevice->release();
 }
 
-void Renderer::draw( MTK::View* pView )
+void Renderer::draw( FrameTarget* pTarget )
 {
     NS::AutoreleasePool* pPool = NS::AutoreleasePool::alloc()->init();
 
     MTL::CommandBuffer* pCmd = _pCommandQueue->commandBuffer();
-    MTL::RenderPassDescriptor* pRpd = pView->currentRenderPassDescriptor();
+    MTL::RenderPassDescriptor* pRpd = pTarget->renderPassDescriptor();
     MTL::RenderCommandEncoder* pEnc = pCmd->renderCommandEncoder( pRpd );
     pEnc->endEncoding();
-    pCmd->presentDrawable( pView->currentDrawable() );
+    if ( MTL::Drawable* pDrawable = pTarget->drawable() )
+    {
+        pCmd->presentDrawable( pDrawable );
+    }
     pCmd->commit();
 
     pPool->release();
 }
 
+void Renderer::waitForIdle()
+{
+    // A queue completes its command buffers in the order they were committed:
+    MTL::CommandBuffer* pCmd = _pCommandQueue->commandBuffer();
+    pCmd->commit();
+    pCmd->waitUntilCompleted();
+}
+
 #pragma endregion Renderer }
@@ -28,6 +28,8 @@
 
 #include <simd/simd.h>
 
+#include "../benchmark/benchmark.hpp"
+
 
 #pragma region Declarations {
 
@@ -38,7 +40,8 @@ class Renderer
         ~Renderer();
         void buildShaders();
         void buildBuffers();
-        void draw( MTK::View* pView );
+        void draw( FrameTarget* pTarget );
+        void waitForIdle();
 
     private:
         MTL::Device* _pDevice;
@@ -90,6 +93,14 @@ int main( int argc, char* argv[] )
 {
     NS::AutoreleasePool* pAutoreleasePool = NS::AutoreleasePool::alloc()->init();
 
+    benchmark::Options options;
+    if ( benchmark::parseOptions( argc, argv, &options ) )
+    {
+        int result = benchmark::run< Renderer >( options, "01-primitive", MTL::PixelFormatInvalid, MTL::ClearColor::Make( 1.0, 0.0, 0.0, 1.0 ) );
+        pAutoreleasePool->release();
+        return result;
+    }
+
     MyAppDelegate del;
     UI::ApplicationMain(argc, argv, &del);
 
@@ -167,7 +178,8 @@ MyMTKViewDelegate::~MyMTKViewDelegate()
 
 void MyMTKViewDelegate::drawInMTKView( MTK::View* pView )
 {
-    _pRenderer->draw( pView );
+    ViewTarget target( pView );
+    _pRenderer->draw( &target );
 }
 
 #pragma endregion ViewDelegate }
@@ -283,12 +295,12 @@ void Renderer::buildBuffers()
     memcpy( _pVertexColorsBuffer->contents(), colors, colorDataSize );
 }
 
-void Renderer::draw( MTK::View* pView )
+void Renderer::draw( FrameTarget* pTarget )
 {
     NS::AutoreleasePool* pPool = NS::AutoreleasePool::alloc()->init();
 
     MTL::CommandBuffer* pCmd = _pCommandQueue->commandBuffer();
-    MTL::RenderPassDescriptor* pRpd = pView->currentRenderPassDescriptor();
+    MTL::RenderPassDescriptor* pRpd = pTarget->renderPassDescriptor();
     MTL::RenderCommandEncoder* pEnc = pCmd->renderCommandEncoder( pRpd );
 
     pEnc->setRenderPipelineState( _pPSO );
@@ -297,10 +309,21 @@ void Renderer::draw( MTK::View* pView )
     pEnc->drawPrimitives( MTL::PrimitiveType::PrimitiveTypeTriangle, NS::UInteger(0), NS::UInteger(3) );
 
     pEnc->endEncoding();
-    pCmd->presentDrawable( pView->currentDrawable() );
+    if ( MTL::Drawable* pDrawable = pTarget->drawable() )
+    {
+        pCmd->presentDrawable( pDrawable );
+    }
     pCmd->commit();
 
     pPool->release();
 }
 
+void Renderer::waitForIdle()
+{
+    // A queue completes its command buffers in the order they were committed:
+    MTL::CommandBuffer* pCmd = _pCommandQueue->commandBuffer();
+    pCmd->commit();
+    pCmd->waitUntilCompleted();
+}
+
 #pragma endregion Renderer }
@@ -28,6 +28,8 @@
 
 #include <simd/simd.h>
 
+#include "../benchmark/benchmark.hpp"
+
 
 #pragma region Declarations {
 
@@ -39,7 +41,8 @@ class Renderer
         void buildShaders();
         void buildBuffers();
         void buildFrameData();
-        void draw( MTK::View* pView );
+        void draw( FrameTarget* pTarget );
+        void waitForIdle();
 
     private:
         MTL::Device* _pDevice;
@@ -98,6 +101,14 @@ int main( int argc, char* argv[] )
 {
     NS::AutoreleasePool* pAutoreleasePool = NS::AutoreleasePool::alloc()->init();
 
+    benchmark::Options options;
+    if ( benchmark::parseOptions( argc, argv, &options ) )
+    {
+        int result = benchmark::run< Renderer >( options, "03-animation", MTL::PixelFormatInvalid, MTL::ClearColor::Make( 1.0, 0.0, 0.0, 1.0 ) );
+        pAutoreleasePool->release();
+        return result;
+    }
+
     MyAppDelegate del;
     UI::ApplicationMain(argc, argv, &del);
 
@@ -175,7 +186,8 @@ MyMTKViewDelegate::~MyMTKViewDelegate()
 
 void MyMTKViewDelegate::drawInMTKView( MTK::View* pView )
 {
-    _pRenderer->draw( pView );
+    ViewTarget target( pView );
+    _pRenderer->draw( &target );
 }
 
 #pragma endregion ViewDelegate }
@@ -345,7 +357,7 @@ void Renderer::buildFrameData()
     }
 }
 
-void Renderer::draw( MTK::View* pView )
+void Renderer::draw( FrameTarget* pTarget )
 {
     NS::AutoreleasePool* pPool = NS::AutoreleasePool::alloc()->init();
 
@@ -361,7 +373,7 @@ void Renderer::draw( MTK::View* pView )
 
     reinterpret_cast< FrameData * >( pFrameDataBuffer->contents() )->angle = (_angle += 0.01f);
 
-    MTL::RenderPassDescriptor* pRpd = pView->currentRenderPassDescriptor();
+    MTL::RenderPassDescriptor* pRpd = pTarget->renderPassDescriptor();
     MTL::RenderCommandEncoder* pEnc = pCmd->renderCommandEncoder( pRpd );
 
     pEnc->setRenderPipelineState( _pPSO );
@@ -373,10 +385,25 @@ void Renderer::draw( MTK::View* pView )
     pEnc->drawPrimitives( MTL::PrimitiveType::PrimitiveTypeTriangle, NS::UInteger(0), NS::UInteger(3) );
 
     pEnc->endEncoding();
-    pCmd->presentDrawable( pView->currentDrawable() );
+    if ( MTL::Drawable* pDrawable = pTarget->drawable() )
+    {
+        pCmd->presentDrawable( pDrawable );
+    }
     pCmd->commit();
 
     pPool->release();
 }
 
+void Renderer::waitForIdle()
+{
+    for ( int i = 0; i < Renderer::kMaxFramesInFlight; ++i )
+    {
+        dispatch_semaphore_wait( _semaphore, DISPATCH_TIME_FOREVER );
+    }
+    for ( int i = 0; i < Renderer::kMaxFramesInFlight; ++i )
+    {
+        dispatch_semaphore_signal( _semaphore );
+    }
+}
+
 #pragma endregion Renderer }
@@ -28,6 +28,8 @@
 
 #include <simd/simd.h>
 
+#include "../benchmark/benchmark.hpp"
+
 static constexpr size_t kNumInstances = 32;
 static constexpr size_t kMaxFramesInFlight = 3;
 
@@ -41,7 +43,8 @@ class Renderer
         ~Renderer();
         void buildShaders();
         void buildBuffers();
-        void draw( MTK::View* pView );
+        void draw( FrameTarget* pTarget );
+        void waitForIdle();
 
     private:
         MTL::Device* _pDevice;
@@ -99,6 +102,14 @@ int main( int argc, char* argv[] )
 {
     NS::AutoreleasePool* pAutoreleasePool = NS::AutoreleasePool::alloc()->init();
 
+    benchmark::Options options;
+    if ( benchmark::parseOptions( argc, argv, &options ) )
+    {
+        int result = benchmark::run< Renderer >( options, "04-instancing", MTL::PixelFormatInvalid, MTL::ClearColor::Make( 1.0, 0.0, 0.0, 1.0 ) );
+        pAutoreleasePool->release();
+        return result;
+    }
+
     MyAppDelegate del;
     UI::ApplicationMain(argc, argv, &del);
 
@@ -176,7 +187,8 @@ MyMTKViewDelegate::~MyMTKViewDelegate()
 
 void MyMTKViewDelegate::drawInMTKView( MTK::View* pView )
 {
-    _pRenderer->draw( pView );
+    ViewTarget target( pView );
+    _pRenderer->draw( &target );
 }
 
 #pragma endregion ViewDelegate }
@@ -331,7 +343,7 @@ void Renderer::buildBuffers()
     }
 }
 
-void Renderer::draw( MTK::View* pView )
+void Renderer::draw( FrameTarget* pTarget )
 {
     using simd::float4;
     using simd::float4x4;
@@ -368,7 +380,7 @@ void Renderer::draw( MTK::View* pView )
         pInstanceData[ i ].instanceColor = (float4){ r, g, b, 1.0f };
     }
 
-    MTL::RenderPassDescriptor* pRpd = pView->currentRenderPassDescriptor();
+    MTL::RenderPassDescriptor* pRpd = pTarget->renderPassDescriptor();
     MTL::RenderCommandEncoder* pEnc = pCmd->renderCommandEncoder( pRpd );
 
     pEnc->setRenderPipelineState( _pPSO );
@@ -385,10 +397,25 @@ void Renderer::draw( MTK::View* pView )
                                 kNumInstances );
 
     pEnc->endEncoding();
-    pCmd->presentDrawable( pView->currentDrawable() );
+    if ( MTL::Drawable* pDrawable = pTarget->drawable() )
+    {
+        pCmd->presentDrawable( pDrawable );
+    }
     pCmd->commit();
 
     pPool->release();
 }
 
+void Renderer::waitForIdle()
+{
+    for ( int i = 0; i < Renderer::kMaxFramesInFlight; ++i )
+    {
+        dispatch_semaphore_wait( _semaphore, DISPATCH_TIME_FOREVER );
+    }
+    for ( int i = 0; i < Renderer::kMaxFramesInFlight; ++i )
+    {
+        dispatch_semaphore_signal( _semaphore );
+    }
+}
+
 #pragma endregion Renderer }
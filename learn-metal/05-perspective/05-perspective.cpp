@@ -28,6 +28,8 @@
 
 #include <simd/simd.h>
 
+#include "../benchmark/benchmark.hpp"
+
 static constexpr size_t kNumInstances = 32;
 static constexpr size_t kMaxFramesInFlight = 3;
 
@@ -54,7 +56,8 @@ class Renderer
         void buildShaders();
         void buildDepthStencilStates();
         void buildBuffers();
-        void draw( MTK::View* pView );
+        void draw( FrameTarget* pTarget );
+        void waitForIdle();
 
     private:
         MTL::Device* _pDevice;
@@ -114,6 +117,14 @@ int main( int argc, char* argv[] )
 {
     NS::AutoreleasePool* pAutoreleasePool = NS::AutoreleasePool::alloc()->init();
 
+    benchmark::Options options;
+    if ( benchmark::parseOptions( argc, argv, &options ) )
+    {
+        int result = benchmark::run< Renderer >( options, "05-perspective", MTL::PixelFormatDepth16Unorm, MTL::ClearColor::Make( 0.1, 0.1, 0.1, 1.0 ) );
+        pAutoreleasePool->release();
+        return result;
+    }
+
     MyAppDelegate del;
     UI::ApplicationMain(argc, argv, &del);
 
@@ -193,7 +204,8 @@ MyMTKViewDelegate::~MyMTKViewDelegate()
 
 void MyMTKViewDelegate::drawInMTKView( MTK::View* pView )
 {
-    _pRenderer->draw( pView );
+    ViewTarget target( pView );
+    _pRenderer->draw( &target );
 }
 
 #pragma endregion ViewDelegate }
@@ -488,7 +500,7 @@ void Renderer::buildBuffers()
     }
 }
 
-void Renderer::draw( MTK::View* pView )
+void Renderer::draw( FrameTarget* pTarget )
 {
     using simd::float3;
     using simd::float4;
@@ -549,7 +561,7 @@ void Renderer::draw( MTK::View* pView )
 
     // Begin render pass:
 
-    MTL::RenderPassDescriptor* pRpd = pView->currentRenderPassDescriptor();
+    MTL::RenderPassDescriptor* pRpd = pTarget->renderPassDescriptor();
     MTL::RenderCommandEncoder* pEnc = pCmd->renderCommandEncoder( pRpd );
 
     pEnc->setRenderPipelineState( _pPSO );
@@ -569,10 +581,25 @@ void Renderer::draw( MTK::View* pView )
                                 kNumInstances );
 
     pEnc->endEncoding();
-    pCmd->presentDrawable( pView->currentDrawable() );
+    if ( MTL::Drawable* pDrawable = pTarget->drawable() )
+    {
+        pCmd->presentDrawable( pDrawable );
+    }
     pCmd->commit();
 
     pPool->release();
 }
 
+void Renderer::waitForIdle()
+{
+    for ( int i = 0; i < Renderer::kMaxFramesInFlight; ++i )
+    {
+        dispatch_semaphore_wait( _semaphore, DISPATCH_TIME_FOREVER );
+    }
+    for ( int i = 0; i < Renderer::kMaxFramesInFlight; ++i )
+    {
+        dispatch_semaphore_signal( _semaphore );
+    }
+}
+
 #pragma endregion Renderer }
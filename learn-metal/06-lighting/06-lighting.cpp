@@ -27,12 +27,18 @@
 #include <MetalKit/MetalKit.hpp>
 
 #include <simd/simd.h>
+#include <algorithm>
+#include <cstdlib>
+
+#include "../benchmark/benchmark.hpp"
 
 static constexpr size_t kInstanceRows = 10;
 static constexpr size_t kInstanceColumns = 10;
 static constexpr size_t kInstanceDepth = 10;
 static constexpr size_t kNumInstances = (kInstanceRows * kInstanceColumns * kInstanceDepth);
 static constexpr size_t kMaxFramesInFlight = 3;
+static constexpr size_t kEncoderThreadCount = 4;
+static constexpr size_t kMaxVertexBuffers = 3;
 
 
 #pragma region Declarations {
@@ -50,6 +56,24 @@ namespace math
     simd::float3x3 discardTranslation( const simd::float4x4& m );
 }
 
+// Skips encoder calls that would not change the bound state. Each thread
+// encodes into its own encoder, so each one gets its own cache.
+class EncoderStateCache
+{
+    public:
+        EncoderStateCache( MTL::RenderCommandEncoder* pEncoder );
+        void setRenderPipelineState( MTL::RenderPipelineState* pPSO );
+        void setDepthStencilState( MTL::DepthStencilState* pDepthStencilState );
+        void setVertexBuffer( MTL::Buffer* pBuffer, NS::UInteger offset, NS::UInteger index );
+
+    private:
+        MTL::RenderCommandEncoder* _pEncoder;
+        MTL::RenderPipelineState* _pPSO;
+        MTL::DepthStencilState* _pDepthStencilState;
+        MTL::Buffer* _pVertexBuffers[ kMaxVertexBuffers ];
+        NS::UInteger _vertexBufferOffsets[ kMaxVertexBuffers ];
+};
+
 class Renderer
 {
     public:
@@ -58,7 +82,10 @@ class Renderer
         void buildShaders();
         void buildDepthStencilStates();
         void buildBuffers();
-        void draw( MTK::View* pView );
+        void encodeDraws( MTL::RenderCommandEncoder* pEnc, size_t firstInstance, size_t instanceCount,
+                          MTL::Buffer* pInstanceDataBuffer, MTL::Buffer* pCameraDataBuffer );
+        void draw( FrameTarget* pTarget );
+        void waitForIdle();
 
     private:
         MTL::Device* _pDevice;
@@ -74,6 +101,7 @@ class Renderer
         int _frame;
         dispatch_semaphore_t _semaphore;
         static const int kMaxFramesInFlight;
+        bool _parallelEncoding;
 };
 
 class MyMTKViewDelegate : public MTK::ViewDelegate
@@ -118,6 +146,14 @@ int main( int argc, char* argv[] )
 {
     NS::AutoreleasePool* pAutoreleasePool = NS::AutoreleasePool::alloc()->init();
 
+    benchmark::Options options;
+    if ( benchmark::parseOptions( argc, argv, &options ) )
+    {
+        int result = benchmark::run< Renderer >( options, "06-lighting", MTL::PixelFormatDepth16Unorm, MTL::ClearColor::Make( 0.1, 0.1, 0.1, 1.0 ) );
+        pAutoreleasePool->release();
+        return result;
+    }
+
     MyAppDelegate del;
     UI::ApplicationMain(argc, argv, &del);
 
@@ -197,7 +233,8 @@ MyMTKViewDelegate::~MyMTKViewDelegate()
 
 void MyMTKViewDelegate::drawInMTKView( MTK::View* pView )
 {
-    _pRenderer->draw( pView );
+    ViewTarget target( pView );
+    _pRenderer->draw( &target );
 }
 
 #pragma endregion ViewDelegate }
@@ -290,6 +327,52 @@ namespace math
 }
 
 
+#pragma mark - EncoderStateCache
+
+EncoderStateCache::EncoderStateCache( MTL::RenderCommandEncoder* pEncoder )
+: _pEncoder( pEncoder )
+, _pPSO( nullptr )
+, _pDepthStencilState( nullptr )
+, _pVertexBuffers{}
+, _vertexBufferOffsets{}
+{
+}
+
+void EncoderStateCache::setRenderPipelineState( MTL::RenderPipelineState* pPSO )
+{
+    if ( _pPSO != pPSO )
+    {
+        _pEncoder->setRenderPipelineState( pPSO );
+        _pPSO = pPSO;
+    }
+}
+
+void EncoderStateCache::setDepthStencilState( MTL::DepthStencilState* pDepthStencilState )
+{
+    if ( _pDepthStencilState != pDepthStencilState )
+    {
+        _pEncoder->setDepthStencilState( pDepthStencilState );
+        _pDepthStencilState = pDepthStencilState;
+    }
+}
+
+void EncoderStateCache::setVertexBuffer( MTL::Buffer* pBuffer, NS::UInteger offset, NS::UInteger index )
+{
+    assert( index < kMaxVertexBuffers );
+    if ( _pVertexBuffers[ index ] != pBuffer )
+    {
+        _pEncoder->setVertexBuffer( pBuffer, offset, index );
+    }
+    else if ( _vertexBufferOffsets[ index ] != offset )
+    {
+        // Moving within the bound buffer is cheaper than rebinding it:
+        _pEncoder->setVertexBufferOffset( offset, index );
+    }
+    _pVertexBuffers[ index ] = pBuffer;
+    _vertexBufferOffsets[ index ] = offset;
+}
+
+
 #pragma mark - Renderer
 #pragma region Renderer {
 
@@ -299,6 +382,7 @@ Renderer::Renderer( MTL::Device* pDevice )
 : _pDevice( pDevice->retain() )
 , _angle ( 0.f )
 , _frame( 0 )
+, _parallelEncoding( getenv( "LEARN_METAL_PARALLEL_ENCODING" ) != nullptr )
 {
     _pCommandQueue = _pDevice->newCommandQueue();
     buildShaders();
@@ -531,7 +615,33 @@ void Renderer::buildBuffers()
     }
 }
 
-void Renderer::draw( MTK::View* pView )
+void Renderer::encodeDraws( MTL::RenderCommandEncoder* pEnc, size_t firstInstance, size_t instanceCount,
+                            MTL::Buffer* pInstanceDataBuffer, MTL::Buffer* pCameraDataBuffer )
+{
+    EncoderStateCache cache( pEnc );
+
+    pEnc->setCullMode( MTL::CullModeBack );
+    pEnc->setFrontFacingWinding( MTL::Winding::WindingCounterClockwise );
+
+    // One draw per cube, as a scene of distinct objects would issue. Only the
+    // instance data offset changes between draws, so the cache drops the rest:
+    for ( size_t i = firstInstance; i < firstInstance + instanceCount; ++i )
+    {
+        cache.setRenderPipelineState( _pPSO );
+        cache.setDepthStencilState( _pDepthStencilState );
+        cache.setVertexBuffer( _pVertexDataBuffer, /* offset */ 0, /* index */ 0 );
+        cache.setVertexBuffer( pInstanceDataBuffer, /* offset */ i * sizeof( shader_types::InstanceData ), /* index */ 1 );
+        cache.setVertexBuffer( pCameraDataBuffer, /* offset */ 0, /* index */ 2 );
+
+        pEnc->drawIndexedPrimitives( MTL::PrimitiveType::PrimitiveTypeTriangle,
+                                    6 * 6, MTL::IndexType::IndexTypeUInt16,
+                                    _pIndexBuffer,
+                                    0,
+                                    1 );
+    }
+}
+
+void Renderer::draw( FrameTarget* pTarget )
 {
     using simd::float3;
     using simd::float4;
@@ -603,7 +713,7 @@ void Renderer::draw( MTK::View* pView )
 
     // Update camera state:
 
-    CGSize drawableSize = pView->drawableSize();
+    CGSize drawableSize = pTarget->drawableSize();
     CGFloat aspectRatio = drawableSize.width / drawableSize.height;
 
     MTL::Buffer* pCameraDataBuffer = _pCameraDataBuffer[ _frame ];
@@ -614,7 +724,41 @@ void Renderer::draw( MTK::View* pView )
 
     // Begin render pass:
 
-    MTL::RenderPassDescriptor* pRpd = pView->currentRenderPassDescriptor();
+    MTL::RenderPassDescriptor* pRpd = pTarget->renderPassDescriptor();
+
+    if ( _parallelEncoding )
+    {
+        // Sub-encoders execute in the order they are created, not the order
+        // they finish encoding in. Creating them up front on this thread
+        // keeps the output identical from frame to frame.
+        MTL::ParallelRenderCommandEncoder* pParallelEnc = pCmd->parallelRenderCommandEncoder( pRpd );
+        MTL::RenderCommandEncoder* pSubEncoders[ kEncoderThreadCount ];
+        for ( size_t i = 0; i < kEncoderThreadCount; ++i )
+        {
+            pSubEncoders[ i ] = pParallelEnc->renderCommandEncoder();
+        }
+
+        // Blocks cannot capture arrays, so hand the workers a pointer:
+        MTL::RenderCommandEncoder** ppSubEncoders = pSubEncoders;
+        const size_t instancesPerThread = (kNumInstances + kEncoderThreadCount - 1) / kEncoderThreadCount;
+        dispatch_apply( kEncoderThreadCount, dispatch_get_global_queue( QOS_CLASS_USER_INTERACTIVE, 0 ), ^( size_t i ){
+            size_t first = std::min( i * instancesPerThread, kNumInstances );
+            size_t count = std::min( instancesPerThread, kNumInstances - first );
+            pRenderer->encodeDraws( ppSubEncoders[ i ], first, count, pInstanceDataBuffer, pCameraDataBuffer );
+            ppSubEncoders[ i ]->endEncoding();
+        });
+
+        pParallelEnc->endEncoding();
+        if ( MTL::Drawable* pDrawable = pTarget->drawable() )
+        {
+            pCmd->presentDrawable( pDrawable );
+        }
+        pCmd->commit();
+
+        pPool->release();
+        return;
+    }
+
     MTL::RenderCommandEncoder* pEnc = pCmd->renderCommandEncoder( pRpd );
 
     pEnc->setRenderPipelineState( _pPSO );
@@ -634,10 +778,25 @@ void Renderer::draw( MTK::View* pView )
                                 kNumInstances );
 
     pEnc->endEncoding();
-    pCmd->presentDrawable( pView->currentDrawable() );
+    if ( MTL::Drawable* pDrawable = pTarget->drawable() )
+    {
+        pCmd->presentDrawable( pDrawable );
+    }
     pCmd->commit();
 
     pPool->release();
 }
 
+void Renderer::waitForIdle()
+{
+    for ( int i = 0; i < Renderer::kMaxFramesInFlight; ++i )
+    {
+        dispatch_semaphore_wait( _semaphore, DISPATCH_TIME_FOREVER );
+    }
+    for ( int i = 0; i < Renderer::kMaxFramesInFlight; ++i )
+    {
+        dispatch_semaphore_signal( _semaphore );
+    }
+}
+
 #pragma endregion Renderer }
@@ -27,12 +27,20 @@
 #include <MetalKit/MetalKit.hpp>
 
 #include <simd/simd.h>
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#include "../benchmark/benchmark.hpp"
+#include "../ktx2/ktx2.hpp"
+#include "../texture-compression/texture-compression.hpp"
 
 static constexpr size_t kInstanceRows = 10;
 static constexpr size_t kInstanceColumns = 10;
 static constexpr size_t kInstanceDepth = 10;
 static constexpr size_t kNumInstances = (kInstanceRows * kInstanceColumns * kInstanceDepth);
 static constexpr size_t kMaxFramesInFlight = 3;
+static constexpr size_t kStagingBufferSize = 4 * 1024 * 1024;
 
 
 #pragma region Declarations {
@@ -50,6 +58,48 @@ namespace math
     simd::float3x3 discardTranslation( const simd::float4x4& m );
 }
 
+class UploadManager
+{
+    public:
+        UploadManager( MTL::Device* pDevice, MTL::CommandQueue* pCommandQueue, size_t ringSize );
+        ~UploadManager();
+        void* stage( size_t size, size_t* pOffset );
+        void copyToTexture( size_t offset, MTL::Texture* pTexture, uint32_t level, uint32_t slice, MTL::Origin origin, MTL::Size size, size_t bytesPerRow );
+        bool uploadTexture( MTL::Texture* pTexture, uint32_t level, uint32_t slice, MTL::Size size, const void* pBytes, size_t bytesPerRow, uint32_t blockHeight );
+        uint64_t flush();
+        bool isComplete( uint64_t value ) const;
+        void wait( uint64_t value );
+        MTL::SharedEvent* event() const;
+
+    private:
+        struct Batch
+        {
+            uint64_t value;
+            size_t end;
+            MTL::CommandBuffer* pCommandBuffer;
+        };
+
+        bool hasSpace( size_t offset, size_t size ) const;
+        void retire();
+
+        MTL::CommandQueue* _pCommandQueue;
+        MTL::Buffer* _pStagingBuffer;
+        MTL::SharedEvent* _pEvent;
+        MTL::CommandBuffer* _pCommandBuffer;
+        MTL::BlitCommandEncoder* _pBlitEncoder;
+        std::deque< Batch > _batches;
+        size_t _ringSize;
+        size_t _head;
+        size_t _tail;
+        uint64_t _nextValue;
+};
+
+namespace ktx2
+{
+    MTL::PixelFormat pixelFormat( const FormatInfo* pFormat );
+    MTL::Texture* newTexture( MTL::Device* pDevice, UploadManager* pUploads, const File& file, SupercompressionDecoder decoder );
+}
+
 class Renderer
 {
     public:
@@ -59,7 +109,8 @@ class Renderer
         void buildDepthStencilStates();
         void buildTextures();
         void buildBuffers();
-        void draw( MTK::View* pView );
+        void draw( FrameTarget* pTarget );
+        void waitForIdle();
 
     private:
         MTL::Device* _pDevice;
@@ -68,6 +119,7 @@ class Renderer
         MTL::RenderPipelineState* _pPSO;
         MTL::DepthStencilState* _pDepthStencilState;
         MTL::Texture* _pTexture;
+        UploadManager* _pUploadManager;
         MTL::Buffer* _pVertexDataBuffer;
         MTL::Buffer* _pInstanceDataBuffer[kMaxFramesInFlight];
         MTL::Buffer* _pCameraDataBuffer[kMaxFramesInFlight];
@@ -120,6 +172,14 @@ int main( int argc, char* argv[] )
 {
     NS::AutoreleasePool* pAutoreleasePool = NS::AutoreleasePool::alloc()->init();
 
+    benchmark::Options options;
+    if ( benchmark::parseOptions( argc, argv, &options ) )
+    {
+        int result = benchmark::run< Renderer >( options, "07-texturing", MTL::PixelFormatDepth16Unorm, MTL::ClearColor::Make( 0.1, 0.1, 0.1, 1.0 ) );
+        pAutoreleasePool->release();
+        return result;
+    }
+
     MyAppDelegate del;
     UI::ApplicationMain(argc, argv, &del);
 
@@ -199,7 +259,8 @@ MyMTKViewDelegate::~MyMTKViewDelegate()
 
 void MyMTKViewDelegate::drawInMTKView( MTK::View* pView )
 {
-    _pRenderer->draw( pView );
+    ViewTarget target( pView );
+    _pRenderer->draw( &target );
 }
 
 #pragma endregion ViewDelegate }
@@ -292,6 +353,282 @@ namespace math
 }
 
 
+#pragma mark - UploadManager
+
+// Staging offsets are aligned so that copies into any pixel format are valid:
+static constexpr size_t kStagingAlignment = 256;
+
+UploadManager::UploadManager( MTL::Device* pDevice, MTL::CommandQueue* pCommandQueue, size_t ringSize )
+: _pCommandQueue( pCommandQueue->retain() )
+, _pCommandBuffer( nullptr )
+, _pBlitEncoder( nullptr )
+, _ringSize( ringSize )
+, _head( 0 )
+, _tail( 0 )
+, _nextValue( 1 )
+{
+    _pStagingBuffer = pDevice->newBuffer( ringSize, MTL::ResourceStorageModeShared | MTL::ResourceCPUCacheModeWriteCombined );
+    _pEvent = pDevice->newSharedEvent();
+}
+
+UploadManager::~UploadManager()
+{
+    wait( flush() );
+    _pEvent->release();
+    _pStagingBuffer->release();
+    _pCommandQueue->release();
+}
+
+bool UploadManager::hasSpace( size_t offset, size_t size ) const
+{
+    if ( offset + size > _ringSize )
+    {
+        return false;
+    }
+    if ( _batches.empty() && !_pCommandBuffer )
+    {
+        return true;
+    }
+    // Space in use runs from _tail to _head, possibly wrapping around the end:
+    if ( _tail < _head )
+    {
+        return offset >= _head || offset + size <= _tail;
+    }
+    return offset >= _head && offset + size <= _tail;
+}
+
+void UploadManager::retire()
+{
+    uint64_t completed = _pEvent->signaledValue();
+    while ( !_batches.empty() && _batches.front().value <= completed )
+    {
+        _tail = _batches.front().end;
+        _batches.front().pCommandBuffer->release();
+        _batches.pop_front();
+    }
+    if ( _batches.empty() && !_pCommandBuffer )
+    {
+        _head = 0;
+        _tail = 0;
+    }
+}
+
+void* UploadManager::stage( size_t size, size_t* pOffset )
+{
+    if ( size > _ringSize )
+    {
+        return nullptr;
+    }
+
+    retire();
+    for ( ;; )
+    {
+        size_t offset = (_head + kStagingAlignment - 1) & ~(kStagingAlignment - 1);
+        if ( offset + size > _ringSize )
+        {
+            offset = 0;
+        }
+        if ( hasSpace( offset, size ) )
+        {
+            if ( !_pCommandBuffer )
+            {
+                _pCommandBuffer = _pCommandQueue->commandBuffer()->retain();
+                _pBlitEncoder = _pCommandBuffer->blitCommandEncoder();
+            }
+
+            _head = offset + size;
+            *pOffset = offset;
+            return reinterpret_cast< uint8_t* >( _pStagingBuffer->contents() ) + offset;
+        }
+
+        // The ring is full: submit what is pending and wait for the oldest batch.
+        flush();
+        wait( _batches.front().value );
+    }
+}
+
+void UploadManager::copyToTexture( size_t offset, MTL::Texture* pTexture, uint32_t level, uint32_t slice, MTL::Origin origin, MTL::Size size, size_t bytesPerRow )
+{
+    assert( _pBlitEncoder );
+    _pBlitEncoder->copyFromBuffer( _pStagingBuffer, offset, bytesPerRow, 0, size,
+                                   pTexture, slice, level, origin );
+}
+
+// Images larger than half the ring go up in bands of whole block rows, so a
+// level of any size streams through the ring without waiting for all of it.
+bool UploadManager::uploadTexture( MTL::Texture* pTexture, uint32_t level, uint32_t slice, MTL::Size size, const void* pBytes, size_t bytesPerRow, uint32_t blockHeight )
+{
+    const uint32_t blockRows = (uint32_t)((size.height + blockHeight - 1) / blockHeight);
+    const uint32_t rowsPerChunk = (uint32_t)std::min< size_t >( blockRows, std::max< size_t >( 1, (_ringSize / 2) / bytesPerRow ) );
+
+    const uint8_t* pSrc = reinterpret_cast< const uint8_t* >( pBytes );
+    for ( uint32_t row = 0; row < blockRows; row += rowsPerChunk )
+    {
+        const uint32_t rows = std::min( rowsPerChunk, blockRows - row );
+        size_t offset = 0;
+        void* pStaging = stage( rows * bytesPerRow, &offset );
+        if ( !pStaging )
+        {
+            return false;
+        }
+
+        memcpy( pStaging, pSrc + row * bytesPerRow, rows * bytesPerRow );
+
+        // The last band may end in a partial block at the bottom edge:
+        const uint32_t y = row * blockHeight;
+        const uint32_t height = std::min< uint32_t >( rows * blockHeight, (uint32_t)size.height - y );
+        copyToTexture( offset, pTexture, level, slice, MTL::Origin( 0, y, 0 ), MTL::Size( size.width, height, 1 ), bytesPerRow );
+    }
+    return true;
+}
+
+uint64_t UploadManager::flush()
+{
+    if ( !_pCommandBuffer )
+    {
+        return _nextValue - 1;
+    }
+
+    // All copies recorded since the last flush go out in one command buffer,
+    // which signals the event once the GPU has finished them:
+    uint64_t value = _nextValue++;
+    _pBlitEncoder->endEncoding();
+    _pCommandBuffer->encodeSignalEvent( _pEvent, value );
+    _pCommandBuffer->commit();
+
+    _batches.push_back( { value, _head, _pCommandBuffer } );
+    _pCommandBuffer = nullptr;
+    _pBlitEncoder = nullptr;
+    return value;
+}
+
+bool UploadManager::isComplete( uint64_t value ) const
+{
+    return _pEvent->signaledValue() >= value;
+}
+
+void UploadManager::wait( uint64_t value )
+{
+    while ( !_batches.empty() && _batches.front().value <= value )
+    {
+        _batches.front().pCommandBuffer->waitUntilCompleted();
+        _tail = _batches.front().end;
+        _batches.front().pCommandBuffer->release();
+        _batches.pop_front();
+    }
+    retire();
+}
+
+MTL::SharedEvent* UploadManager::event() const
+{
+    return _pEvent;
+}
+
+
+#pragma mark - KTX2
+
+namespace ktx2
+{
+    MTL::PixelFormat pixelFormat( const FormatInfo* pFormat )
+    {
+        static constexpr struct { uint32_t vkFormat; MTL::PixelFormat pixelFormat; } kPixelFormats[] = {
+            {  37, MTL::PixelFormatRGBA8Unorm },
+            {  43, MTL::PixelFormatRGBA8Unorm_sRGB },
+            {  44, MTL::PixelFormatBGRA8Unorm },
+            {  50, MTL::PixelFormatBGRA8Unorm_sRGB },
+            { 133, MTL::PixelFormatBC1_RGBA },
+            { 134, MTL::PixelFormatBC1_RGBA_sRGB },
+            { 137, MTL::PixelFormatBC3_RGBA },
+            { 138, MTL::PixelFormatBC3_RGBA_sRGB },
+            { 145, MTL::PixelFormatBC7_RGBAUnorm },
+            { 146, MTL::PixelFormatBC7_RGBAUnorm_sRGB },
+            { 147, MTL::PixelFormatETC2_RGB8 },
+            { 148, MTL::PixelFormatETC2_RGB8_sRGB },
+            { 157, MTL::PixelFormatASTC_4x4_LDR },
+            { 158, MTL::PixelFormatASTC_4x4_sRGB },
+            { 165, MTL::PixelFormatASTC_6x6_LDR },
+            { 166, MTL::PixelFormatASTC_6x6_sRGB },
+            { 171, MTL::PixelFormatASTC_8x8_LDR },
+            { 172, MTL::PixelFormatASTC_8x8_sRGB },
+        };
+        for ( const auto& entry : kPixelFormats )
+        {
+            if ( entry.vkFormat == pFormat->vkFormat )
+            {
+                return entry.pixelFormat;
+            }
+        }
+        return MTL::PixelFormatInvalid;
+    }
+
+    MTL::Texture* newTexture( MTL::Device* pDevice, UploadManager* pUploads, const File& file, SupercompressionDecoder decoder )
+    {
+        if ( file.supercompressionScheme != 0 && !decoder )
+        {
+            return nullptr;
+        }
+
+        MTL::TextureDescriptor* pTextureDesc = MTL::TextureDescriptor::alloc()->init();
+        pTextureDesc->setWidth( file.width );
+        pTextureDesc->setHeight( file.height );
+        pTextureDesc->setPixelFormat( pixelFormat( file.pFormat ) );
+        pTextureDesc->setMipmapLevelCount( file.levelCount );
+        if ( file.faceCount == 6 )
+        {
+            pTextureDesc->setTextureType( file.layerCount > 1 ? MTL::TextureTypeCubeArray : MTL::TextureTypeCube );
+        }
+        else
+        {
+            pTextureDesc->setTextureType( file.layerCount > 1 ? MTL::TextureType2DArray : MTL::TextureType2D );
+        }
+        pTextureDesc->setArrayLength( file.layerCount );
+        pTextureDesc->setStorageMode( MTL::StorageModePrivate );
+        pTextureDesc->setUsage( MTL::TextureUsageShaderRead );
+
+        MTL::Texture* pTexture = pDevice->newTexture( pTextureDesc );
+        pTextureDesc->release();
+
+        std::vector< uint8_t > decoded;
+        for ( uint32_t i = 0; i < file.levelCount; ++i )
+        {
+            const Level& level = file.levels[ i ];
+            const uint8_t* pLevelData = file.pData + level.byteOffset;
+
+            // Supercompressed levels are expanded into cached memory first;
+            // decoders read back their own output, which is slow from the
+            // write-combined staging buffer.
+            if ( file.supercompressionScheme != 0 )
+            {
+                decoded.resize( level.uncompressedByteLength );
+                if ( !decoder( file.supercompressionScheme, pLevelData, level.byteLength, decoded.data(), decoded.size() ) )
+                {
+                    pTexture->release();
+                    return nullptr;
+                }
+                pLevelData = decoded.data();
+            }
+
+            // Layers and faces are stored one after another within the level:
+            uint32_t w = std::max( 1u, file.width >> i );
+            uint32_t h = std::max( 1u, file.height >> i );
+            size_t bytesPerRow = levelBytesPerRow( file, i );
+            size_t bytesPerImage = levelImageSize( file, i );
+            for ( uint32_t slice = 0; slice < file.layerCount * file.faceCount; ++slice )
+            {
+                if ( !pUploads->uploadTexture( pTexture, i, slice, MTL::Size( w, h, 1 ), pLevelData + slice * bytesPerImage,
+                                               bytesPerRow, file.pFormat->blockHeight ) )
+                {
+                    pTexture->release();
+                    return nullptr;
+                }
+            }
+        }
+
+        return pTexture;
+    }
+}
+
+
 #pragma mark - Renderer
 #pragma region Renderer {
 
@@ -303,16 +640,21 @@ Renderer::Renderer( MTL::Device* pDevice )
 , _frame( 0 )
 {
     _pCommandQueue = _pDevice->newCommandQueue();
+    _pUploadManager = new UploadManager( _pDevice, _pCommandQueue, kStagingBufferSize );
     buildShaders();
     buildDepthStencilStates();
     buildTextures();
     buildBuffers();
 
+    // Submit the texture uploads; later command buffers on the same queue see their results.
+    _pUploadManager->flush();
+
     _semaphore = dispatch_semaphore_create( Renderer::kMaxFramesInFlight );
 }
 
 Renderer::~Renderer()
 {
+    delete _pUploadManager;
     _pTexture->release();
     _pShaderLibrary->release();
     _pDepthStencilState->release();
@@ -418,7 +760,7 @@ void Renderer::buildShaders()
 
         half4 fragment fragmentMain( v2f in [[stage_in]], texture2d< half, access::sample > tex [[texture(0)]] )
         {
-            constexpr sampler s( address::repeat, filter::linear );
+            constexpr sampler s( address::repeat, filter::linear, mip_filter::linear );
             half3 texel = tex.sample( s, in.texcoord ).rgb;
 
             // assume light coming from (front-top-right)
@@ -475,16 +817,50 @@ void Renderer::buildDepthStencilStates()
 
 void Renderer::buildTextures()
 {
+    // Use a texture shipped with the app when there is one:
+    NS::String* pPath = NS::Bundle::mainBundle()->resourcePath()->stringByAppendingString( NS::String::string( "/texture.ktx2", NS::UTF8StringEncoding ) );
+    ktx2::File file;
+    if ( ktx2::map( pPath->utf8String(), &file ) )
+    {
+        // The fragment shader samples a texture2d, so arrays and cube maps
+        // can't replace the checkerboard:
+        if ( file.layerCount == 1 && file.faceCount == 1 )
+        {
+            _pTexture = ktx2::newTexture( _pDevice, _pUploadManager, file, nullptr );
+        }
+        ktx2::unmap( &file );
+        if ( _pTexture )
+        {
+            return;
+        }
+    }
+
     const uint32_t tw = 128;
     const uint32_t th = 128;
 
+    // Prefer a block-compressed format the GPU can sample directly. ASTC is
+    // available on every Apple GPU, BC on Macs running iOS apps:
+    bool compressed = true;
+    texcomp::Format format = texcomp::Format::ASTC4x4;
+    MTL::PixelFormat pixelFormat = MTL::PixelFormatASTC_4x4_LDR;
+    if ( !_pDevice->supportsFamily( MTL::GPUFamilyApple2 ) )
+    {
+        format = texcomp::Format::BC1;
+        pixelFormat = MTL::PixelFormatBC1_RGBA;
+        compressed = _pDevice->supportsBCTextureCompression();
+    }
+    if ( !compressed )
+    {
+        pixelFormat = MTL::PixelFormatRGBA8Unorm;
+    }
+
     MTL::TextureDescriptor* pTextureDesc = MTL::TextureDescriptor::alloc()->init();
     pTextureDesc->setWidth( tw );
     pTextureDesc->setHeight( th );
-    pTextureDesc->setPixelFormat( MTL::PixelFormatRGBA8Unorm );
+    pTextureDesc->setPixelFormat( pixelFormat );
     pTextureDesc->setTextureType( MTL::TextureType2D );
-    pTextureDesc->setStorageMode( MTL::StorageModeShared );
-    pTextureDesc->setUsage( MTL::ResourceUsageSample | MTL::ResourceUsageRead );
+    pTextureDesc->setStorageMode( MTL::StorageModePrivate );
+    pTextureDesc->setUsage( MTL::TextureUsageShaderRead );
 
     MTL::Texture *pTexture = _pDevice->newTexture( pTextureDesc );
     _pTexture = pTexture;
@@ -506,7 +882,17 @@ void Renderer::buildTextures()
         }
     }
 
-    _pTexture->replaceRegion( MTL::Region( 0, 0, 0, tw, th, 1 ), 0, pTextureData, tw * 4 );
+    if ( compressed )
+    {
+        std::vector< uint8_t > blocks( texcomp::compressedSize( format, tw, th ) );
+        texcomp::compress( format, pTextureData, tw, th, blocks.data() );
+        _pUploadManager->uploadTexture( _pTexture, 0, 0, MTL::Size( tw, th, 1 ), blocks.data(),
+                                        texcomp::compressedBytesPerRow( format, tw ), texcomp::kBlockDim );
+    }
+    else
+    {
+        _pUploadManager->uploadTexture( _pTexture, 0, 0, MTL::Size( tw, th, 1 ), pTextureData, tw * 4, 1 );
+    }
 
     pTextureDesc->release();
 }
@@ -586,7 +972,7 @@ void Renderer::buildBuffers()
     }
 }
 
-void Renderer::draw( MTK::View* pView )
+void Renderer::draw( FrameTarget* pTarget )
 {
     using simd::float3;
     using simd::float4;
@@ -656,7 +1042,7 @@ void Renderer::draw( MTK::View* pView )
 
     // Update camera state:
 
-    CGSize drawableSize = pView->drawableSize();
+    CGSize drawableSize = pTarget->drawableSize();
     CGFloat aspectRatio = drawableSize.width / drawableSize.height;
 
     MTL::Buffer* pCameraDataBuffer = _pCameraDataBuffer[ _frame ];
@@ -667,7 +1053,7 @@ void Renderer::draw( MTK::View* pView )
 
     // Begin render pass:
 
-    MTL::RenderPassDescriptor* pRpd = pView->currentRenderPassDescriptor();
+    MTL::RenderPassDescriptor* pRpd = pTarget->renderPassDescriptor();
     MTL::RenderCommandEncoder* pEnc = pCmd->renderCommandEncoder( pRpd );
 
     pEnc->setRenderPipelineState( _pPSO );
@@ -689,10 +1075,25 @@ void Renderer::draw( MTK::View* pView )
                                 kNumInstances );
 
     pEnc->endEncoding();
-    pCmd->presentDrawable( pView->currentDrawable() );
+    if ( MTL::Drawable* pDrawable = pTarget->drawable() )
+    {
+        pCmd->presentDrawable( pDrawable );
+    }
     pCmd->commit();
 
     pPool->release();
 }
 
+void Renderer::waitForIdle()
+{
+    for ( int i = 0; i < Renderer::kMaxFramesInFlight; ++i )
+    {
+        dispatch_semaphore_wait( _semaphore, DISPATCH_TIME_FOREVER );
+    }
+    for ( int i = 0; i < Renderer::kMaxFramesInFlight; ++i )
+    {
+        dispatch_semaphore_signal( _semaphore );
+    }
+}
+
 #pragma endregion Renderer }
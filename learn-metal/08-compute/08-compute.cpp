@@ -27,6 +27,13 @@
 #include <MetalKit/MetalKit.hpp>
 
 #include <simd/simd.h>
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+#include "../benchmark/benchmark.hpp"
+#include "../culling/culling.hpp"
+#include "../mipmap/mipmap.hpp"
 
 static constexpr size_t kInstanceRows = 10;
 static constexpr size_t kInstanceColumns = 10;
@@ -35,6 +42,9 @@ static constexpr size_t kNumInstances = (kInstanceRows * kInstanceColumns * kIns
 static constexpr size_t kMaxFramesInFlight = 3;
 static constexpr uint32_t kTextureWidth = 128;
 static constexpr uint32_t kTextureHeight = 128;
+static constexpr uint32_t kTextureMipCount = mipmap::levelCount( kTextureWidth, kTextureHeight );
+static constexpr uint32_t kMeshCount = 1;
+static constexpr float kInstanceScale = 0.2f;
 
 
 #pragma region Declarations {
@@ -50,6 +60,7 @@ namespace math
     simd::float4x4 makeTranslate( const simd::float3& v );
     simd::float4x4 makeScale( const simd::float3& v );
     simd::float3x3 discardTranslation( const simd::float4x4& m );
+    void extractFrustumPlanes( const simd::float4x4& m, simd::float4* pPlanes );
 }
 
 class Renderer
@@ -59,11 +70,15 @@ class Renderer
         ~Renderer();
         void buildShaders();
         void buildComputePipeline();
+        void buildCullingPipelines();
         void buildDepthStencilStates();
         void buildTextures();
         void buildBuffers();
         void generateMandelbrotTexture();
-        void draw( MTK::View* pView );
+        void encodeCulling( MTL::CommandBuffer* pCommandBuffer );
+        void validateCulling( int frame );
+        void draw( FrameTarget* pTarget );
+        void waitForIdle();
 
     private:
         MTL::Device* _pDevice;
@@ -71,12 +86,23 @@ class Renderer
         MTL::Library* _pShaderLibrary;
         MTL::RenderPipelineState* _pPSO;
         MTL::ComputePipelineState* _pComputePSO;
+        MTL::ComputePipelineState* _pCullPSO;
+        MTL::ComputePipelineState* _pEncodeDrawsPSO;
         MTL::DepthStencilState* _pDepthStencilState;
         MTL::Texture* _pTexture;
         MTL::Buffer* _pVertexDataBuffer;
+        MTL::Buffer* _pInstanceSourceBuffer;
         MTL::Buffer* _pInstanceDataBuffer[kMaxFramesInFlight];
         MTL::Buffer* _pCameraDataBuffer[kMaxFramesInFlight];
+        MTL::Buffer* _pCullUniformsBuffer[kMaxFramesInFlight];
+        MTL::Buffer* _pVisibleInstanceBuffer[kMaxFramesInFlight];
+        MTL::Buffer* _pDrawArgumentsBuffer[kMaxFramesInFlight];
+        MTL::IndirectCommandBuffer* _pIndirectCommandBuffer[kMaxFramesInFlight];
+        MTL::Buffer* _pDrawCommandsBuffer[kMaxFramesInFlight];
         MTL::Buffer* _pIndexBuffer;
+        uint32_t _baseInstances[kMeshCount];
+        bool _useIndirectCommandBuffer;
+        bool _validateCulling;
         float _angle;
         int _frame;
         dispatch_semaphore_t _semaphore;
@@ -125,6 +151,14 @@ int main( int argc, char* argv[] )
 {
     NS::AutoreleasePool* pAutoreleasePool = NS::AutoreleasePool::alloc()->init();
 
+    benchmark::Options options;
+    if ( benchmark::parseOptions( argc, argv, &options ) )
+    {
+        int result = benchmark::run< Renderer >( options, "08-compute", MTL::PixelFormatDepth16Unorm, MTL::ClearColor::Make( 0.1, 0.1, 0.1, 1.0 ) );
+        pAutoreleasePool->release();
+        return result;
+    }
+
     MyAppDelegate del;
     UI::ApplicationMain(argc, argv, &del);
 
@@ -204,7 +238,8 @@ MyMTKViewDelegate::~MyMTKViewDelegate()
 
 void MyMTKViewDelegate::drawInMTKView( MTK::View* pView )
 {
-    _pRenderer->draw( pView );
+    ViewTarget target( pView );
+    _pRenderer->draw( &target );
 }
 
 #pragma endregion ViewDelegate }
@@ -294,6 +329,29 @@ namespace math
         return simd_matrix( m.columns[0].xyz, m.columns[1].xyz, m.columns[2].xyz );
     }
 
+    void extractFrustumPlanes( const simd::float4x4& m, simd::float4* pPlanes )
+    {
+        // Planes of the clip volume -w <= x, y <= w and 0 <= z <= w, taken from
+        // the rows of the matrix and normalized so that dot() gives distances:
+        using simd::float4;
+        float4 rows[4];
+        for ( int r = 0; r < 4; ++r )
+        {
+            rows[ r ] = (float4){ m.columns[0][r], m.columns[1][r], m.columns[2][r], m.columns[3][r] };
+        }
+
+        pPlanes[0] = rows[3] + rows[0];
+        pPlanes[1] = rows[3] - rows[0];
+        pPlanes[2] = rows[3] + rows[1];
+        pPlanes[3] = rows[3] - rows[1];
+        pPlanes[4] = rows[2];
+        pPlanes[5] = rows[3] - rows[2];
+        for ( int i = 0; i < 6; ++i )
+        {
+            pPlanes[ i ] /= simd::length( pPlanes[ i ].xyz );
+        }
+    }
+
 }
 
 
@@ -304,12 +362,17 @@ const int Renderer::kMaxFramesInFlight = 3;
 
 Renderer::Renderer( MTL::Device* pDevice )
 : _pDevice( pDevice->retain() )
+, _pIndirectCommandBuffer{}
+, _pDrawCommandsBuffer{}
+, _useIndirectCommandBuffer( getenv( "LEARN_METAL_ICB" ) != nullptr )
+, _validateCulling( getenv( "LEARN_METAL_VALIDATE_CULLING" ) != nullptr )
 , _angle ( 0.f )
 , _frame( 0 )
 {
     _pCommandQueue = _pDevice->newCommandQueue();
     buildShaders();
     buildComputePipeline();
+    buildCullingPipelines();
     buildDepthStencilStates();
     buildTextures();
     buildBuffers();
@@ -324,15 +387,26 @@ Renderer::~Renderer()
     _pShaderLibrary->release();
     _pDepthStencilState->release();
     _pVertexDataBuffer->release();
+    _pInstanceSourceBuffer->release();
     for ( int i = 0; i < kMaxFramesInFlight; ++i )
     {
         _pInstanceDataBuffer[i]->release();
+        _pCullUniformsBuffer[i]->release();
+        _pVisibleInstanceBuffer[i]->release();
+        _pDrawArgumentsBuffer[i]->release();
+        if ( _pIndirectCommandBuffer[i] )
+        {
+            _pIndirectCommandBuffer[i]->release();
+            _pDrawCommandsBuffer[i]->release();
+        }
     }
     for ( int i = 0; i < kMaxFramesInFlight; ++i )
     {
         _pCameraDataBuffer[i]->release();
     }
     _pIndexBuffer->release();
+    _pEncodeDrawsPSO->release();
+    _pCullPSO->release();
     _pComputePSO->release();
     _pPSO->release();
     _pCommandQueue->release();
@@ -361,6 +435,51 @@ namespace shader_types
         simd::float4x4 worldTransform;
         simd::float3x3 worldNormalTransform;
     };
+
+    // The parts of an instance that never change. ix and iy select the
+    // rotations that the instance picks from the per-frame tables.
+    struct InstanceSource
+    {
+        simd::float3 offset;
+        uint32_t ix;
+        uint32_t iy;
+        uint32_t mesh;
+        simd::float4 color;
+    };
+
+    struct CullUniforms
+    {
+        simd::float4x4 objectTransform;
+        simd::float4 frustumPlanes[6];
+        float scale;
+        float boundingRadius;
+        uint32_t instanceCount;
+        uint32_t rowCount;
+    };
+}
+
+namespace cull
+{
+    // The rotation tables follow the uniforms in the same buffer, at an offset
+    // that is valid for a constant buffer binding:
+    static constexpr size_t kRotationsOffset = (sizeof( shader_types::CullUniforms ) + 255) & ~size_t( 255 );
+    static constexpr size_t kUniformsBufferSize = kRotationsOffset + 2 * kInstanceRows * sizeof( simd::float4x4 );
+
+    // The sample's types for the reference in culling.hpp:
+    struct Types
+    {
+        using float3x3 = simd::float3x3;
+        using float4 = simd::float4;
+        using float4x4 = simd::float4x4;
+        using InstanceSource = shader_types::InstanceSource;
+        using InstanceData = shader_types::InstanceData;
+        using CullUniforms = shader_types::CullUniforms;
+        using DrawArguments = MTL::DrawIndexedPrimitivesIndirectArguments;
+
+        static float4 makeFloat4( float x, float y, float z, float w ) { return (float4){ x, y, z, w }; }
+        static float4x4 makeMatrix( float4 c0, float4 c1, float4 c2, float4 c3 ) { return simd_matrix( c0, c1, c2, c3 ); }
+        static float3x3 discardTranslation( const float4x4& m ) { return math::discardTranslation( m ); }
+    };
 }
 
 void Renderer::buildShaders()
@@ -403,30 +522,34 @@ void Renderer::buildShaders()
         v2f vertex vertexMain( device const VertexData* vertexData [[buffer(0)]],
                                device const InstanceData* instanceData [[buffer(1)]],
                                device const CameraData& cameraData [[buffer(2)]],
+                               device const uint* visibleInstances [[buffer(3)]],
                                uint vertexId [[vertex_id]],
                                uint instanceId [[instance_id]] )
         {
             v2f o;
 
+            // Only visible instances are drawn, so look up which one this is:
+            const device InstanceData& instance = instanceData[ visibleInstances[ instanceId ] ];
+
             const device VertexData& vd = vertexData[ vertexId ];
             float4 pos = float4( vd.position, 1.0 );
-            pos = instanceData[ instanceId ].instanceTransform * pos;
+            pos = instance.instanceTransform * pos;
             pos = cameraData.perspectiveTransform * cameraData.worldTransform * pos;
             o.position = pos;
 
-            float3 normal = instanceData[ instanceId ].instanceNormalTransform * vd.normal;
+            float3 normal = instance.instanceNormalTransform * vd.normal;
             normal = cameraData.worldNormalTransform * normal;
             o.normal = normal;
 
             o.texcoord = vd.texcoord.xy;
 
-            o.color = half3( instanceData[ instanceId ].instanceColor.rgb );
+            o.color = half3( instance.instanceColor.rgb );
             return o;
         }
 
         half4 fragment fragmentMain( v2f in [[stage_in]], texture2d< half, access::sample > tex [[texture(0)]] )
         {
-            constexpr sampler s( address::repeat, filter::linear );
+            constexpr sampler s( address::repeat, filter::linear, mip_filter::linear );
             half3 texel = tex.sample( s, in.texcoord ).rgb;
 
             // assume light coming from (front-top-right)
@@ -456,6 +579,7 @@ void Renderer::buildShaders()
     pDesc->setFragmentFunction( pFragFn );
     pDesc->colorAttachments()->object(0)->setPixelFormat( MTL::PixelFormat::PixelFormatBGRA8Unorm_sRGB );
     pDesc->setDepthAttachmentPixelFormat( MTL::PixelFormat::PixelFormatDepth16Unorm );
+    pDesc->setSupportIndirectCommandBuffers( _useIndirectCommandBuffer );
 
     _pPSO = _pDevice->newRenderPipelineState( pDesc, &pError );
     if ( !_pPSO )
@@ -523,6 +647,183 @@ void Renderer::buildComputePipeline()
     pComputeLibrary->release();
 }
 
+void Renderer::buildCullingPipelines()
+{
+    const char* kernelSrc = R"(
+        #include <metal_stdlib>
+        using namespace metal;
+
+        struct InstanceData
+        {
+            float4x4 instanceTransform;
+            float3x3 instanceNormalTransform;
+            float4 instanceColor;
+        };
+
+        struct InstanceSource
+        {
+            float3 offset;
+            uint ix;
+            uint iy;
+            uint mesh;
+            float4 color;
+        };
+
+        struct CullUniforms
+        {
+            float4x4 objectTransform;
+            float4 frustumPlanes[6];
+            float scale;
+            float boundingRadius;
+            uint instanceCount;
+            uint rowCount;
+        };
+
+        // Matches MTL::DrawIndexedPrimitivesIndirectArguments:
+        struct DrawArguments
+        {
+            uint indexCount;
+            atomic_uint instanceCount;
+            uint indexStart;
+            int baseVertex;
+            uint baseInstance;
+        };
+
+        struct DrawArgumentValues
+        {
+            uint indexCount;
+            uint instanceCount;
+            uint indexStart;
+            int baseVertex;
+            uint baseInstance;
+        };
+
+        struct DrawCommands
+        {
+            command_buffer commands [[id(0)]];
+        };
+
+        kernel void cullInstances( device const InstanceSource* sources [[buffer(0)]],
+                                   constant CullUniforms& uniforms [[buffer(1)]],
+                                   constant float4x4* rotations [[buffer(2)]],
+                                   device InstanceData* instances [[buffer(3)]],
+                                   device uint* visibleInstances [[buffer(4)]],
+                                   device DrawArguments* drawArguments [[buffer(5)]],
+                                   uint index [[thread_position_in_grid]] )
+        {
+            if ( index >= uniforms.instanceCount )
+            {
+                return;
+            }
+
+            // Keep in step with cull::cullInstancesReference():
+            InstanceSource source = sources[ index ];
+            float4x4 translate = float4x4( float4( 1, 0, 0, 0 ), float4( 0, 1, 0, 0 ), float4( 0, 0, 1, 0 ), float4( source.offset, 1 ) );
+            float4x4 scale = float4x4( float4( uniforms.scale, 0, 0, 0 ), float4( 0, uniforms.scale, 0, 0 ),
+                                       float4( 0, 0, uniforms.scale, 0 ), float4( 0, 0, 0, 1 ) );
+            float4x4 zrot = rotations[ source.ix ];
+            float4x4 yrot = rotations[ uniforms.rowCount + source.iy ];
+            float4x4 transform = uniforms.objectTransform * translate * yrot * zrot * scale;
+
+            instances[ index ].instanceTransform = transform;
+            instances[ index ].instanceNormalTransform = float3x3( transform[0].xyz, transform[1].xyz, transform[2].xyz );
+            instances[ index ].instanceColor = source.color;
+
+            // Test the bounding sphere against each frustum plane:
+            float3 center = transform[3].xyz;
+            for ( uint i = 0; i < 6; ++i )
+            {
+                float4 plane = uniforms.frustumPlanes[ i ];
+                if ( !(plane.x * center.x + plane.y * center.y + plane.z * center.z + plane.w >= -uniforms.boundingRadius) )
+                {
+                    return;
+                }
+            }
+
+            device DrawArguments& args = drawArguments[ source.mesh ];
+            uint slot = atomic_fetch_add_explicit( &args.instanceCount, 1, memory_order_relaxed );
+            visibleInstances[ args.baseInstance + slot ] = index;
+        }
+
+        kernel void encodeDraws( device const DrawArgumentValues* drawArguments [[buffer(0)]],
+                                 device const ushort* indices [[buffer(1)]],
+                                 device DrawCommands& drawCommands [[buffer(2)]],
+                                 constant uint& meshCount [[buffer(3)]],
+                                 uint mesh [[thread_position_in_grid]] )
+        {
+            if ( mesh >= meshCount )
+            {
+                return;
+            }
+
+            // One command per mesh. The pipeline and buffers come from the
+            // render encoder that executes the commands:
+            render_command command( drawCommands.commands, mesh );
+            device const DrawArgumentValues& args = drawArguments[ mesh ];
+            if ( args.instanceCount == 0 )
+            {
+                command.reset();
+                return;
+            }
+            command.draw_indexed_primitives( primitive_type::triangle, args.indexCount, indices + args.indexStart,
+                                             args.instanceCount, args.baseVertex, args.baseInstance );
+        })";
+    NS::Error* pError = nullptr;
+
+    // Without fast math, the kernel rounds like the CPU reference does:
+    MTL::CompileOptions* pOptions = MTL::CompileOptions::alloc()->init();
+    pOptions->setMathMode( MTL::MathModeSafe );
+
+    MTL::Library* pCullLibrary = _pDevice->newLibrary( NS::String::string(kernelSrc, NS::UTF8StringEncoding), pOptions, &pError );
+    pOptions->release();
+    if ( !pCullLibrary )
+    {
+        __builtin_printf( "%s", pError->localizedDescription()->utf8String() );
+        assert(false);
+    }
+
+    MTL::Function* pCullFn = pCullLibrary->newFunction( NS::String::string("cullInstances", NS::UTF8StringEncoding) );
+    MTL::Function* pEncodeDrawsFn = pCullLibrary->newFunction( NS::String::string("encodeDraws", NS::UTF8StringEncoding) );
+    _pCullPSO = _pDevice->newComputePipelineState( pCullFn, &pError );
+    if ( !_pCullPSO )
+    {
+        __builtin_printf( "%s", pError->localizedDescription()->utf8String() );
+        assert(false);
+    }
+    _pEncodeDrawsPSO = _pDevice->newComputePipelineState( pEncodeDrawsFn, &pError );
+    if ( !_pEncodeDrawsPSO )
+    {
+        __builtin_printf( "%s", pError->localizedDescription()->utf8String() );
+        assert(false);
+    }
+
+    if ( _useIndirectCommandBuffer )
+    {
+        // Each frame in flight gets its own commands, plus an argument buffer
+        // that hands them to the encodeDraws kernel:
+        MTL::IndirectCommandBufferDescriptor* pIcbDesc = MTL::IndirectCommandBufferDescriptor::alloc()->init();
+        pIcbDesc->setCommandTypes( MTL::IndirectCommandTypeDrawIndexed );
+        pIcbDesc->setInheritPipelineState( true );
+        pIcbDesc->setInheritBuffers( true );
+
+        MTL::ArgumentEncoder* pArgumentEncoder = pEncodeDrawsFn->newArgumentEncoder( 2 );
+        for ( size_t i = 0; i < kMaxFramesInFlight; ++i )
+        {
+            _pIndirectCommandBuffer[ i ] = _pDevice->newIndirectCommandBuffer( pIcbDesc, kMeshCount, MTL::ResourceStorageModePrivate );
+            _pDrawCommandsBuffer[ i ] = _pDevice->newBuffer( pArgumentEncoder->encodedLength(), MTL::ResourceStorageModeShared );
+            pArgumentEncoder->setArgumentBuffer( _pDrawCommandsBuffer[ i ], 0 );
+            pArgumentEncoder->setIndirectCommandBuffer( _pIndirectCommandBuffer[ i ], 0 );
+        }
+
+        pArgumentEncoder->release();
+        pIcbDesc->release();
+    }
+
+    pEncodeDrawsFn->release();
+    pCullFn->release();
+    pCullLibrary->release();
+}
+
 void Renderer::buildDepthStencilStates()
 {
     MTL::DepthStencilDescriptor* pDsDesc = MTL::DepthStencilDescriptor::alloc()->init();
@@ -539,6 +840,7 @@ void Renderer::buildTextures()
     MTL::TextureDescriptor* pTextureDesc = MTL::TextureDescriptor::alloc()->init();
     pTextureDesc->setWidth( kTextureWidth );
     pTextureDesc->setHeight( kTextureHeight );
+    pTextureDesc->setMipmapLevelCount( kTextureMipCount );
     pTextureDesc->setPixelFormat( MTL::PixelFormatRGBA8Unorm );
     pTextureDesc->setTextureType( MTL::TextureType2D );
     pTextureDesc->setStorageMode( MTL::StorageModeShared );
@@ -623,6 +925,57 @@ void Renderer::buildBuffers()
     {
         _pCameraDataBuffer[ i ] = _pDevice->newBuffer( cameraDataSize, MTL::ResourceStorageModeShared );
     }
+
+    for ( size_t i = 0; i < kMaxFramesInFlight; ++i )
+    {
+        _pCullUniformsBuffer[ i ] = _pDevice->newBuffer( cull::kUniformsBufferSize, MTL::ResourceStorageModeShared );
+        _pVisibleInstanceBuffer[ i ] = _pDevice->newBuffer( kNumInstances * sizeof( uint32_t ), MTL::ResourceStorageModeShared );
+        _pDrawArgumentsBuffer[ i ] = _pDevice->newBuffer( kMeshCount * sizeof( MTL::DrawIndexedPrimitivesIndirectArguments ), MTL::ResourceStorageModeShared );
+    }
+
+    // Everything about an instance that doesn't animate is uploaded once. The
+    // cull kernel builds the transforms from it each frame:
+    using simd::float4;
+    const float scl = kInstanceScale;
+    float3 objectPosition = { 0.f, 0.f, -10.f };
+
+    _pInstanceSourceBuffer = _pDevice->newBuffer( kNumInstances * sizeof( shader_types::InstanceSource ), MTL::ResourceStorageModeShared );
+    shader_types::InstanceSource* pSources = reinterpret_cast< shader_types::InstanceSource* >( _pInstanceSourceBuffer->contents() );
+
+    size_t ix = 0;
+    size_t iy = 0;
+    size_t iz = 0;
+    for ( size_t i = 0; i < kNumInstances; ++i )
+    {
+        if ( ix == kInstanceRows )
+        {
+            ix = 0;
+            iy += 1;
+        }
+        if ( iy == kInstanceRows )
+        {
+            iy = 0;
+            iz += 1;
+        }
+
+        float x = ((float)ix - (float)kInstanceRows/2.f) * (2.f * scl) + scl;
+        float y = ((float)iy - (float)kInstanceColumns/2.f) * (2.f * scl) + scl;
+        float z = ((float)iz - (float)kInstanceDepth/2.f) * (2.f * scl);
+        pSources[ i ].offset = math::add( objectPosition, { x, y, z } );
+        pSources[ i ].ix = (uint32_t)ix;
+        pSources[ i ].iy = (uint32_t)iy;
+        pSources[ i ].mesh = 0;
+
+        float iDivNumInstances = i / (float)kNumInstances;
+        float r = iDivNumInstances;
+        float g = 1.0f - r;
+        float b = sinf( M_PI * 2.0f * iDivNumInstances );
+        pSources[ i ].color = (float4){ r, g, b, 1.0f };
+
+        ix += 1;
+    }
+
+    cull::assignBaseInstances< cull::Types >( pSources, kNumInstances, _baseInstances, kMeshCount );
 }
 
 void Renderer::generateMandelbrotTexture()
@@ -651,10 +1004,78 @@ void Renderer::generateMandelbrotTexture()
 
     pComputeEncoder->endEncoding();
 
+    // The kernel only writes the base level, so rebuild the rest of the mip chain:
+    MTL::BlitCommandEncoder* pBlitEncoder = pCommandBuffer->blitCommandEncoder();
+    pBlitEncoder->generateMipmaps( _pTexture );
+    pBlitEncoder->endEncoding();
+
     pCommandBuffer->commit();
 }
 
-void Renderer::draw( MTK::View* pView )
+void Renderer::encodeCulling( MTL::CommandBuffer* pCommandBuffer )
+{
+    MTL::ComputeCommandEncoder* pComputeEncoder = pCommandBuffer->computeCommandEncoder();
+
+    pComputeEncoder->setComputePipelineState( _pCullPSO );
+    pComputeEncoder->setBuffer( _pInstanceSourceBuffer, 0, 0 );
+    pComputeEncoder->setBuffer( _pCullUniformsBuffer[ _frame ], 0, 1 );
+    pComputeEncoder->setBuffer( _pCullUniformsBuffer[ _frame ], cull::kRotationsOffset, 2 );
+    pComputeEncoder->setBuffer( _pInstanceDataBuffer[ _frame ], 0, 3 );
+    pComputeEncoder->setBuffer( _pVisibleInstanceBuffer[ _frame ], 0, 4 );
+    pComputeEncoder->setBuffer( _pDrawArgumentsBuffer[ _frame ], 0, 5 );
+
+    NS::UInteger threadgroupWidth = std::min< NS::UInteger >( _pCullPSO->maxTotalThreadsPerThreadgroup(), 64 );
+    MTL::Size threadgroupSize( threadgroupWidth, 1, 1 );
+    MTL::Size threadgroupCount( (kNumInstances + threadgroupWidth - 1) / threadgroupWidth, 1, 1 );
+    pComputeEncoder->dispatchThreadgroups( threadgroupCount, threadgroupSize );
+
+    if ( _useIndirectCommandBuffer )
+    {
+        // Dispatches in a serial compute encoder run in order, so the draw
+        // arguments are final when this reads them:
+        const uint32_t meshCount = kMeshCount;
+        pComputeEncoder->setComputePipelineState( _pEncodeDrawsPSO );
+        pComputeEncoder->setBuffer( _pDrawArgumentsBuffer[ _frame ], 0, 0 );
+        pComputeEncoder->setBuffer( _pIndexBuffer, 0, 1 );
+        pComputeEncoder->setBuffer( _pDrawCommandsBuffer[ _frame ], 0, 2 );
+        pComputeEncoder->setBytes( &meshCount, sizeof( meshCount ), 3 );
+        pComputeEncoder->useResource( _pIndirectCommandBuffer[ _frame ], MTL::ResourceUsageWrite );
+        pComputeEncoder->dispatchThreadgroups( MTL::Size( 1, 1, 1 ), MTL::Size( kMeshCount, 1, 1 ) );
+    }
+
+    pComputeEncoder->endEncoding();
+}
+
+void Renderer::validateCulling( int frame )
+{
+    // Runs the reference on the same inputs and compares the results, within
+    // the tolerances in culling.hpp:
+    const shader_types::CullUniforms* pUniforms = reinterpret_cast< const shader_types::CullUniforms* >( _pCullUniformsBuffer[ frame ]->contents() );
+    const simd::float4x4* pRotations = reinterpret_cast< const simd::float4x4* >( (const uint8_t*)pUniforms + cull::kRotationsOffset );
+    const shader_types::InstanceSource* pSources = reinterpret_cast< const shader_types::InstanceSource* >( _pInstanceSourceBuffer->contents() );
+
+    std::vector< shader_types::InstanceData > instances( kNumInstances );
+    std::vector< uint32_t > visible( kNumInstances );
+    std::vector< float > margins( kNumInstances );
+    MTL::DrawIndexedPrimitivesIndirectArguments drawArguments[ kMeshCount ];
+    cull::resetDrawArguments< cull::Types >( drawArguments, _baseInstances, kMeshCount, 6 * 6 );
+    cull::cullInstancesReference< cull::Types >( *pUniforms, pRotations, pSources, instances.data(), visible.data(), drawArguments, margins.data() );
+
+    const MTL::DrawIndexedPrimitivesIndirectArguments* pGpuArguments =
+        reinterpret_cast< const MTL::DrawIndexedPrimitivesIndirectArguments* >( _pDrawArgumentsBuffer[ frame ]->contents() );
+    const shader_types::InstanceData* pGpuInstances = reinterpret_cast< const shader_types::InstanceData* >( _pInstanceDataBuffer[ frame ]->contents() );
+    const uint32_t* pGpuVisible = reinterpret_cast< const uint32_t* >( _pVisibleInstanceBuffer[ frame ]->contents() );
+
+    cull::Report report = cull::compareResults< cull::Types >( instances.data(), visible.data(), drawArguments, margins.data(),
+                                                               pGpuInstances, pGpuVisible, pGpuArguments, kNumInstances, kMeshCount );
+    if ( !report.passed() )
+    {
+        __builtin_printf( "culling mismatch: gpu %u visible, reference %u visible, %zu visibility mismatches, %zu transforms differ\n",
+                          report.gpuVisible, report.referenceVisible, report.visibilityMismatches, report.inexactTransforms );
+    }
+}
+
+void Renderer::draw( FrameTarget* pTarget )
 {
     using simd::float3;
     using simd::float4;
@@ -668,14 +1089,30 @@ void Renderer::draw( MTK::View* pView )
     MTL::CommandBuffer* pCmd = _pCommandQueue->commandBuffer();
     dispatch_semaphore_wait( _semaphore, DISPATCH_TIME_FOREVER );
     Renderer* pRenderer = this;
+    int frame = _frame;
     pCmd->addCompletedHandler( ^void( MTL::CommandBuffer* pCmd ){
+        if ( pRenderer->_validateCulling )
+        {
+            pRenderer->validateCulling( frame );
+        }
         dispatch_semaphore_signal( pRenderer->_semaphore );
     });
 
     _angle += 0.002f;
 
-    const float scl = 0.2f;
-    shader_types::InstanceData* pInstanceData = reinterpret_cast< shader_types::InstanceData *>( pInstanceDataBuffer->contents() );
+    // Update camera state:
+
+    CGSize drawableSize = pTarget->drawableSize();
+    CGFloat aspectRatio = drawableSize.width / drawableSize.height;
+
+    MTL::Buffer* pCameraDataBuffer = _pCameraDataBuffer[ _frame ];
+    shader_types::CameraData* pCameraData = reinterpret_cast< shader_types::CameraData *>( pCameraDataBuffer->contents() );
+    pCameraData->perspectiveTransform = math::makePerspective( 45.f * M_PI / 180.f, aspectRatio, 0.03f, 500.0f ) ;
+    pCameraData->worldTransform = math::makeIdentity();
+    pCameraData->worldNormalTransform = math::discardTranslation( pCameraData->worldTransform );
+
+    // Update culling inputs. These are per frame, not per instance: the cull
+    // kernel builds each instance's transform from the rotation tables:
 
     float3 objectPosition = { 0.f, 0.f, -10.f };
 
@@ -685,57 +1122,30 @@ void Renderer::draw( MTK::View* pView )
     float4x4 rtInv = math::makeTranslate( { -objectPosition.x, -objectPosition.y, -objectPosition.z } );
     float4x4 fullObjectRot = rt * rr1 * rr0 * rtInv;
 
-    size_t ix = 0;
-    size_t iy = 0;
-    size_t iz = 0;
-    for ( size_t i = 0; i < kNumInstances; ++i )
-    {
-        if ( ix == kInstanceRows )
-        {
-            ix = 0;
-            iy += 1;
-        }
-        if ( iy == kInstanceRows )
-        {
-            iy = 0;
-            iz += 1;
-        }
-
-        float4x4 scale = math::makeScale( (float3){ scl, scl, scl } );
-        float4x4 zrot = math::makeZRotate( _angle * sinf((float)ix) );
-        float4x4 yrot = math::makeYRotate( _angle * cosf((float)iy));
+    shader_types::CullUniforms* pUniforms = reinterpret_cast< shader_types::CullUniforms* >( _pCullUniformsBuffer[ _frame ]->contents() );
+    pUniforms->objectTransform = fullObjectRot;
+    math::extractFrustumPlanes( pCameraData->perspectiveTransform * pCameraData->worldTransform, pUniforms->frustumPlanes );
+    pUniforms->scale = kInstanceScale;
+    pUniforms->boundingRadius = 0.5f * kInstanceScale * sqrtf( 3.f );
+    pUniforms->instanceCount = kNumInstances;
+    pUniforms->rowCount = kInstanceRows;
 
-        float x = ((float)ix - (float)kInstanceRows/2.f) * (2.f * scl) + scl;
-        float y = ((float)iy - (float)kInstanceColumns/2.f) * (2.f * scl) + scl;
-        float z = ((float)iz - (float)kInstanceDepth/2.f) * (2.f * scl);
-        float4x4 translate = math::makeTranslate( math::add( objectPosition, { x, y, z } ) );
-
-        pInstanceData[ i ].instanceTransform = fullObjectRot * translate * yrot * zrot * scale;
-        pInstanceData[ i ].instanceNormalTransform = math::discardTranslation( pInstanceData[ i ].instanceTransform );
-
-        float iDivNumInstances = i / (float)kNumInstances;
-        float r = iDivNumInstances;
-        float g = 1.0f - r;
-        float b = sinf( M_PI * 2.0f * iDivNumInstances );
-        pInstanceData[ i ].instanceColor = (float4){ r, g, b, 1.0f };
-
-        ix += 1;
+    float4x4* pRotations = reinterpret_cast< float4x4* >( (uint8_t*)pUniforms + cull::kRotationsOffset );
+    for ( size_t i = 0; i < kInstanceRows; ++i )
+    {
+        pRotations[ i ] = math::makeZRotate( _angle * sinf((float)i) );
+        pRotations[ kInstanceRows + i ] = math::makeYRotate( _angle * cosf((float)i) );
     }
 
-    // Update camera state:
+    MTL::DrawIndexedPrimitivesIndirectArguments* pDrawArguments =
+        reinterpret_cast< MTL::DrawIndexedPrimitivesIndirectArguments* >( _pDrawArgumentsBuffer[ _frame ]->contents() );
+    cull::resetDrawArguments< cull::Types >( pDrawArguments, _baseInstances, kMeshCount, 6 * 6 );
 
-    CGSize drawableSize = pView->drawableSize();
-    CGFloat aspectRatio = drawableSize.width / drawableSize.height;
-
-    MTL::Buffer* pCameraDataBuffer = _pCameraDataBuffer[ _frame ];
-    shader_types::CameraData* pCameraData = reinterpret_cast< shader_types::CameraData *>( pCameraDataBuffer->contents() );
-    pCameraData->perspectiveTransform = math::makePerspective( 45.f * M_PI / 180.f, aspectRatio, 0.03f, 500.0f ) ;
-    pCameraData->worldTransform = math::makeIdentity();
-    pCameraData->worldNormalTransform = math::discardTranslation( pCameraData->worldTransform );
+    encodeCulling( pCmd );
 
     // Begin render pass:
 
-    MTL::RenderPassDescriptor* pRpd = pView->currentRenderPassDescriptor();
+    MTL::RenderPassDescriptor* pRpd = pTarget->renderPassDescriptor();
     MTL::RenderCommandEncoder* pEnc = pCmd->renderCommandEncoder( pRpd );
 
     pEnc->setRenderPipelineState( _pPSO );
@@ -744,23 +1154,53 @@ void Renderer::draw( MTK::View* pView )
     pEnc->setVertexBuffer( _pVertexDataBuffer, /* offset */ 0, /* index */ 0 );
     pEnc->setVertexBuffer( pInstanceDataBuffer, /* offset */ 0, /* index */ 1 );
     pEnc->setVertexBuffer( pCameraDataBuffer, /* offset */ 0, /* index */ 2 );
+    pEnc->setVertexBuffer( _pVisibleInstanceBuffer[ _frame ], /* offset */ 0, /* index */ 3 );
 
     pEnc->setFragmentTexture( _pTexture, /* index */ 0 );
 
     pEnc->setCullMode( MTL::CullModeBack );
     pEnc->setFrontFacingWinding( MTL::Winding::WindingCounterClockwise );
 
-    pEnc->drawIndexedPrimitives( MTL::PrimitiveType::PrimitiveTypeTriangle,
-                                6 * 6, MTL::IndexType::IndexTypeUInt16,
-                                _pIndexBuffer,
-                                0,
-                                kNumInstances );
+    if ( _useIndirectCommandBuffer )
+    {
+        // The commands inherit the pipeline and buffers set above. They refer
+        // to the index buffer without binding it, so declare that it's used:
+        pEnc->useResource( _pIndexBuffer, MTL::ResourceUsageRead );
+        pEnc->executeCommandsInBuffer( _pIndirectCommandBuffer[ _frame ], NS::Range( 0, kMeshCount ) );
+    }
+    else
+    {
+        for ( uint32_t mesh = 0; mesh < kMeshCount; ++mesh )
+        {
+            pEnc->drawIndexedPrimitives( MTL::PrimitiveType::PrimitiveTypeTriangle,
+                                        MTL::IndexType::IndexTypeUInt16,
+                                        _pIndexBuffer,
+                                        0,
+                                        _pDrawArgumentsBuffer[ _frame ],
+                                        mesh * sizeof( MTL::DrawIndexedPrimitivesIndirectArguments ) );
+        }
+    }
 
     pEnc->endEncoding();
-    pCmd->presentDrawable( pView->currentDrawable() );
+    if ( MTL::Drawable* pDrawable = pTarget->drawable() )
+    {
+        pCmd->presentDrawable( pDrawable );
+    }
     pCmd->commit();
 
     pPool->release();
 }
 
+void Renderer::waitForIdle()
+{
+    for ( int i = 0; i < Renderer::kMaxFramesInFlight; ++i )
+    {
+        dispatch_semaphore_wait( _semaphore, DISPATCH_TIME_FOREVER );
+    }
+    for ( int i = 0; i < Renderer::kMaxFramesInFlight; ++i )
+    {
+        dispatch_semaphore_signal( _semaphore );
+    }
+}
+
 #pragma endregion Renderer }
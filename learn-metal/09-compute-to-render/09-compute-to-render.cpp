@@ -27,14 +27,19 @@
 #include <MetalKit/MetalKit.hpp>
 
 #include <simd/simd.h>
+#include <algorithm>
+#include <vector>
+
+#include "../benchmark/benchmark.hpp"
+#include "../frame-graph/frame-graph.hpp"
+#include "../virtual-texture/virtual-texture.hpp"
 
 static constexpr size_t kInstanceRows = 10;
 static constexpr size_t kInstanceColumns = 10;
 static constexpr size_t kInstanceDepth = 10;
 static constexpr size_t kNumInstances = (kInstanceRows * kInstanceColumns * kInstanceDepth);
 static constexpr size_t kMaxFramesInFlight = 3;
-static constexpr uint32_t kTextureWidth = 128;
-static constexpr uint32_t kTextureHeight = 128;
+static constexpr uint32_t kMaxTilesPerFrame = 8;
 
 
 #pragma region Declarations {
@@ -52,6 +57,20 @@ namespace math
     simd::float3x3 discardTranslation( const simd::float4x4& m );
 }
 
+// Metal's types for fg::FrameGraph
+struct MetalFrameGraphApi
+{
+    using Texture = MTL::Texture;
+    using PixelFormat = MTL::PixelFormat;
+    using ComputeCommandEncoder = MTL::ComputeCommandEncoder;
+    using RenderCommandEncoder = MTL::RenderCommandEncoder;
+};
+
+using FrameGraph = fg::FrameGraph< MetalFrameGraphApi >;
+
+void executeFrameGraph( FrameGraph* pGraph, MTL::Device* pDevice, MTL::CommandBuffer* pCmd, MTL::Heap* pHeap, MTL::Fence* const* pFences,
+                        MTL::ClearColor clearColor, double clearDepth );
+
 class Renderer
 {
     public:
@@ -62,10 +81,17 @@ class Renderer
         void buildDepthStencilStates();
         void buildTextures();
         void buildBuffers();
-        void generateMandelbrotTexture( MTL::CommandBuffer* pCommandBuffer );
-        void draw( MTK::View* pView );
+        void generateMandelbrotTexture( MTL::ComputeCommandEncoder* pComputeEncoder );
+        FrameGraph::TextureDesc transientTextureDesc( uint32_t width, uint32_t height, MTL::PixelFormat pixelFormat, uint32_t bytesPerPixel );
+        MTL::Heap* transientHeap( uint64_t size );
+        void buildFrameGraph( MTL::Texture* pDrawableTexture, bool tilePass );
+        void draw( FrameTarget* pTarget );
+        void waitForIdle();
 
     private:
+        static void encodeCubes( void* pContext, MTL::RenderCommandEncoder* pEnc );
+        static void encodeTiles( void* pContext, MTL::ComputeCommandEncoder* pEnc );
+
         MTL::Device* _pDevice;
         MTL::CommandQueue* _pCommandQueue;
         MTL::Library* _pShaderLibrary;
@@ -77,12 +103,23 @@ class Renderer
         MTL::Buffer* _pInstanceDataBuffer[kMaxFramesInFlight];
         MTL::Buffer* _pCameraDataBuffer[kMaxFramesInFlight];
         MTL::Buffer* _pIndexBuffer;
-        MTL::Buffer* _pTextureAnimationBuffer;
+        MTL::Buffer* _pPageTableBuffer[kMaxFramesInFlight];
+        MTL::Buffer* _pFeedbackBuffer[kMaxFramesInFlight];
+        MTL::Buffer* _pTileRequestBuffer[kMaxFramesInFlight];
+        vt::VirtualTexture _virtualTexture;
+        size_t _tileRequestCount;
+        FrameGraph _frameGraph;
+        uint32_t _drawableResource;
+        uint32_t _graphWidth;
+        uint32_t _graphHeight;
+        bool _graphHasTilePass;
+        MTL::Heap* _pTransientHeap[kMaxFramesInFlight];
+        std::vector< MTL::Fence* > _fences;
+        uint64_t _reportedTransientBytes;
         float _angle;
         int _frame;
         dispatch_semaphore_t _semaphore;
         static const int kMaxFramesInFlight;
-        uint _animationIndex;
 };
 
 class MyMTKViewDelegate : public MTK::ViewDelegate
@@ -127,6 +164,14 @@ int main( int argc, char* argv[] )
 {
     NS::AutoreleasePool* pAutoreleasePool = NS::AutoreleasePool::alloc()->init();
 
+    benchmark::Options options;
+    if ( benchmark::parseOptions( argc, argv, &options ) )
+    {
+        int result = benchmark::run< Renderer >( options, "09-compute-to-render", MTL::PixelFormatInvalid, MTL::ClearColor::Make( 0.1, 0.1, 0.1, 1.0 ) );
+        pAutoreleasePool->release();
+        return result;
+    }
+
     MyAppDelegate del;
     UI::ApplicationMain(argc, argv, &del);
 
@@ -174,7 +219,8 @@ void MySceneDelegate::sceneWillConnectToSession( UI::Scene *scene, UI::SceneSess
     _pMtkView = MTK::View::alloc()->init( frame, _pDevice );
     _pMtkView->setColorPixelFormat( MTL::PixelFormat::PixelFormatBGRA8Unorm_sRGB );
     _pMtkView->setClearColor( MTL::ClearColor::Make( 0.1, 0.1, 0.1, 1.0 ) );
-    _pMtkView->setDepthStencilPixelFormat( MTL::PixelFormat::PixelFormatDepth16Unorm );
+    // The renderer's frame graph owns the depth buffer:
+    _pMtkView->setDepthStencilPixelFormat( MTL::PixelFormat::PixelFormatInvalid );
     _pMtkView->setClearDepth( 1.0f );
 
     _pViewDelegate = new MyMTKViewDelegate( _pDevice );
@@ -206,7 +252,8 @@ MyMTKViewDelegate::~MyMTKViewDelegate()
 
 void MyMTKViewDelegate::drawInMTKView( MTK::View* pView )
 {
-    _pRenderer->draw( pView );
+    ViewTarget target( pView );
+    _pRenderer->draw( &target );
 }
 
 #pragma endregion ViewDelegate }
@@ -299,6 +346,103 @@ namespace math
 }
 
 
+#pragma mark - FrameGraph
+
+// Encodes the passes of a compiled graph into one command buffer, waiting on
+// and updating the fences compile() inserted
+void executeFrameGraph( FrameGraph* pGraph, MTL::Device* pDevice, MTL::CommandBuffer* pCmd, MTL::Heap* pHeap, MTL::Fence* const* pFences,
+                        MTL::ClearColor clearColor, double clearDepth )
+{
+    // Transient textures only exist for this command buffer, which keeps
+    // them alive after the release below:
+    std::vector< uint32_t > transients;
+    for ( uint32_t i = 0; i < pGraph->resourceCount(); ++i )
+    {
+        const FrameGraph::Resource& r = pGraph->resource( i );
+        if ( r.imported || r.firstUse == fg::kInvalid )
+        {
+            continue;
+        }
+
+        MTL::TextureDescriptor* pTextureDesc = MTL::TextureDescriptor::texture2DDescriptor( r.desc.pixelFormat, r.desc.width, r.desc.height, false );
+        MTL::TextureUsage usage = MTL::TextureUsageUnknown;
+        usage |= r.attachment ? MTL::TextureUsageRenderTarget : 0;
+        usage |= r.shaderRead ? MTL::TextureUsageShaderRead : 0;
+        usage |= r.shaderWrite ? MTL::TextureUsageShaderWrite : 0;
+        pTextureDesc->setUsage( usage );
+
+        if ( r.memoryless )
+        {
+            pTextureDesc->setStorageMode( MTL::StorageModeMemoryless );
+            pGraph->setTexture( i, pDevice->newTexture( pTextureDesc ) );
+        }
+        else
+        {
+            assert( pHeap && r.heapOffset + r.desc.size <= pHeap->size() );
+            pTextureDesc->setStorageMode( MTL::StorageModePrivate );
+            pGraph->setTexture( i, pHeap->newTexture( pTextureDesc, r.heapOffset ) );
+        }
+        transients.push_back( i );
+    }
+
+    for ( uint32_t index : pGraph->order() )
+    {
+        const FrameGraph::Pass& p = pGraph->pass( index );
+        if ( p.type == fg::PassType::Compute )
+        {
+            MTL::ComputeCommandEncoder* pEnc = pCmd->computeCommandEncoder();
+            for ( uint32_t fence : p.waitFences )
+            {
+                pEnc->waitForFence( pFences[ fence ] );
+            }
+            p.encodeCompute( p.pContext, pEnc );
+            if ( p.fence != fg::kInvalid )
+            {
+                pEnc->updateFence( pFences[ p.fence ] );
+            }
+            pEnc->endEncoding();
+            continue;
+        }
+
+        MTL::RenderPassDescriptor* pRpd = MTL::RenderPassDescriptor::renderPassDescriptor();
+        if ( p.color.resource != fg::kInvalid )
+        {
+            MTL::RenderPassColorAttachmentDescriptor* pColor = pRpd->colorAttachments()->object( 0 );
+            pColor->setTexture( pGraph->texture( p.color.resource ) );
+            pColor->setLoadAction( (MTL::LoadAction)p.color.load );
+            pColor->setStoreAction( (MTL::StoreAction)p.color.store );
+            pColor->setClearColor( clearColor );
+        }
+        if ( p.depth.resource != fg::kInvalid )
+        {
+            MTL::RenderPassDepthAttachmentDescriptor* pDepth = pRpd->depthAttachment();
+            pDepth->setTexture( pGraph->texture( p.depth.resource ) );
+            pDepth->setLoadAction( (MTL::LoadAction)p.depth.load );
+            pDepth->setStoreAction( (MTL::StoreAction)p.depth.store );
+            pDepth->setClearDepth( clearDepth );
+        }
+
+        MTL::RenderCommandEncoder* pEnc = pCmd->renderCommandEncoder( pRpd );
+        for ( uint32_t fence : p.waitFences )
+        {
+            pEnc->waitForFence( pFences[ fence ], MTL::RenderStageVertex );
+        }
+        p.encodeRender( p.pContext, pEnc );
+        if ( p.fence != fg::kInvalid )
+        {
+            pEnc->updateFence( pFences[ p.fence ], MTL::RenderStageFragment );
+        }
+        pEnc->endEncoding();
+    }
+
+    for ( uint32_t i : transients )
+    {
+        pGraph->texture( i )->release();
+        pGraph->setTexture( i, nullptr );
+    }
+}
+
+
 #pragma mark - Renderer
 #pragma region Renderer {
 
@@ -308,7 +452,13 @@ Renderer::Renderer( MTL::Device* pDevice )
 : _pDevice( pDevice->retain() )
 , _angle ( 0.f )
 , _frame( 0 )
-, _animationIndex(0)
+, _tileRequestCount( 0 )
+, _drawableResource( fg::kInvalid )
+, _graphWidth( 0 )
+, _graphHeight( 0 )
+, _graphHasTilePass( false )
+, _pTransientHeap{}
+, _reportedTransientBytes( 0 )
 {
     _pCommandQueue = _pDevice->newCommandQueue();
     buildShaders();
@@ -322,7 +472,20 @@ Renderer::Renderer( MTL::Device* pDevice )
 
 Renderer::~Renderer()
 {
-    _pTextureAnimationBuffer->release();
+    for ( int i = 0; i < kMaxFramesInFlight; ++i )
+    {
+        _pPageTableBuffer[i]->release();
+        _pFeedbackBuffer[i]->release();
+        _pTileRequestBuffer[i]->release();
+        if ( _pTransientHeap[i] )
+        {
+            _pTransientHeap[i]->release();
+        }
+    }
+    for ( MTL::Fence* pFence : _fences )
+    {
+        pFence->release();
+    }
     _pTexture->release();
     _pShaderLibrary->release();
     _pDepthStencilState->release();
@@ -427,10 +590,63 @@ void Renderer::buildShaders()
             return o;
         }
 
-        half4 fragment fragmentMain( v2f in [[stage_in]], texture2d< half, access::sample > tex [[texture(0)]] )
+        // Must match the virtual texture constants on the CPU:
+        constant uint kVirtualTilesPerSide = 64;
+        constant uint kVirtualMipCount = 7;
+        constant uint kCacheTilesPerSide = 8;
+        constant float kTileSize = 128.0;
+        constant float kTileBorder = 1.0;
+        constant uint kInvalidPageEntry = 0xFFFFFFFF;
+
+        uint pageIndex( uint mip, uint2 tile )
         {
-            constexpr sampler s( address::repeat, filter::linear );
-            half3 texel = tex.sample( s, in.texcoord ).rgb;
+            uint offset = 0;
+            for ( uint m = 0; m < mip; ++m )
+            {
+                uint n = kVirtualTilesPerSide >> m;
+                offset += n * n;
+            }
+            return offset + tile.y * (kVirtualTilesPerSide >> mip) + tile.x;
+        }
+
+        [[early_fragment_tests]]
+        half4 fragment fragmentMain( v2f in [[stage_in]],
+                                     texture2d< half, access::sample > tileCache [[texture(0)]],
+                                     device const uint* pageTable [[buffer(0)]],
+                                     device atomic_uint* feedback [[buffer(1)]] )
+        {
+            constexpr sampler s( address::clamp_to_edge, filter::linear );
+
+            // Pick the mip level from the footprint of this pixel in the virtual texture:
+            float2 virtualTexel = in.texcoord * float( kVirtualTilesPerSide ) * (kTileSize - 2.0 * kTileBorder);
+            float2 dx = dfdx( virtualTexel );
+            float2 dy = dfdy( virtualTexel );
+            float lod = 0.5 * log2( max( dot( dx, dx ), dot( dy, dy ) ) );
+            uint mip = uint( clamp( lod, 0.0, float( kVirtualMipCount - 1 ) ) );
+
+            float2 uv = fract( in.texcoord );
+            uint tilesAtMip = kVirtualTilesPerSide >> mip;
+            uint2 tile = min( uint2( uv * tilesAtMip ), uint2( tilesAtMip - 1 ) );
+            uint page = pageIndex( mip, tile );
+
+            // Record which page was needed, sampling one pixel in every 4x4 block:
+            if ( ((uint( in.position.x ) | uint( in.position.y )) & 3) == 0 )
+            {
+                atomic_fetch_or_explicit( &feedback[ page / 32 ], 1u << (page % 32), memory_order_relaxed );
+            }
+
+            half3 texel = half3( 1.0 );
+            uint entry = pageTable[ page ];
+            if ( entry != kInvalidPageEntry )
+            {
+                float2 slot = float2( entry & 0xFF, (entry >> 8) & 0xFF );
+                uint residentMip = (entry >> 16) & 0xFF;
+                uint tilesAtResidentMip = kVirtualTilesPerSide >> residentMip;
+                uint2 residentTile = min( uint2( uv * tilesAtResidentMip ), uint2( tilesAtResidentMip - 1 ) );
+                float2 tileUV = uv * float( tilesAtResidentMip ) - float2( residentTile );
+                float2 cacheUV = (slot * kTileSize + kTileBorder + tileUV * (kTileSize - 2.0 * kTileBorder)) / (kTileSize * kCacheTilesPerSide);
+                texel = tileCache.sample( s, cacheUV ).rgb;
+            }
 
             // assume light coming from (front-top-right)
             float3 l = normalize(float3( 1.0, 1.0, 0.8 ));
@@ -479,28 +695,36 @@ void Renderer::buildComputePipeline()
         #include <metal_stdlib>
         using namespace metal;
 
-        kernel void mandelbrot_set(texture2d< half, access::write > tex [[texture(0)]],
-                                   uint2 index [[thread_position_in_grid]],
-                                   uint2 gridSize [[threads_per_grid]],
-                                   device const uint* frame [[buffer(0)]])
+        // Must match the virtual texture constants on the CPU:
+        constant uint kVirtualTilesPerSide = 64;
+        constant uint kTileSize = 128;
+        constant uint kTileBorder = 1;
+
+        struct TileRequest
         {
-            constexpr float kAnimationFrequency = 0.01;
-            constexpr float kAnimationSpeed = 4;
-            constexpr float kAnimationScaleLow = 0.62;
-            constexpr float kAnimationScale = 0.38;
+            uint mip;
+            uint tileX;
+            uint tileY;
+            uint slotX;
+            uint slotY;
+        };
 
-            constexpr float2 kMandelbrotPixelOffset = {-0.2, -0.35};
-            constexpr float2 kMandelbrotOrigin = {-1.2, -0.32};
-            constexpr float2 kMandelbrotScale = {2.2, 2.0};
+        kernel void mandelbrot_set(texture2d< half, access::write > tex [[texture(0)]],
+                                   uint3 index [[thread_position_in_grid]],
+                                   device const TileRequest* requests [[buffer(0)]])
+        {
+            const device TileRequest& request = requests[ index.z ];
 
-            // Map time to zoom value in [kAnimationScaleLow, 1]
-            float zoom = kAnimationScaleLow + kAnimationScale * cos(kAnimationFrequency * *frame);
-            // Speed up zooming
-            zoom = pow(zoom, kAnimationSpeed);
+            // Map the texel, including the border shared with neighboring tiles,
+            // to its position in the virtual texture. Border texels at the edge
+            // of the texture clamp to it rather than wrap to the opposite side:
+            float tilesAtMip = float( kVirtualTilesPerSide >> request.mip );
+            float2 inTile = (float2( index.xy ) - float( kTileBorder ) + 0.5) / float( kTileSize - 2 * kTileBorder );
+            float2 uv = saturate( (float2( request.tileX, request.tileY ) + inTile) / tilesAtMip );
 
-            //Scale
-            float x0 = zoom * kMandelbrotScale.x * ((float)index.x / gridSize.x + kMandelbrotPixelOffset.x) + kMandelbrotOrigin.x;
-            float y0 = zoom * kMandelbrotScale.y * ((float)index.y / gridSize.y + kMandelbrotPixelOffset.y) + kMandelbrotOrigin.y;
+            // Scale
+            float x0 = 2.0 * uv.x - 1.5;
+            float y0 = 2.0 * uv.y - 1.0;
 
             // Implement Mandelbrot set
             float x = 0.0;
@@ -518,7 +742,8 @@ void Renderer::buildComputePipeline()
 
             // Convert iteration result to colors
             half color = (0.5 + 0.5 * cos(3.0 + iteration * 0.15));
-            tex.write(half4(color, color, color, 1.0), index, 0);
+            uint2 texel = uint2( request.slotX, request.slotY ) * kTileSize + index.xy;
+            tex.write(half4(color, color, color, 1.0), texel, 0);
         })";
     NS::Error* pError = nullptr;
 
@@ -555,12 +780,12 @@ void Renderer::buildDepthStencilStates()
 void Renderer::buildTextures()
 {
     MTL::TextureDescriptor* pTextureDesc = MTL::TextureDescriptor::alloc()->init();
-    pTextureDesc->setWidth( kTextureWidth );
-    pTextureDesc->setHeight( kTextureHeight );
+    pTextureDesc->setWidth( vt::kTileSize * vt::kCacheTilesPerSide );
+    pTextureDesc->setHeight( vt::kTileSize * vt::kCacheTilesPerSide );
     pTextureDesc->setPixelFormat( MTL::PixelFormatRGBA8Unorm );
     pTextureDesc->setTextureType( MTL::TextureType2D );
-    pTextureDesc->setStorageMode( MTL::StorageModeShared );
-    pTextureDesc->setUsage( MTL::ResourceUsageSample | MTL::ResourceUsageRead | MTL::ResourceUsageWrite);
+    pTextureDesc->setStorageMode( MTL::StorageModePrivate );
+    pTextureDesc->setUsage( MTL::TextureUsageShaderRead | MTL::TextureUsageShaderWrite );
 
     MTL::Texture *pTexture = _pDevice->newTexture( pTextureDesc );
     _pTexture = pTexture;
@@ -642,23 +867,24 @@ void Renderer::buildBuffers()
         _pCameraDataBuffer[ i ] = _pDevice->newBuffer( cameraDataSize, MTL::ResourceStorageModeShared );
     }
 
-    _pTextureAnimationBuffer = _pDevice->newBuffer( sizeof(uint), MTL::ResourceStorageModeShared );
+    for ( size_t i = 0; i < kMaxFramesInFlight; ++i )
+    {
+        _pPageTableBuffer[ i ] = _pDevice->newBuffer( vt::kNumPages * sizeof( uint32_t ), MTL::ResourceStorageModeShared );
+        _pFeedbackBuffer[ i ] = _pDevice->newBuffer( vt::kFeedbackWords * sizeof( uint32_t ), MTL::ResourceStorageModeShared );
+        _pTileRequestBuffer[ i ] = _pDevice->newBuffer( kMaxTilesPerFrame * sizeof( vt::TileRequest ), MTL::ResourceStorageModeShared );
+        memset( _pFeedbackBuffer[ i ]->contents(), 0, vt::kFeedbackWords * sizeof( uint32_t ) );
+    }
 }
 
-void Renderer::generateMandelbrotTexture( MTL::CommandBuffer* pCommandBuffer )
+void Renderer::generateMandelbrotTexture( MTL::ComputeCommandEncoder* pComputeEncoder )
 {
-    assert(pCommandBuffer);
-
-    uint* ptr = reinterpret_cast<uint*>(_pTextureAnimationBuffer->contents());
-    *ptr = (_animationIndex++) % 5000;
-
-    MTL::ComputeCommandEncoder* pComputeEncoder = pCommandBuffer->computeCommandEncoder();
+    assert(pComputeEncoder);
 
     pComputeEncoder->setComputePipelineState( _pComputePSO );
     pComputeEncoder->setTexture( _pTexture, 0 );
-    pComputeEncoder->setBuffer(_pTextureAnimationBuffer, 0, 0);
+    pComputeEncoder->setBuffer( _pTileRequestBuffer[ _frame ], 0, 0 );
 
-    MTL::Size gridSize = MTL::Size( kTextureWidth, kTextureHeight, 1 );
+    MTL::Size gridSize = MTL::Size( vt::kTileSize, vt::kTileSize, _tileRequestCount );
 
     if (_pDevice->supportsFamily(MTL::GPUFamily::GPUFamilyApple4)) {
         NS::UInteger threadGroupSize = _pComputePSO->maxTotalThreadsPerThreadgroup();
@@ -667,15 +893,122 @@ void Renderer::generateMandelbrotTexture( MTL::CommandBuffer* pCommandBuffer )
         pComputeEncoder->dispatchThreads( gridSize, threadgroupSize );
     } else {
         MTL::Size threadgroupSize( 8, 4, 1 );
-        MTL::Size threadgroupCount = MTL::Size( gridSize.width / threadgroupSize.width, gridSize.height / threadgroupSize.height, 1 );
+        MTL::Size threadgroupCount = MTL::Size( gridSize.width / threadgroupSize.width, gridSize.height / threadgroupSize.height, gridSize.depth );
 
         pComputeEncoder->dispatchThreadgroups( threadgroupCount, threadgroupSize );
     }
+}
+
+FrameGraph::TextureDesc Renderer::transientTextureDesc( uint32_t width, uint32_t height, MTL::PixelFormat pixelFormat, uint32_t bytesPerPixel )
+{
+    MTL::TextureDescriptor* pTextureDesc = MTL::TextureDescriptor::texture2DDescriptor( pixelFormat, width, height, false );
+    pTextureDesc->setStorageMode( MTL::StorageModePrivate );
+    pTextureDesc->setUsage( MTL::TextureUsageRenderTarget | MTL::TextureUsageShaderRead );
+
+    MTL::SizeAndAlign sizeAndAlign = _pDevice->heapTextureSizeAndAlign( pTextureDesc );
+    return { width, height, pixelFormat, bytesPerPixel, sizeAndAlign.size, sizeAndAlign.align };
+}
 
-    pComputeEncoder->endEncoding();
+MTL::Heap* Renderer::transientHeap( uint64_t size )
+{
+    // The frame that last used this slot has completed, so its heap can be
+    // replaced when the graph needs more memory:
+    MTL::Heap*& pHeap = _pTransientHeap[ _frame ];
+    if ( !pHeap || pHeap->size() < size )
+    {
+        if ( pHeap )
+        {
+            pHeap->release();
+        }
+
+        MTL::HeapDescriptor* pHeapDesc = MTL::HeapDescriptor::alloc()->init();
+        pHeapDesc->setType( MTL::HeapTypePlacement );
+        pHeapDesc->setStorageMode( MTL::StorageModePrivate );
+        pHeapDesc->setHazardTrackingMode( MTL::HazardTrackingModeUntracked );
+        pHeapDesc->setSize( size );
+        pHeap = _pDevice->newHeap( pHeapDesc );
+        pHeapDesc->release();
+    }
+    return pHeap;
 }
 
-void Renderer::draw( MTK::View* pView )
+void Renderer::encodeCubes( void* pContext, MTL::RenderCommandEncoder* pEnc )
+{
+    Renderer* pRenderer = static_cast< Renderer* >( pContext );
+    int frame = pRenderer->_frame;
+    pEnc->setRenderPipelineState( pRenderer->_pPSO );
+    pEnc->setDepthStencilState( pRenderer->_pDepthStencilState );
+
+    pEnc->setVertexBuffer( pRenderer->_pVertexDataBuffer, /* offset */ 0, /* index */ 0 );
+    pEnc->setVertexBuffer( pRenderer->_pInstanceDataBuffer[ frame ], /* offset */ 0, /* index */ 1 );
+    pEnc->setVertexBuffer( pRenderer->_pCameraDataBuffer[ frame ], /* offset */ 0, /* index */ 2 );
+
+    pEnc->setFragmentTexture( pRenderer->_pTexture, /* index */ 0 );
+    pEnc->setFragmentBuffer( pRenderer->_pPageTableBuffer[ frame ], /* offset */ 0, /* index */ 0 );
+    pEnc->setFragmentBuffer( pRenderer->_pFeedbackBuffer[ frame ], /* offset */ 0, /* index */ 1 );
+
+    pEnc->setCullMode( MTL::CullModeBack );
+    pEnc->setFrontFacingWinding( MTL::Winding::WindingCounterClockwise );
+
+    pEnc->drawIndexedPrimitives( MTL::PrimitiveType::PrimitiveTypeTriangle,
+                                6 * 6, MTL::IndexType::IndexTypeUInt16,
+                                pRenderer->_pIndexBuffer,
+                                0,
+                                kNumInstances );
+}
+
+void Renderer::encodeTiles( void* pContext, MTL::ComputeCommandEncoder* pEnc )
+{
+    static_cast< Renderer* >( pContext )->generateMandelbrotTexture( pEnc );
+}
+
+void Renderer::buildFrameGraph( MTL::Texture* pDrawableTexture, bool tilePass )
+{
+    // The render pass is declared first, and compile() still schedules the
+    // compute pass that feeds it before it. The passes encode from the
+    // current frame's buffers, so the graph holds no per-frame state:
+
+    uint32_t width = (uint32_t)pDrawableTexture->width();
+    uint32_t height = (uint32_t)pDrawableTexture->height();
+
+    _frameGraph.reset( _pDevice->supportsFamily( MTL::GPUFamilyApple1 ) );
+
+    _drawableResource = _frameGraph.importTexture( "drawable",
+        { width, height, MTL::PixelFormatBGRA8Unorm_sRGB, 4, 0, 0 }, pDrawableTexture, /* persistent */ false );
+    uint32_t tileCache = _frameGraph.importTexture( "tile cache",
+        { vt::kTileSize * vt::kCacheTilesPerSide, vt::kTileSize * vt::kCacheTilesPerSide, MTL::PixelFormatRGBA8Unorm, 4, 0, 0 }, _pTexture, /* persistent */ true );
+    uint32_t depth = _frameGraph.createTexture( "depth", transientTextureDesc( width, height, MTL::PixelFormatDepth16Unorm, 2 ) );
+
+    uint32_t renderPass = _frameGraph.addRenderPass( "render cubes", &Renderer::encodeCubes, this );
+    _frameGraph.setColorAttachment( renderPass, _drawableResource, /* clear */ true );
+    _frameGraph.setDepthAttachment( renderPass, depth, /* clear */ true );
+    _frameGraph.read( renderPass, tileCache );
+
+    if ( tilePass )
+    {
+        uint32_t generatePass = _frameGraph.addComputePass( "generate tiles", &Renderer::encodeTiles, this );
+        _frameGraph.write( generatePass, tileCache );
+    }
+
+    _frameGraph.compile();
+    _graphWidth = width;
+    _graphHeight = height;
+    _graphHasTilePass = tilePass;
+
+    const fg::Report& report = _frameGraph.report();
+    if ( report.transientBytes + report.memorylessBytes != _reportedTransientBytes )
+    {
+        _frameGraph.printReport();
+        _reportedTransientBytes = report.transientBytes + report.memorylessBytes;
+    }
+
+    while ( _fences.size() < report.fenceCount )
+    {
+        _fences.push_back( _pDevice->newFence() );
+    }
+}
+
+void Renderer::draw( FrameTarget* pTarget )
 {
     using simd::float3;
     using simd::float4;
@@ -745,7 +1078,7 @@ void Renderer::draw( MTK::View* pView )
 
     // Update camera state:
 
-    CGSize drawableSize = pView->drawableSize();
+    CGSize drawableSize = pTarget->drawableSize();
     CGFloat aspectRatio = drawableSize.width / drawableSize.height;
 
     MTL::Buffer* pCameraDataBuffer = _pCameraDataBuffer[ _frame ];
@@ -754,38 +1087,55 @@ void Renderer::draw( MTK::View* pView )
     pCameraData->worldTransform = math::makeIdentity();
     pCameraData->worldNormalTransform = math::discardTranslation( pCameraData->worldTransform );
 
-    // Update texture:
-
-    generateMandelbrotTexture( pCmd );
-
-    // Begin render pass:
-
-    MTL::RenderPassDescriptor* pRpd = pView->currentRenderPassDescriptor();
-    MTL::RenderCommandEncoder* pEnc = pCmd->renderCommandEncoder( pRpd );
+    // Update virtual texture. The feedback for this frame index was written
+    // kMaxFramesInFlight frames ago and its command buffer has completed:
 
-    pEnc->setRenderPipelineState( _pPSO );
-    pEnc->setDepthStencilState( _pDepthStencilState );
+    uint32_t* pFeedback = reinterpret_cast< uint32_t* >( _pFeedbackBuffer[ _frame ]->contents() );
+    _virtualTexture.processFeedback( pFeedback );
+    memset( pFeedback, 0, vt::kFeedbackWords * sizeof( uint32_t ) );
 
-    pEnc->setVertexBuffer( _pVertexDataBuffer, /* offset */ 0, /* index */ 0 );
-    pEnc->setVertexBuffer( pInstanceDataBuffer, /* offset */ 0, /* index */ 1 );
-    pEnc->setVertexBuffer( pCameraDataBuffer, /* offset */ 0, /* index */ 2 );
+    vt::TileRequest* pTileRequests = reinterpret_cast< vt::TileRequest* >( _pTileRequestBuffer[ _frame ]->contents() );
+    _tileRequestCount = _virtualTexture.update( pTileRequests, kMaxTilesPerFrame );
+    _virtualTexture.writePageTable( reinterpret_cast< uint32_t* >( _pPageTableBuffer[ _frame ]->contents() ) );
 
-    pEnc->setFragmentTexture( _pTexture, /* index */ 0 );
+    // The graph only changes with the drawable size and with whether tiles
+    // are generated. Otherwise last frame's graph runs again, with this
+    // frame's drawable swapped in:
 
-    pEnc->setCullMode( MTL::CullModeBack );
-    pEnc->setFrontFacingWinding( MTL::Winding::WindingCounterClockwise );
+    MTL::RenderPassDescriptor* pRpd = pTarget->renderPassDescriptor();
+    MTL::Texture* pDrawableTexture = pRpd->colorAttachments()->object( 0 )->texture();
+    bool tilePass = _tileRequestCount > 0;
+    if ( !_frameGraph.compiled() || pDrawableTexture->width() != _graphWidth || pDrawableTexture->height() != _graphHeight ||
+         tilePass != _graphHasTilePass )
+    {
+        buildFrameGraph( pDrawableTexture, tilePass );
+    }
+    _frameGraph.setTexture( _drawableResource, pDrawableTexture );
 
-    pEnc->drawIndexedPrimitives( MTL::PrimitiveType::PrimitiveTypeTriangle,
-                                6 * 6, MTL::IndexType::IndexTypeUInt16,
-                                _pIndexBuffer,
-                                0,
-                                kNumInstances );
+    const fg::Report& report = _frameGraph.report();
+    MTL::Heap* pHeap = report.heapBytes > 0 ? transientHeap( report.heapBytes ) : nullptr;
+    executeFrameGraph( &_frameGraph, _pDevice, pCmd, pHeap, _fences.data(), pRpd->colorAttachments()->object( 0 )->clearColor(),
+                       pRpd->depthAttachment()->clearDepth() );
 
-    pEnc->endEncoding();
-    pCmd->presentDrawable( pView->currentDrawable() );
+    if ( MTL::Drawable* pDrawable = pTarget->drawable() )
+    {
+        pCmd->presentDrawable( pDrawable );
+    }
     pCmd->commit();
 
     pPool->release();
 }
 
+void Renderer::waitForIdle()
+{
+    for ( int i = 0; i < Renderer::kMaxFramesInFlight; ++i )
+    {
+        dispatch_semaphore_wait( _semaphore, DISPATCH_TIME_FOREVER );
+    }
+    for ( int i = 0; i < Renderer::kMaxFramesInFlight; ++i )
+    {
+        dispatch_semaphore_signal( _semaphore );
+    }
+}
+
 #pragma endregion Renderer }
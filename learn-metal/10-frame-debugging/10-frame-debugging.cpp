@@ -27,16 +27,58 @@
 #include <MetalKit/MetalKit.hpp>
 
 #include <simd/simd.h>
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 #include <time.h>
+#include <sys/resource.h>
+#include <mach/mach_time.h>
+#include <mach-o/getsect.h>
+#include <mach-o/ldsyms.h>
+
+#include "../async-compute/async-compute.hpp"
+#include "../benchmark/benchmark.hpp"
+#include "../cmdstream/cmdstream.hpp"
+#include "../command-list/command-list.hpp"
+#include "../completion-pool/completion-pool.hpp"
+#include "../frame-pacer/frame-pacer.hpp"
+#include "../frame-stats/frame-stats.hpp"
+#include "../mipmap/mipmap.hpp"
+#include "../null-backend/null-backend.hpp"
+#include "../pipeline-cache/pipeline-cache.hpp"
+#include "../softraster/softraster.hpp"
+#include "../specialization/specialization.hpp"
+
+#ifndef LEARN_METAL_TRACING
+#define LEARN_METAL_TRACING 1
+#endif
 
 static constexpr size_t kInstanceRows = 10;
 static constexpr size_t kInstanceColumns = 10;
 static constexpr size_t kInstanceDepth = 10;
 static constexpr size_t kNumInstances = (kInstanceRows * kInstanceColumns * kInstanceDepth);
 static constexpr size_t kMaxFramesInFlight = 3;
+static constexpr uint32_t kTextureRingSize = kMaxFramesInFlight;
 static constexpr uint32_t kTextureWidth = 128;
 static constexpr uint32_t kTextureHeight = 128;
+static constexpr uint32_t kTextureMipCount = mipmap::levelCount( kTextureWidth, kTextureHeight );
+static constexpr size_t kCounterSamplesPerFrame = 4;
+static constexpr uint64_t kTimestampCalibrationInterval = 120;
+static constexpr uint64_t kStatsReportInterval = 600;
+static constexpr float kAngularSpeed = 0.12f;
+static constexpr double kBenchmarkTimestep = 1.0 / 60.0;
 static constexpr double kAutoCaptureTimeoutSecs = std::chrono::seconds(3).count();
 
 auto start = std::chrono::system_clock::now();
@@ -59,34 +101,396 @@ namespace math
     simd::float3x3 discardTranslation( const simd::float4x4& m );
 }
 
-class Renderer
+struct FrameTiming
+{
+    double cpuTime;
+    double waitTime;
+    double commitTime;
+    double gpuTime;
+    double completionTime;
+    std::atomic< bool > completed;
+};
+
+// Trace spans are kept in a ring buffer per thread and written out as a
+// Chrome trace (chrome://tracing, ui.perfetto.dev) on demand. Building with
+// LEARN_METAL_TRACING=0 removes them entirely.
+namespace trace
+{
+    static constexpr uint32_t kGpuTrack = 0;
+    static constexpr size_t kRingCapacity = 8192;
+
+    struct Span
+    {
+        const char* name;
+        double begin;
+        double end;
+        uint32_t track;
+    };
+
+    class ThreadRing
+    {
+        public:
+            ThreadRing( uint32_t track );
+            void push( const Span& span );
+            size_t copy( Span* pSpans, size_t maxSpans ) const;
+            uint32_t track() const;
+            ThreadRing* next() const;
+            void setNext( ThreadRing* pNext );
+
+        private:
+            Span _spans[ kRingCapacity ];
+            std::atomic< uint64_t > _head;
+            uint32_t _track;
+            ThreadRing* _pNext;
+    };
+
+    class Scope
+    {
+        public:
+            Scope( const char* name );
+            ~Scope();
+
+        private:
+            const char* _name;
+            double _begin;
+    };
+
+    void record( const char* name, double begin, double end );
+    void recordGpu( const char* name, double begin, double end );
+    bool writeChromeTrace( const char* path );
+}
+
+#if LEARN_METAL_TRACING
+#define TRACE_CONCAT_( a, b ) a##b
+#define TRACE_CONCAT( a, b ) TRACE_CONCAT_( a, b )
+#define TRACE_SCOPE( name ) trace::Scope TRACE_CONCAT( _traceScope, __LINE__ )( name )
+#define TRACE_SPAN( name, begin, end ) trace::record( name, begin, end )
+#define TRACE_GPU_SPAN( name, begin, end ) trace::recordGpu( name, begin, end )
+#else
+#define TRACE_SCOPE( name ) ((void)0)
+#define TRACE_SPAN( name, begin, end ) ((void)0)
+#define TRACE_GPU_SPAN( name, begin, end ) ((void)0)
+#endif
+
+// A compact binary log of the encoder calls the renderer makes, plus the
+// bytes it changes in its buffers each frame. Every op is stored as
+// [ op : u8 ][ payload size : u32 ][ payload ], so readers can skip ops they
+// do not handle. Pipeline and depth-stencil states cannot be serialized, so
+// they are referenced by name and the function constants of their variant,
+// and resolved again when replaying.
+namespace cmdstream
+{
+    class Recorder
+    {
+        public:
+            Recorder();
+            void nameState( const void* pState, const char* name, const specialization::VariantKey& constants = {} );
+            void beginFrame();
+            void endFrame();
+            uint32_t bufferId( MTL::Buffer* pBuffer );
+            uint32_t textureId( MTL::Texture* pTexture );
+            uint32_t stateId( const void* pState );
+            void op( Op op, const void* pPayload, uint32_t size );
+            template< typename T > void op( Op op, const T& payload );
+            size_t size() const;
+            bool save( const char* path ) const;
+
+        private:
+            struct TrackedBuffer
+            {
+                uint32_t id;
+                MTL::Buffer* pBuffer;
+                std::vector< uint8_t > shadow;
+            };
+
+            void writeDeltas( TrackedBuffer& buffer );
+
+            std::vector< uint8_t > _stream;
+            std::unordered_map< const void*, uint32_t > _ids;
+            std::unordered_map< const void*, StateDecl > _states;
+            std::vector< TrackedBuffer > _buffers;
+            uint32_t _nextId;
+    };
+
+    class ComputeEncoder
+    {
+        public:
+            ComputeEncoder( MTL::ComputeCommandEncoder* pEncoder, Recorder* pRecorder );
+            void setComputePipelineState( MTL::ComputePipelineState* pPSO );
+            void setBuffer( MTL::Buffer* pBuffer, NS::UInteger offset, NS::UInteger index );
+            void setTexture( MTL::Texture* pTexture, NS::UInteger index );
+            void dispatchThreads( MTL::Size threadsPerGrid, MTL::Size threadsPerThreadgroup );
+            void dispatchThreadgroups( MTL::Size threadgroupsPerGrid, MTL::Size threadsPerThreadgroup );
+            void endEncoding();
+
+        private:
+            MTL::ComputeCommandEncoder* _pEncoder;
+            Recorder* _pRecorder;
+    };
+
+    class RenderEncoder
+    {
+        public:
+            RenderEncoder( MTL::RenderCommandEncoder* pEncoder, Recorder* pRecorder );
+            void setRenderPipelineState( MTL::RenderPipelineState* pPSO );
+            void setDepthStencilState( MTL::DepthStencilState* pDepthStencilState );
+            void setVertexBuffer( MTL::Buffer* pBuffer, NS::UInteger offset, NS::UInteger index );
+            void setFragmentTexture( MTL::Texture* pTexture, NS::UInteger index );
+            void setCullMode( MTL::CullMode cullMode );
+            void setFrontFacingWinding( MTL::Winding winding );
+            void drawIndexedPrimitives( MTL::PrimitiveType primitiveType, NS::UInteger indexCount, MTL::IndexType indexType,
+                                        MTL::Buffer* pIndexBuffer, NS::UInteger indexBufferOffset, NS::UInteger instanceCount );
+            void endEncoding();
+
+        private:
+            MTL::RenderCommandEncoder* _pEncoder;
+            Recorder* _pRecorder;
+    };
+
+    class BlitEncoder
+    {
+        public:
+            BlitEncoder( MTL::BlitCommandEncoder* pEncoder, Recorder* pRecorder );
+            void generateMipmaps( MTL::Texture* pTexture );
+            void endEncoding();
+
+        private:
+            MTL::BlitCommandEncoder* _pEncoder;
+            Recorder* _pRecorder;
+    };
+
+    class Replayer
+    {
+        public:
+            Replayer( MTL::Device* pDevice );
+            ~Replayer();
+            bool load( const char* path );
+            void setStateResolver( const std::function< NS::Object*( const StateDecl& ) >& resolve );
+            size_t frameCount() const;
+            void replayFrame( size_t frame, MTL::CommandBuffer* pCommandBuffer, MTL::RenderPassDescriptor* pRpd );
+
+        private:
+            template< typename T > T* object( uint32_t id ) const;
+
+            MTL::Device* _pDevice;
+            Reader _reader;
+            std::unordered_map< uint32_t, NS::Object* > _objects;
+            std::function< NS::Object*( const StateDecl& ) > _resolveState;
+    };
+}
+
+// Metal's types for cmdlist::RenderList. The render pass is flushed into a
+// cmdstream::RenderEncoder, so a recording sees the calls that reach Metal.
+struct MetalCommandApi
+{
+    using RenderPipelineState = MTL::RenderPipelineState;
+    using DepthStencilState = MTL::DepthStencilState;
+    using ComputePipelineState = MTL::ComputePipelineState;
+    using Buffer = MTL::Buffer;
+    using Texture = MTL::Texture;
+    using CullMode = MTL::CullMode;
+    using Winding = MTL::Winding;
+    using PrimitiveType = MTL::PrimitiveType;
+    using IndexType = MTL::IndexType;
+    using Size = MTL::Size;
+};
+
+using RenderCommandList = cmdlist::RenderList< MetalCommandApi >;
+
+struct BenchmarkOptions
+{
+    size_t warmupFrames;
+    size_t frameCount;
+    uint32_t width;
+    uint32_t height;
+    bool submit;
+    bool nullDevice;
+    const char* outputPath;
+    const char* recordPath;
+    const char* replayPath;
+    const char* rasterizePath;
+    const char* pngPath;
+};
+
+bool parseBenchmarkOptions( int argc, char* argv[], BenchmarkOptions* pOptions );
+int runBenchmark( const BenchmarkOptions& options );
+int runReplay( const BenchmarkOptions& options );
+int runRasterize( const BenchmarkOptions& options );
+
+// Keeps an MTL::BinaryArchive and its pipeline_cache::CacheIndex in the
+// documents directory. Pipelines the index lists are built with
+// PipelineOptionFailOnBinaryArchiveMiss, so a stale archive is counted
+// instead of silently compiling again.
+class PipelineCache
+{
+    public:
+        PipelineCache( MTL::Device* pDevice );
+        ~PipelineCache();
+        std::string deviceName() const;
+        bool contains( uint64_t key ) const;
+        void attach( MTL::RenderPipelineDescriptor* pDesc ) const;
+        void attach( MTL::ComputePipelineDescriptor* pDesc ) const;
+        void add( const MTL::RenderPipelineDescriptor* pDesc, uint64_t key, const std::string& name );
+        void add( const MTL::ComputePipelineDescriptor* pDesc, uint64_t key, const std::string& name );
+        void recordHit();
+        void recordStaleHit();
+        void save();
+        void printMetrics() const;
+
+    private:
+        MTL::Device* _pDevice;
+        MTL::BinaryArchive* _pArchive;
+        std::string _archivePath;
+        std::string _indexPath;
+        pipeline_cache::CacheIndex _index;
+        bool _dirty;
+        pipeline_cache::Metrics _metrics;
+        mutable std::mutex _mutex;
+};
+
+// Compiles libraries and pipelines with the asynchronous device calls, so
+// every pipeline builds in parallel off the calling thread. Each pipeline is
+// handed back as a future, and the time spent in every step is recorded.
+class PipelineBuilder
+{
+    public:
+        PipelineBuilder( MTL::Device* pDevice, PipelineCache* pCache );
+        ~PipelineBuilder();
+        bool loadLibrary( const void* pBytes, size_t size );
+        void useMetal4Compiler( const std::string& archivePath, bool harvest );
+        void saveHarvest( const std::string& archivePath, const std::string& scriptPath ) const;
+        std::shared_future< MTL::RenderPipelineState* > buildRenderPipeline( const char* name, const char* source, const char* vertexName,
+                                                                             const char* fragmentName, const MTL::RenderPipelineDescriptor* pDesc,
+                                                                             const specialization::VariantKey& constants );
+        std::shared_future< MTL::ComputePipelineState* > buildComputePipeline( const char* name, const char* source, const char* kernelName,
+                                                                               const specialization::VariantKey& constants );
+        void waitForAll();
+        void printTimes() const;
+
+        template< typename T >
+        static bool isReady( const std::shared_future< T >& future );
+        template< typename T >
+        static T result( const std::shared_future< T >& future );
+
+    private:
+        struct CompileTime
+        {
+            std::string name;
+            double seconds;
+        };
+
+        void buildRenderState( MTL::RenderPipelineDescriptor* pDesc, uint64_t key, const std::string& label,
+                               std::shared_ptr< std::promise< MTL::RenderPipelineState* > > pPromise, bool failOnMiss );
+        void buildComputeState( MTL::ComputePipelineDescriptor* pDesc, uint64_t key, const std::string& label,
+                                std::shared_ptr< std::promise< MTL::ComputePipelineState* > > pPromise, bool failOnMiss );
+        void buildRenderState4( MTL::Library* pLibrary, const std::string& vertex, const std::string& fragment,
+                                MTL::FunctionConstantValues* pConstants, MTL::RenderPipelineDescriptor* pDesc,
+                                const std::string& label, std::shared_ptr< std::promise< MTL::RenderPipelineState* > > pPromise );
+        void buildComputeState4( MTL::Library* pLibrary, const std::string& kernel, MTL::FunctionConstantValues* pConstants,
+                                 const std::string& label, std::shared_ptr< std::promise< MTL::ComputePipelineState* > > pPromise );
+        MTL::Library* library( const std::string& source ) const;
+        void addLibrary( const std::string& source, MTL::Library* pLibrary );
+        static MTL::FunctionConstantValues* newConstantValues( const specialization::VariantKey& constants );
+        static MTL4::FunctionDescriptor* newFunctionDescriptor4( MTL::Library* pLibrary, const std::string& name, MTL::FunctionConstantValues* pConstants );
+        static std::string variantLabel( const char* name, const specialization::VariantKey& constants );
+        static pipeline_cache::CompileOptions describeCompileOptions( const MTL::CompileOptions* pOptions );
+        static pipeline_cache::VertexDescriptor describeVertexDescriptor( const MTL::VertexDescriptor* pDesc );
+        static void describeAttachments( const MTL::RenderPipelineDescriptor* pDesc, pipeline_cache::PipelineKey* pKey );
+        template< typename T >
+        static void fail( std::promise< T >* pPromise, const std::string& label, NS::Error* pError );
+        void recordTime( const std::string& name, double begin, double end );
+
+        MTL::Device* _pDevice;
+        PipelineCache* _pCache;
+        MTL::Library* _pLibrary;
+        MTL::CompileOptions* _pCompileOptions;
+        MTL4::Compiler* _pCompiler;
+        MTL4::CompilerTaskOptions* _pTaskOptions;
+        MTL4::Archive* _pPipelineArchive;
+        MTL4::PipelineDataSetSerializer* _pSerializer;
+        std::atomic< size_t > _archiveHits;
+        std::atomic< size_t > _archiveMisses;
+        std::string _libraryBytes;
+        std::unordered_map< std::string, MTL::Library* > _sourceLibraries;
+        dispatch_group_t _group;
+        double _startTime;
+        double _finishTime;
+        mutable std::mutex _mutex;
+        std::vector< CompileTime > _times;
+};
+
+class Renderer : public ComputeQueue
 {
     public:
         Renderer( MTL::Device* pDevice );
         ~Renderer();
         void buildShaders();
         void buildComputePipeline();
+        void setRenderVariant( const specialization::VariantKey& constants );
+        void setComputeVariant( const specialization::VariantKey& constants );
         void buildDepthStencilStates();
         void buildTextures();
         void buildBuffers();
-        void generateMandelbrotTexture( MTL::CommandBuffer* pCommandBuffer );
+        void buildCounterSampleBuffer();
+        bool pipelinesReady();
+        bool waitForPipelines();
+        void drawPlaceholderFrame( FrameTarget* pTarget );
+        void generateMandelbrotTexture( MTL::CommandBuffer* pCommandBuffer, const ComputeJob& job );
+        void submit( const ComputeJob& job ) override;
+        void recordPassTime( MTL::CounterSampleBuffer* pCounterSampleBuffer, NS::UInteger firstSample, TimingPhase phase );
         void draw( MTK::View* pView );
+        void drawFrame( FrameTarget* pTarget, double timestep );
+        void setBenchmarkMode();
+        void setSubmitEnabled( bool enabled );
+        void useNullQueues();
+        void setRecorder( cmdstream::Recorder* pRecorder );
+        void nameStates( cmdstream::Replayer* pReplayer );
+        NS::Object* replayState( const cmdstream::StateDecl& state );
+        void waitForIdle();
+        const FrameStats& stats() const;
+        void resetStats();
         void triggerCapture();
+        void writeTrace();
         static bool beginCapture;
 
     private:
+        static void frameCompleted( void* pContext, uint32_t frame, MTL::CommandBuffer* pCmd );
+        static void computeCompleted( void* pContext, uint32_t slot, MTL::CommandBuffer* pCmd );
+        std::shared_future< MTL::RenderPipelineState* > renderVariant( const specialization::VariantKey& constants );
+        std::shared_future< MTL::ComputePipelineState* > computeVariant( const specialization::VariantKey& constants );
+
         MTL::Device* _pDevice;
         MTL::CommandQueue* _pCommandQueue;
-        MTL::Library* _pShaderLibrary;
+        MTL::CommandQueue* _pComputeQueue;
+        MTL::SharedEvent* _pComputeEvent;
+        MTL::SharedEvent* _pRenderEvent;
+        AsyncComputeScheduler _computeScheduler;
+        PipelineCache _pipelineCache;
+        PipelineBuilder _pipelineBuilder;
+        specialization::VariantCache< MTL::RenderPipelineState* > _renderVariants;
+        specialization::VariantCache< MTL::ComputePipelineState* > _computeVariants;
+        std::shared_future< MTL::RenderPipelineState* > _renderPipeline;
+        std::shared_future< MTL::ComputePipelineState* > _computePipeline;
+        specialization::VariantKey _requestedRenderConstants;
+        specialization::VariantKey _requestedComputeConstants;
+        specialization::VariantKey _renderConstants;
+        specialization::VariantKey _computeConstants;
+        const char* _pShaderSource;
+        const char* _pKernelSource;
+        bool _pipelinesReported;
         MTL::RenderPipelineState* _pPSO;
         MTL::ComputePipelineState* _pComputePSO;
+        double _startTime;
+        size_t _placeholderFrames;
+        bool _harvestPipelines;
         MTL::DepthStencilState* _pDepthStencilState;
-        MTL::Texture* _pTexture;
+        MTL::Texture* _pTextures[kTextureRingSize];
         MTL::Buffer* _pVertexDataBuffer;
         MTL::Buffer* _pInstanceDataBuffer[kMaxFramesInFlight];
         MTL::Buffer* _pCameraDataBuffer[kMaxFramesInFlight];
         MTL::Buffer* _pIndexBuffer;
-        MTL::Buffer* _pTextureAnimationBuffer;
+        MTL::Buffer* _pTextureAnimationBuffer[kTextureRingSize];
+        FrameTiming _frameTimings[kMaxFramesInFlight];
         float _angle;
         int _frame;
         dispatch_semaphore_t _semaphore;
@@ -94,6 +498,25 @@ class Renderer
         uint _animationIndex;
         bool _hasCaptured;
         NS::String* _pTraceSaveFilePath;
+        FramePacer _pacer;
+        size_t _heldFrames;
+        FrameStats _stats;
+        MTL::CounterSampleBuffer* _pCounterSampleBuffer;
+        MTL::Timestamp _cpuTimestampBase;
+        MTL::Timestamp _gpuTimestampBase;
+        std::atomic< double > _gpuTicksToSeconds;
+        uint64_t _frameCount;
+        bool _traceInsteadOfCapture;
+        bool _benchmark;
+        bool _submit;
+        double _lastFrameStart;
+        cmdstream::Recorder* _pRecorder;
+        cmdlist::BlockPool _commandBlocks;
+        RenderCommandList _renderList;
+        size_t _drawCalls;
+        completion::Pool< MTL::CommandBuffer, ::kMaxFramesInFlight > _frameCompletions;
+        completion::Pool< MTL::CommandBuffer, ::kTextureRingSize > _computeCompletions;
+        dispatch_semaphore_t _computeSlots[ ::kTextureRingSize ];
 };
 
 class MyMTKViewDelegate : public MTK::ViewDelegate
@@ -138,6 +561,14 @@ int main( int argc, char* argv[] )
 {
     NS::AutoreleasePool* pAutoreleasePool = NS::AutoreleasePool::alloc()->init();
 
+    BenchmarkOptions options;
+    if ( parseBenchmarkOptions( argc, argv, &options ) )
+    {
+        int result = runBenchmark( options );
+        pAutoreleasePool->release();
+        return result;
+    }
+
     MyAppDelegate del;
     UI::ApplicationMain(argc, argv, &del);
 
@@ -310,180 +741,2090 @@ namespace math
 }
 
 
-#pragma mark - Renderer
-#pragma region Renderer {
-
-const int Renderer::kMaxFramesInFlight = 3;
-bool Renderer::beginCapture{false};
+#pragma mark - Timing
 
-Renderer::Renderer( MTL::Device* pDevice )
-: _pDevice( pDevice->retain() )
-, _angle ( 0.f )
-, _frame( 0 )
-, _animationIndex(0)
-, _hasCaptured(false)
+// Seconds on the clock that GPUStartTime() and GPUEndTime() report, the one
+// behind CACurrentMediaTime(), so CPU and GPU spans share a timeline.
+static double hostTime()
 {
-    _pCommandQueue = _pDevice->newCommandQueue();
-    buildShaders();
-    buildComputePipeline();
-    buildDepthStencilStates();
-    buildTextures();
-    buildBuffers();
+    static const double kSecondsPerTick = []() {
+        mach_timebase_info_data_t timebase;
+        mach_timebase_info( &timebase );
+        return (double)timebase.numer / timebase.denom * 1e-9;
+    }();
+    return mach_absolute_time() * kSecondsPerTick;
+}
 
-    _semaphore = dispatch_semaphore_create( Renderer::kMaxFramesInFlight );
+
+#pragma mark - Pipeline Cache
+
+static std::string documentsPath()
+{
+    NS::FileManager *fileManager = NS::FileManager::defaultManager();
+    NS::Array *documentsDirectories = fileManager->URLsForDirectory(NS::SearchPathDirectory::DocumentDirectory, NS::UserDomainMask);
+    NS::URL *documentsDirectory = (NS::URL *)documentsDirectories->object(0);
+    return documentsDirectory->path()->utf8String();
 }
 
-Renderer::~Renderer()
+PipelineCache::PipelineCache( MTL::Device* pDevice )
+: _pDevice( pDevice->retain() )
+, _pArchive( nullptr )
+, _dirty( false )
+, _metrics{ 0, 0, 0 }
 {
-    _pTextureAnimationBuffer->release();
-    _pTexture->release();
-    _pShaderLibrary->release();
-    _pDepthStencilState->release();
-    _pVertexDataBuffer->release();
-    for ( int i = 0; i < kMaxFramesInFlight; ++i )
+    using NS::StringEncoding::UTF8StringEncoding;
+
+    _archivePath = documentsPath() + "/pipelines.binaryarchive";
+    _indexPath = documentsPath() + "/pipelines.index";
+
+    MTL::BinaryArchiveDescriptor* pDesc = MTL::BinaryArchiveDescriptor::alloc()->init();
+    NS::URL* pURL = nullptr;
+    if ( _index.load( _indexPath.c_str() ) )
     {
-        _pInstanceDataBuffer[i]->release();
+        pURL = NS::URL::alloc()->initFileURLWithPath( NS::String::string( _archivePath.c_str(), UTF8StringEncoding ) );
+        pDesc->setUrl( pURL );
     }
-    for ( int i = 0; i < kMaxFramesInFlight; ++i )
+
+    NS::Error* pError = nullptr;
+    _pArchive = _pDevice->newBinaryArchive( pDesc, &pError );
+    if ( !_pArchive && pURL )
     {
-        _pCameraDataBuffer[i]->release();
+        // Without the archive, the index is worthless. Start over empty:
+        __builtin_printf( "Discarding pipeline cache: %s\n", pError->localizedDescription()->utf8String() );
+        _index.clear();
+        pDesc->setUrl( nullptr );
+        _pArchive = _pDevice->newBinaryArchive( pDesc, &pError );
     }
-    _pIndexBuffer->release();
-    _pComputePSO->release();
-    _pPSO->release();
-    _pCommandQueue->release();
-    _pDevice->release();
-}
-
-namespace shader_types
-{
-    struct VertexData
+    if ( !_pArchive )
     {
-        simd::float3 position;
-        simd::float3 normal;
-        simd::float2 texcoord;
-    };
+        __builtin_printf( "%s", pError->localizedDescription()->utf8String() );
+        assert( false );
+    }
 
-    struct InstanceData
+    if ( pURL )
     {
-        simd::float4x4 instanceTransform;
-        simd::float3x3 instanceNormalTransform;
-        simd::float4 instanceColor;
-    };
+        pURL->release();
+    }
+    pDesc->release();
+}
 
-    struct CameraData
-    {
-        simd::float4x4 perspectiveTransform;
-        simd::float4x4 worldTransform;
-        simd::float3x3 worldNormalTransform;
-    };
+PipelineCache::~PipelineCache()
+{
+    _pArchive->release();
+    _pDevice->release();
 }
 
-void Renderer::buildShaders()
+std::string PipelineCache::deviceName() const
 {
-    using NS::StringEncoding::UTF8StringEncoding;
+    return _pDevice->name()->utf8String();
+}
 
-    const char* shaderSrc = R"(
-        #include <metal_stdlib>
-        using namespace metal;
+bool PipelineCache::contains( uint64_t key ) const
+{
+    std::lock_guard< std::mutex > lock( _mutex );
+    return _index.contains( key );
+}
 
-        struct v2f
-        {
-            float4 position [[position]];
-            float3 normal;
-            half3 color;
-            float2 texcoord;
-        };
+void PipelineCache::attach( MTL::RenderPipelineDescriptor* pDesc ) const
+{
+    pDesc->setBinaryArchives( NS::Array::array( _pArchive ) );
+}
 
-        struct VertexData
-        {
-            float3 position;
-            float3 normal;
-            float2 texcoord;
-        };
+void PipelineCache::attach( MTL::ComputePipelineDescriptor* pDesc ) const
+{
+    pDesc->setBinaryArchives( NS::Array::array( _pArchive ) );
+}
 
-        struct InstanceData
-        {
-            float4x4 instanceTransform;
-            float3x3 instanceNormalTransform;
-            float4 instanceColor;
-        };
+void PipelineCache::add( const MTL::RenderPipelineDescriptor* pDesc, uint64_t key, const std::string& name )
+{
+    std::lock_guard< std::mutex > lock( _mutex );
+    NS::Error* pError = nullptr;
+    ++_metrics.misses;
+    if ( !_pArchive->addRenderPipelineFunctions( pDesc, &pError ) )
+    {
+        __builtin_printf( "Failed to cache pipeline %s: %s\n", name.c_str(), pError->localizedDescription()->utf8String() );
+        return;
+    }
+    _index.insert( key, name );
+    _dirty = true;
+}
 
-        struct CameraData
-        {
-            float4x4 perspectiveTransform;
-            float4x4 worldTransform;
-            float3x3 worldNormalTransform;
-        };
+void PipelineCache::add( const MTL::ComputePipelineDescriptor* pDesc, uint64_t key, const std::string& name )
+{
+    std::lock_guard< std::mutex > lock( _mutex );
+    NS::Error* pError = nullptr;
+    ++_metrics.misses;
+    if ( !_pArchive->addComputePipelineFunctions( pDesc, &pError ) )
+    {
+        __builtin_printf( "Failed to cache pipeline %s: %s\n", name.c_str(), pError->localizedDescription()->utf8String() );
+        return;
+    }
+    _index.insert( key, name );
+    _dirty = true;
+}
 
-        v2f vertex vertexMain( device const VertexData* vertexData [[buffer(0)]],
-                               device const InstanceData* instanceData [[buffer(1)]],
-                               device const CameraData& cameraData [[buffer(2)]],
-                               uint vertexId [[vertex_id]],
-                               uint instanceId [[instance_id]] )
-        {
-            v2f o;
+void PipelineCache::recordHit()
+{
+    std::lock_guard< std::mutex > lock( _mutex );
+    ++_metrics.hits;
+}
 
-            const device VertexData& vd = vertexData[ vertexId ];
-            float4 pos = float4( vd.position, 1.0 );
-            pos = instanceData[ instanceId ].instanceTransform * pos;
-            pos = cameraData.perspectiveTransform * cameraData.worldTransform * pos;
-            o.position = pos;
+void PipelineCache::recordStaleHit()
+{
+    std::lock_guard< std::mutex > lock( _mutex );
+    ++_metrics.staleHits;
+}
 
-            float3 normal = instanceData[ instanceId ].instanceNormalTransform * vd.normal;
-            normal = cameraData.worldNormalTransform * normal;
-            o.normal = normal;
+void PipelineCache::save()
+{
+    using NS::StringEncoding::UTF8StringEncoding;
 
-            o.texcoord = vd.texcoord.xy;
+    std::lock_guard< std::mutex > lock( _mutex );
+    if ( !_dirty )
+    {
+        return;
+    }
 
-            o.color = half3( instanceData[ instanceId ].instanceColor.rgb );
-            return o;
-        }
+    // Write the archive before the index, so the index never names
+    // pipelines that didn't make it to disk:
+    NS::URL* pURL = NS::URL::alloc()->initFileURLWithPath( NS::String::string( _archivePath.c_str(), UTF8StringEncoding ) );
+    NS::Error* pError = nullptr;
+    if ( !_pArchive->serializeToURL( pURL, &pError ) )
+    {
+        __builtin_printf( "Failed to write pipeline cache: %s\n", pError->localizedDescription()->utf8String() );
+    }
+    else if ( !_index.save( _indexPath.c_str() ) )
+    {
+        __builtin_printf( "Failed to write pipeline index to \"%s\"\n", _indexPath.c_str() );
+    }
+    else
+    {
+        _dirty = false;
+    }
+    pURL->release();
+}
 
-        half4 fragment fragmentMain( v2f in [[stage_in]], texture2d< half, access::sample > tex [[texture(0)]] )
-        {
-            constexpr sampler s( address::repeat, filter::linear );
-            half3 texel = tex.sample( s, in.texcoord ).rgb;
+void PipelineCache::printMetrics() const
+{
+    std::lock_guard< std::mutex > lock( _mutex );
+    __builtin_printf( "pipeline cache: %zu hits, %zu misses, %zu stale, %zu entries\n",
+                      _metrics.hits, _metrics.misses, _metrics.staleHits, _index.size() );
+}
 
-            // assume light coming from (front-top-right)
-            float3 l = normalize(float3( 1.0, 1.0, 0.8 ));
-            float3 n = normalize( in.normal );
 
-            half ndotl = half( saturate( dot( n, l ) ) );
+#pragma mark - PipelineBuilder
 
-            half3 illum = (in.color * texel * 0.1) + (in.color * texel * ndotl);
-            return half4( illum, 1.0 );
-        }
-    )";
+PipelineBuilder::PipelineBuilder( MTL::Device* pDevice, PipelineCache* pCache )
+: _pDevice( pDevice->retain() )
+, _pCache( pCache )
+, _pLibrary( nullptr )
+, _pCompileOptions( MTL::CompileOptions::alloc()->init() )
+, _pCompiler( nullptr )
+, _pTaskOptions( nullptr )
+, _pPipelineArchive( nullptr )
+, _pSerializer( nullptr )
+, _archiveHits( 0 )
+, _archiveMisses( 0 )
+, _group( dispatch_group_create() )
+, _startTime( hostTime() )
+, _finishTime( 0.0 )
+{
+}
+
+PipelineBuilder::~PipelineBuilder()
+{
+    // The completion handlers point back at the builder:
+    waitForAll();
+    dispatch_release( _group );
+    if ( _pLibrary )
+    {
+        _pLibrary->release();
+    }
+    for ( auto& entry : _sourceLibraries )
+    {
+        entry.second->release();
+    }
+    _pCompileOptions->release();
+    if ( _pCompiler )
+    {
+        _pCompiler->release();
+    }
+    if ( _pTaskOptions )
+    {
+        _pTaskOptions->release();
+    }
+    if ( _pPipelineArchive )
+    {
+        _pPipelineArchive->release();
+    }
+    if ( _pSerializer )
+    {
+        _pSerializer->release();
+    }
+    _pDevice->release();
+}
 
+bool PipelineBuilder::loadLibrary( const void* pBytes, size_t size )
+{
+    // The bytes live in the binary, so the data must not free them:
+    dispatch_data_t data = dispatch_data_create( pBytes, size, nullptr, ^{} );
     NS::Error* pError = nullptr;
-    MTL::Library* pLibrary = _pDevice->newLibrary( NS::String::string(shaderSrc, UTF8StringEncoding), nullptr, &pError );
-    if ( !pLibrary )
+    double start = hostTime();
+    _pLibrary = _pDevice->newLibrary( data, &pError );
+    dispatch_release( data );
+    if ( !_pLibrary )
     {
-        __builtin_printf( "%s", pError->localizedDescription()->utf8String() );
-        assert( false );
+        __builtin_printf( "Failed to load metallib: %s\n", pError->localizedDescription()->utf8String() );
+        return false;
     }
+    recordTime( "metallib", start, hostTime() );
 
-    MTL::Function* pVertexFn = pLibrary->newFunction( NS::String::string("vertexMain", UTF8StringEncoding) );
-    MTL::Function* pFragFn = pLibrary->newFunction( NS::String::string("fragmentMain", UTF8StringEncoding) );
+    // Pipelines built from the metallib are keyed by its contents instead of
+    // the source:
+    _libraryBytes.assign( static_cast< const char* >( pBytes ), size );
+    return true;
+}
 
-    MTL::RenderPipelineDescriptor* pDesc = MTL::RenderPipelineDescriptor::alloc()->init();
-    pDesc->setVertexFunction( pVertexFn );
-    pDesc->setFragmentFunction( pFragFn );
-    pDesc->colorAttachments()->object(0)->setPixelFormat( MTL::PixelFormat::PixelFormatBGRA8Unorm_sRGB );
-    pDesc->setDepthAttachmentPixelFormat( MTL::PixelFormat::PixelFormatDepth16Unorm );
+void PipelineBuilder::useMetal4Compiler( const std::string& archivePath, bool harvest )
+{
+    using NS::StringEncoding::UTF8StringEncoding;
 
-    _pPSO = _pDevice->newRenderPipelineState( pDesc, &pError );
-    if ( !_pPSO )
+    MTL4::CompilerDescriptor* pCompilerDesc = MTL4::CompilerDescriptor::alloc()->init();
+    if ( harvest )
     {
-        __builtin_printf( "%s", pError->localizedDescription()->utf8String() );
-        assert( false );
+        // The serializer sees every pipeline the compiler builds, and keeps
+        // both its descriptor and its compiled code:
+        MTL4::PipelineDataSetSerializerDescriptor* pSerializerDesc = MTL4::PipelineDataSetSerializerDescriptor::alloc()->init();
+        pSerializerDesc->setConfiguration( (MTL4::PipelineDataSetSerializerConfiguration)(
+            MTL4::PipelineDataSetSerializerConfigurationCaptureDescriptors | MTL4::PipelineDataSetSerializerConfigurationCaptureBinaries ) );
+        _pSerializer = _pDevice->newPipelineDataSetSerializer( pSerializerDesc );
+        pCompilerDesc->setPipelineDataSetSerializer( _pSerializer );
+        pSerializerDesc->release();
     }
+    else
+    {
+        // Without a harvested archive there is nothing to gain, so stay on
+        // the path that uses the binary archive cache:
+        NS::URL* pURL = NS::URL::alloc()->initFileURLWithPath( NS::String::string( archivePath.c_str(), UTF8StringEncoding ) );
+        NS::Error* pError = nullptr;
+        _pPipelineArchive = _pDevice->newArchive( pURL, &pError );
+        pURL->release();
+        if ( !_pPipelineArchive )
+        {
+            pCompilerDesc->release();
+            return;
+        }
+
+        // Pipelines the archive misses still find its compiled functions:
+        _pTaskOptions = MTL4::CompilerTaskOptions::alloc()->init();
+        _pTaskOptions->setLookupArchives( NS::Array::array( _pPipelineArchive ) );
+    }
+
+    NS::Error* pError = nullptr;
+    _pCompiler = _pDevice->newCompiler( pCompilerDesc, &pError );
+    if ( !_pCompiler )
+    {
+        __builtin_printf( "%s", pError->localizedDescription()->utf8String() );
+        assert( false );
+    }
+    pCompilerDesc->release();
+}
+
+void PipelineBuilder::saveHarvest( const std::string& archivePath, const std::string& scriptPath ) const
+{
+    using NS::StringEncoding::UTF8StringEncoding;
+
+    if ( !_pSerializer )
+    {
+        return;
+    }
+
+    NS::URL* pURL = NS::URL::alloc()->initFileURLWithPath( NS::String::string( archivePath.c_str(), UTF8StringEncoding ) );
+    NS::Error* pError = nullptr;
+    if ( _pSerializer->serializeAsArchiveAndFlushToURL( pURL, &pError ) )
+    {
+        printf( "Harvested pipelines are available at %s.\n", archivePath.c_str() );
+    }
+    else
+    {
+        __builtin_printf( "Failed to write pipeline archive: %s\n", pError->localizedDescription()->utf8String() );
+    }
+    pURL->release();
+
+    // The script lists the descriptors only, for tools that compile the
+    // archive offline:
+    NS::Data* pScript = _pSerializer->serializeAsPipelinesScript( &pError );
+    FILE* pFile = pScript ? fopen( scriptPath.c_str(), "wb" ) : nullptr;
+    if ( !pFile )
+    {
+        __builtin_printf( "Failed to write pipelines script to \"%s\"\n", scriptPath.c_str() );
+        return;
+    }
+    fwrite( pScript->mutableBytes(), 1, pScript->length(), pFile );
+    fclose( pFile );
+    printf( "Pipelines script is available at %s.\n", scriptPath.c_str() );
+}
+
+std::shared_future< MTL::RenderPipelineState* > PipelineBuilder::buildRenderPipeline( const char* name, const char* source, const char* vertexName,
+                                                                                      const char* fragmentName, const MTL::RenderPipelineDescriptor* pDesc,
+                                                                                      const specialization::VariantKey& constants )
+{
+    using NS::StringEncoding::UTF8StringEncoding;
+
+    // std::function needs copyable captures, so share the promise:
+    auto pPromise = std::make_shared< std::promise< MTL::RenderPipelineState* > >();
+    std::shared_future< MTL::RenderPipelineState* > future = pPromise->get_future().share();
+
+    // The handlers run after this returns, so they keep their own copies of
+    // the descriptor and names:
+    MTL::RenderPipelineDescriptor* pPipelineDesc = static_cast< MTL::RenderPipelineDescriptor* >( pDesc->copy() );
+    MTL::FunctionConstantValues* pConstants = newConstantValues( constants );
+    std::string label = variantLabel( name, constants ), vertex( vertexName ), fragment( fragmentName );
+    uint64_t key = 0;
+    if ( _pCache )
+    {
+        // A metallib was compiled ahead of time, so the options don't apply:
+        pipeline_cache::PipelineKey pipelineKey = {};
+        pipelineKey.kind = pipeline_cache::PipelineKind::Render;
+        pipelineKey.device = _pCache->deviceName();
+        pipelineKey.source = _pLibrary ? _libraryBytes : source;
+        pipelineKey.compileOptions = _pLibrary ? pipeline_cache::CompileOptions{} : describeCompileOptions( _pCompileOptions );
+        pipelineKey.functions = { vertex, fragment };
+        describeAttachments( pDesc, &pipelineKey );
+        pipelineKey.vertexDescriptor = describeVertexDescriptor( pDesc->vertexDescriptor() );
+        pipelineKey.sampleCount = (uint32_t)pDesc->rasterSampleCount();
+        pipelineKey.constants = constants.hash();
+        key = pipeline_cache::hashKey( pipelineKey );
+        _pCache->attach( pPipelineDesc );
+    }
+    PipelineBuilder* pBuilder = this;
+    auto buildState = [=]( MTL::Library* pLibrary ){
+        if ( pBuilder->_pCompiler )
+        {
+            pBuilder->buildRenderState4( pLibrary, vertex, fragment, pConstants, pPipelineDesc, label, pPromise );
+            pConstants->release();
+            return;
+        }
+
+        // Specializing compiles the function for these constant values, so
+        // it runs here, off the calling thread:
+        NS::Error* pError = nullptr;
+        MTL::Function* pVertexFn = pLibrary->newFunction( NS::String::string( vertex.c_str(), UTF8StringEncoding ), pConstants, &pError );
+        MTL::Function* pFragFn = pVertexFn ? pLibrary->newFunction( NS::String::string( fragment.c_str(), UTF8StringEncoding ), pConstants, &pError ) : nullptr;
+        pConstants->release();
+        if ( !pVertexFn || !pFragFn )
+        {
+            if ( pVertexFn )
+            {
+                pVertexFn->release();
+            }
+            fail( pPromise.get(), label, pError );
+            pPipelineDesc->release();
+            dispatch_group_leave( pBuilder->_group );
+            return;
+        }
+        pPipelineDesc->setVertexFunction( pVertexFn );
+        pPipelineDesc->setFragmentFunction( pFragFn );
+        pVertexFn->release();
+        pFragFn->release();
+
+        pBuilder->buildRenderState( pPipelineDesc, key, label, pPromise, pBuilder->_pCache && pBuilder->_pCache->contains( key ) );
+    };
+
+    dispatch_group_enter( _group );
+    if ( MTL::Library* pLibrary = library( source ) )
+    {
+        dispatch_async( dispatch_get_global_queue( QOS_CLASS_USER_INITIATED, 0 ), ^{
+            buildState( pLibrary );
+        });
+        return future;
+    }
+
+    double libraryStart = hostTime();
+    _pDevice->newLibrary( NS::String::string( source, UTF8StringEncoding ), _pCompileOptions, [=]( MTL::Library* pLibrary, NS::Error* pError ){
+        if ( !pLibrary )
+        {
+            fail( pPromise.get(), label, pError );
+            pPipelineDesc->release();
+            pConstants->release();
+            dispatch_group_leave( pBuilder->_group );
+            return;
+        }
+        pBuilder->recordTime( label + " library", libraryStart, hostTime() );
+        pBuilder->addLibrary( source, pLibrary );
+        buildState( pLibrary );
+    });
+
+    return future;
+}
+
+std::shared_future< MTL::ComputePipelineState* > PipelineBuilder::buildComputePipeline( const char* name, const char* source, const char* kernelName,
+                                                                                        const specialization::VariantKey& constants )
+{
+    using NS::StringEncoding::UTF8StringEncoding;
+
+    auto pPromise = std::make_shared< std::promise< MTL::ComputePipelineState* > >();
+    std::shared_future< MTL::ComputePipelineState* > future = pPromise->get_future().share();
+
+    MTL::ComputePipelineDescriptor* pPipelineDesc = MTL::ComputePipelineDescriptor::alloc()->init();
+    MTL::FunctionConstantValues* pConstants = newConstantValues( constants );
+    std::string label = variantLabel( name, constants ), kernel( kernelName );
+    uint64_t key = 0;
+    if ( _pCache )
+    {
+        pipeline_cache::PipelineKey pipelineKey = {};
+        pipelineKey.kind = pipeline_cache::PipelineKind::Compute;
+        pipelineKey.device = _pCache->deviceName();
+        pipelineKey.source = _pLibrary ? _libraryBytes : source;
+        pipelineKey.compileOptions = _pLibrary ? pipeline_cache::CompileOptions{} : describeCompileOptions( _pCompileOptions );
+        pipelineKey.functions = { kernel };
+        pipelineKey.constants = constants.hash();
+        key = pipeline_cache::hashKey( pipelineKey );
+        _pCache->attach( pPipelineDesc );
+    }
+    PipelineBuilder* pBuilder = this;
+    auto buildState = [=]( MTL::Library* pLibrary ){
+        if ( pBuilder->_pCompiler )
+        {
+            pPipelineDesc->release();
+            pBuilder->buildComputeState4( pLibrary, kernel, pConstants, label, pPromise );
+            pConstants->release();
+            return;
+        }
+
+        NS::Error* pError = nullptr;
+        MTL::Function* pKernelFn = pLibrary->newFunction( NS::String::string( kernel.c_str(), UTF8StringEncoding ), pConstants, &pError );
+        pConstants->release();
+        if ( !pKernelFn )
+        {
+            fail( pPromise.get(), label, pError );
+            pPipelineDesc->release();
+            dispatch_group_leave( pBuilder->_group );
+            return;
+        }
+        pPipelineDesc->setComputeFunction( pKernelFn );
+        pKernelFn->release();
+
+        pBuilder->buildComputeState( pPipelineDesc, key, label, pPromise, pBuilder->_pCache && pBuilder->_pCache->contains( key ) );
+    };
+
+    dispatch_group_enter( _group );
+    if ( MTL::Library* pLibrary = library( source ) )
+    {
+        dispatch_async( dispatch_get_global_queue( QOS_CLASS_USER_INITIATED, 0 ), ^{
+            buildState( pLibrary );
+        });
+        return future;
+    }
+
+    double libraryStart = hostTime();
+    _pDevice->newLibrary( NS::String::string( source, UTF8StringEncoding ), _pCompileOptions, [=]( MTL::Library* pLibrary, NS::Error* pError ){
+        if ( !pLibrary )
+        {
+            fail( pPromise.get(), label, pError );
+            pPipelineDesc->release();
+            pConstants->release();
+            dispatch_group_leave( pBuilder->_group );
+            return;
+        }
+        pBuilder->recordTime( label + " library", libraryStart, hostTime() );
+        pBuilder->addLibrary( source, pLibrary );
+        buildState( pLibrary );
+    });
+
+    return future;
+}
+
+MTL::Library* PipelineBuilder::library( const std::string& source ) const
+{
+    // Variants of a pipeline share their library, whether it came from the
+    // metallib or from source that compiled earlier:
+    if ( _pLibrary )
+    {
+        return _pLibrary;
+    }
+    std::lock_guard< std::mutex > lock( _mutex );
+    auto it = _sourceLibraries.find( source );
+    return it != _sourceLibraries.end() ? it->second : nullptr;
+}
+
+void PipelineBuilder::addLibrary( const std::string& source, MTL::Library* pLibrary )
+{
+    std::lock_guard< std::mutex > lock( _mutex );
+    MTL::Library*& pCached = _sourceLibraries[ source ];
+    if ( !pCached )
+    {
+        pCached = pLibrary->retain();
+    }
+}
+
+MTL::FunctionConstantValues* PipelineBuilder::newConstantValues( const specialization::VariantKey& constants )
+{
+    static constexpr MTL::DataType kDataTypes[] = { MTL::DataTypeBool, MTL::DataTypeUInt, MTL::DataTypeFloat, MTL::DataTypeFloat3 };
+
+    MTL::FunctionConstantValues* pValues = MTL::FunctionConstantValues::alloc()->init();
+    for ( const specialization::Value& value : constants.values() )
+    {
+        pValues->setConstantValue( value.bytes, kDataTypes[ (size_t)value.type ], value.index );
+    }
+    return pValues;
+}
+
+std::string PipelineBuilder::variantLabel( const char* name, const specialization::VariantKey& constants )
+{
+    // Labels end up in the cache index, so they must not contain spaces:
+    if ( constants.values().empty() )
+    {
+        return name;
+    }
+    char suffix[18];
+    snprintf( suffix, sizeof( suffix ), ".%08x", (uint32_t)constants.hash() );
+    return std::string( name ) + suffix;
+}
+
+pipeline_cache::CompileOptions PipelineBuilder::describeCompileOptions( const MTL::CompileOptions* pOptions )
+{
+    pipeline_cache::CompileOptions options = { (uint32_t)pOptions->languageVersion(), (uint32_t)pOptions->mathMode(),
+                                               (uint32_t)pOptions->optimizationLevel(), pOptions->preserveInvariance(), {} };
+    if ( NS::Dictionary* pMacros = pOptions->preprocessorMacros() )
+    {
+        // Values may be strings or numbers, so compare their descriptions:
+        NS::Enumerator< NS::Object >* pKeys = pMacros->keyEnumerator< NS::Object >();
+        while ( NS::Object* pKey = pKeys->nextObject() )
+        {
+            options.macros.emplace_back( pKey->description()->utf8String(), pMacros->object( pKey )->description()->utf8String() );
+        }
+    }
+    return options;
+}
+
+pipeline_cache::VertexDescriptor PipelineBuilder::describeVertexDescriptor( const MTL::VertexDescriptor* pDesc )
+{
+    // Shaders that fetch their own vertices leave every attribute invalid:
+    static constexpr uint32_t kMaxVertexAttributes = 31;
+    static constexpr uint32_t kMaxVertexBuffers = 31;
+    pipeline_cache::VertexDescriptor descriptor;
+    if ( !pDesc )
+    {
+        return descriptor;
+    }
+    for ( uint32_t i = 0; i < kMaxVertexAttributes; ++i )
+    {
+        MTL::VertexAttributeDescriptor* pAttribute = pDesc->attributes()->object( i );
+        if ( pAttribute->format() != MTL::VertexFormatInvalid )
+        {
+            descriptor.attributes.push_back( { i, (uint32_t)pAttribute->format(), (uint32_t)pAttribute->offset(), (uint32_t)pAttribute->bufferIndex() } );
+        }
+    }
+    for ( uint32_t i = 0; i < kMaxVertexBuffers; ++i )
+    {
+        MTL::VertexBufferLayoutDescriptor* pLayout = pDesc->layouts()->object( i );
+        if ( pLayout->stride() != 0 )
+        {
+            descriptor.layouts.push_back( { i, (uint32_t)pLayout->stride(), (uint32_t)pLayout->stepFunction(), (uint32_t)pLayout->stepRate() } );
+        }
+    }
+    return descriptor;
+}
+
+void PipelineBuilder::describeAttachments( const MTL::RenderPipelineDescriptor* pDesc, pipeline_cache::PipelineKey* pKey )
+{
+    static constexpr uint32_t kMaxColorAttachments = 8;
+    for ( uint32_t i = 0; i < kMaxColorAttachments; ++i )
+    {
+        MTL::RenderPipelineColorAttachmentDescriptor* pAttachment = pDesc->colorAttachments()->object( i );
+        pKey->pixelFormats.push_back( (uint32_t)pAttachment->pixelFormat() );
+        if ( pAttachment->pixelFormat() != MTL::PixelFormatInvalid )
+        {
+            pKey->blendStates.push_back( { pAttachment->isBlendingEnabled(),
+                                           (uint32_t)pAttachment->rgbBlendOperation(), (uint32_t)pAttachment->alphaBlendOperation(),
+                                           (uint32_t)pAttachment->sourceRGBBlendFactor(), (uint32_t)pAttachment->sourceAlphaBlendFactor(),
+                                           (uint32_t)pAttachment->destinationRGBBlendFactor(), (uint32_t)pAttachment->destinationAlphaBlendFactor(),
+                                           (uint32_t)pAttachment->writeMask() } );
+        }
+    }
+    pKey->pixelFormats.push_back( (uint32_t)pDesc->depthAttachmentPixelFormat() );
+    pKey->pixelFormats.push_back( (uint32_t)pDesc->stencilAttachmentPixelFormat() );
+}
+
+void PipelineBuilder::buildRenderState( MTL::RenderPipelineDescriptor* pDesc, uint64_t key, const std::string& label,
+                                        std::shared_ptr< std::promise< MTL::RenderPipelineState* > > pPromise, bool failOnMiss )
+{
+    // Pipelines the index knows must come from the archive. Anything else is
+    // compiled, then added to the archive for the next launch:
+    MTL::PipelineOption options = failOnMiss ? MTL::PipelineOptionFailOnBinaryArchiveMiss : MTL::PipelineOptionNone;
+    PipelineBuilder* pBuilder = this;
+    double start = hostTime();
+    _pDevice->newRenderPipelineState( pDesc, options, [=]( MTL::RenderPipelineState* pPSO, MTL::RenderPipelineReflection*, NS::Error* pError ){
+        if ( !pPSO && failOnMiss )
+        {
+            pBuilder->_pCache->recordStaleHit();
+            pBuilder->buildRenderState( pDesc, key, label, pPromise, false );
+            return;
+        }
+        if ( !pPSO )
+        {
+            fail( pPromise.get(), label, pError );
+            pDesc->release();
+            dispatch_group_leave( pBuilder->_group );
+            return;
+        }
+        pBuilder->recordTime( label + " pipeline", start, hostTime() );
+
+        if ( pBuilder->_pCache )
+        {
+            if ( failOnMiss )
+            {
+                pBuilder->_pCache->recordHit();
+            }
+            else
+            {
+                pBuilder->_pCache->add( pDesc, key, label );
+            }
+        }
+
+        // The handler doesn't own the state, the caller of get() does:
+        pPromise->set_value( pPSO->retain() );
+        pDesc->release();
+        dispatch_group_leave( pBuilder->_group );
+    });
+}
+
+void PipelineBuilder::buildComputeState( MTL::ComputePipelineDescriptor* pDesc, uint64_t key, const std::string& label,
+                                         std::shared_ptr< std::promise< MTL::ComputePipelineState* > > pPromise, bool failOnMiss )
+{
+    MTL::PipelineOption options = failOnMiss ? MTL::PipelineOptionFailOnBinaryArchiveMiss : MTL::PipelineOptionNone;
+    PipelineBuilder* pBuilder = this;
+    double start = hostTime();
+    _pDevice->newComputePipelineState( pDesc, options, [=]( MTL::ComputePipelineState* pPSO, MTL::ComputePipelineReflection*, NS::Error* pError ){
+        if ( !pPSO && failOnMiss )
+        {
+            pBuilder->_pCache->recordStaleHit();
+            pBuilder->buildComputeState( pDesc, key, label, pPromise, false );
+            return;
+        }
+        if ( !pPSO )
+        {
+            fail( pPromise.get(), label, pError );
+            pDesc->release();
+            dispatch_group_leave( pBuilder->_group );
+            return;
+        }
+        pBuilder->recordTime( label + " pipeline", start, hostTime() );
+
+        if ( pBuilder->_pCache )
+        {
+            if ( failOnMiss )
+            {
+                pBuilder->_pCache->recordHit();
+            }
+            else
+            {
+                pBuilder->_pCache->add( pDesc, key, label );
+            }
+        }
+
+        pPromise->set_value( pPSO->retain() );
+        pDesc->release();
+        dispatch_group_leave( pBuilder->_group );
+    });
+}
+
+MTL4::FunctionDescriptor* PipelineBuilder::newFunctionDescriptor4( MTL::Library* pLibrary, const std::string& name, MTL::FunctionConstantValues* pConstants )
+{
+    // Metal 4 descriptors name their functions instead of holding them, and
+    // specialize them by wrapping the name with the constant values:
+    MTL4::LibraryFunctionDescriptor* pFunction = MTL4::LibraryFunctionDescriptor::alloc()->init();
+    pFunction->setLibrary( pLibrary );
+    pFunction->setName( NS::String::string( name.c_str(), NS::UTF8StringEncoding ) );
+
+    MTL4::SpecializedFunctionDescriptor* pSpecialized = MTL4::SpecializedFunctionDescriptor::alloc()->init();
+    pSpecialized->setFunctionDescriptor( pFunction );
+    pSpecialized->setConstantValues( pConstants );
+    pFunction->release();
+    return pSpecialized;
+}
+
+void PipelineBuilder::buildRenderState4( MTL::Library* pLibrary, const std::string& vertex, const std::string& fragment,
+                                         MTL::FunctionConstantValues* pConstants, MTL::RenderPipelineDescriptor* pDesc,
+                                         const std::string& label, std::shared_ptr< std::promise< MTL::RenderPipelineState* > > pPromise )
+{
+    // The depth format is left to the render pass in Metal 4:
+    MTL4::FunctionDescriptor* pVertexFn = newFunctionDescriptor4( pLibrary, vertex, pConstants );
+    MTL4::FunctionDescriptor* pFragFn = newFunctionDescriptor4( pLibrary, fragment, pConstants );
+
+    MTL4::RenderPipelineDescriptor* pDesc4 = MTL4::RenderPipelineDescriptor::alloc()->init();
+    pDesc4->setVertexFunctionDescriptor( pVertexFn );
+    pDesc4->setFragmentFunctionDescriptor( pFragFn );
+    pDesc4->colorAttachments()->object(0)->setPixelFormat( pDesc->colorAttachments()->object(0)->pixelFormat() );
+    pDesc4->setRasterSampleCount( pDesc->rasterSampleCount() );
+    pVertexFn->release();
+    pFragFn->release();
+    pDesc->release();
+
+    // A harvested archive hands out the pipeline without compiling anything:
+    double start = hostTime();
+    if ( _pPipelineArchive )
+    {
+        NS::Error* pError = nullptr;
+        if ( MTL::RenderPipelineState* pPSO = _pPipelineArchive->newRenderPipelineState( pDesc4, &pError ) )
+        {
+            ++_archiveHits;
+            recordTime( label + " archive", start, hostTime() );
+            pPromise->set_value( pPSO );
+            pDesc4->release();
+            dispatch_group_leave( _group );
+            return;
+        }
+        ++_archiveMisses;
+    }
+
+    PipelineBuilder* pBuilder = this;
+    MTL4::CompilerTask* pTask = _pCompiler->newRenderPipelineState( pDesc4, _pTaskOptions, [=]( MTL::RenderPipelineState* pPSO, NS::Error* pError ){
+        if ( !pPSO )
+        {
+            fail( pPromise.get(), label, pError );
+        }
+        else
+        {
+            pBuilder->recordTime( label + " pipeline", start, hostTime() );
+            pPromise->set_value( pPSO->retain() );
+        }
+        pDesc4->release();
+        dispatch_group_leave( pBuilder->_group );
+    });
+    pTask->release();
+}
+
+void PipelineBuilder::buildComputeState4( MTL::Library* pLibrary, const std::string& kernel, MTL::FunctionConstantValues* pConstants,
+                                          const std::string& label, std::shared_ptr< std::promise< MTL::ComputePipelineState* > > pPromise )
+{
+    MTL4::FunctionDescriptor* pKernelFn = newFunctionDescriptor4( pLibrary, kernel, pConstants );
+
+    MTL4::ComputePipelineDescriptor* pDesc4 = MTL4::ComputePipelineDescriptor::alloc()->init();
+    pDesc4->setComputeFunctionDescriptor( pKernelFn );
+    pKernelFn->release();
+
+    double start = hostTime();
+    if ( _pPipelineArchive )
+    {
+        NS::Error* pError = nullptr;
+        if ( MTL::ComputePipelineState* pPSO = _pPipelineArchive->newComputePipelineState( pDesc4, &pError ) )
+        {
+            ++_archiveHits;
+            recordTime( label + " archive", start, hostTime() );
+            pPromise->set_value( pPSO );
+            pDesc4->release();
+            dispatch_group_leave( _group );
+            return;
+        }
+        ++_archiveMisses;
+    }
+
+    PipelineBuilder* pBuilder = this;
+    MTL4::CompilerTask* pTask = _pCompiler->newComputePipelineState( pDesc4, _pTaskOptions, [=]( MTL::ComputePipelineState* pPSO, NS::Error* pError ){
+        if ( !pPSO )
+        {
+            fail( pPromise.get(), label, pError );
+        }
+        else
+        {
+            pBuilder->recordTime( label + " pipeline", start, hostTime() );
+            pPromise->set_value( pPSO->retain() );
+        }
+        pDesc4->release();
+        dispatch_group_leave( pBuilder->_group );
+    });
+    pTask->release();
+}
+
+void PipelineBuilder::waitForAll()
+{
+    dispatch_group_wait( _group, DISPATCH_TIME_FOREVER );
+}
+
+void PipelineBuilder::printTimes() const
+{
+    std::lock_guard< std::mutex > lock( _mutex );
+    double total = 0.0;
+    for ( const CompileTime& time : _times )
+    {
+        __builtin_printf( "compiled %-24s %8.2f ms\n", time.name.c_str(), time.seconds * 1e3 );
+        total += time.seconds;
+    }
+
+    // With everything compiling in parallel, the wall time stays close to
+    // the slowest chain rather than the sum of all steps:
+    __builtin_printf( "compiled %zu steps in %.2f ms (%.2f ms if run one after another)\n",
+                      _times.size(), (_finishTime - _startTime) * 1e3, total * 1e3 );
+    if ( _pPipelineArchive )
+    {
+        __builtin_printf( "pipeline archive: %zu hits, %zu misses\n", _archiveHits.load(), _archiveMisses.load() );
+    }
+}
+
+template< typename T >
+bool PipelineBuilder::isReady( const std::shared_future< T >& future )
+{
+    return future.valid() && future.wait_for( std::chrono::seconds( 0 ) ) == std::future_status::ready;
+}
+
+// The pipeline of a ready future, or nullptr if it failed to build. fail()
+// already reported why.
+template< typename T >
+T PipelineBuilder::result( const std::shared_future< T >& future )
+{
+    try
+    {
+        return future.get();
+    }
+    catch ( const std::runtime_error& )
+    {
+        return nullptr;
+    }
+}
+
+template< typename T >
+void PipelineBuilder::fail( std::promise< T >* pPromise, const std::string& label, NS::Error* pError )
+{
+    std::string message = label + ": " + (pError ? pError->localizedDescription()->utf8String() : "unknown error");
+    __builtin_printf( "Failed to build %s\n", message.c_str() );
+    pPromise->set_exception( std::make_exception_ptr( std::runtime_error( message ) ) );
+}
+
+void PipelineBuilder::recordTime( const std::string& name, double begin, double end )
+{
+    std::lock_guard< std::mutex > lock( _mutex );
+    _times.push_back( { name, end - begin } );
+    _finishTime = std::max( _finishTime, end );
+}
+
+
+#pragma mark - Command Stream
+
+namespace cmdstream
+{
+    static Dispatch makeDispatch( MTL::Size grid, MTL::Size threadgroup )
+    {
+        return { { (uint32_t)grid.width, (uint32_t)grid.height, (uint32_t)grid.depth },
+                 { (uint32_t)threadgroup.width, (uint32_t)threadgroup.height, (uint32_t)threadgroup.depth } };
+    }
+
+    Recorder::Recorder()
+    : _nextId( 1 )
+    {
+        Header header = { kMagic, kVersion };
+        _stream.insert( _stream.end(), (const uint8_t*)&header, (const uint8_t*)(&header + 1) );
+    }
+
+    void Recorder::nameState( const void* pState, const char* name, const specialization::VariantKey& constants )
+    {
+        _states[ pState ] = { name, constants };
+    }
+
+    void Recorder::op( Op op, const void* pPayload, uint32_t size )
+    {
+        _stream.push_back( (uint8_t)op );
+        _stream.insert( _stream.end(), (const uint8_t*)&size, (const uint8_t*)(&size + 1) );
+        _stream.insert( _stream.end(), (const uint8_t*)pPayload, (const uint8_t*)pPayload + size );
+    }
+
+    template< typename T >
+    void Recorder::op( Op op, const T& payload )
+    {
+        this->op( op, &payload, sizeof( T ) );
+    }
+
+    uint32_t Recorder::bufferId( MTL::Buffer* pBuffer )
+    {
+        auto it = _ids.find( pBuffer );
+        if ( it != _ids.end() )
+        {
+            return it->second;
+        }
+
+        // The shadow starts zeroed like a new buffer, so the first delta
+        // carries whatever the app has written so far:
+        uint32_t id = _nextId++;
+        _ids[ pBuffer ] = id;
+        op( Op::DeclareBuffer, BufferDecl{ id, 0, pBuffer->length() } );
+        _buffers.push_back( { id, pBuffer, std::vector< uint8_t >( pBuffer->length(), 0 ) } );
+        return id;
+    }
+
+    uint32_t Recorder::textureId( MTL::Texture* pTexture )
+    {
+        auto it = _ids.find( pTexture );
+        if ( it != _ids.end() )
+        {
+            return it->second;
+        }
+
+        uint32_t id = _nextId++;
+        _ids[ pTexture ] = id;
+        op( Op::DeclareTexture, TextureDecl{ id, (uint32_t)pTexture->width(), (uint32_t)pTexture->height(),
+                                             (uint32_t)pTexture->mipmapLevelCount(), (uint32_t)pTexture->pixelFormat(),
+                                             (uint32_t)pTexture->usage() } );
+        return id;
+    }
+
+    uint32_t Recorder::stateId( const void* pState )
+    {
+        auto it = _ids.find( pState );
+        if ( it != _ids.end() )
+        {
+            return it->second;
+        }
+
+        uint32_t id = _nextId++;
+        _ids[ pState ] = id;
+        auto state = _states.find( pState );
+        std::vector< uint8_t > payload = stateDeclaration( id, state != _states.end() ? state->second : StateDecl{ "unnamed", {} } );
+        op( Op::DeclareState, payload.data(), (uint32_t)payload.size() );
+        return id;
+    }
+
+    void Recorder::beginFrame()
+    {
+        op( Op::BeginFrame, nullptr, 0 );
+    }
+
+    void Recorder::endFrame()
+    {
+        // The app fills its buffers while encoding, so collect the changes
+        // once all passes are recorded. Replaying applies them before commit.
+        for ( TrackedBuffer& buffer : _buffers )
+        {
+            writeDeltas( buffer );
+        }
+        op( Op::EndFrame, nullptr, 0 );
+    }
+
+    void Recorder::writeDeltas( TrackedBuffer& buffer )
+    {
+        const uint8_t* pContents = (const uint8_t*)buffer.pBuffer->contents();
+        const size_t length = buffer.shadow.size();
+
+        size_t offset = 0;
+        while ( offset < length )
+        {
+            size_t chunk = std::min( kDeltaGranularity, length - offset );
+            if ( !memcmp( pContents + offset, &buffer.shadow[ offset ], chunk ) )
+            {
+                offset += chunk;
+                continue;
+            }
+
+            // Extend the run over consecutive changed chunks:
+            size_t end = offset + chunk;
+            while ( end < length )
+            {
+                size_t next = std::min( kDeltaGranularity, length - end );
+                if ( !memcmp( pContents + end, &buffer.shadow[ end ], next ) )
+                {
+                    break;
+                }
+                end += next;
+            }
+
+            uint32_t header[2] = { buffer.id, (uint32_t)offset };
+            uint32_t size = (uint32_t)(sizeof( header ) + end - offset);
+            _stream.push_back( (uint8_t)Op::BufferData );
+            _stream.insert( _stream.end(), (const uint8_t*)&size, (const uint8_t*)(&size + 1) );
+            _stream.insert( _stream.end(), (const uint8_t*)header, (const uint8_t*)(header + 2) );
+            _stream.insert( _stream.end(), pContents + offset, pContents + end );
+            memcpy( &buffer.shadow[ offset ], pContents + offset, end - offset );
+            offset = end;
+        }
+    }
+
+    size_t Recorder::size() const
+    {
+        return _stream.size();
+    }
+
+    bool Recorder::save( const char* path ) const
+    {
+        FILE* pFile = fopen( path, "wb" );
+        if ( !pFile )
+        {
+            return false;
+        }
+        size_t written = fwrite( _stream.data(), 1, _stream.size(), pFile );
+        return fclose( pFile ) == 0 && written == _stream.size();
+    }
+
+    ComputeEncoder::ComputeEncoder( MTL::ComputeCommandEncoder* pEncoder, Recorder* pRecorder )
+    : _pEncoder( pEncoder )
+    , _pRecorder( pRecorder )
+    {
+        if ( _pRecorder )
+        {
+            _pRecorder->op( Op::BeginCompute, nullptr, 0 );
+        }
+    }
+
+    void ComputeEncoder::setComputePipelineState( MTL::ComputePipelineState* pPSO )
+    {
+        _pEncoder->setComputePipelineState( pPSO );
+        if ( _pRecorder )
+        {
+            _pRecorder->op( Op::SetComputePipelineState, _pRecorder->stateId( pPSO ) );
+        }
+    }
+
+    void ComputeEncoder::setBuffer( MTL::Buffer* pBuffer, NS::UInteger offset, NS::UInteger index )
+    {
+        _pEncoder->setBuffer( pBuffer, offset, index );
+        if ( _pRecorder )
+        {
+            _pRecorder->op( Op::SetComputeBuffer, Binding{ _pRecorder->bufferId( pBuffer ), (uint32_t)offset, (uint32_t)index } );
+        }
+    }
+
+    void ComputeEncoder::setTexture( MTL::Texture* pTexture, NS::UInteger index )
+    {
+        _pEncoder->setTexture( pTexture, index );
+        if ( _pRecorder )
+        {
+            _pRecorder->op( Op::SetComputeTexture, Binding{ _pRecorder->textureId( pTexture ), 0, (uint32_t)index } );
+        }
+    }
+
+    void ComputeEncoder::dispatchThreads( MTL::Size threadsPerGrid, MTL::Size threadsPerThreadgroup )
+    {
+        _pEncoder->dispatchThreads( threadsPerGrid, threadsPerThreadgroup );
+        if ( _pRecorder )
+        {
+            _pRecorder->op( Op::DispatchThreads, makeDispatch( threadsPerGrid, threadsPerThreadgroup ) );
+        }
+    }
+
+    void ComputeEncoder::dispatchThreadgroups( MTL::Size threadgroupsPerGrid, MTL::Size threadsPerThreadgroup )
+    {
+        _pEncoder->dispatchThreadgroups( threadgroupsPerGrid, threadsPerThreadgroup );
+        if ( _pRecorder )
+        {
+            _pRecorder->op( Op::DispatchThreadgroups, makeDispatch( threadgroupsPerGrid, threadsPerThreadgroup ) );
+        }
+    }
+
+    void ComputeEncoder::endEncoding()
+    {
+        _pEncoder->endEncoding();
+        if ( _pRecorder )
+        {
+            _pRecorder->op( Op::EndEncoding, nullptr, 0 );
+        }
+    }
+
+    RenderEncoder::RenderEncoder( MTL::RenderCommandEncoder* pEncoder, Recorder* pRecorder )
+    : _pEncoder( pEncoder )
+    , _pRecorder( pRecorder )
+    {
+        if ( _pRecorder )
+        {
+            _pRecorder->op( Op::BeginRender, nullptr, 0 );
+        }
+    }
+
+    void RenderEncoder::setRenderPipelineState( MTL::RenderPipelineState* pPSO )
+    {
+        _pEncoder->setRenderPipelineState( pPSO );
+        if ( _pRecorder )
+        {
+            _pRecorder->op( Op::SetRenderPipelineState, _pRecorder->stateId( pPSO ) );
+        }
+    }
+
+    void RenderEncoder::setDepthStencilState( MTL::DepthStencilState* pDepthStencilState )
+    {
+        _pEncoder->setDepthStencilState( pDepthStencilState );
+        if ( _pRecorder )
+        {
+            _pRecorder->op( Op::SetDepthStencilState, _pRecorder->stateId( pDepthStencilState ) );
+        }
+    }
+
+    void RenderEncoder::setVertexBuffer( MTL::Buffer* pBuffer, NS::UInteger offset, NS::UInteger index )
+    {
+        _pEncoder->setVertexBuffer( pBuffer, offset, index );
+        if ( _pRecorder )
+        {
+            _pRecorder->op( Op::SetVertexBuffer, Binding{ _pRecorder->bufferId( pBuffer ), (uint32_t)offset, (uint32_t)index } );
+        }
+    }
+
+    void RenderEncoder::setFragmentTexture( MTL::Texture* pTexture, NS::UInteger index )
+    {
+        _pEncoder->setFragmentTexture( pTexture, index );
+        if ( _pRecorder )
+        {
+            _pRecorder->op( Op::SetFragmentTexture, Binding{ _pRecorder->textureId( pTexture ), 0, (uint32_t)index } );
+        }
+    }
+
+    void RenderEncoder::setCullMode( MTL::CullMode cullMode )
+    {
+        _pEncoder->setCullMode( cullMode );
+        if ( _pRecorder )
+        {
+            _pRecorder->op( Op::SetCullMode, (uint32_t)cullMode );
+        }
+    }
+
+    void RenderEncoder::setFrontFacingWinding( MTL::Winding winding )
+    {
+        _pEncoder->setFrontFacingWinding( winding );
+        if ( _pRecorder )
+        {
+            _pRecorder->op( Op::SetFrontFacingWinding, (uint32_t)winding );
+        }
+    }
+
+    void RenderEncoder::drawIndexedPrimitives( MTL::PrimitiveType primitiveType, NS::UInteger indexCount, MTL::IndexType indexType,
+                                               MTL::Buffer* pIndexBuffer, NS::UInteger indexBufferOffset, NS::UInteger instanceCount )
+    {
+        _pEncoder->drawIndexedPrimitives( primitiveType, indexCount, indexType, pIndexBuffer, indexBufferOffset, instanceCount );
+        if ( _pRecorder )
+        {
+            _pRecorder->op( Op::DrawIndexedPrimitives, DrawIndexed{ (uint32_t)primitiveType, (uint32_t)indexCount, (uint32_t)indexType,
+                                                                    _pRecorder->bufferId( pIndexBuffer ), (uint32_t)indexBufferOffset,
+                                                                    (uint32_t)instanceCount } );
+        }
+    }
+
+    void RenderEncoder::endEncoding()
+    {
+        _pEncoder->endEncoding();
+        if ( _pRecorder )
+        {
+            _pRecorder->op( Op::EndEncoding, nullptr, 0 );
+        }
+    }
+
+    BlitEncoder::BlitEncoder( MTL::BlitCommandEncoder* pEncoder, Recorder* pRecorder )
+    : _pEncoder( pEncoder )
+    , _pRecorder( pRecorder )
+    {
+        if ( _pRecorder )
+        {
+            _pRecorder->op( Op::BeginBlit, nullptr, 0 );
+        }
+    }
+
+    void BlitEncoder::generateMipmaps( MTL::Texture* pTexture )
+    {
+        _pEncoder->generateMipmaps( pTexture );
+        if ( _pRecorder )
+        {
+            _pRecorder->op( Op::GenerateMipmaps, _pRecorder->textureId( pTexture ) );
+        }
+    }
+
+    void BlitEncoder::endEncoding()
+    {
+        _pEncoder->endEncoding();
+        if ( _pRecorder )
+        {
+            _pRecorder->op( Op::EndEncoding, nullptr, 0 );
+        }
+    }
+
+    Replayer::Replayer( MTL::Device* pDevice )
+    : _pDevice( pDevice->retain() )
+    {
+    }
+
+    Replayer::~Replayer()
+    {
+        for ( auto& entry : _objects )
+        {
+            entry.second->release();
+        }
+        _pDevice->release();
+    }
+
+    void Replayer::setStateResolver( const std::function< NS::Object*( const StateDecl& ) >& resolve )
+    {
+        _resolveState = resolve;
+    }
+
+    template< typename T >
+    T* Replayer::object( uint32_t id ) const
+    {
+        auto it = _objects.find( id );
+        return it != _objects.end() ? static_cast< T* >( it->second ) : nullptr;
+    }
+
+    bool Replayer::load( const char* path )
+    {
+        if ( !_reader.load( path ) )
+        {
+            __builtin_printf( "Invalid command stream \"%s\": %s\n", path, _reader.error() );
+            return false;
+        }
+
+        // Create everything the stream declares up front, so that no frame
+        // fails halfway through:
+        for ( const auto& entry : _reader.states() )
+        {
+            NS::Object* pState = _resolveState ? _resolveState( entry.second ) : nullptr;
+            if ( !pState )
+            {
+                __builtin_printf( "Replay stream references unknown state \"%s\"\n", entry.second.name.c_str() );
+                return false;
+            }
+            _objects[ entry.first ] = pState->retain();
+        }
+        for ( const auto& entry : _reader.buffers() )
+        {
+            MTL::Buffer* pBuffer = _pDevice->newBuffer( entry.second.length, MTL::ResourceStorageModeShared );
+            if ( !pBuffer || !pBuffer->contents() )
+            {
+                __builtin_printf( "Failed to create a replay buffer of %llu bytes\n", (unsigned long long)entry.second.length );
+                if ( pBuffer )
+                {
+                    pBuffer->release();
+                }
+                return false;
+            }
+            _objects[ entry.first ] = pBuffer;
+        }
+        for ( const auto& entry : _reader.textures() )
+        {
+            const TextureDecl& decl = entry.second;
+            MTL::TextureDescriptor* pDesc = MTL::TextureDescriptor::texture2DDescriptor( (MTL::PixelFormat)decl.pixelFormat, decl.width, decl.height, false );
+            pDesc->setMipmapLevelCount( decl.mipmapLevelCount );
+            pDesc->setUsage( decl.usage );
+            pDesc->setStorageMode( MTL::StorageModePrivate );
+            MTL::Texture* pTexture = _pDevice->newTexture( pDesc );
+            if ( !pTexture )
+            {
+                __builtin_printf( "Failed to create a %ux%u replay texture\n", decl.width, decl.height );
+                return false;
+            }
+            _objects[ entry.first ] = pTexture;
+        }
+        return true;
+    }
+
+    size_t Replayer::frameCount() const
+    {
+        return _reader.frameCount();
+    }
+
+    void Replayer::replayFrame( size_t frame, MTL::CommandBuffer* pCommandBuffer, MTL::RenderPassDescriptor* pRpd )
+    {
+        MTL::ComputeCommandEncoder* pComputeEncoder = nullptr;
+        MTL::RenderCommandEncoder* pRenderEncoder = nullptr;
+        MTL::BlitCommandEncoder* pBlitEncoder = nullptr;
+
+        size_t cursor = _reader.frameOffset( frame );
+        Op op;
+        const uint8_t* pPayload;
+        uint32_t size;
+        while ( _reader.next( &cursor, &op, &pPayload, &size ) )
+        {
+            Binding binding;
+            Dispatch dispatch;
+            uint32_t value;
+            switch ( op )
+            {
+                case Op::DeclareBuffer:
+                case Op::DeclareTexture:
+                case Op::DeclareState:
+                    // load() has created these already
+                    break;
+                case Op::BufferData:
+                {
+                    // load() has checked that the write lies within the buffer:
+                    uint32_t header[2];
+                    memcpy( header, pPayload, sizeof( header ) );
+                    MTL::Buffer* pBuffer = object< MTL::Buffer >( header[0] );
+                    memcpy( (uint8_t*)pBuffer->contents() + header[1], pPayload + sizeof( header ), size - sizeof( header ) );
+                    break;
+                }
+                case Op::BeginFrame:
+                    break;
+                case Op::EndFrame:
+                    return;
+                case Op::BeginCompute:
+                    pComputeEncoder = pCommandBuffer->computeCommandEncoder();
+                    break;
+                case Op::BeginRender:
+                    pRenderEncoder = pCommandBuffer->renderCommandEncoder( pRpd );
+                    break;
+                case Op::BeginBlit:
+                    pBlitEncoder = pCommandBuffer->blitCommandEncoder();
+                    break;
+                case Op::EndEncoding:
+                    if ( pComputeEncoder ) pComputeEncoder->endEncoding();
+                    if ( pRenderEncoder ) pRenderEncoder->endEncoding();
+                    if ( pBlitEncoder ) pBlitEncoder->endEncoding();
+                    pComputeEncoder = nullptr;
+                    pRenderEncoder = nullptr;
+                    pBlitEncoder = nullptr;
+                    break;
+                case Op::SetComputePipelineState:
+                    memcpy( &value, pPayload, sizeof( value ) );
+                    pComputeEncoder->setComputePipelineState( object< MTL::ComputePipelineState >( value ) );
+                    break;
+                case Op::SetComputeBuffer:
+                    memcpy( &binding, pPayload, sizeof( binding ) );
+                    pComputeEncoder->setBuffer( object< MTL::Buffer >( binding.id ), binding.offset, binding.index );
+                    break;
+                case Op::SetComputeTexture:
+                    memcpy( &binding, pPayload, sizeof( binding ) );
+                    pComputeEncoder->setTexture( object< MTL::Texture >( binding.id ), binding.index );
+                    break;
+                case Op::DispatchThreads:
+                case Op::DispatchThreadgroups:
+                {
+                    memcpy( &dispatch, pPayload, sizeof( dispatch ) );
+                    MTL::Size grid( dispatch.grid[0], dispatch.grid[1], dispatch.grid[2] );
+                    MTL::Size threadgroup( dispatch.threadgroup[0], dispatch.threadgroup[1], dispatch.threadgroup[2] );
+                    if ( op == Op::DispatchThreads )
+                    {
+                        pComputeEncoder->dispatchThreads( grid, threadgroup );
+                    }
+                    else
+                    {
+                        pComputeEncoder->dispatchThreadgroups( grid, threadgroup );
+                    }
+                    break;
+                }
+                case Op::GenerateMipmaps:
+                    memcpy( &value, pPayload, sizeof( value ) );
+                    pBlitEncoder->generateMipmaps( object< MTL::Texture >( value ) );
+                    break;
+                case Op::SetRenderPipelineState:
+                    memcpy( &value, pPayload, sizeof( value ) );
+                    pRenderEncoder->setRenderPipelineState( object< MTL::RenderPipelineState >( value ) );
+                    break;
+                case Op::SetDepthStencilState:
+                    memcpy( &value, pPayload, sizeof( value ) );
+                    pRenderEncoder->setDepthStencilState( object< MTL::DepthStencilState >( value ) );
+                    break;
+                case Op::SetVertexBuffer:
+                    memcpy( &binding, pPayload, sizeof( binding ) );
+                    pRenderEncoder->setVertexBuffer( object< MTL::Buffer >( binding.id ), binding.offset, binding.index );
+                    break;
+                case Op::SetFragmentTexture:
+                    memcpy( &binding, pPayload, sizeof( binding ) );
+                    pRenderEncoder->setFragmentTexture( object< MTL::Texture >( binding.id ), binding.index );
+                    break;
+                case Op::SetCullMode:
+                    memcpy( &value, pPayload, sizeof( value ) );
+                    pRenderEncoder->setCullMode( (MTL::CullMode)value );
+                    break;
+                case Op::SetFrontFacingWinding:
+                    memcpy( &value, pPayload, sizeof( value ) );
+                    pRenderEncoder->setFrontFacingWinding( (MTL::Winding)value );
+                    break;
+                case Op::DrawIndexedPrimitives:
+                {
+                    DrawIndexed draw;
+                    memcpy( &draw, pPayload, sizeof( draw ) );
+                    pRenderEncoder->drawIndexedPrimitives( (MTL::PrimitiveType)draw.primitiveType, draw.indexCount, (MTL::IndexType)draw.indexType,
+                                                           object< MTL::Buffer >( draw.indexBufferId ), draw.indexBufferOffset, draw.instanceCount );
+                    break;
+                }
+            }
+        }
+    }
+}
+
+
+#pragma mark - Benchmark
+
+bool parseBenchmarkOptions( int argc, char* argv[], BenchmarkOptions* pOptions )
+{
+    *pOptions = { 60, 480, 1920, 1080, true, false, nullptr, nullptr, nullptr, nullptr, nullptr };
+
+    bool enabled = false;
+    if ( const char* pFrames = getenv( "LEARN_METAL_BENCHMARK" ) )
+    {
+        enabled = true;
+        if ( atoi( pFrames ) > 0 )
+        {
+            pOptions->frameCount = atoi( pFrames );
+        }
+    }
+
+    for ( int i = 1; i < argc; ++i )
+    {
+        if ( !strcmp( argv[ i ], "--benchmark" ) )
+        {
+            enabled = true;
+        }
+        else if ( !strcmp( argv[ i ], "--frames" ) && i + 1 < argc )
+        {
+            pOptions->frameCount = std::max( atoi( argv[ ++i ] ), 1 );
+        }
+        else if ( !strcmp( argv[ i ], "--warmup" ) && i + 1 < argc )
+        {
+            pOptions->warmupFrames = std::max( atoi( argv[ ++i ] ), 0 );
+        }
+        else if ( !strcmp( argv[ i ], "--size" ) && i + 1 < argc )
+        {
+            sscanf( argv[ ++i ], "%ux%u", &pOptions->width, &pOptions->height );
+        }
+        else if ( !strcmp( argv[ i ], "--no-submit" ) )
+        {
+            pOptions->submit = false;
+        }
+        else if ( !strcmp( argv[ i ], "--null-device" ) )
+        {
+            pOptions->nullDevice = true;
+        }
+        else if ( !strcmp( argv[ i ], "--output" ) && i + 1 < argc )
+        {
+            pOptions->outputPath = argv[ ++i ];
+        }
+        else if ( !strcmp( argv[ i ], "--record" ) && i + 1 < argc )
+        {
+            pOptions->recordPath = argv[ ++i ];
+        }
+        else if ( !strcmp( argv[ i ], "--replay" ) && i + 1 < argc )
+        {
+            // Replaying is always a benchmark:
+            pOptions->replayPath = argv[ ++i ];
+            enabled = true;
+        }
+        else if ( !strcmp( argv[ i ], "--rasterize" ) && i + 1 < argc )
+        {
+            pOptions->rasterizePath = argv[ ++i ];
+            enabled = true;
+        }
+        else if ( !strcmp( argv[ i ], "--png" ) && i + 1 < argc )
+        {
+            pOptions->pngPath = argv[ ++i ];
+        }
+    }
+    return enabled;
+}
+
+int runBenchmark( const BenchmarkOptions& options )
+{
+    if ( options.replayPath )
+    {
+        return runReplay( options );
+    }
+    if ( options.rasterizePath )
+    {
+        return runRasterize( options );
+    }
+
+    MTL::Device* pDevice = MTL::CreateSystemDefaultDevice();
+    if ( !pDevice )
+    {
+        __builtin_printf( "No Metal device available\n" );
+        return 1;
+    }
+
+    Renderer* pRenderer = new Renderer( pDevice );
+    if ( !pRenderer->waitForPipelines() )
+    {
+        __builtin_printf( "No pipelines to benchmark\n" );
+        delete pRenderer;
+        pDevice->release();
+        return 1;
+    }
+    pRenderer->setBenchmarkMode();
+    pRenderer->setSubmitEnabled( options.submit );
+    if ( options.nullDevice )
+    {
+        pRenderer->useNullQueues();
+    }
+    OffscreenTarget* pTarget = new OffscreenTarget( pDevice, options.width, options.height );
+
+    for ( size_t i = 0; i < options.warmupFrames; ++i )
+    {
+        pRenderer->drawFrame( pTarget, kBenchmarkTimestep );
+    }
+    pRenderer->waitForIdle();
+    pRenderer->resetStats();
+    nullbackend::resetStats();
+
+    cmdstream::Recorder* pRecorder = options.recordPath ? new cmdstream::Recorder() : nullptr;
+    pRenderer->setRecorder( pRecorder );
+
+    double start = hostTime();
+    for ( size_t i = 0; i < options.frameCount; ++i )
+    {
+        pRenderer->drawFrame( pTarget, kBenchmarkTimestep );
+    }
+    pRenderer->waitForIdle();
+    double elapsed = hostTime() - start;
+
+    if ( pRecorder )
+    {
+        pRenderer->setRecorder( nullptr );
+        if ( !pRecorder->save( options.recordPath ) )
+        {
+            __builtin_printf( "Failed to write command stream to \"%s\"\n", options.recordPath );
+        }
+        delete pRecorder;
+    }
+
+    FILE* pFile = options.outputPath ? fopen( options.outputPath, "w" ) : stdout;
+    if ( !pFile )
+    {
+        __builtin_printf( "Failed to open \"%s\"\n", options.outputPath );
+        return 1;
+    }
+
+    // ru_maxrss is reported in bytes on Darwin:
+    struct rusage usage;
+    getrusage( RUSAGE_SELF, &usage );
+
+    fprintf( pFile, "{\n" );
+    fprintf( pFile, "  \"sample\": \"10-frame-debugging\",\n" );
+    fprintf( pFile, "  \"device\": \"%s\",\n", pDevice->name()->utf8String() );
+    fprintf( pFile, "  \"submit\": %s,\n", options.submit ? "true" : "false" );
+    fprintf( pFile, "  \"nullDevice\": %s,\n", options.nullDevice ? "true" : "false" );
+    if ( options.nullDevice )
+    {
+        nullbackend::Stats encoded = nullbackend::stats();
+        fprintf( pFile, "  \"nullBackend\": { \"commandBuffersPerFrame\": %.2f, \"encodersPerFrame\": %.2f, \"encoderCallsPerFrame\": %.2f },\n",
+                 (double)encoded.commandBuffers / options.frameCount, (double)encoded.encoders / options.frameCount,
+                 (double)encoded.encoderCalls / options.frameCount );
+    }
+    fprintf( pFile, "  \"width\": %u,\n  \"height\": %u,\n", options.width, options.height );
+    fprintf( pFile, "  \"frames\": %zu,\n  \"warmupFrames\": %zu,\n", options.frameCount, options.warmupFrames );
+    fprintf( pFile, "  \"seconds\": %.6f,\n  \"framesPerSecond\": %.2f,\n", elapsed, options.frameCount / elapsed );
+    fprintf( pFile, "  \"phases\": " );
+    pRenderer->stats().writeJson( pFile );
+    fprintf( pFile, ",\n  \"memory\": { \"deviceAllocatedBytes\": %lu, \"maxResidentBytes\": %ld }\n",
+             (unsigned long)pDevice->currentAllocatedSize(), (long)usage.ru_maxrss );
+    fprintf( pFile, "}\n" );
+    if ( pFile != stdout )
+    {
+        fclose( pFile );
+    }
+
+    delete pTarget;
+    delete pRenderer;
+    pDevice->release();
+    return 0;
+}
+
+int runReplay( const BenchmarkOptions& options )
+{
+    MTL::Device* pDevice = MTL::CreateSystemDefaultDevice();
+    if ( !pDevice )
+    {
+        __builtin_printf( "No Metal device available\n" );
+        return 1;
+    }
+
+    // The renderer is only needed for the pipeline and depth-stencil states
+    // that the stream refers to by name, and builds the variants it recorded:
+    Renderer* pRenderer = new Renderer( pDevice );
+
+    // With --null-device, the stream's buffers and textures live in host
+    // memory instead of on the GPU:
+    MTL::Device* pResourceDevice = options.nullDevice ? reinterpret_cast< MTL::Device* >( nullbackend::newDevice() ) : pDevice->retain();
+    cmdstream::Replayer* pReplayer = new cmdstream::Replayer( pResourceDevice );
+    pResourceDevice->release();
+    if ( !pRenderer->waitForPipelines() )
+    {
+        __builtin_printf( "No pipelines to replay with\n" );
+        delete pReplayer;
+        delete pRenderer;
+        pDevice->release();
+        return 1;
+    }
+    pRenderer->nameStates( pReplayer );
+    if ( !pReplayer->load( options.replayPath ) || pReplayer->frameCount() == 0 )
+    {
+        __builtin_printf( "Failed to load command stream \"%s\"\n", options.replayPath );
+        delete pReplayer;
+        delete pRenderer;
+        pDevice->release();
+        return 1;
+    }
+
+    // With --null-device, the replay measures only the cost of issuing the
+    // stream through metal-cpp:
+    OffscreenTarget* pTarget = new OffscreenTarget( pDevice, options.width, options.height );
+    MTL::CommandQueue* pCommandQueue = options.nullDevice ? reinterpret_cast< MTL::CommandQueue* >( nullbackend::newCommandQueue() )
+                                                          : pDevice->newCommandQueue();
+    nullbackend::resetStats();
+    dispatch_semaphore_t semaphore = dispatch_semaphore_create( kMaxFramesInFlight );
+    TimingHistogram* pGpuTimes = new TimingHistogram();
+    TimingHistogram* pCpuTimes = new TimingHistogram();
+
+    double start = hostTime();
+    for ( size_t frame = 0; frame < pReplayer->frameCount(); ++frame )
+    {
+        NS::AutoreleasePool* pPool = NS::AutoreleasePool::alloc()->init();
+        dispatch_semaphore_wait( semaphore, DISPATCH_TIME_FOREVER );
+
+        double cpuStart = hostTime();
+        MTL::CommandBuffer* pCmd = pCommandQueue->commandBuffer();
+        pCmd->addCompletedHandler( ^void( MTL::CommandBuffer* pCmd ){
+            pGpuTimes->record( pCmd->GPUEndTime() - pCmd->GPUStartTime() );
+            dispatch_semaphore_signal( semaphore );
+        });
+        pReplayer->replayFrame( frame, pCmd, pTarget->renderPassDescriptor() );
+        pCmd->commit();
+        pCpuTimes->record( hostTime() - cpuStart );
+
+        pPool->release();
+    }
+    for ( size_t i = 0; i < kMaxFramesInFlight; ++i )
+    {
+        dispatch_semaphore_wait( semaphore, DISPATCH_TIME_FOREVER );
+    }
+    double elapsed = hostTime() - start;
 
-    pVertexFn->release();
-    pFragFn->release();
-    pDesc->release();
-    _pShaderLibrary = pLibrary;
+    // A semaphore must be back at its initial value when it's released:
+    for ( size_t i = 0; i < kMaxFramesInFlight; ++i )
+    {
+        dispatch_semaphore_signal( semaphore );
+    }
+
+    int result = 0;
+    FILE* pFile = options.outputPath ? fopen( options.outputPath, "w" ) : stdout;
+    if ( pFile )
+    {
+        fprintf( pFile, "{\n" );
+        fprintf( pFile, "  \"replay\": \"%s\",\n", options.replayPath );
+        fprintf( pFile, "  \"device\": \"%s\",\n", pDevice->name()->utf8String() );
+        fprintf( pFile, "  \"nullDevice\": %s,\n", options.nullDevice ? "true" : "false" );
+        if ( options.nullDevice )
+        {
+            nullbackend::Stats encoded = nullbackend::stats();
+            fprintf( pFile, "  \"nullBackend\": { \"encodersPerFrame\": %.2f, \"encoderCallsPerFrame\": %.2f },\n",
+                     (double)encoded.encoders / pReplayer->frameCount(), (double)encoded.encoderCalls / pReplayer->frameCount() );
+        }
+        fprintf( pFile, "  \"frames\": %zu,\n", pReplayer->frameCount() );
+        fprintf( pFile, "  \"seconds\": %.6f,\n  \"framesPerSecond\": %.2f,\n", elapsed, pReplayer->frameCount() / elapsed );
+        const TimingHistogram* histograms[] = { pCpuTimes, pGpuTimes };
+        const char* names[] = { "replay cpu", "gpu frame" };
+        for ( size_t i = 0; i < 2; ++i )
+        {
+            fprintf( pFile, "  \"%s\": { \"p50Ms\": %.4f, \"p95Ms\": %.4f, \"p99Ms\": %.4f }%s\n", names[ i ],
+                     histograms[ i ]->percentile( 0.50 ) * 1e3, histograms[ i ]->percentile( 0.95 ) * 1e3,
+                     histograms[ i ]->percentile( 0.99 ) * 1e3, i == 0 ? "," : "" );
+        }
+        fprintf( pFile, "}\n" );
+        if ( pFile != stdout )
+        {
+            fclose( pFile );
+        }
+    }
+    else
+    {
+        __builtin_printf( "Failed to open \"%s\"\n", options.outputPath );
+        result = 1;
+    }
+
+    delete pCpuTimes;
+    delete pGpuTimes;
+    dispatch_release( semaphore );
+    pCommandQueue->release();
+    delete pTarget;
+    delete pReplayer;
+    delete pRenderer;
+    pDevice->release();
+    return result;
+}
+
+
+#pragma mark - Trace
+
+namespace trace
+{
+    static std::atomic< ThreadRing* > gRings{ nullptr };
+    static std::atomic< uint32_t > gNextTrack{ kGpuTrack + 1 };
+
+    static ThreadRing* threadRing()
+    {
+        // Rings live until the process exits, so the writer never has to
+        // coordinate with a thread that is flushing:
+        thread_local ThreadRing* pRing = nullptr;
+        if ( !pRing )
+        {
+            pRing = new ThreadRing( gNextTrack.fetch_add( 1, std::memory_order_relaxed ) );
+            ThreadRing* pHead = gRings.load( std::memory_order_relaxed );
+            do
+            {
+                pRing->setNext( pHead );
+            } while ( !gRings.compare_exchange_weak( pHead, pRing, std::memory_order_release, std::memory_order_relaxed ) );
+        }
+        return pRing;
+    }
+
+    ThreadRing::ThreadRing( uint32_t track )
+    : _head( 0 )
+    , _track( track )
+    , _pNext( nullptr )
+    {
+    }
+
+    void ThreadRing::push( const Span& span )
+    {
+        uint64_t head = _head.load( std::memory_order_relaxed );
+        _spans[ head % kRingCapacity ] = span;
+        _head.store( head + 1, std::memory_order_release );
+    }
+
+    size_t ThreadRing::copy( Span* pSpans, size_t maxSpans ) const
+    {
+        uint64_t head = _head.load( std::memory_order_acquire );
+        uint64_t first = head > kRingCapacity ? head - kRingCapacity : 0;
+        size_t count = 0;
+        for ( uint64_t i = first; i < head && count < maxSpans; ++i )
+        {
+            pSpans[ count++ ] = _spans[ i % kRingCapacity ];
+        }
+
+        // Drop whatever the owning thread overwrote, or may be overwriting,
+        // while we were copying:
+        uint64_t written = _head.load( std::memory_order_acquire ) + 1;
+        size_t stale = written > first + kRingCapacity ? (size_t)std::min< uint64_t >( written - first - kRingCapacity, count ) : 0;
+        if ( stale > 0 )
+        {
+            std::copy( pSpans + stale, pSpans + count, pSpans );
+            count -= stale;
+        }
+        return count;
+    }
+
+    uint32_t ThreadRing::track() const
+    {
+        return _track;
+    }
+
+    ThreadRing* ThreadRing::next() const
+    {
+        return _pNext;
+    }
+
+    void ThreadRing::setNext( ThreadRing* pNext )
+    {
+        _pNext = pNext;
+    }
+
+    Scope::Scope( const char* name )
+    : _name( name )
+    , _begin( hostTime() )
+    {
+    }
+
+    Scope::~Scope()
+    {
+        record( _name, _begin, hostTime() );
+    }
+
+    void record( const char* name, double begin, double end )
+    {
+        ThreadRing* pRing = threadRing();
+        pRing->push( { name, begin, end, pRing->track() } );
+    }
+
+    void recordGpu( const char* name, double begin, double end )
+    {
+        threadRing()->push( { name, begin, end, kGpuTrack } );
+    }
+
+    bool writeChromeTrace( const char* path )
+    {
+        FILE* pFile = fopen( path, "w" );
+        if ( !pFile )
+        {
+            return false;
+        }
+
+        Span* pSpans = new Span[ kRingCapacity ];
+        fprintf( pFile, "{\"traceEvents\":[\n" );
+        fprintf( pFile, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"GPU\"}}", kGpuTrack );
+        for ( ThreadRing* pRing = gRings.load( std::memory_order_acquire ); pRing; pRing = pRing->next() )
+        {
+            size_t count = pRing->copy( pSpans, kRingCapacity );
+            for ( size_t i = 0; i < count; ++i )
+            {
+                // Chrome traces use microseconds:
+                fprintf( pFile, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                         pSpans[ i ].name, pSpans[ i ].track, pSpans[ i ].begin * 1e6, (pSpans[ i ].end - pSpans[ i ].begin) * 1e6 );
+            }
+        }
+        fprintf( pFile, "\n]}\n" );
+        delete [] pSpans;
+
+        return fclose( pFile ) == 0;
+    }
+}
+
+
+#pragma mark - Renderer
+#pragma region Renderer {
+
+const int Renderer::kMaxFramesInFlight = 3;
+bool Renderer::beginCapture{false};
+
+Renderer::Renderer( MTL::Device* pDevice )
+: _pDevice( pDevice->retain() )
+, _computeScheduler( kTextureRingSize )
+, _pipelineCache( pDevice )
+, _pipelineBuilder( pDevice, &_pipelineCache )
+, _pPSO( nullptr )
+, _pComputePSO( nullptr )
+, _pShaderSource( nullptr )
+, _pKernelSource( nullptr )
+, _pipelinesReported( false )
+, _startTime( hostTime() )
+, _placeholderFrames( 0 )
+, _harvestPipelines( getenv( "LEARN_METAL_HARVEST_PIPELINES" ) != nullptr )
+, _angle ( 0.f )
+, _frame( 0 )
+, _animationIndex(0)
+, _hasCaptured(false)
+, _pacer( kMaxFramesInFlight )
+, _heldFrames( 0 )
+, _pCounterSampleBuffer( nullptr )
+, _cpuTimestampBase( 0 )
+, _gpuTimestampBase( 0 )
+, _gpuTicksToSeconds( 1e-9 )
+, _frameCount( 0 )
+, _traceInsteadOfCapture( getenv( "LEARN_METAL_TRACE" ) != nullptr )
+, _benchmark( false )
+, _submit( true )
+, _pRecorder( nullptr )
+, _lastFrameStart( 0.0 )
+, _renderList( &_commandBlocks )
+, _drawCalls( 1 )
+, _frameCompletions( completion::Ordering::AsCompleted )
+, _computeCompletions( completion::Ordering::AsCompleted )
+{
+    _pCommandQueue = _pDevice->newCommandQueue();
+    _pComputeQueue = _pDevice->newCommandQueue();
+    _pComputeEvent = _pDevice->newSharedEvent();
+    _pRenderEvent = _pDevice->newSharedEvent();
+
+    // The Makefile embeds the shaders precompiled into a metallib. Builds
+    // without it, or LEARN_METAL_SHADER_SOURCE, compile the inline source:
+    unsigned long metallibSize = 0;
+    const uint8_t* pMetallib = getsectiondata( &_mh_execute_header, "__TEXT", "__metallib", &metallibSize );
+    if ( pMetallib && !getenv( "LEARN_METAL_SHADER_SOURCE" ) )
+    {
+        _pipelineBuilder.loadLibrary( pMetallib, metallibSize );
+    }
+
+    // On Metal 4 devices, development runs with LEARN_METAL_HARVEST_PIPELINES
+    // record the pipelines they build. Later runs load them from the archive:
+    if ( _pDevice->supportsFamily( MTL::GPUFamilyMetal4 ) )
+    {
+        _pipelineBuilder.useMetal4Compiler( documentsPath() + "/pipelines.mtl4archive", _harvestPipelines );
+    }
+    buildShaders();
+    buildComputePipeline();
+    buildDepthStencilStates();
+    buildTextures();
+    buildBuffers();
+    buildCounterSampleBuffer();
+
+    _semaphore = dispatch_semaphore_create( Renderer::kMaxFramesInFlight );
+    for ( dispatch_semaphore_t& slot : _computeSlots )
+    {
+        slot = dispatch_semaphore_create( 1 );
+    }
+
+    for ( FrameTiming& timing : _frameTimings )
+    {
+        timing.completed = false;
+    }
+    _pacer.setLowLatencyMode( getenv( "LEARN_METAL_LOW_LATENCY" ) != nullptr );
+
+    // Splits the instances over this many draws, to give encoding some weight:
+    if ( const char* pDrawCalls = getenv( "LEARN_METAL_DRAW_CALLS" ) )
+    {
+        _drawCalls = std::clamp< size_t >( strtoul( pDrawCalls, nullptr, 10 ), 1, kNumInstances );
+    }
+}
+
+Renderer::~Renderer()
+{
+    waitForPipelines();
+    if ( _pCounterSampleBuffer )
+    {
+        _pCounterSampleBuffer->release();
+    }
+    for ( uint32_t i = 0; i < kTextureRingSize; ++i )
+    {
+        _pTextureAnimationBuffer[i]->release();
+        _pTextures[i]->release();
+    }
+    _pDepthStencilState->release();
+    _pVertexDataBuffer->release();
+    for ( int i = 0; i < kMaxFramesInFlight; ++i )
+    {
+        _pInstanceDataBuffer[i]->release();
+    }
+    for ( int i = 0; i < kMaxFramesInFlight; ++i )
+    {
+        _pCameraDataBuffer[i]->release();
+    }
+    _pIndexBuffer->release();
+    _renderVariants.forEach( []( const specialization::VariantKey&, std::shared_future< MTL::RenderPipelineState* > pipeline ){
+        if ( MTL::RenderPipelineState* pPSO = PipelineBuilder::result( pipeline ) )
+        {
+            pPSO->release();
+        }
+    });
+    _computeVariants.forEach( []( const specialization::VariantKey&, std::shared_future< MTL::ComputePipelineState* > pipeline ){
+        if ( MTL::ComputePipelineState* pPSO = PipelineBuilder::result( pipeline ) )
+        {
+            pPSO->release();
+        }
+    });
+    _pRenderEvent->release();
+    _pComputeEvent->release();
+    _pComputeQueue->release();
+    _pCommandQueue->release();
+    _pDevice->release();
+}
+
+namespace shader_types
+{
+    struct VertexData
+    {
+        simd::float3 position;
+        simd::float3 normal;
+        simd::float2 texcoord;
+    };
+
+    struct InstanceData
+    {
+        simd::float4x4 instanceTransform;
+        simd::float3x3 instanceNormalTransform;
+        simd::float4 instanceColor;
+    };
+
+    struct CameraData
+    {
+        simd::float4x4 perspectiveTransform;
+        simd::float4x4 worldTransform;
+        simd::float3x3 worldNormalTransform;
+    };
+
+    // The software rasterizer reads the recorded buffers through its own
+    // copies of these types:
+    static_assert( sizeof( VertexData ) == sizeof( softraster::VertexData ) && offsetof( VertexData, texcoord ) == offsetof( softraster::VertexData, texcoord ), "vertex layouts differ" );
+    static_assert( sizeof( InstanceData ) == sizeof( softraster::InstanceData ) && offsetof( InstanceData, instanceColor ) == offsetof( softraster::InstanceData, instanceColor ), "instance layouts differ" );
+    static_assert( sizeof( CameraData ) == sizeof( softraster::CameraData ) && offsetof( CameraData, worldNormalTransform ) == offsetof( softraster::CameraData, worldNormalTransform ), "camera layouts differ" );
+}
+
+static_assert( softraster::kCullModeBack == MTL::CullModeBack && softraster::kCullModeFront == MTL::CullModeFront &&
+               softraster::kWindingCounterClockwise == MTL::WindingCounterClockwise &&
+               softraster::kPrimitiveTypeTriangle == MTL::PrimitiveTypeTriangle && softraster::kIndexTypeUInt16 == MTL::IndexTypeUInt16,
+               "the rasterizer's enum values differ from Metal's" );
+
+void Renderer::buildShaders()
+{
+    const char* shaderSrc = R"(
+        #include <metal_stdlib>
+        using namespace metal;
+
+        struct v2f
+        {
+            float4 position [[position]];
+            float3 normal;
+            half3 color;
+            float2 texcoord;
+        };
+
+        struct VertexData
+        {
+            float3 position;
+            float3 normal;
+            float2 texcoord;
+        };
+
+        struct InstanceData
+        {
+            float4x4 instanceTransform;
+            float3x3 instanceNormalTransform;
+            float4 instanceColor;
+        };
+
+        struct CameraData
+        {
+            float4x4 perspectiveTransform;
+            float4x4 worldTransform;
+            float3x3 worldNormalTransform;
+        };
+
+        v2f vertex vertexMain( device const VertexData* vertexData [[buffer(0)]],
+                               device const InstanceData* instanceData [[buffer(1)]],
+                               device const CameraData& cameraData [[buffer(2)]],
+                               uint vertexId [[vertex_id]],
+                               uint instanceId [[instance_id]] )
+        {
+            v2f o;
+
+            const device VertexData& vd = vertexData[ vertexId ];
+            float4 pos = float4( vd.position, 1.0 );
+            pos = instanceData[ instanceId ].instanceTransform * pos;
+            pos = cameraData.perspectiveTransform * cameraData.worldTransform * pos;
+            o.position = pos;
+
+            float3 normal = instanceData[ instanceId ].instanceNormalTransform * vd.normal;
+            normal = cameraData.worldNormalTransform * normal;
+            o.normal = normal;
+
+            o.texcoord = vd.texcoord.xy;
+
+            o.color = half3( instanceData[ instanceId ].instanceColor.rgb );
+            return o;
+        }
+
+        constant float3 kLightDirection [[function_constant(10)]];
+
+        half4 fragment fragmentMain( v2f in [[stage_in]], texture2d< half, access::sample > tex [[texture(0)]] )
+        {
+            constexpr sampler s( address::repeat, filter::linear, mip_filter::linear );
+            half3 texel = tex.sample( s, in.texcoord ).rgb;
+
+            // by default, light comes from (front-top-right)
+            float3 l = normalize( kLightDirection );
+            float3 n = normalize( in.normal );
+
+            half ndotl = half( saturate( dot( n, l ) ) );
+
+            half3 illum = (in.color * texel * 0.1) + (in.color * texel * ndotl);
+            return half4( illum, 1.0 );
+        }
+    )";
+
+    _pShaderSource = shaderSrc;
+    setRenderVariant( specialization::VariantKey().setDefault( shader_constants::kLightDirection ) );
+}
+
+void Renderer::setRenderVariant( const specialization::VariantKey& constants )
+{
+    // Frames keep using the current pipeline until this variant is ready:
+    _renderPipeline = renderVariant( constants );
+    _requestedRenderConstants = constants;
+}
+
+std::shared_future< MTL::RenderPipelineState* > Renderer::renderVariant( const specialization::VariantKey& constants )
+{
+    return _renderVariants.get( constants, [&](){
+        // The builder fills in the shader functions once the library compiled:
+        MTL::RenderPipelineDescriptor* pDesc = MTL::RenderPipelineDescriptor::alloc()->init();
+        pDesc->colorAttachments()->object(0)->setPixelFormat( MTL::PixelFormat::PixelFormatBGRA8Unorm_sRGB );
+        pDesc->setDepthAttachmentPixelFormat( MTL::PixelFormat::PixelFormatDepth16Unorm );
+
+        std::shared_future< MTL::RenderPipelineState* > pipeline =
+            _pipelineBuilder.buildRenderPipeline( "render", _pShaderSource, "vertexMain", "fragmentMain", pDesc, constants );
+
+        pDesc->release();
+        return pipeline;
+    });
 }
 
 void Renderer::buildComputePipeline()
@@ -492,16 +2833,21 @@ void Renderer::buildComputePipeline()
         #include <metal_stdlib>
         using namespace metal;
 
+        // Specialized per variant, so the compiler can fold them into the
+        // code and unroll for a fixed iteration count:
+        constant uint kMaxIteration [[function_constant(0)]];
+        constant float kAnimationFrequency [[function_constant(1)]];
+        constant float kAnimationSpeed [[function_constant(2)]];
+        constant float kAnimationScaleLow [[function_constant(3)]];
+        constant float kAnimationScale [[function_constant(4)]];
+        constant float kPaletteFrequency [[function_constant(5)]];
+        constant float kPalettePhase [[function_constant(6)]];
+
         kernel void mandelbrot_set(texture2d< half, access::write > tex [[texture(0)]],
                                    uint2 index [[thread_position_in_grid]],
                                    uint2 gridSize [[threads_per_grid]],
                                    device const uint* frame [[buffer(0)]])
         {
-            constexpr float kAnimationFrequency = 0.01;
-            constexpr float kAnimationSpeed = 4;
-            constexpr float kAnimationScaleLow = 0.62;
-            constexpr float kAnimationScale = 0.38;
-
             constexpr float2 kMandelbrotPixelOffset = {-0.2, -0.35};
             constexpr float2 kMandelbrotOrigin = {-1.2, -0.32};
             constexpr float2 kMandelbrotScale = {2.2, 2.0};
@@ -519,9 +2865,8 @@ void Renderer::buildComputePipeline()
             float x = 0.0;
             float y = 0.0;
             uint iteration = 0;
-            uint max_iteration = 1000;
             float xtmp = 0.0;
-            while(x * x + y * y <= 4 && iteration < max_iteration)
+            while(x * x + y * y <= 4 && iteration < kMaxIteration)
             {
                 xtmp = x * x - y * y + x0;
                 y = 2 * x * y + y0;
@@ -530,28 +2875,38 @@ void Renderer::buildComputePipeline()
             }
 
             // Convert iteration result to colors
-            half color = (0.5 + 0.5 * cos(3.0 + iteration * 0.15));
+            half color = (0.5 + 0.5 * cos(kPalettePhase + iteration * kPaletteFrequency));
             tex.write(half4(color, color, color, 1.0), index, 0);
         })";
-    NS::Error* pError = nullptr;
 
-    MTL::Library* pComputeLibrary = _pDevice->newLibrary( NS::String::string(kernelSrc, NS::UTF8StringEncoding), nullptr, &pError );
-    if ( !pComputeLibrary )
+    _pKernelSource = kernelSrc;
+
+    specialization::VariantKey constants;
+    constants.setDefault( shader_constants::kMaxIteration )
+             .setDefault( shader_constants::kAnimationFrequency )
+             .setDefault( shader_constants::kAnimationSpeed )
+             .setDefault( shader_constants::kAnimationScaleLow )
+             .setDefault( shader_constants::kAnimationScale )
+             .setDefault( shader_constants::kPaletteFrequency )
+             .setDefault( shader_constants::kPalettePhase );
+    if ( const char* pIterations = getenv( "LEARN_METAL_MAX_ITERATIONS" ) )
     {
-        __builtin_printf( "%s", pError->localizedDescription()->utf8String() );
-        assert(false);
+        constants.set( shader_constants::kMaxIteration, (uint32_t)strtoul( pIterations, nullptr, 10 ) );
     }
+    setComputeVariant( constants );
+}
 
-    MTL::Function* pMandelbrotFn = pComputeLibrary->newFunction( NS::String::string("mandelbrot_set", NS::UTF8StringEncoding) );
-    _pComputePSO = _pDevice->newComputePipelineState( pMandelbrotFn, &pError );
-    if ( !_pComputePSO )
-    {
-        __builtin_printf( "%s", pError->localizedDescription()->utf8String() );
-        assert(false);
-    }
+void Renderer::setComputeVariant( const specialization::VariantKey& constants )
+{
+    _computePipeline = computeVariant( constants );
+    _requestedComputeConstants = constants;
+}
 
-    pMandelbrotFn->release();
-    pComputeLibrary->release();
+std::shared_future< MTL::ComputePipelineState* > Renderer::computeVariant( const specialization::VariantKey& constants )
+{
+    return _computeVariants.get( constants, [&](){
+        return _pipelineBuilder.buildComputePipeline( "mandelbrot_set", _pKernelSource, "mandelbrot_set", constants );
+    });
 }
 
 void Renderer::buildDepthStencilStates()
@@ -570,13 +2925,17 @@ void Renderer::buildTextures()
     MTL::TextureDescriptor* pTextureDesc = MTL::TextureDescriptor::alloc()->init();
     pTextureDesc->setWidth( kTextureWidth );
     pTextureDesc->setHeight( kTextureHeight );
+    pTextureDesc->setMipmapLevelCount( kTextureMipCount );
     pTextureDesc->setPixelFormat( MTL::PixelFormatRGBA8Unorm );
     pTextureDesc->setTextureType( MTL::TextureType2D );
     pTextureDesc->setStorageMode( MTL::StorageModeShared );
     pTextureDesc->setUsage( MTL::ResourceUsageSample | MTL::ResourceUsageRead | MTL::ResourceUsageWrite);
 
-    MTL::Texture *pTexture = _pDevice->newTexture( pTextureDesc );
-    _pTexture = pTexture;
+    // The compute queue writes one slot while earlier frames sample the others:
+    for ( uint32_t i = 0; i < kTextureRingSize; ++i )
+    {
+        _pTextures[ i ] = _pDevice->newTexture( pTextureDesc );
+    }
 
     pTextureDesc->release();
 }
@@ -655,7 +3014,50 @@ void Renderer::buildBuffers()
         _pCameraDataBuffer[ i ] = _pDevice->newBuffer( cameraDataSize, MTL::ResourceStorageModeShared );
     }
 
-    _pTextureAnimationBuffer = _pDevice->newBuffer( sizeof(uint), MTL::ResourceStorageModeShared );
+    for ( uint32_t i = 0; i < kTextureRingSize; ++i )
+    {
+        _pTextureAnimationBuffer[ i ] = _pDevice->newBuffer( sizeof(uint), MTL::ResourceStorageModeShared );
+    }
+}
+
+void Renderer::buildCounterSampleBuffer()
+{
+    // Per-encoder timestamps need counter sampling at encoder boundaries,
+    // which tile-based GPUs expose instead of sampling between draws:
+    if ( !_pDevice->supportsCounterSampling( MTL::CounterSamplingPointAtStageBoundary ) )
+    {
+        return;
+    }
+
+    MTL::CounterSet* pTimestampSet = nullptr;
+    NS::Array* pCounterSets = _pDevice->counterSets();
+    for ( NS::UInteger i = 0; pCounterSets && i < pCounterSets->count(); ++i )
+    {
+        MTL::CounterSet* pCounterSet = pCounterSets->object< MTL::CounterSet >( i );
+        if ( pCounterSet->name()->isEqualToString( MTL::CommonCounterSetTimestamp ) )
+        {
+            pTimestampSet = pCounterSet;
+        }
+    }
+    if ( !pTimestampSet )
+    {
+        return;
+    }
+
+    MTL::CounterSampleBufferDescriptor* pDesc = MTL::CounterSampleBufferDescriptor::alloc()->init();
+    pDesc->setCounterSet( pTimestampSet );
+    pDesc->setStorageMode( MTL::StorageModeShared );
+    pDesc->setSampleCount( kCounterSamplesPerFrame * kMaxFramesInFlight );
+
+    NS::Error* pError = nullptr;
+    _pCounterSampleBuffer = _pDevice->newCounterSampleBuffer( pDesc, &pError );
+    if ( !_pCounterSampleBuffer )
+    {
+        __builtin_printf( "Counter sampling unavailable: %s\n", pError->localizedDescription()->utf8String() );
+    }
+    pDesc->release();
+
+    _pDevice->sampleTimestamps( &_cpuTimestampBase, &_gpuTimestampBase );
 }
 
 void Renderer::triggerCapture()
@@ -703,18 +3105,56 @@ void Renderer::triggerCapture()
     pCaptureDescriptor->release();
 }
 
-void Renderer::generateMandelbrotTexture( MTL::CommandBuffer* pCommandBuffer )
+void Renderer::writeTrace()
+{
+    char filename[NAME_MAX];
+    std::time_t now;
+    std::time( &now );
+    std::strftime( filename, NAME_MAX, "trace-%H-%M-%S_%m-%d-%y.json", std::localtime( &now ) );
+
+    NS::FileManager *fileManager = NS::FileManager::defaultManager();
+    NS::Array *documentsDirectories = fileManager->URLsForDirectory(NS::SearchPathDirectory::DocumentDirectory, NS::UserDomainMask);
+    NS::URL *documentsDirectory = (NS::URL *)documentsDirectories->object(0);
+    NS::String *tracePath = documentsDirectory->path()->stringByAppendingString( NS::String::string( "/", NS::UTF8StringEncoding ) );
+    tracePath = tracePath->stringByAppendingString( NS::String::string( filename, NS::UTF8StringEncoding ) );
+
+    if ( !trace::writeChromeTrace( tracePath->utf8String() ) )
+    {
+        __builtin_printf( "Failed to write trace to \"%s\"\n", tracePath->utf8String() );
+        return;
+    }
+    printf( "Trace output is available at %s.\n", tracePath->utf8String() );
+}
+
+void Renderer::generateMandelbrotTexture( MTL::CommandBuffer* pCommandBuffer, const ComputeJob& job )
 {
     assert(pCommandBuffer);
+    TRACE_SCOPE( "generateMandelbrotTexture" );
 
-    uint* ptr = reinterpret_cast<uint*>(_pTextureAnimationBuffer->contents());
+    MTL::Texture* pTexture = _pTextures[ job.slot ];
+    MTL::Buffer* pTextureAnimationBuffer = _pTextureAnimationBuffer[ job.slot ];
+    uint* ptr = reinterpret_cast<uint*>(pTextureAnimationBuffer->contents());
     *ptr = (_animationIndex++) % 5000;
 
-    MTL::ComputeCommandEncoder* pComputeEncoder = pCommandBuffer->computeCommandEncoder();
+    // Timestamps go in the slot of the frame that samples this generation:
+    NS::UInteger firstSample = (job.generation % kMaxFramesInFlight) * kCounterSamplesPerFrame;
+
+    MTL::ComputePassDescriptor* pComputePassDesc = MTL::ComputePassDescriptor::computePassDescriptor();
+    if ( _pCounterSampleBuffer )
+    {
+        MTL::ComputePassSampleBufferAttachmentDescriptor* pAttachment = pComputePassDesc->sampleBufferAttachments()->object( 0 );
+        pAttachment->setSampleBuffer( _pCounterSampleBuffer );
+        pAttachment->setStartOfEncoderSampleIndex( firstSample + 0 );
+        pAttachment->setEndOfEncoderSampleIndex( firstSample + 1 );
+    }
+
+    // The cmdstream encoders forward every call, and log it when recording:
+    cmdstream::ComputeEncoder computeEncoder( pCommandBuffer->computeCommandEncoder( pComputePassDesc ), _pRecorder );
+    cmdstream::ComputeEncoder* pComputeEncoder = &computeEncoder;
 
     pComputeEncoder->setComputePipelineState( _pComputePSO );
-    pComputeEncoder->setTexture( _pTexture, 0 );
-    pComputeEncoder->setBuffer(_pTextureAnimationBuffer, 0, 0);
+    pComputeEncoder->setTexture( pTexture, 0 );
+    pComputeEncoder->setBuffer(pTextureAnimationBuffer, 0, 0);
 
     MTL::Size gridSize = MTL::Size( kTextureWidth, kTextureHeight, 1 );
 
@@ -731,17 +3171,319 @@ void Renderer::generateMandelbrotTexture( MTL::CommandBuffer* pCommandBuffer )
     }
 
     pComputeEncoder->endEncoding();
+
+    // The kernel only writes the base level, so rebuild the rest of the mip chain:
+    cmdstream::BlitEncoder blitEncoder( pCommandBuffer->blitCommandEncoder(), _pRecorder );
+    blitEncoder.generateMipmaps( pTexture );
+    blitEncoder.endEncoding();
+}
+
+void Renderer::submit( const ComputeJob& job )
+{
+    TRACE_SCOPE( "submit compute" );
+    MTL::CommandBuffer* pCmd = _pComputeQueue->commandBuffer();
+
+    // Don't overwrite the slot until the last frame that sampled it is done:
+    if ( job.renderWaitValue > 0 )
+    {
+        pCmd->encodeWait( _pRenderEvent, job.renderWaitValue );
+    }
+
+    generateMandelbrotTexture( pCmd, job );
+    pCmd->encodeSignalEvent( _pComputeEvent, job.generation );
+
+    // Handlers of one queue may run late, so wait until the slot's last job
+    // reported before arming it again. Jobs that aren't committed never
+    // complete, so they don't arm a slot:
+    if ( _submit )
+    {
+        dispatch_semaphore_wait( _computeSlots[ job.slot ], DISPATCH_TIME_FOREVER );
+        _computeCompletions.attach( pCmd, job.slot, &Renderer::computeCompleted, this );
+        pCmd->commit();
+    }
+}
+
+void Renderer::computeCompleted( void* pContext, uint32_t slot, MTL::CommandBuffer* pCmd )
+{
+    // The ring has a texture slot per frame in flight, so a job's texture
+    // slot is also the frame slot its timestamps went to:
+    static_assert( ::kTextureRingSize == ::kMaxFramesInFlight, "compute timestamps are indexed by texture slot" );
+
+    Renderer* pRenderer = static_cast< Renderer* >( pContext );
+    TRACE_GPU_SPAN( "gpu compute", pCmd->GPUStartTime(), pCmd->GPUEndTime() );
+    if ( MTL::CounterSampleBuffer* pCounterSampleBuffer = pRenderer->_pCounterSampleBuffer )
+    {
+        pRenderer->recordPassTime( pCounterSampleBuffer, slot * kCounterSamplesPerFrame, TimingPhase::ComputePass );
+    }
+    dispatch_semaphore_signal( pRenderer->_computeSlots[ slot ] );
+}
+
+void Renderer::recordPassTime( MTL::CounterSampleBuffer* pCounterSampleBuffer, NS::UInteger firstSample, TimingPhase phase )
+{
+    NS::Data* pData = pCounterSampleBuffer->resolveCounterRange( NS::Range( firstSample, 2 ) );
+    if ( !pData || pData->length() < 2 * sizeof( MTL::CounterResultTimestamp ) )
+    {
+        return;
+    }
+
+    const MTL::CounterResultTimestamp* pSamples = reinterpret_cast< const MTL::CounterResultTimestamp* >( pData->mutableBytes() );
+    uint64_t begin = pSamples[ 0 ].timestamp;
+    uint64_t end = pSamples[ 1 ].timestamp;
+    if ( begin != MTL::CounterErrorValue && end != MTL::CounterErrorValue && end >= begin )
+    {
+        _stats.record( phase, (end - begin) * _gpuTicksToSeconds );
+    }
+}
+
+void Renderer::setBenchmarkMode()
+{
+    // Benchmarks render a fixed workload, so keep every frame slot in use
+    // and never stop for a GPU capture or a placeholder frame:
+    waitForPipelines();
+    _benchmark = true;
+    _hasCaptured = true;
+    while ( _heldFrames > 0 )
+    {
+        dispatch_semaphore_signal( _semaphore );
+        --_heldFrames;
+    }
+}
+
+void Renderer::waitForIdle()
+{
+    for ( size_t i = _heldFrames; i < kMaxFramesInFlight; ++i )
+    {
+        dispatch_semaphore_wait( _semaphore, DISPATCH_TIME_FOREVER );
+    }
+    for ( size_t i = _heldFrames; i < kMaxFramesInFlight; ++i )
+    {
+        dispatch_semaphore_signal( _semaphore );
+    }
+    for ( dispatch_semaphore_t slot : _computeSlots )
+    {
+        dispatch_semaphore_wait( slot, DISPATCH_TIME_FOREVER );
+        dispatch_semaphore_signal( slot );
+    }
+}
+
+void Renderer::setSubmitEnabled( bool enabled )
+{
+    _submit = enabled;
+}
+
+void Renderer::useNullQueues()
+{
+    // Let the work the constructor queued finish before dropping the queues:
+    for ( MTL::CommandQueue* pQueue : { _pCommandQueue, _pComputeQueue } )
+    {
+        MTL::CommandBuffer* pCmd = pQueue->commandBuffer();
+        pCmd->commit();
+        pCmd->waitUntilCompleted();
+        pQueue->release();
+    }
+    _pCommandQueue = reinterpret_cast< MTL::CommandQueue* >( nullbackend::newCommandQueue() );
+    _pComputeQueue = reinterpret_cast< MTL::CommandQueue* >( nullbackend::newCommandQueue() );
+
+    // Nothing writes the pass timestamps any more:
+    if ( _pCounterSampleBuffer )
+    {
+        _pCounterSampleBuffer->release();
+        _pCounterSampleBuffer = nullptr;
+    }
+}
+
+void Renderer::setRecorder( cmdstream::Recorder* pRecorder )
+{
+    waitForPipelines();
+    _pRecorder = pRecorder;
+    if ( _pRecorder )
+    {
+        _pRecorder->nameState( _pPSO, "render", _renderConstants );
+        _pRecorder->nameState( _pComputePSO, "mandelbrot_set", _computeConstants );
+        _pRecorder->nameState( _pDepthStencilState, "depth less" );
+    }
+}
+
+void Renderer::nameStates( cmdstream::Replayer* pReplayer )
+{
+    pReplayer->setStateResolver( [this]( const cmdstream::StateDecl& state ){
+        return replayState( state );
+    });
+}
+
+NS::Object* Renderer::replayState( const cmdstream::StateDecl& state )
+{
+    // Replays use the variants the stream was recorded with, building any
+    // that this run hasn't:
+    if ( state.name == "render" )
+    {
+        return PipelineBuilder::result( renderVariant( state.constants ) );
+    }
+    if ( state.name == "mandelbrot_set" )
+    {
+        return PipelineBuilder::result( computeVariant( state.constants ) );
+    }
+    if ( state.name == "depth less" )
+    {
+        return _pDepthStencilState;
+    }
+    return nullptr;
+}
+
+const FrameStats& Renderer::stats() const
+{
+    return _stats;
+}
+
+void Renderer::resetStats()
+{
+    _stats.reset();
+    _lastFrameStart = 0.0;
 }
 
 void Renderer::draw( MTK::View* pView )
+{
+    if ( pView->preferredFramesPerSecond() > 0 )
+    {
+        _pacer.setFrameBudget( 1.0 / pView->preferredFramesPerSecond() );
+    }
+
+    // Advance the animation by the real time between frames, so that it runs
+    // at the same speed regardless of the display refresh rate:
+    double now = hostTime();
+    double timestep = _lastFrameStart > 0.0 ? std::min( now - _lastFrameStart, 0.1 ) : 1.0 / 60.0;
+
+    ViewTarget target( pView );
+    drawFrame( &target, timestep );
+}
+
+bool Renderer::pipelinesReady()
+{
+    // Switch to the requested variants once they are compiled. A variant
+    // that failed keeps the previous one. Without one, frames stay
+    // placeholders:
+    bool switched = false;
+    if ( PipelineBuilder::isReady( _renderPipeline ) )
+    {
+        if ( MTL::RenderPipelineState* pPSO = PipelineBuilder::result( _renderPipeline ) )
+        {
+            _pPSO = pPSO;
+            _renderConstants = _requestedRenderConstants;
+            if ( _pRecorder )
+            {
+                _pRecorder->nameState( _pPSO, "render", _renderConstants );
+            }
+            switched = true;
+        }
+        _renderPipeline = {};
+    }
+    if ( PipelineBuilder::isReady( _computePipeline ) )
+    {
+        if ( MTL::ComputePipelineState* pPSO = PipelineBuilder::result( _computePipeline ) )
+        {
+            _pComputePSO = pPSO;
+            _computeConstants = _requestedComputeConstants;
+            if ( _pRecorder )
+            {
+                _pRecorder->nameState( _pComputePSO, "mandelbrot_set", _computeConstants );
+            }
+            switched = true;
+        }
+        _computePipeline = {};
+    }
+    if ( !_pPSO || !_pComputePSO )
+    {
+        return false;
+    }
+
+    // A new variant adds its pipeline to the archive, so write it out
+    // again. save() does nothing when no pipeline was added:
+    if ( switched )
+    {
+        _pipelineCache.save();
+    }
+    if ( _pipelinesReported )
+    {
+        return true;
+    }
+
+    _pipelinesReported = true;
+    _pipelineBuilder.printTimes();
+    _pipelineCache.printMetrics();
+    if ( _harvestPipelines )
+    {
+        _pipelineBuilder.saveHarvest( documentsPath() + "/pipelines.mtl4archive", documentsPath() + "/pipelines.mtlp-json" );
+    }
+    __builtin_printf( "first frame %.2f ms after startup, %zu placeholder frames\n",
+                      (hostTime() - _startTime) * 1e3, _placeholderFrames );
+    return true;
+}
+
+bool Renderer::waitForPipelines()
+{
+    _pipelineBuilder.waitForAll();
+    return pipelinesReady();
+}
+
+void Renderer::drawPlaceholderFrame( FrameTarget* pTarget )
+{
+    TRACE_SCOPE( "placeholder frame" );
+
+    // Only clears the drawable, so the app shows something while the
+    // pipelines compile. No frame state advances until the real frames start:
+    dispatch_semaphore_wait( _semaphore, DISPATCH_TIME_FOREVER );
+    MTL::CommandBuffer* pCmd = _pCommandQueue->commandBuffer();
+    Renderer* pRenderer = this;
+    pCmd->addCompletedHandler( ^void( MTL::CommandBuffer* pCmd ){
+        dispatch_semaphore_signal( pRenderer->_semaphore );
+    });
+
+    MTL::RenderPassDescriptor* pRpd = pTarget->renderPassDescriptor();
+    MTL::RenderCommandEncoder* pEnc = pCmd->renderCommandEncoder( pRpd );
+    pEnc->endEncoding();
+    if ( MTL::Drawable* pDrawable = pTarget->drawable() )
+    {
+        pCmd->presentDrawable( pDrawable );
+    }
+    pCmd->commit();
+    ++_placeholderFrames;
+}
+
+void Renderer::frameCompleted( void* pContext, uint32_t frame, MTL::CommandBuffer* pCmd )
+{
+    Renderer* pRenderer = static_cast< Renderer* >( pContext );
+    FrameTiming* pTiming = &pRenderer->_frameTimings[ frame ];
+    pTiming->gpuTime = pCmd->GPUEndTime() - pCmd->GPUStartTime();
+    pTiming->completionTime = hostTime();
+    pRenderer->_stats.record( TimingPhase::GpuFrame, pTiming->gpuTime );
+    TRACE_GPU_SPAN( "gpu frame", pCmd->GPUStartTime(), pCmd->GPUEndTime() );
+
+    if ( MTL::CounterSampleBuffer* pCounterSampleBuffer = pRenderer->_pCounterSampleBuffer )
+    {
+        pRenderer->recordPassTime( pCounterSampleBuffer, frame * kCounterSamplesPerFrame + 2, TimingPhase::RenderPass );
+    }
+
+    pTiming->completed.store( true, std::memory_order_release );
+    dispatch_semaphore_signal( pRenderer->_semaphore );
+}
+
+void Renderer::drawFrame( FrameTarget* pTarget, double timestep )
 {
     using simd::float3;
     using simd::float4;
     using simd::float4x4;
 
+    TRACE_SCOPE( "draw" );
     NS::AutoreleasePool* pPool = NS::AutoreleasePool::alloc()->init();
 
-    if ( Renderer::beginCapture )
+    if ( !pipelinesReady() )
+    {
+        drawPlaceholderFrame( pTarget );
+        pPool->release();
+        return;
+    }
+
+    if ( Renderer::beginCapture && !_traceInsteadOfCapture )
     {
         triggerCapture();
     }
@@ -750,13 +3492,66 @@ void Renderer::draw( MTK::View* pView )
     MTL::Buffer* pInstanceDataBuffer = _pInstanceDataBuffer[ _frame ];
 
     MTL::CommandBuffer* pCmd = _pCommandQueue->commandBuffer();
+    MTL::CounterSampleBuffer* pCounterSampleBuffer = _pCounterSampleBuffer;
+    if ( pCounterSampleBuffer && _frameCount > 0 && _frameCount % kTimestampCalibrationInterval == 0 )
+    {
+        // GPU timestamps tick in a device specific unit. Relate them to the
+        // CPU clock, which counts nanoseconds:
+        MTL::Timestamp cpuTimestamp = 0;
+        MTL::Timestamp gpuTimestamp = 0;
+        _pDevice->sampleTimestamps( &cpuTimestamp, &gpuTimestamp );
+        if ( gpuTimestamp > _gpuTimestampBase && cpuTimestamp > _cpuTimestampBase )
+        {
+            _gpuTicksToSeconds = 1e-9 * (double)(cpuTimestamp - _cpuTimestampBase) / (double)(gpuTimestamp - _gpuTimestampBase);
+        }
+    }
+    ++_frameCount;
+
+    double waitStart = hostTime();
+    if ( _lastFrameStart > 0.0 )
+    {
+        _stats.record( TimingPhase::FrameInterval, waitStart - _lastFrameStart );
+    }
+    _lastFrameStart = waitStart;
     dispatch_semaphore_wait( _semaphore, DISPATCH_TIME_FOREVER );
-    Renderer* pRenderer = this;
-    pCmd->addCompletedHandler( ^void( MTL::CommandBuffer* pCmd ){
-        dispatch_semaphore_signal( pRenderer->_semaphore );
-    });
 
-    _angle += 0.002f;
+    // Feed the pacer with the last frame that used this slot, then hold back
+    // or hand out semaphore permits to match the frames in flight it picked:
+    FrameTiming* pTiming = &_frameTimings[ _frame ];
+    if ( pTiming->completed.exchange( false, std::memory_order_acquire ) && !_benchmark )
+    {
+        size_t target = _pacer.update( { pTiming->cpuTime, pTiming->waitTime, pTiming->gpuTime,
+                                         pTiming->completionTime - pTiming->commitTime } );
+        while ( _heldFrames < kMaxFramesInFlight - target )
+        {
+            dispatch_semaphore_wait( _semaphore, DISPATCH_TIME_FOREVER );
+            ++_heldFrames;
+        }
+        while ( _heldFrames > kMaxFramesInFlight - target )
+        {
+            dispatch_semaphore_signal( _semaphore );
+            --_heldFrames;
+        }
+    }
+    double cpuStart = hostTime();
+    pTiming->waitTime = cpuStart - waitStart;
+    _stats.record( TimingPhase::Wait, pTiming->waitTime );
+    TRACE_SPAN( "semaphore wait", waitStart, cpuStart );
+
+    if ( _pRecorder )
+    {
+        _pRecorder->beginFrame();
+    }
+
+    NS::UInteger firstSample = _frame * kCounterSamplesPerFrame;
+
+    // Benchmarks step the animation by a fixed interval whoever calls them, so
+    // every run renders the same frames however long each one takes:
+    if ( _benchmark )
+    {
+        timestep = kBenchmarkTimestep;
+    }
+    _angle += kAngularSpeed * timestep;
 
     const float scl = 0.2f;
     shader_types::InstanceData* pInstanceData = reinterpret_cast< shader_types::InstanceData *>( pInstanceDataBuffer->contents() );
@@ -806,9 +3601,13 @@ void Renderer::draw( MTK::View* pView )
         ix += 1;
     }
 
+    double cameraStart = hostTime();
+    _stats.record( TimingPhase::InstanceUpdate, cameraStart - cpuStart );
+    TRACE_SPAN( "instance update", cpuStart, cameraStart );
+
     // Update camera state:
 
-    CGSize drawableSize = pView->drawableSize();
+    CGSize drawableSize = pTarget->drawableSize();
     CGFloat aspectRatio = drawableSize.width / drawableSize.height;
 
     MTL::Buffer* pCameraDataBuffer = _pCameraDataBuffer[ _frame ];
@@ -817,38 +3616,120 @@ void Renderer::draw( MTK::View* pView )
     pCameraData->worldTransform = math::makeIdentity();
     pCameraData->worldNormalTransform = math::discardTranslation( pCameraData->worldTransform );
 
-    // Update texture:
+    double encodeStart = hostTime();
+    _stats.record( TimingPhase::CameraUpdate, encodeStart - cameraStart );
+    TRACE_SPAN( "camera update", cameraStart, encodeStart );
+
+    // Update texture. The compute queue generates the next frame's texture
+    // while this frame renders, so this frame only waits for its own:
 
-    generateMandelbrotTexture( pCmd );
+    const uint64_t frameNumber = _frameCount;
+    _computeScheduler.scheduleFrame( frameNumber, this );
+    pCmd->encodeWait( _pComputeEvent, _computeScheduler.renderWaitValue( frameNumber ) );
+    MTL::Texture* pTexture = _pTextures[ _computeScheduler.slot( frameNumber ) ];
 
     // Begin render pass:
 
-    MTL::RenderPassDescriptor* pRpd = pView->currentRenderPassDescriptor();
-    MTL::RenderCommandEncoder* pEnc = pCmd->renderCommandEncoder( pRpd );
+    MTL::RenderPassDescriptor* pRpd = pTarget->renderPassDescriptor();
+    if ( _pCounterSampleBuffer )
+    {
+        MTL::RenderPassSampleBufferAttachmentDescriptor* pAttachment = pRpd->sampleBufferAttachments()->object( 0 );
+        pAttachment->setSampleBuffer( _pCounterSampleBuffer );
+        pAttachment->setStartOfVertexSampleIndex( firstSample + 2 );
+        pAttachment->setEndOfVertexSampleIndex( MTL::CounterDontSample );
+        pAttachment->setStartOfFragmentSampleIndex( MTL::CounterDontSample );
+        pAttachment->setEndOfFragmentSampleIndex( firstSample + 3 );
+    }
 
-    pEnc->setRenderPipelineState( _pPSO );
-    pEnc->setDepthStencilState( _pDepthStencilState );
+    // Record the draws into a command list first. Each draw sets all of its
+    // state, and the list drops the calls that change nothing:
 
-    pEnc->setVertexBuffer( _pVertexDataBuffer, /* offset */ 0, /* index */ 0 );
-    pEnc->setVertexBuffer( pInstanceDataBuffer, /* offset */ 0, /* index */ 1 );
-    pEnc->setVertexBuffer( pCameraDataBuffer, /* offset */ 0, /* index */ 2 );
+    double recordStart = hostTime();
+    RenderCommandList* pList = &_renderList;
+    for ( size_t draw = 0; draw < _drawCalls; ++draw )
+    {
+        const size_t first = draw * kNumInstances / _drawCalls;
+        const size_t count = ( draw + 1 ) * kNumInstances / _drawCalls - first;
 
-    pEnc->setFragmentTexture( _pTexture, /* index */ 0 );
+        pList->setRenderPipelineState( _pPSO );
+        pList->setDepthStencilState( _pDepthStencilState );
 
-    pEnc->setCullMode( MTL::CullModeBack );
-    pEnc->setFrontFacingWinding( MTL::Winding::WindingCounterClockwise );
+        pList->setVertexBuffer( _pVertexDataBuffer, /* offset */ 0, /* index */ 0 );
+        pList->setVertexBuffer( pInstanceDataBuffer, /* offset */ first * sizeof( shader_types::InstanceData ), /* index */ 1 );
+        pList->setVertexBuffer( pCameraDataBuffer, /* offset */ 0, /* index */ 2 );
 
-    pEnc->drawIndexedPrimitives( MTL::PrimitiveType::PrimitiveTypeTriangle,
-                                6 * 6, MTL::IndexType::IndexTypeUInt16,
-                                _pIndexBuffer,
-                                0,
-                                kNumInstances );
+        pList->setFragmentTexture( pTexture, /* index */ 0 );
 
-    pEnc->endEncoding();
-    pCmd->presentDrawable( pView->currentDrawable() );
-    pCmd->commit();
+        pList->setCullMode( MTL::CullModeBack );
+        pList->setFrontFacingWinding( MTL::Winding::WindingCounterClockwise );
+
+        pList->drawIndexedPrimitives( MTL::PrimitiveType::PrimitiveTypeTriangle,
+                                      6 * 6, MTL::IndexType::IndexTypeUInt16,
+                                      _pIndexBuffer,
+                                      0,
+                                      count );
+    }
+
+    // Then issue what is left in one loop. The flush phase is the part of
+    // encoding spent in Metal:
+
+    double flushStart = hostTime();
+    cmdstream::RenderEncoder renderEncoder( pCmd->renderCommandEncoder( pRpd ), _pRecorder );
+    pList->flush( &renderEncoder );
+    renderEncoder.endEncoding();
+    pList->reset();
+    double flushEnd = hostTime();
+    _stats.record( TimingPhase::Record, flushStart - recordStart );
+    _stats.record( TimingPhase::Flush, flushEnd - flushStart );
+    TRACE_SPAN( "record", recordStart, flushStart );
+    TRACE_SPAN( "flush", flushStart, flushEnd );
+
+    pCmd->encodeSignalEvent( _pRenderEvent, _computeScheduler.renderSignalValue( frameNumber ) );
+    if ( MTL::Drawable* pDrawable = pTarget->drawable() )
+    {
+        pCmd->presentDrawable( pDrawable );
+    }
+    if ( _pRecorder )
+    {
+        _pRecorder->endFrame();
+    }
+    pTiming->commitTime = hostTime();
+    pTiming->cpuTime = pTiming->commitTime - cpuStart;
+    _stats.record( TimingPhase::Encode, pTiming->commitTime - encodeStart );
+    _stats.record( TimingPhase::CpuFrame, pTiming->cpuTime );
+    TRACE_SPAN( "encode", encodeStart, pTiming->commitTime );
+    if ( _submit )
+    {
+        // The handler block for this frame's slot was made once, up front, so
+        // attaching it allocates nothing:
+        _frameCompletions.attach( pCmd, _frame, &Renderer::frameCompleted, this );
+        TRACE_SCOPE( "commit" );
+        pCmd->commit();
+    }
+    else
+    {
+        // Drop the encoded work so that only the CPU side of the frame is
+        // measured. Nothing was attached, so the pool slot stays free and
+        // only the frame has to be retired here:
+        pTiming->gpuTime = 0.0;
+        pTiming->completionTime = hostTime();
+        pTiming->completed.store( true, std::memory_order_release );
+        dispatch_semaphore_signal( _semaphore );
+    }
+
+    if ( !_benchmark && _frameCount % kStatsReportInterval == 0 )
+    {
+        _stats.print();
+    }
+
+    if ( Renderer::beginCapture && _traceInsteadOfCapture )
+    {
+        writeTrace();
 
-    if ( Renderer::beginCapture )
+        Renderer::beginCapture = false;
+        _hasCaptured = true;
+    }
+    else if ( Renderer::beginCapture )
     {
         MTL::CaptureManager* pCaptureManager = MTL::CaptureManager::sharedCaptureManager();
         pCaptureManager->stopCapture();
@@ -871,7 +3752,63 @@ void Renderer::draw( MTK::View* pView )
         }
     }
 
-    pPool->release();
+    {
+        TRACE_SCOPE( "autorelease pool drain" );
+        pPool->release();
+    }
 }
 
 #pragma endregion Renderer }
+
+
+#pragma mark - Software Rasterizer
+
+int runRasterize( const BenchmarkOptions& options )
+{
+    // Needs no Metal device: the stream carries every buffer the frames use.
+    softraster::Rasterizer* pRasterizer = new softraster::Rasterizer( options.width, options.height );
+    if ( !pRasterizer->load( options.rasterizePath ) || pRasterizer->frameCount() == 0 )
+    {
+        __builtin_printf( "Failed to load command stream \"%s\"\n", options.rasterizePath );
+        delete pRasterizer;
+        return 1;
+    }
+
+    TimingHistogram* pFrameTimes = new TimingHistogram();
+    double start = hostTime();
+    for ( size_t frame = 0; frame < pRasterizer->frameCount(); ++frame )
+    {
+        double frameStart = hostTime();
+        pRasterizer->executeFrame( frame );
+        pFrameTimes->record( hostTime() - frameStart );
+    }
+    double elapsed = hostTime() - start;
+
+    int result = 0;
+    if ( options.pngPath && !pRasterizer->writePng( options.pngPath ) )
+    {
+        __builtin_printf( "Failed to write \"%s\"\n", options.pngPath );
+        result = 1;
+    }
+
+    FILE* pFile = options.outputPath ? fopen( options.outputPath, "w" ) : stdout;
+    if ( pFile )
+    {
+        fprintf( pFile, "{\n" );
+        fprintf( pFile, "  \"rasterize\": \"%s\",\n", options.rasterizePath );
+        fprintf( pFile, "  \"width\": %u,\n  \"height\": %u,\n", options.width, options.height );
+        fprintf( pFile, "  \"frames\": %zu,\n", pRasterizer->frameCount() );
+        fprintf( pFile, "  \"seconds\": %.6f,\n  \"framesPerSecond\": %.2f,\n", elapsed, pRasterizer->frameCount() / elapsed );
+        fprintf( pFile, "  \"frame\": { \"p50Ms\": %.4f, \"p95Ms\": %.4f, \"p99Ms\": %.4f }\n",
+                 pFrameTimes->percentile( 0.50 ) * 1e3, pFrameTimes->percentile( 0.95 ) * 1e3, pFrameTimes->percentile( 0.99 ) * 1e3 );
+        fprintf( pFile, "}\n" );
+        if ( pFile != stdout )
+        {
+            fclose( pFile );
+        }
+    }
+
+    delete pFrameTimes;
+    delete pRasterizer;
+    return result;
+}
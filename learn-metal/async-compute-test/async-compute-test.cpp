@@ -0,0 +1,167 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tests AsyncComputeScheduler with a mock compute queue. The mock records the
+// jobs the scheduler submits, and a small model of the two GPU queues runs
+// them against the render frames. Each queue works through its command
+// buffers in order and stalls on a shared event wait, like the Metal queues
+// in 10-frame-debugging.
+
+#include "../test-support/check.hpp"
+#include "../async-compute/async-compute.hpp"
+
+#include <vector>
+
+static constexpr uint32_t kRingSize = 3;
+
+class MockComputeQueue : public ComputeQueue
+{
+    public:
+        void submit( const ComputeJob& job ) override
+        {
+            jobs.push_back( job );
+        }
+
+        std::vector< ComputeJob > jobs;
+};
+
+// Runs the submitted jobs and frames 1 to frameCount. When both queues can
+// make progress, preferCompute picks which one goes first. Returns false if
+// a frame samples a slot that doesn't hold its generation, or if the queues
+// deadlock.
+static bool runQueues( const AsyncComputeScheduler& scheduler, const std::vector< ComputeJob >& jobs, uint64_t frameCount, bool preferCompute )
+{
+    std::vector< uint64_t > slotGeneration( kRingSize, 0 );
+    uint64_t computeEvent = 0;
+    uint64_t renderEvent = 0;
+    size_t nextJob = 0;
+    uint64_t nextFrame = 1;
+
+    while ( nextJob < jobs.size() || nextFrame <= frameCount )
+    {
+        bool computeReady = nextJob < jobs.size() && renderEvent >= jobs[ nextJob ].renderWaitValue;
+        bool renderReady = nextFrame <= frameCount && computeEvent >= scheduler.renderWaitValue( nextFrame );
+        if ( !computeReady && !renderReady )
+        {
+            return false;
+        }
+
+        if ( computeReady && (preferCompute || !renderReady) )
+        {
+            const ComputeJob& job = jobs[ nextJob++ ];
+            slotGeneration[ job.slot ] = job.generation;
+            computeEvent = job.generation;
+        }
+        else
+        {
+            if ( slotGeneration[ scheduler.slot( nextFrame ) ] != nextFrame )
+            {
+                return false;
+            }
+            renderEvent = scheduler.renderSignalValue( nextFrame );
+            ++nextFrame;
+        }
+    }
+    return true;
+}
+
+static void testSubmitsOneAhead()
+{
+    AsyncComputeScheduler scheduler( kRingSize );
+    MockComputeQueue queue;
+
+    // The first frame also generates its own texture:
+    scheduler.scheduleFrame( 1, &queue );
+    CHECK( queue.jobs.size() == 2 );
+    CHECK( queue.jobs[ 0 ].generation == 1 );
+    CHECK( queue.jobs[ 1 ].generation == 2 );
+
+    for ( uint64_t frame = 2; frame <= 10; ++frame )
+    {
+        size_t before = queue.jobs.size();
+        scheduler.scheduleFrame( frame, &queue );
+        CHECK( queue.jobs.size() == before + 1 );
+        CHECK( queue.jobs.back().generation == frame + 1 );
+    }
+
+    // Scheduling a frame again submits nothing:
+    scheduler.scheduleFrame( 10, &queue );
+    CHECK( queue.jobs.size() == 11 );
+}
+
+static void testEventValues()
+{
+    AsyncComputeScheduler scheduler( kRingSize );
+    MockComputeQueue queue;
+    for ( uint64_t frame = 1; frame <= 20; ++frame )
+    {
+        scheduler.scheduleFrame( frame, &queue );
+        CHECK( scheduler.renderWaitValue( frame ) == frame );
+        CHECK( scheduler.renderSignalValue( frame ) == frame );
+    }
+
+    for ( const ComputeJob& job : queue.jobs )
+    {
+        CHECK( job.slot == job.generation % kRingSize );
+
+        // The slot was last sampled by frame generation - kRingSize:
+        uint64_t lastReader = job.generation > kRingSize ? job.generation - kRingSize : 0;
+        CHECK( job.renderWaitValue == lastReader );
+    }
+}
+
+static void testQueuesNeverRace()
+{
+    // Whichever queue runs first, every frame samples its own generation and
+    // neither queue waits forever.
+    AsyncComputeScheduler scheduler( kRingSize );
+    MockComputeQueue queue;
+    const uint64_t frameCount = 50;
+    for ( uint64_t frame = 1; frame <= frameCount; ++frame )
+    {
+        scheduler.scheduleFrame( frame, &queue );
+    }
+    CHECK( runQueues( scheduler, queue.jobs, frameCount, /* preferCompute */ true ) );
+    CHECK( runQueues( scheduler, queue.jobs, frameCount, /* preferCompute */ false ) );
+}
+
+static void testEarlyWaitRaces()
+{
+    // The model catches a job that doesn't wait long enough: the compute
+    // queue runs ahead and overwrites a slot before its frame samples it.
+    AsyncComputeScheduler scheduler( kRingSize );
+    MockComputeQueue queue;
+    const uint64_t frameCount = 10;
+    for ( uint64_t frame = 1; frame <= frameCount; ++frame )
+    {
+        scheduler.scheduleFrame( frame, &queue );
+    }
+    for ( ComputeJob& job : queue.jobs )
+    {
+        job.renderWaitValue = 0;
+    }
+    CHECK( !runQueues( scheduler, queue.jobs, frameCount, /* preferCompute */ true ) );
+}
+
+int main()
+{
+    testSubmitsOneAhead();
+    testEventValues();
+    testQueuesNeverRace();
+    testEarlyWaitRaces();
+    return check::finish( "async-compute-test" );
+}
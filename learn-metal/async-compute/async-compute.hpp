@@ -0,0 +1,107 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Decides which Mandelbrot texture generations 10-frame-debugging submits on
+// its compute queue, and which shared event values each one waits for. It
+// makes no Metal calls, so the async compute test checks the ordering with a
+// mock queue on any platform.
+
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+
+#pragma region Declarations {
+
+// One generation of the Mandelbrot texture. Generation N is sampled by
+// frame N and written into ring slot N % ringSize.
+struct ComputeJob
+{
+    uint64_t generation;
+    uint32_t slot;
+    uint64_t renderWaitValue;
+};
+
+// Receives the jobs the scheduler releases. The renderer encodes them on its
+// compute queue; a mock can record them and check the event values instead.
+class ComputeQueue
+{
+    public:
+        virtual ~ComputeQueue() = default;
+        virtual void submit( const ComputeJob& job ) = 0;
+};
+
+// Orders the compute and render queues with two shared events. Compute
+// signals the generation it finished and render signals the frame it
+// finished. Frame N waits for compute value N. Generation N waits for render
+// value N - ringSize, the last frame that sampled its slot.
+class AsyncComputeScheduler
+{
+    public:
+        AsyncComputeScheduler( uint32_t ringSize );
+        void scheduleFrame( uint64_t frame, ComputeQueue* pQueue );
+        uint32_t slot( uint64_t generation ) const;
+        uint64_t renderWaitValue( uint64_t frame ) const;
+        uint64_t renderSignalValue( uint64_t frame ) const;
+
+    private:
+        uint32_t _ringSize;
+        uint64_t _submitted;
+};
+
+#pragma endregion Declarations }
+
+
+#pragma mark - AsyncComputeScheduler
+#pragma region AsyncComputeScheduler {
+
+inline AsyncComputeScheduler::AsyncComputeScheduler( uint32_t ringSize )
+: _ringSize( ringSize )
+, _submitted( 0 )
+{
+    assert( ringSize > 0 );
+}
+
+inline void AsyncComputeScheduler::scheduleFrame( uint64_t frame, ComputeQueue* pQueue )
+{
+    // Frames count from 1, so that event value 0 means nothing has finished.
+    // Nothing ran ahead of the first frame, so it also generates its own texture:
+    assert( frame > 0 );
+    while ( _submitted < frame + 1 )
+    {
+        uint64_t generation = ++_submitted;
+        uint64_t renderWaitValue = generation > _ringSize ? generation - _ringSize : 0;
+        pQueue->submit( { generation, slot( generation ), renderWaitValue } );
+    }
+}
+
+inline uint32_t AsyncComputeScheduler::slot( uint64_t generation ) const
+{
+    return (uint32_t)(generation % _ringSize);
+}
+
+inline uint64_t AsyncComputeScheduler::renderWaitValue( uint64_t frame ) const
+{
+    return frame;
+}
+
+inline uint64_t AsyncComputeScheduler::renderSignalValue( uint64_t frame ) const
+{
+    return frame;
+}
+
+#pragma endregion AsyncComputeScheduler }
@@ -0,0 +1,312 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Renders a sample offscreen for a fixed number of frames and writes its
+// frame times as JSON. A Renderer draws into a FrameTarget: the scene
+// delegate wraps its MTK::View in a ViewTarget, and a benchmark run hands it
+// an OffscreenTarget, which has no drawable to present. benchmark::run()
+// only needs the Renderer to have draw( FrameTarget* ) and waitForIdle().
+// Include it after Metal.hpp and MetalKit.hpp.
+
+#pragma once
+
+#include <Metal/Metal.hpp>
+#include <MetalKit/MetalKit.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/resource.h>
+#include <mach/mach_time.h>
+
+#include "../frame-stats/frame-stats.hpp"
+
+#pragma region Declarations {
+
+class FrameTarget
+{
+    public:
+        virtual ~FrameTarget() = default;
+        virtual MTL::RenderPassDescriptor* renderPassDescriptor() = 0;
+        virtual MTL::Drawable* drawable() = 0;
+        virtual CGSize drawableSize() const = 0;
+};
+
+class ViewTarget : public FrameTarget
+{
+    public:
+        ViewTarget( MTK::View* pView );
+        MTL::RenderPassDescriptor* renderPassDescriptor() override;
+        MTL::Drawable* drawable() override;
+        CGSize drawableSize() const override;
+
+    private:
+        MTK::View* _pView;
+};
+
+// Pass the depth format and clear color of the sample's MTK::View, so both
+// targets render the same frames. PixelFormatInvalid leaves out the depth
+// attachment.
+class OffscreenTarget : public FrameTarget
+{
+    public:
+        OffscreenTarget( MTL::Device* pDevice, uint32_t width, uint32_t height,
+                         MTL::PixelFormat depthPixelFormat = MTL::PixelFormatDepth16Unorm,
+                         MTL::ClearColor clearColor = MTL::ClearColor::Make( 0.1, 0.1, 0.1, 1.0 ) );
+        ~OffscreenTarget() override;
+        MTL::RenderPassDescriptor* renderPassDescriptor() override;
+        MTL::Drawable* drawable() override;
+        CGSize drawableSize() const override;
+
+    private:
+        MTL::Texture* _pColorTexture;
+        MTL::Texture* _pDepthTexture;
+        MTL::RenderPassDescriptor* _pRpd;
+};
+
+namespace benchmark
+{
+    struct Options
+    {
+        size_t warmupFrames;
+        size_t frameCount;
+        uint32_t width;
+        uint32_t height;
+        const char* outputPath;
+    };
+
+    // True when --benchmark or the LEARN_METAL_BENCHMARK environment variable
+    // asks for a benchmark run instead of the app.
+    bool parseOptions( int argc, char* argv[], Options* pOptions );
+
+    double hostTime();
+
+    // The samples advance their animation by a fixed step each frame, so every
+    // run renders the same frames however long each one takes.
+    template< typename RendererT >
+    int run( const Options& options, const char* pSampleName, MTL::PixelFormat depthPixelFormat, MTL::ClearColor clearColor );
+}
+
+#pragma endregion Declarations }
+
+#pragma mark - FrameTarget
+#pragma region FrameTarget {
+
+inline ViewTarget::ViewTarget( MTK::View* pView )
+: _pView( pView )
+{
+}
+
+inline MTL::RenderPassDescriptor* ViewTarget::renderPassDescriptor()
+{
+    return _pView->currentRenderPassDescriptor();
+}
+
+inline MTL::Drawable* ViewTarget::drawable()
+{
+    return _pView->currentDrawable();
+}
+
+inline CGSize ViewTarget::drawableSize() const
+{
+    return _pView->drawableSize();
+}
+
+inline OffscreenTarget::OffscreenTarget( MTL::Device* pDevice, uint32_t width, uint32_t height, MTL::PixelFormat depthPixelFormat,
+                                         MTL::ClearColor clearColor )
+: _pDepthTexture( nullptr )
+{
+    MTL::TextureDescriptor* pTextureDesc = MTL::TextureDescriptor::texture2DDescriptor( MTL::PixelFormatBGRA8Unorm_sRGB, width, height, false );
+    pTextureDesc->setStorageMode( MTL::StorageModePrivate );
+    pTextureDesc->setUsage( MTL::TextureUsageRenderTarget );
+    _pColorTexture = pDevice->newTexture( pTextureDesc );
+
+    _pRpd = MTL::RenderPassDescriptor::alloc()->init();
+    MTL::RenderPassColorAttachmentDescriptor* pColorAttachment = _pRpd->colorAttachments()->object( 0 );
+    pColorAttachment->setTexture( _pColorTexture );
+    pColorAttachment->setLoadAction( MTL::LoadActionClear );
+    pColorAttachment->setStoreAction( MTL::StoreActionStore );
+    pColorAttachment->setClearColor( clearColor );
+
+    if ( depthPixelFormat != MTL::PixelFormatInvalid )
+    {
+        pTextureDesc->setPixelFormat( depthPixelFormat );
+        _pDepthTexture = pDevice->newTexture( pTextureDesc );
+
+        MTL::RenderPassDepthAttachmentDescriptor* pDepthAttachment = _pRpd->depthAttachment();
+        pDepthAttachment->setTexture( _pDepthTexture );
+        pDepthAttachment->setLoadAction( MTL::LoadActionClear );
+        pDepthAttachment->setStoreAction( MTL::StoreActionDontCare );
+        pDepthAttachment->setClearDepth( 1.0 );
+    }
+}
+
+inline OffscreenTarget::~OffscreenTarget()
+{
+    _pRpd->release();
+    if ( _pDepthTexture )
+    {
+        _pDepthTexture->release();
+    }
+    _pColorTexture->release();
+}
+
+inline MTL::RenderPassDescriptor* OffscreenTarget::renderPassDescriptor()
+{
+    return _pRpd;
+}
+
+inline MTL::Drawable* OffscreenTarget::drawable()
+{
+    return nullptr;
+}
+
+inline CGSize OffscreenTarget::drawableSize() const
+{
+    return CGSizeMake( _pColorTexture->width(), _pColorTexture->height() );
+}
+
+#pragma endregion FrameTarget }
+
+#pragma mark - Benchmark
+#pragma region Benchmark {
+
+namespace benchmark
+{
+    inline bool parseOptions( int argc, char* argv[], Options* pOptions )
+    {
+        *pOptions = { 60, 480, 1920, 1080, nullptr };
+
+        bool enabled = false;
+        if ( const char* pFrames = getenv( "LEARN_METAL_BENCHMARK" ) )
+        {
+            enabled = true;
+            if ( atoi( pFrames ) > 0 )
+            {
+                pOptions->frameCount = atoi( pFrames );
+            }
+        }
+
+        for ( int i = 1; i < argc; ++i )
+        {
+            if ( !strcmp( argv[ i ], "--benchmark" ) )
+            {
+                enabled = true;
+            }
+            else if ( !strcmp( argv[ i ], "--frames" ) && i + 1 < argc )
+            {
+                pOptions->frameCount = std::max( atoi( argv[ ++i ] ), 1 );
+            }
+            else if ( !strcmp( argv[ i ], "--warmup" ) && i + 1 < argc )
+            {
+                pOptions->warmupFrames = std::max( atoi( argv[ ++i ] ), 0 );
+            }
+            else if ( !strcmp( argv[ i ], "--size" ) && i + 1 < argc )
+            {
+                sscanf( argv[ ++i ], "%ux%u", &pOptions->width, &pOptions->height );
+            }
+            else if ( !strcmp( argv[ i ], "--output" ) && i + 1 < argc )
+            {
+                pOptions->outputPath = argv[ ++i ];
+            }
+        }
+        return enabled;
+    }
+
+    inline double hostTime()
+    {
+        static const double kSecondsPerTick = []() {
+            mach_timebase_info_data_t timebase;
+            mach_timebase_info( &timebase );
+            return (double)timebase.numer / timebase.denom * 1e-9;
+        }();
+        return mach_absolute_time() * kSecondsPerTick;
+    }
+
+    template< typename RendererT >
+    int run( const Options& options, const char* pSampleName, MTL::PixelFormat depthPixelFormat, MTL::ClearColor clearColor )
+    {
+        MTL::Device* pDevice = MTL::CreateSystemDefaultDevice();
+        if ( !pDevice )
+        {
+            __builtin_printf( "No Metal device available\n" );
+            return 1;
+        }
+
+        RendererT* pRenderer = new RendererT( pDevice );
+        OffscreenTarget* pTarget = new OffscreenTarget( pDevice, options.width, options.height, depthPixelFormat, clearColor );
+
+        for ( size_t i = 0; i < options.warmupFrames; ++i )
+        {
+            pRenderer->draw( pTarget );
+        }
+        pRenderer->waitForIdle();
+
+        // draw() waits for a free frame slot, so once the frames in flight
+        // are full its time includes the GPU's:
+        TimingHistogram* pFrameTimes = new TimingHistogram();
+        double start = hostTime();
+        for ( size_t i = 0; i < options.frameCount; ++i )
+        {
+            double frameStart = hostTime();
+            pRenderer->draw( pTarget );
+            pFrameTimes->record( hostTime() - frameStart );
+        }
+        pRenderer->waitForIdle();
+        double elapsed = hostTime() - start;
+
+        int result = 0;
+        FILE* pFile = options.outputPath ? fopen( options.outputPath, "w" ) : stdout;
+        if ( pFile )
+        {
+            // ru_maxrss is reported in bytes on Darwin:
+            struct rusage usage;
+            getrusage( RUSAGE_SELF, &usage );
+
+            fprintf( pFile, "{\n" );
+            fprintf( pFile, "  \"sample\": \"%s\",\n", pSampleName );
+            fprintf( pFile, "  \"device\": \"%s\",\n", pDevice->name()->utf8String() );
+            fprintf( pFile, "  \"width\": %u,\n  \"height\": %u,\n", options.width, options.height );
+            fprintf( pFile, "  \"frames\": %zu,\n  \"warmupFrames\": %zu,\n", options.frameCount, options.warmupFrames );
+            fprintf( pFile, "  \"seconds\": %.6f,\n  \"framesPerSecond\": %.2f,\n", elapsed, options.frameCount / elapsed );
+            fprintf( pFile, "  \"frame\": { \"p50Ms\": %.4f, \"p95Ms\": %.4f, \"p99Ms\": %.4f },\n",
+                     pFrameTimes->percentile( 0.50 ) * 1e3, pFrameTimes->percentile( 0.95 ) * 1e3, pFrameTimes->percentile( 0.99 ) * 1e3 );
+            fprintf( pFile, "  \"memory\": { \"deviceAllocatedBytes\": %lu, \"maxResidentBytes\": %ld }\n",
+                     (unsigned long)pDevice->currentAllocatedSize(), (long)usage.ru_maxrss );
+            fprintf( pFile, "}\n" );
+            if ( pFile != stdout )
+            {
+                fclose( pFile );
+            }
+        }
+        else
+        {
+            __builtin_printf( "Failed to open \"%s\"\n", options.outputPath );
+            result = 1;
+        }
+
+        delete pFrameTimes;
+        delete pTarget;
+        delete pRenderer;
+        pDevice->release();
+        return result;
+    }
+}
+
+#pragma endregion Benchmark }
@@ -0,0 +1,322 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tests cmdstream::Reader against a well-formed stream, then against
+// truncated and malformed ones, which parse() must reject before the
+// replayer or the rasterizer executes any op. States must carry the
+// function constants they were specialized with.
+
+#include "../test-support/check.hpp"
+#include "../cmdstream/cmdstream.hpp"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using cmdstream::Op;
+
+static const specialization::Constant< uint32_t > kMaxIteration = { 0, "kMaxIteration", 1000 };
+static const specialization::Constant< float > kPalettePhase = { 6, "kPalettePhase", 3.0f };
+
+class Stream
+{
+    public:
+        Stream()
+        {
+            cmdstream::Header header = { cmdstream::kMagic, cmdstream::kVersion };
+            append( &header, sizeof( header ) );
+        }
+
+        void op( Op op, const void* pPayload, uint32_t size )
+        {
+            bytes.push_back( (uint8_t)op );
+            append( &size, sizeof( size ) );
+            append( pPayload, size );
+        }
+
+        void op( Op op )
+        {
+            this->op( op, nullptr, 0 );
+        }
+
+        template< typename T >
+        void op( Op op, const T& payload )
+        {
+            this->op( op, &payload, sizeof( T ) );
+        }
+
+        void state( uint32_t id, const std::string& name, const specialization::VariantKey& constants = {} )
+        {
+            std::vector< uint8_t > payload = cmdstream::stateDeclaration( id, { name, constants } );
+            op( Op::DeclareState, payload.data(), (uint32_t)payload.size() );
+        }
+
+        void bufferData( uint32_t id, uint32_t offset, uint32_t length )
+        {
+            std::vector< uint8_t > payload( cmdstream::kBufferDataHeaderSize + length, 0xab );
+            memcpy( &payload[0], &id, sizeof( id ) );
+            memcpy( &payload[4], &offset, sizeof( offset ) );
+            op( Op::BufferData, payload.data(), (uint32_t)payload.size() );
+        }
+
+        std::vector< uint8_t > bytes;
+
+    private:
+        void append( const void* pData, size_t size )
+        {
+            bytes.insert( bytes.end(), (const uint8_t*)pData, (const uint8_t*)pData + size );
+        }
+};
+
+// One frame as 10-frame-debugging records it: a compute pass, a blit pass
+// and a render pass, with resources declared on first use, then the buffer
+// writes. Leaves the last frame open.
+static Stream frame()
+{
+    Stream s;
+    s.op( Op::BeginFrame );
+    s.op( Op::BeginCompute );
+    s.state( 3, "mandelbrot_set", specialization::VariantKey().set( kMaxIteration, 50u ).setDefault( kPalettePhase ) );
+    s.op( Op::SetComputePipelineState, uint32_t( 3 ) );
+    s.op( Op::DeclareBuffer, cmdstream::BufferDecl{ 1, 0, 256 } );
+    s.op( Op::SetComputeBuffer, cmdstream::Binding{ 1, 0, 0 } );
+    s.op( Op::DeclareTexture, cmdstream::TextureDecl{ 2, 64, 64, 7, 70, 3 } );
+    s.op( Op::SetComputeTexture, cmdstream::Binding{ 2, 0, 0 } );
+    s.op( Op::DispatchThreads, cmdstream::Dispatch{ { 64, 64, 1 }, { 8, 8, 1 } } );
+    s.op( Op::EndEncoding );
+    s.op( Op::BeginBlit );
+    s.op( Op::GenerateMipmaps, uint32_t( 2 ) );
+    s.op( Op::EndEncoding );
+    s.op( Op::BeginRender );
+    s.state( 4, "render" );
+    s.op( Op::SetRenderPipelineState, uint32_t( 4 ) );
+    s.op( Op::SetVertexBuffer, cmdstream::Binding{ 1, 64, 0 } );
+    s.op( Op::SetFragmentTexture, cmdstream::Binding{ 2, 0, 0 } );
+    s.op( Op::SetCullMode, uint32_t( 2 ) );
+    s.op( Op::SetFrontFacingWinding, uint32_t( 1 ) );
+    s.op( Op::DrawIndexedPrimitives, cmdstream::DrawIndexed{ 3, 36, 0, 1, 0, 10 } );
+    s.op( Op::EndEncoding );
+    s.bufferData( 1, 192, 64 );
+    return s;
+}
+
+static bool parses( const std::vector< uint8_t >& bytes )
+{
+    cmdstream::Reader reader;
+    bool parsed = reader.parse( bytes );
+    CHECK( parsed == (reader.error() == nullptr) );
+    CHECK( parsed || reader.frameCount() == 0 );
+    return parsed;
+}
+
+// The first frame with one more op, which should be rejected
+template< typename... _Args >
+static bool parsesWith( _Args... args )
+{
+    Stream s = frame();
+    s.op( args... );
+    s.op( Op::EndFrame );
+    return parses( s.bytes );
+}
+
+static void testValid()
+{
+    Stream s = frame();
+    s.op( Op::EndFrame );
+    size_t firstFrameEnd = s.bytes.size();
+    s.op( Op::BeginFrame );
+    s.bufferData( 1, 0, 256 );
+    s.op( Op::EndFrame );
+
+    cmdstream::Reader reader;
+    CHECK( reader.parse( s.bytes ) );
+    CHECK( reader.frameCount() == 2 );
+    CHECK( reader.buffers().at( 1 ).length == 256 );
+    CHECK( reader.textures().at( 2 ).mipmapLevelCount == 7 );
+    const cmdstream::StateDecl& mandelbrot = reader.states().at( 3 );
+    CHECK( mandelbrot.name == "mandelbrot_set" );
+    CHECK( mandelbrot.constants.values().size() == 2 );
+    CHECK( mandelbrot.constants.get( kMaxIteration ) == 50 );
+    CHECK( mandelbrot.constants.get( kPalettePhase ) == 3.0f );
+    CHECK( reader.states().at( 4 ).name == "render" );
+    CHECK( reader.states().at( 4 ).constants.values().empty() );
+
+    size_t cursor = reader.frameOffset( 1 );
+    Op op;
+    const uint8_t* pPayload;
+    uint32_t size;
+    size_t ops = 0;
+    while ( reader.next( &cursor, &op, &pPayload, &size ) )
+    {
+        ++ops;
+    }
+    CHECK( ops == 3 && op == Op::EndFrame );
+
+    // Only cuts between frames leave a valid stream:
+    for ( size_t length = 0; length < s.bytes.size(); ++length )
+    {
+        std::vector< uint8_t > truncated( s.bytes.begin(), s.bytes.begin() + length );
+        bool valid = length == sizeof( cmdstream::Header ) || length == firstFrameEnd;
+        CHECK( parses( truncated ) == valid );
+    }
+
+    CHECK( sizeof( cmdstream::BufferDecl ) == 16 );
+}
+
+static void testMalformed()
+{
+    std::vector< uint8_t > bytes = frame().bytes;
+    bytes[0] ^= 1;
+    CHECK( !parses( bytes ) );
+
+    // Payloads of the wrong size:
+    CHECK( !parsesWith( Op::SetCullMode, uint64_t( 2 ) ) );
+    CHECK( !parsesWith( Op::DeclareBuffer, uint32_t( 5 ) ) );
+    CHECK( !parsesWith( Op::EndFrame, uint32_t( 0 ) ) );
+    CHECK( !parsesWith( Op::BufferData, uint32_t( 1 ) ) );
+    CHECK( !parsesWith( Op::DeclareState, uint32_t( 5 ) ) );
+
+    // Unknown ops:
+    CHECK( !parsesWith( (Op)0 ) );
+    CHECK( !parsesWith( (Op)200 ) );
+
+    // Buffer writes must lie within a declared buffer:
+    Stream s = frame();
+    s.bufferData( 1, 0, 256 );
+    s.op( Op::EndFrame );
+    CHECK( parses( s.bytes ) );
+    s = frame();
+    s.bufferData( 1, 193, 64 );
+    s.op( Op::EndFrame );
+    CHECK( !parses( s.bytes ) );
+    s = frame();
+    s.bufferData( 1, 0xfffffff0, 32 );
+    s.op( Op::EndFrame );
+    CHECK( !parses( s.bytes ) );
+    s = frame();
+    s.bufferData( 9, 0, 16 );
+    s.op( Op::EndFrame );
+    CHECK( !parses( s.bytes ) );
+
+    // References to undeclared or mismatched ids:
+    Stream unknownState;
+    unknownState.op( Op::BeginFrame );
+    unknownState.op( Op::BeginCompute );
+    unknownState.op( Op::SetComputePipelineState, uint32_t( 3 ) );
+    unknownState.op( Op::EndEncoding );
+    unknownState.op( Op::EndFrame );
+    CHECK( !parses( unknownState.bytes ) );
+    s = frame();
+    s.op( Op::BeginBlit );
+    s.op( Op::GenerateMipmaps, uint32_t( 1 ) );
+    s.op( Op::EndEncoding );
+    s.op( Op::EndFrame );
+    CHECK( !parses( s.bytes ) );
+    CHECK( !parsesWith( Op::DeclareTexture, cmdstream::TextureDecl{ 1, 16, 16, 1, 70, 3 } ) );
+    CHECK( !parsesWith( Op::DeclareBuffer, cmdstream::BufferDecl{ 1, 0, 512 } ) );
+    CHECK( parsesWith( Op::DeclareBuffer, cmdstream::BufferDecl{ 1, 0, 256 } ) );
+
+    // Resources past the limits:
+    CHECK( !parsesWith( Op::DeclareBuffer, cmdstream::BufferDecl{ 5, 0, cmdstream::kMaxBufferLength + 1 } ) );
+    CHECK( !parsesWith( Op::DeclareBuffer, cmdstream::BufferDecl{ 5, 0, 0 } ) );
+    CHECK( !parsesWith( Op::DeclareTexture, cmdstream::TextureDecl{ 5, 0, 64, 1, 70, 3 } ) );
+    CHECK( !parsesWith( Op::DeclareTexture, cmdstream::TextureDecl{ 5, 32768, 64, 1, 70, 3 } ) );
+    CHECK( !parsesWith( Op::DeclareTexture, cmdstream::TextureDecl{ 5, 64, 64, 8, 70, 3 } ) );
+    CHECK( parsesWith( Op::DeclareTexture, cmdstream::TextureDecl{ 5, 64, 1, 7, 70, 3 } ) );
+
+    // Ops outside the frame or encoder they belong to:
+    CHECK( !parsesWith( Op::DispatchThreads, cmdstream::Dispatch{ { 1, 1, 1 }, { 1, 1, 1 } } ) );
+    CHECK( !parsesWith( Op::EndEncoding ) );
+    CHECK( !parsesWith( Op::BeginBlit ) );
+    CHECK( !parsesWith( Op::BeginFrame ) );
+    s = frame();
+    s.op( Op::BeginRender );
+    s.op( Op::BeginCompute );
+    s.op( Op::EndEncoding );
+    s.op( Op::EndEncoding );
+    s.op( Op::EndFrame );
+    CHECK( !parses( s.bytes ) );
+    s = frame();
+    s.op( Op::BeginCompute );
+    s.op( Op::DrawIndexedPrimitives, cmdstream::DrawIndexed{ 3, 36, 0, 1, 0, 10 } );
+    s.op( Op::EndEncoding );
+    s.op( Op::EndFrame );
+    CHECK( !parses( s.bytes ) );
+    s = frame();
+    s.op( Op::BeginRender );
+    s.bufferData( 1, 0, 16 );
+    s.op( Op::EndEncoding );
+    s.op( Op::EndFrame );
+    CHECK( !parses( s.bytes ) );
+    s = frame();
+    s.op( Op::EndFrame );
+    s.bufferData( 1, 0, 16 );
+    CHECK( !parses( s.bytes ) );
+}
+
+// Parses a state declaration after changing its payload
+template< typename F >
+static bool parsesState( F change )
+{
+    std::vector< uint8_t > payload =
+        cmdstream::stateDeclaration( 5, { "render", specialization::VariantKey().set( kMaxIteration, 50u ).setDefault( kPalettePhase ) } );
+    change( &payload );
+    Stream s = frame();
+    s.op( Op::DeclareState, payload.data(), (uint32_t)payload.size() );
+    s.op( Op::EndFrame );
+    return parses( s.bytes );
+}
+
+static void testStateConstants()
+{
+    CHECK( parsesState( []( std::vector< uint8_t >* ){} ) );
+
+    // The name length must match the bytes that follow:
+    CHECK( !parsesState( []( std::vector< uint8_t >* p ){ (*p)[4] = 0; } ) );
+    CHECK( !parsesState( []( std::vector< uint8_t >* p ){ (*p)[4] += 1; } ) );
+    CHECK( !parsesState( []( std::vector< uint8_t >* p ){ (*p)[4] = 0xff; } ) );
+    CHECK( !parsesState( []( std::vector< uint8_t >* p ){ p->pop_back(); } ) );
+    CHECK( !parsesState( []( std::vector< uint8_t >* p ){ p->push_back( 0 ); } ) );
+
+    // Each constant has a known type and appears once:
+    const size_t firstConstant = 2 * sizeof( uint32_t ) + 6;
+    const size_t secondConstant = firstConstant + sizeof( cmdstream::ConstantDecl );
+    CHECK( !parsesState( [=]( std::vector< uint8_t >* p ){ (*p)[ firstConstant + 4 ] = 4; } ) );
+    CHECK( !parsesState( [=]( std::vector< uint8_t >* p ){ (*p)[ secondConstant ] = 0; } ) );
+
+    // An id declared again must name the same variant:
+    Stream s = frame();
+    s.state( 3, "mandelbrot_set", specialization::VariantKey().set( kMaxIteration, 50u ).setDefault( kPalettePhase ) );
+    s.op( Op::EndFrame );
+    CHECK( parses( s.bytes ) );
+    s = frame();
+    s.state( 3, "mandelbrot_set", specialization::VariantKey().setDefault( kMaxIteration ).setDefault( kPalettePhase ) );
+    s.op( Op::EndFrame );
+    CHECK( !parses( s.bytes ) );
+    s = frame();
+    s.state( 3, "mandelbrot_set" );
+    s.op( Op::EndFrame );
+    CHECK( !parses( s.bytes ) );
+}
+
+int main()
+{
+    testValid();
+    testMalformed();
+    testStateConstants();
+    return check::finish( "cmdstream-test" );
+}
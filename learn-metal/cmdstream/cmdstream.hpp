@@ -0,0 +1,579 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// The format of the command streams 10-frame-debugging records, and a reader
+// for them. A stream is a header followed by ops, each an Op byte, a 32-bit
+// payload size and the payload. Reader::parse() checks every op before
+// anything executes one: payload sizes, that ids are declared with the kind
+// the op expects, that buffer writes lie within the declared buffer, and
+// that ops only appear inside the frames and encoders they belong to. The
+// replayer and the software rasterizer can then execute a stream without
+// further checks. The cmdstream test feeds parse() malformed streams on any
+// platform.
+//
+// Version 2 records the function constants each pipeline state was
+// specialized with, so replays and reference images use the same variant.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "../specialization/specialization.hpp"
+
+#pragma region Declarations {
+
+namespace cmdstream
+{
+    static constexpr uint32_t kMagic = 0x53434d4c; // "LMCS"
+    static constexpr uint32_t kVersion = 2;
+    static constexpr size_t kDeltaGranularity = 64;
+
+    // Limits of the resources a stream may declare. Buffers are created
+    // whole before replay, so the limit keeps a corrupt length from
+    // exhausting memory.
+    static constexpr uint64_t kMaxBufferLength = 1ull << 30;
+    static constexpr uint32_t kMaxTextureDimension = 16384;
+
+    enum class Op : uint8_t
+    {
+        DeclareBuffer = 1,
+        DeclareTexture,
+        DeclareState,
+        BufferData,
+        BeginFrame,
+        EndFrame,
+        BeginCompute,
+        BeginRender,
+        BeginBlit,
+        EndEncoding,
+        SetComputePipelineState,
+        SetComputeBuffer,
+        SetComputeTexture,
+        DispatchThreads,
+        DispatchThreadgroups,
+        GenerateMipmaps,
+        SetRenderPipelineState,
+        SetDepthStencilState,
+        SetVertexBuffer,
+        SetFragmentTexture,
+        SetCullMode,
+        SetFrontFacingWinding,
+        DrawIndexedPrimitives
+    };
+
+    struct Header
+    {
+        uint32_t magic;
+        uint32_t version;
+    };
+
+    // reserved is written as zero, so that recordings are byte-for-byte
+    // reproducible
+    struct BufferDecl
+    {
+        uint32_t id;
+        uint32_t reserved;
+        uint64_t length;
+    };
+
+    struct TextureDecl
+    {
+        uint32_t id;
+        uint32_t width;
+        uint32_t height;
+        uint32_t mipmapLevelCount;
+        uint32_t pixelFormat;
+        uint32_t usage;
+    };
+
+    // Pipeline states can't be serialized, so a stream names them and lists
+    // the function constants they were specialized with. The payload is the
+    // id, the length of the name, the name and a ConstantDecl per constant.
+    struct StateDecl
+    {
+        std::string name;
+        specialization::VariantKey constants;
+    };
+
+    struct ConstantDecl
+    {
+        uint32_t index;
+        uint32_t type;
+        uint8_t bytes[16];
+    };
+
+    std::vector< uint8_t > stateDeclaration( uint32_t id, const StateDecl& state );
+
+    struct Binding
+    {
+        uint32_t id;
+        uint32_t offset;
+        uint32_t index;
+    };
+
+    struct Dispatch
+    {
+        uint32_t grid[3];
+        uint32_t threadgroup[3];
+    };
+
+    struct DrawIndexed
+    {
+        uint32_t primitiveType;
+        uint32_t indexCount;
+        uint32_t indexType;
+        uint32_t indexBufferId;
+        uint32_t indexBufferOffset;
+        uint32_t instanceCount;
+    };
+
+    // A BufferData payload starts with the buffer id and the offset of the
+    // bytes that follow
+    static constexpr uint32_t kBufferDataHeaderSize = 2 * sizeof( uint32_t );
+
+    class Reader
+    {
+        public:
+            bool load( const char* path );
+            bool parse( std::vector< uint8_t > stream );
+            const char* error() const;
+            size_t frameCount() const;
+            size_t frameOffset( size_t frame ) const;
+            bool next( size_t* pCursor, Op* pOp, const uint8_t** ppPayload, uint32_t* pSize ) const;
+
+            // Every resource and state the stream declares, by id
+            const std::unordered_map< uint32_t, BufferDecl >& buffers() const;
+            const std::unordered_map< uint32_t, TextureDecl >& textures() const;
+            const std::unordered_map< uint32_t, StateDecl >& states() const;
+
+        private:
+            bool fail( const char* error );
+            bool check( Op op, const uint8_t* pPayload, uint32_t size );
+
+            enum class Encoder { None, Compute, Render, Blit };
+
+            std::vector< uint8_t > _stream;
+            std::vector< size_t > _frameOffsets;
+            std::unordered_map< uint32_t, BufferDecl > _buffers;
+            std::unordered_map< uint32_t, TextureDecl > _textures;
+            std::unordered_map< uint32_t, StateDecl > _states;
+            const char* _error = nullptr;
+            bool _inFrame = false;
+            Encoder _encoder = Encoder::None;
+    };
+}
+
+#pragma endregion Declarations }
+
+
+#pragma mark - Reader
+#pragma region Reader {
+
+namespace cmdstream
+{
+    inline std::vector< uint8_t > stateDeclaration( uint32_t id, const StateDecl& state )
+    {
+        const uint32_t nameLength = (uint32_t)state.name.size();
+        const size_t headerSize = 2 * sizeof( uint32_t ) + nameLength;
+        std::vector< uint8_t > payload( headerSize + state.constants.values().size() * sizeof( ConstantDecl ) );
+        memcpy( &payload[0], &id, sizeof( id ) );
+        memcpy( &payload[4], &nameLength, sizeof( nameLength ) );
+        memcpy( &payload[8], state.name.data(), nameLength );
+        uint8_t* pConstant = &payload[ headerSize ];
+        for ( const specialization::Value& value : state.constants.values() )
+        {
+            ConstantDecl decl = { value.index, (uint32_t)value.type, {} };
+            memcpy( decl.bytes, value.bytes, sizeof( decl.bytes ) );
+            memcpy( pConstant, &decl, sizeof( decl ) );
+            pConstant += sizeof( decl );
+        }
+        return payload;
+    }
+
+    inline bool Reader::load( const char* path )
+    {
+        FILE* pFile = fopen( path, "rb" );
+        if ( !pFile )
+        {
+            return fail( "can't open the file" );
+        }
+        std::vector< uint8_t > stream;
+        uint8_t chunk[ 64 * 1024 ];
+        size_t bytesRead;
+        while ( (bytesRead = fread( chunk, 1, sizeof( chunk ), pFile )) > 0 )
+        {
+            stream.insert( stream.end(), chunk, chunk + bytesRead );
+        }
+        bool readError = ferror( pFile ) != 0;
+        fclose( pFile );
+        if ( readError )
+        {
+            return fail( "can't read the file" );
+        }
+        return parse( std::move( stream ) );
+    }
+
+    inline bool Reader::parse( std::vector< uint8_t > stream )
+    {
+        _stream = std::move( stream );
+        _frameOffsets.clear();
+        _buffers.clear();
+        _textures.clear();
+        _states.clear();
+        _error = nullptr;
+        _inFrame = false;
+        _encoder = Encoder::None;
+
+        Header header;
+        if ( _stream.size() < sizeof( header ) )
+        {
+            return fail( "truncated header" );
+        }
+        memcpy( &header, _stream.data(), sizeof( header ) );
+        if ( header.magic != kMagic || header.version != kVersion )
+        {
+            return fail( "not a command stream of this version" );
+        }
+
+        // Index the frames and check each op:
+        size_t cursor = sizeof( header );
+        while ( cursor < _stream.size() )
+        {
+            uint32_t size;
+            if ( _stream.size() - cursor < 1 + sizeof( size ) )
+            {
+                return fail( "truncated op" );
+            }
+            memcpy( &size, &_stream[ cursor + 1 ], sizeof( size ) );
+            if ( size > _stream.size() - cursor - 1 - sizeof( size ) )
+            {
+                return fail( "truncated payload" );
+            }
+            Op op = (Op)_stream[ cursor ];
+            if ( op == Op::BeginFrame )
+            {
+                _frameOffsets.push_back( cursor );
+            }
+            if ( !check( op, &_stream[ cursor + 1 + sizeof( size ) ], size ) )
+            {
+                return false;
+            }
+            cursor += 1 + sizeof( size ) + size;
+        }
+        if ( _inFrame )
+        {
+            return fail( "the last frame is incomplete" );
+        }
+        return true;
+    }
+
+    inline bool Reader::fail( const char* error )
+    {
+        _error = error;
+        _frameOffsets.clear();
+        return false;
+    }
+
+    inline bool Reader::check( Op op, const uint8_t* pPayload, uint32_t size )
+    {
+        uint32_t value = 0;
+        Binding binding = {};
+        auto payload = [&]( void* pValue, size_t expectedSize ) {
+            if ( size != expectedSize )
+            {
+                return false;
+            }
+            memcpy( pValue, pPayload, expectedSize );
+            return true;
+        };
+
+        // Resources are declared on first use, so declarations may appear
+        // anywhere in a frame. Encoder ops need the encoder they belong to:
+        Encoder encoder = Encoder::None;
+        switch ( op )
+        {
+            case Op::SetComputePipelineState: case Op::SetComputeBuffer: case Op::SetComputeTexture:
+            case Op::DispatchThreads: case Op::DispatchThreadgroups:
+                encoder = Encoder::Compute;
+                break;
+            case Op::SetRenderPipelineState: case Op::SetDepthStencilState: case Op::SetVertexBuffer:
+            case Op::SetFragmentTexture: case Op::SetCullMode: case Op::SetFrontFacingWinding: case Op::DrawIndexedPrimitives:
+                encoder = Encoder::Render;
+                break;
+            case Op::GenerateMipmaps:
+                encoder = Encoder::Blit;
+                break;
+            default:
+                break;
+        }
+        if ( op != Op::BeginFrame && !_inFrame )
+        {
+            return fail( "op outside a frame" );
+        }
+        if ( encoder != Encoder::None && encoder != _encoder )
+        {
+            return fail( "op outside its encoder" );
+        }
+
+        switch ( op )
+        {
+            case Op::DeclareBuffer:
+            {
+                BufferDecl decl;
+                if ( !payload( &decl, sizeof( decl ) ) )
+                {
+                    return fail( "bad buffer declaration" );
+                }
+                if ( decl.length == 0 || decl.length > kMaxBufferLength )
+                {
+                    return fail( "bad buffer length" );
+                }
+                if ( _textures.count( decl.id ) || _states.count( decl.id ) ||
+                     (!_buffers.emplace( decl.id, decl ).second && _buffers[ decl.id ].length != decl.length) )
+                {
+                    return fail( "id declared twice" );
+                }
+                return true;
+            }
+            case Op::DeclareTexture:
+            {
+                TextureDecl decl;
+                if ( !payload( &decl, sizeof( decl ) ) )
+                {
+                    return fail( "bad texture declaration" );
+                }
+                uint32_t maxLevels = 1;
+                while ( std::max( decl.width, decl.height ) >> maxLevels )
+                {
+                    ++maxLevels;
+                }
+                if ( decl.width == 0 || decl.height == 0 || decl.width > kMaxTextureDimension || decl.height > kMaxTextureDimension ||
+                     decl.mipmapLevelCount == 0 || decl.mipmapLevelCount > maxLevels )
+                {
+                    return fail( "bad texture size" );
+                }
+                if ( _buffers.count( decl.id ) || _states.count( decl.id ) ||
+                     (!_textures.emplace( decl.id, decl ).second && memcmp( &_textures[ decl.id ], &decl, sizeof( decl ) )) )
+                {
+                    return fail( "id declared twice" );
+                }
+                return true;
+            }
+            case Op::DeclareState:
+            {
+                uint32_t nameLength;
+                if ( size < 2 * sizeof( uint32_t ) )
+                {
+                    return fail( "bad state declaration" );
+                }
+                memcpy( &value, pPayload, sizeof( value ) );
+                memcpy( &nameLength, pPayload + sizeof( value ), sizeof( nameLength ) );
+                const size_t remaining = size - 2 * sizeof( uint32_t );
+                if ( nameLength == 0 || nameLength > remaining || (remaining - nameLength) % sizeof( ConstantDecl ) != 0 )
+                {
+                    return fail( "bad state declaration" );
+                }
+
+                StateDecl state;
+                state.name.assign( (const char*)pPayload + 2 * sizeof( uint32_t ), nameLength );
+                for ( size_t offset = size - remaining + nameLength; offset < size; offset += sizeof( ConstantDecl ) )
+                {
+                    ConstantDecl decl;
+                    memcpy( &decl, pPayload + offset, sizeof( decl ) );
+                    if ( decl.type > (uint32_t)specialization::ConstantType::Float3 )
+                    {
+                        return fail( "bad constant type" );
+                    }
+                    specialization::Value constant = { decl.index, (specialization::ConstantType)decl.type, {} };
+                    memcpy( constant.bytes, decl.bytes, sizeof( constant.bytes ) );
+                    const size_t count = state.constants.values().size();
+                    if ( state.constants.set( constant ).values().size() == count )
+                    {
+                        return fail( "constant declared twice" );
+                    }
+                }
+
+                auto declared = _states.emplace( value, state );
+                if ( _buffers.count( value ) || _textures.count( value ) ||
+                     (!declared.second && (declared.first->second.name != state.name || declared.first->second.constants != state.constants)) )
+                {
+                    return fail( "id declared twice" );
+                }
+                return true;
+            }
+            case Op::BufferData:
+            {
+                uint32_t header[2];
+                if ( size < kBufferDataHeaderSize || _encoder != Encoder::None )
+                {
+                    return fail( "bad buffer data" );
+                }
+                memcpy( header, pPayload, sizeof( header ) );
+                auto it = _buffers.find( header[0] );
+                if ( it == _buffers.end() )
+                {
+                    return fail( "buffer data for an undeclared buffer" );
+                }
+                if ( (uint64_t)header[1] + (size - kBufferDataHeaderSize) > it->second.length )
+                {
+                    return fail( "buffer data past the end of the buffer" );
+                }
+                return true;
+            }
+            case Op::BeginFrame:
+                if ( size != 0 || _inFrame )
+                {
+                    return fail( "bad frame start" );
+                }
+                _inFrame = true;
+                return true;
+            case Op::EndFrame:
+                if ( size != 0 || _encoder != Encoder::None )
+                {
+                    return fail( "bad frame end" );
+                }
+                _inFrame = false;
+                return true;
+            case Op::BeginCompute:
+            case Op::BeginRender:
+            case Op::BeginBlit:
+                if ( size != 0 || _encoder != Encoder::None )
+                {
+                    return fail( "bad encoder start" );
+                }
+                _encoder = op == Op::BeginCompute ? Encoder::Compute : op == Op::BeginRender ? Encoder::Render : Encoder::Blit;
+                return true;
+            case Op::EndEncoding:
+                if ( size != 0 || _encoder == Encoder::None )
+                {
+                    return fail( "bad encoder end" );
+                }
+                _encoder = Encoder::None;
+                return true;
+            case Op::SetComputePipelineState:
+            case Op::SetRenderPipelineState:
+            case Op::SetDepthStencilState:
+                if ( !payload( &value, sizeof( value ) ) || !_states.count( value ) )
+                {
+                    return fail( "bad state reference" );
+                }
+                return true;
+            case Op::SetComputeBuffer:
+            case Op::SetVertexBuffer:
+                if ( !payload( &binding, sizeof( binding ) ) || !_buffers.count( binding.id ) ||
+                     binding.offset >= _buffers[ binding.id ].length )
+                {
+                    return fail( "bad buffer binding" );
+                }
+                return true;
+            case Op::SetComputeTexture:
+            case Op::SetFragmentTexture:
+                if ( !payload( &binding, sizeof( binding ) ) || !_textures.count( binding.id ) )
+                {
+                    return fail( "bad texture binding" );
+                }
+                return true;
+            case Op::GenerateMipmaps:
+                if ( !payload( &value, sizeof( value ) ) || !_textures.count( value ) )
+                {
+                    return fail( "bad texture reference" );
+                }
+                return true;
+            case Op::SetCullMode:
+            case Op::SetFrontFacingWinding:
+                if ( !payload( &value, sizeof( value ) ) )
+                {
+                    return fail( "bad render state" );
+                }
+                return true;
+            case Op::DispatchThreads:
+            case Op::DispatchThreadgroups:
+            {
+                Dispatch dispatch;
+                if ( !payload( &dispatch, sizeof( dispatch ) ) )
+                {
+                    return fail( "bad dispatch" );
+                }
+                return true;
+            }
+            case Op::DrawIndexedPrimitives:
+            {
+                DrawIndexed draw;
+                if ( !payload( &draw, sizeof( draw ) ) || !_buffers.count( draw.indexBufferId ) ||
+                     draw.indexBufferOffset >= _buffers[ draw.indexBufferId ].length )
+                {
+                    return fail( "bad draw" );
+                }
+                return true;
+            }
+        }
+        return fail( "unknown op" );
+    }
+
+    inline const char* Reader::error() const
+    {
+        return _error;
+    }
+
+    inline size_t Reader::frameCount() const
+    {
+        return _frameOffsets.size();
+    }
+
+    inline size_t Reader::frameOffset( size_t frame ) const
+    {
+        return _frameOffsets[ frame ];
+    }
+
+    inline bool Reader::next( size_t* pCursor, Op* pOp, const uint8_t** ppPayload, uint32_t* pSize ) const
+    {
+        // parse() has already checked that every op lies within the stream:
+        if ( *pCursor >= _stream.size() )
+        {
+            return false;
+        }
+        *pOp = (Op)_stream[ *pCursor ];
+        memcpy( pSize, &_stream[ *pCursor + 1 ], sizeof( *pSize ) );
+        *ppPayload = &_stream[ *pCursor + 5 ];
+        *pCursor += 5 + *pSize;
+        return true;
+    }
+
+    inline const std::unordered_map< uint32_t, BufferDecl >& Reader::buffers() const
+    {
+        return _buffers;
+    }
+
+    inline const std::unordered_map< uint32_t, TextureDecl >& Reader::textures() const
+    {
+        return _textures;
+    }
+
+    inline const std::unordered_map< uint32_t, StateDecl >& Reader::states() const
+    {
+        return _states;
+    }
+}
+
+#pragma endregion Reader }
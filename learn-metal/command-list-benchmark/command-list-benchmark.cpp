@@ -0,0 +1,333 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures cmdlist::RenderList against encoding straight into an encoder. The
+// encoder is a stand-in that tracks its bindings and hashes them at every
+// draw, so the benchmark needs no GPU. It reports the app's side of encoding,
+// recording, apart from the calls flush() makes into the encoder, and checks
+// that every draw sees the same state either way, also for lists recorded on
+// several threads at once.
+
+#include "../command-list/command-list.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr size_t kDrawsPerFrame = 4096;
+static constexpr size_t kFrames = 200;
+static constexpr size_t kThreads = 4;
+
+#pragma region Declarations {
+
+namespace mock
+{
+    struct RenderPipelineState { int id; };
+    struct DepthStencilState { int id; };
+    struct Buffer { int id; };
+    struct Texture { int id; };
+    struct ComputePipelineState { int id; };
+
+    struct Api
+    {
+        using RenderPipelineState = mock::RenderPipelineState;
+        using DepthStencilState = mock::DepthStencilState;
+        using ComputePipelineState = mock::ComputePipelineState;
+        using Buffer = mock::Buffer;
+        using Texture = mock::Texture;
+
+        enum CullMode : uint32_t { CullModeNone, CullModeFront, CullModeBack };
+        enum Winding : uint32_t { WindingClockwise, WindingCounterClockwise };
+        enum PrimitiveType : uint32_t { PrimitiveTypeTriangle };
+        enum IndexType : uint32_t { IndexTypeUInt16, IndexTypeUInt32 };
+
+        struct Size
+        {
+            Size( uint64_t w, uint64_t h, uint64_t d ) : width( w ), height( h ), depth( d ) {}
+            uint64_t width, height, depth;
+        };
+    };
+
+    // Stands in for a driver's encoder: every call updates the bound state,
+    // and every draw folds that state into a digest.
+    class RenderEncoder
+    {
+        public:
+            RenderEncoder();
+            void setRenderPipelineState( RenderPipelineState* pState );
+            void setDepthStencilState( DepthStencilState* pState );
+            void setCullMode( Api::CullMode cullMode );
+            void setFrontFacingWinding( Api::Winding winding );
+            void setVertexBuffer( Buffer* pBuffer, uint64_t offset, uint32_t index );
+            void setFragmentTexture( Texture* pTexture, uint32_t index );
+            void drawIndexedPrimitives( Api::PrimitiveType primitiveType, uint64_t indexCount, Api::IndexType indexType,
+                                        Buffer* pIndexBuffer, uint64_t indexBufferOffset, uint64_t instanceCount );
+
+            uint64_t digest() const { return _digest; }
+            size_t calls() const { return _calls; }
+            size_t draws() const { return _draws; }
+
+        private:
+            void mix( uint64_t value );
+
+            const void* _pPipelineState;
+            const void* _pDepthStencilState;
+            uint32_t _cullMode;
+            uint32_t _winding;
+            const void* _pVertexBuffers[ 4 ];
+            uint64_t _vertexOffsets[ 4 ];
+            const void* _pFragmentTexture;
+            uint64_t _digest;
+            size_t _calls;
+            size_t _draws;
+    };
+}
+
+// The resources one frame draws with
+struct Scene
+{
+    mock::RenderPipelineState pipelines[ 2 ];
+    mock::DepthStencilState depthStencilState;
+    mock::Buffer vertexBuffer;
+    mock::Buffer instanceBuffer;
+    mock::Buffer cameraBuffer;
+    mock::Buffer indexBuffer;
+    mock::Texture textures[ 4 ];
+};
+
+#pragma endregion Declarations }
+
+
+#pragma mark - Mock Encoder
+#pragma region Mock Encoder {
+
+namespace mock
+{
+    RenderEncoder::RenderEncoder()
+    : _pPipelineState( nullptr )
+    , _pDepthStencilState( nullptr )
+    , _cullMode( Api::CullModeNone )
+    , _winding( Api::WindingClockwise )
+    , _pVertexBuffers{}
+    , _vertexOffsets{}
+    , _pFragmentTexture( nullptr )
+    , _digest( 1469598103934665603ull )
+    , _calls( 0 )
+    , _draws( 0 )
+    {
+    }
+
+    __attribute__((noinline)) void RenderEncoder::setRenderPipelineState( RenderPipelineState* pState )
+    {
+        ++_calls;
+        _pPipelineState = pState;
+    }
+
+    __attribute__((noinline)) void RenderEncoder::setDepthStencilState( DepthStencilState* pState )
+    {
+        ++_calls;
+        _pDepthStencilState = pState;
+    }
+
+    __attribute__((noinline)) void RenderEncoder::setCullMode( Api::CullMode cullMode )
+    {
+        ++_calls;
+        _cullMode = cullMode;
+    }
+
+    __attribute__((noinline)) void RenderEncoder::setFrontFacingWinding( Api::Winding winding )
+    {
+        ++_calls;
+        _winding = winding;
+    }
+
+    __attribute__((noinline)) void RenderEncoder::setVertexBuffer( Buffer* pBuffer, uint64_t offset, uint32_t index )
+    {
+        ++_calls;
+        assert( index < 4 );
+        _pVertexBuffers[ index ] = pBuffer;
+        _vertexOffsets[ index ] = offset;
+    }
+
+    __attribute__((noinline)) void RenderEncoder::setFragmentTexture( Texture* pTexture, uint32_t index )
+    {
+        ++_calls;
+        assert( index == 0 );
+        _pFragmentTexture = pTexture;
+    }
+
+    __attribute__((noinline)) void RenderEncoder::drawIndexedPrimitives( Api::PrimitiveType primitiveType, uint64_t indexCount, Api::IndexType indexType,
+                                                                         Buffer* pIndexBuffer, uint64_t indexBufferOffset, uint64_t instanceCount )
+    {
+        ++_calls;
+        ++_draws;
+        mix( (uintptr_t)_pPipelineState );
+        mix( (uintptr_t)_pDepthStencilState );
+        mix( ( (uint64_t)_cullMode << 32 ) | _winding );
+        for ( size_t i = 0; i < 4; ++i )
+        {
+            mix( (uintptr_t)_pVertexBuffers[ i ] );
+            mix( _vertexOffsets[ i ] );
+        }
+        mix( (uintptr_t)_pFragmentTexture );
+        mix( ( (uint64_t)primitiveType << 32 ) | indexType );
+        mix( indexCount );
+        mix( (uintptr_t)pIndexBuffer );
+        mix( indexBufferOffset );
+        mix( instanceCount );
+    }
+
+    void RenderEncoder::mix( uint64_t value )
+    {
+        _digest = ( _digest ^ value ) * 1099511628211ull;
+    }
+}
+
+#pragma endregion Mock Encoder }
+
+
+#pragma mark - Benchmark
+#pragma region Benchmark {
+
+// Encodes a frame the way a renderer without state tracking would: every
+// draw sets all of its state. Only the instance offset changes every draw;
+// the pipeline and texture change every few hundred.
+template< typename _Encoder >
+static void encodeFrame( _Encoder* pEnc, Scene* pScene )
+{
+    for ( size_t draw = 0; draw < kDrawsPerFrame; ++draw )
+    {
+        pEnc->setRenderPipelineState( &pScene->pipelines[ ( draw / 512 ) & 1 ] );
+        pEnc->setDepthStencilState( &pScene->depthStencilState );
+        pEnc->setVertexBuffer( &pScene->vertexBuffer, 0, 0 );
+        pEnc->setVertexBuffer( &pScene->instanceBuffer, draw * 64, 1 );
+        pEnc->setVertexBuffer( &pScene->cameraBuffer, 0, 2 );
+        pEnc->setFragmentTexture( &pScene->textures[ ( draw / 256 ) & 3 ], 0 );
+        pEnc->setCullMode( mock::Api::CullModeBack );
+        pEnc->setFrontFacingWinding( mock::Api::WindingCounterClockwise );
+        pEnc->drawIndexedPrimitives( mock::Api::PrimitiveTypeTriangle, 36, mock::Api::IndexTypeUInt16, &pScene->indexBuffer, 0, 1 );
+    }
+}
+
+static double elapsedNs( Clock::time_point start, Clock::time_point end )
+{
+    return (double)std::chrono::duration_cast< std::chrono::nanoseconds >( end - start ).count();
+}
+
+static bool checkThreadedRecording( Scene* pScene, cmdlist::BlockPool* pPool, uint64_t expected )
+{
+    std::vector< cmdlist::RenderList< mock::Api >* > lists;
+    for ( size_t i = 0; i < kThreads; ++i )
+    {
+        lists.push_back( new cmdlist::RenderList< mock::Api >( pPool ) );
+    }
+
+    std::vector< std::thread > threads;
+    for ( size_t i = 0; i < kThreads; ++i )
+    {
+        threads.emplace_back( [pScene, pList = lists[ i ]]() {
+            for ( size_t frame = 0; frame < kFrames / 10; ++frame )
+            {
+                pList->reset();
+                encodeFrame( pList, pScene );
+            }
+        } );
+    }
+    for ( std::thread& thread : threads )
+    {
+        thread.join();
+    }
+
+    bool ok = true;
+    for ( cmdlist::RenderList< mock::Api >* pList : lists )
+    {
+        mock::RenderEncoder encoder;
+        pList->flush( &encoder );
+        ok = ok && encoder.digest() == expected && encoder.draws() == kDrawsPerFrame;
+        delete pList;
+    }
+    return ok;
+}
+
+int main()
+{
+    Scene* pScene = new Scene{};
+    cmdlist::BlockPool pool;
+    cmdlist::RenderList< mock::Api > list( &pool );
+
+    // Warm up the pool and the caches, then check that both paths put the
+    // same state in place at every draw:
+
+    mock::RenderEncoder reference;
+    encodeFrame( &reference, pScene );
+    encodeFrame( &list, pScene );
+    mock::RenderEncoder flushed;
+    list.flush( &flushed );
+    if ( flushed.digest() != reference.digest() || flushed.draws() != reference.draws() )
+    {
+        __builtin_printf( "error: flushed state differs from direct encoding\n" );
+        return 1;
+    }
+    const cmdlist::Stats stats = list.stats();
+
+    double directNs = 0.0;
+    double recordNs = 0.0;
+    double flushNs = 0.0;
+    for ( size_t frame = 0; frame < kFrames; ++frame )
+    {
+        mock::RenderEncoder direct;
+        Clock::time_point start = Clock::now();
+        encodeFrame( &direct, pScene );
+        Clock::time_point directEnd = Clock::now();
+
+        list.reset();
+        encodeFrame( &list, pScene );
+        Clock::time_point recordEnd = Clock::now();
+
+        mock::RenderEncoder encoder;
+        list.flush( &encoder );
+        Clock::time_point flushEnd = Clock::now();
+
+        directNs += elapsedNs( start, directEnd );
+        recordNs += elapsedNs( directEnd, recordEnd );
+        flushNs += elapsedNs( recordEnd, flushEnd );
+        assert( encoder.digest() == reference.digest() );
+    }
+
+    const double calls = (double)stats.recordedCalls;
+    __builtin_printf( "%zu draws, %zu calls per frame\n", (size_t)kDrawsPerFrame, stats.recordedCalls );
+    __builtin_printf( "  redundant calls dropped:  %zu (%.1f%%)\n", stats.recordedCalls - stats.packets,
+                      100.0 * ( calls - stats.packets ) / calls );
+    __builtin_printf( "  packet bytes:             %zu in %zu blocks\n", stats.bytes, pool.blockCount() );
+    __builtin_printf( "  direct:                   %.2f ns per call\n", directNs / kFrames / calls );
+    __builtin_printf( "  record:                   %.2f ns per call\n", recordNs / kFrames / calls );
+    __builtin_printf( "  flush:                    %.2f ns per call\n", flushNs / kFrames / calls );
+
+    bool threadsOk = checkThreadedRecording( pScene, &pool, reference.digest() );
+    __builtin_printf( "  %zu recording threads:     %s\n", (size_t)kThreads, threadsOk ? "ok" : "FAILED" );
+
+    delete pScene;
+    return threadsOk ? 0 : 1;
+}
+
+#pragma endregion Benchmark }
@@ -0,0 +1,216 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tests the command lists in command-list.hpp against an encoder that logs
+// every call. Flushing must replay the recorded calls in order, without the
+// ones that set state already in place, whatever the mix of packet sizes.
+
+#include "../test-support/check.hpp"
+#include "../command-list/command-list.hpp"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace mock
+{
+    struct RenderPipelineState { int id; };
+    struct DepthStencilState { int id; };
+    struct ComputePipelineState { int id; };
+    struct Buffer { int id; };
+    struct Texture { int id; };
+
+    struct Api
+    {
+        using RenderPipelineState = mock::RenderPipelineState;
+        using DepthStencilState = mock::DepthStencilState;
+        using ComputePipelineState = mock::ComputePipelineState;
+        using Buffer = mock::Buffer;
+        using Texture = mock::Texture;
+
+        enum CullMode : uint32_t { CullModeNone, CullModeFront, CullModeBack };
+        enum Winding : uint32_t { WindingClockwise, WindingCounterClockwise };
+        enum PrimitiveType : uint32_t { PrimitiveTypeTriangle };
+        enum IndexType : uint32_t { IndexTypeUInt16, IndexTypeUInt32 };
+
+        struct Size
+        {
+            Size( uint64_t w, uint64_t h, uint64_t d ) : width( w ), height( h ), depth( d ) {}
+            uint64_t width, height, depth;
+        };
+    };
+
+    // Logs each call as a line, so a test can compare the whole sequence
+    class Encoder
+    {
+        public:
+            void setRenderPipelineState( RenderPipelineState* pState ) { log( "pipeline", pState->id ); }
+            void setDepthStencilState( DepthStencilState* pState ) { log( "depth", pState->id ); }
+            void setCullMode( Api::CullMode cullMode ) { log( "cull", cullMode ); }
+            void setFrontFacingWinding( Api::Winding winding ) { log( "winding", winding ); }
+            void setVertexBuffer( Buffer* pBuffer, uint64_t offset, uint32_t index ) { log( "vertex", pBuffer->id, offset, index ); }
+            void setFragmentTexture( Texture* pTexture, uint32_t index ) { log( "fragment", pTexture->id, 0, index ); }
+            void drawIndexedPrimitives( Api::PrimitiveType, uint64_t indexCount, Api::IndexType, Buffer* pIndexBuffer,
+                                        uint64_t indexBufferOffset, uint64_t instanceCount )
+            {
+                log( "draw", pIndexBuffer->id, indexBufferOffset, indexCount * 1000 + instanceCount );
+            }
+
+            void setComputePipelineState( ComputePipelineState* pState ) { log( "compute", pState->id ); }
+            void setBuffer( Buffer* pBuffer, uint64_t offset, uint32_t index ) { log( "buffer", pBuffer->id, offset, index ); }
+            void setTexture( Texture* pTexture, uint32_t index ) { log( "texture", pTexture->id, 0, index ); }
+            void dispatchThreads( Api::Size grid, Api::Size threadgroup ) { log( "threads", grid.width, grid.height * 100 + grid.depth, threadgroup.width ); }
+            void dispatchThreadgroups( Api::Size grid, Api::Size threadgroup ) { log( "groups", grid.width, grid.height * 100 + grid.depth, threadgroup.width ); }
+
+            std::vector< std::string > calls;
+
+        private:
+            void log( const char* name, uint64_t a, uint64_t b = 0, uint64_t c = 0 )
+            {
+                calls.push_back( std::string( name ) + " " + std::to_string( a ) + " " + std::to_string( b ) + " " + std::to_string( c ) );
+            }
+    };
+}
+
+using ComputeList = cmdlist::ComputeList< mock::Api >;
+using RenderList = cmdlist::RenderList< mock::Api >;
+using Size = mock::Api::Size;
+
+template< typename _List >
+static std::vector< std::string > flushed( const _List& list )
+{
+    mock::Encoder encoder;
+    list.flush( &encoder );
+    return encoder.calls;
+}
+
+static void testComputeInterleaved()
+{
+    cmdlist::BlockPool pool;
+    ComputeList list( &pool );
+    mock::ComputePipelineState pipeline = { 7 };
+    mock::Buffer buffers[2] = { { 1 }, { 2 } };
+    mock::Texture texture = { 3 };
+
+    // Dispatch packets aren't a multiple of 8 bytes, so every bind that
+    // follows one checks the padding:
+    list.setComputePipelineState( &pipeline );
+    list.setTexture( &texture, 0 );
+    for ( uint32_t i = 0; i < 4; ++i )
+    {
+        list.setBuffer( &buffers[ i % 2 ], i * 16, 0 );
+        list.dispatchThreads( Size( 64, 64, 1 ), Size( 8, 8, 1 ) );
+        list.setBuffer( &buffers[ 1 ], 0, 1 );
+        list.dispatchThreadgroups( Size( 8, 8, 1 ), Size( 8, 8, 1 ) );
+    }
+
+    std::vector< std::string > expected = { "compute 7 0 0", "texture 3 0 0" };
+    for ( uint32_t i = 0; i < 4; ++i )
+    {
+        expected.push_back( "buffer " + std::to_string( i % 2 + 1 ) + " " + std::to_string( i * 16 ) + " 0" );
+        expected.push_back( "threads 64 6401 8" );
+        if ( i == 0 )
+        {
+            expected.push_back( "buffer 2 0 1" );
+        }
+        expected.push_back( "groups 8 801 8" );
+    }
+    CHECK( flushed( list ) == expected );
+    CHECK( list.stats().recordedCalls == 18 );
+    CHECK( list.stats().packets == expected.size() );
+    CHECK( list.stats().bytes % cmdlist::kPacketAlignment == 0 );
+}
+
+static void testRedundantState()
+{
+    cmdlist::BlockPool pool;
+    RenderList list( &pool );
+    mock::RenderPipelineState pipelines[2] = { { 1 }, { 2 } };
+    mock::DepthStencilState depth = { 5 };
+    mock::Buffer vertices = { 10 }, indices = { 11 };
+    mock::Texture texture = { 20 };
+
+    for ( int draw = 0; draw < 3; ++draw )
+    {
+        list.setRenderPipelineState( &pipelines[ draw == 2 ] );
+        list.setDepthStencilState( &depth );
+        list.setCullMode( mock::Api::CullModeBack );
+        list.setFrontFacingWinding( mock::Api::WindingCounterClockwise );
+        list.setVertexBuffer( &vertices, draw == 1 ? 64 : 0, 0 );
+        list.setFragmentTexture( &texture, 0 );
+        list.drawIndexedPrimitives( mock::Api::PrimitiveTypeTriangle, 36, mock::Api::IndexTypeUInt16, &indices, 0, 10 );
+    }
+
+    // Only changes reach the encoder, and every draw is kept:
+    std::vector< std::string > expected = {
+        "pipeline 1 0 0", "depth 5 0 0", "cull 2 0 0", "winding 1 0 0", "vertex 10 0 0", "fragment 20 0 0", "draw 11 0 36010",
+        "vertex 10 64 0", "draw 11 0 36010",
+        "pipeline 2 0 0", "vertex 10 0 0", "draw 11 0 36010" };
+    CHECK( flushed( list ) == expected );
+    CHECK( list.stats().recordedCalls == 21 );
+
+    // reset() forgets the bound state, so the next list records it again:
+    list.reset();
+    list.setRenderPipelineState( &pipelines[1] );
+    list.setVertexBuffer( &vertices, 0, 0 );
+    CHECK( flushed( list ) == std::vector< std::string >( { "pipeline 2 0 0", "vertex 10 0 0" } ) );
+
+    // Indices past the tracked range are always recorded:
+    list.setVertexBuffer( &vertices, 0, cmdlist::kMaxBindings );
+    list.setVertexBuffer( &vertices, 0, cmdlist::kMaxBindings );
+    CHECK( flushed( list ).size() == 4 );
+}
+
+static void testBlocks()
+{
+    // Enough packets to span several blocks, which must flush in order:
+    cmdlist::BlockPool pool;
+    ComputeList list( &pool );
+    mock::Buffer buffer = { 1 };
+    const uint32_t kDispatches = 10000;
+    for ( uint32_t i = 0; i < kDispatches; ++i )
+    {
+        list.setBuffer( &buffer, i, 0 );
+        list.dispatchThreads( Size( i, 1, 1 ), Size( 1, 1, 1 ) );
+    }
+    CHECK( pool.blockCount() > 1 );
+
+    std::vector< std::string > calls = flushed( list );
+    CHECK( calls.size() == 2 * kDispatches );
+    bool ordered = true;
+    for ( uint32_t i = 0; i < kDispatches && ordered; ++i )
+    {
+        ordered = calls[ 2 * i ] == "buffer 1 " + std::to_string( i ) + " 0"
+               && calls[ 2 * i + 1 ] == "threads " + std::to_string( i ) + " 101 1";
+    }
+    CHECK( ordered );
+
+    // Blocks go back to the pool and are reused:
+    size_t blocks = pool.blockCount();
+    list.reset();
+    list.setBuffer( &buffer, 0, 0 );
+    CHECK( pool.blockCount() == blocks );
+    CHECK( flushed( list ).size() == 1 );
+}
+
+int main()
+{
+    testComputeInterleaved();
+    testRedundantState();
+    testBlocks();
+    return check::finish( "command-list-test" );
+}
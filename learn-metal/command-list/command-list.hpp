@@ -0,0 +1,662 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Deferred command lists. Encoder calls are recorded as small POD packets into
+// blocks taken from a BlockPool, without calling Metal, so a list can be
+// recorded on any thread. Calls that would not change the encoder's state are
+// dropped as they are recorded. flush() later issues the remaining packets to
+// an encoder in one loop.
+//
+// _Api names the encoder argument types. The samples pass Metal's types; the
+// command-list benchmark passes stand-ins, so recording builds and runs
+// without Metal.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+#pragma region Declarations {
+
+namespace cmdlist
+{
+    static constexpr size_t kBlockSize = 64 * 1024;
+    static constexpr uint32_t kMaxBindings = 31;
+
+    // Every packet starts on this alignment, and its size in the block is
+    // rounded up to it, so any packet may follow any other:
+    static constexpr size_t kPacketAlignment = 8;
+
+    struct Block
+    {
+        Block* pNext;
+        size_t used;
+        alignas( 16 ) uint8_t data[ kBlockSize ];
+    };
+
+    // Blocks are shared by every list. Recording takes the lock once per
+    // block, not per packet.
+    class BlockPool
+    {
+        public:
+            BlockPool();
+            ~BlockPool();
+            Block* acquire();
+            void release( Block* pBlocks );
+            size_t blockCount() const;
+
+        private:
+            mutable std::mutex _mutex;
+            Block* _pFree;
+            size_t _blockCount;
+    };
+
+    enum class Op : uint8_t
+    {
+        SetRenderPipelineState,
+        SetDepthStencilState,
+        SetCullMode,
+        SetFrontFacingWinding,
+        SetVertexBuffer,
+        SetFragmentTexture,
+        DrawIndexedPrimitives,
+        SetComputePipelineState,
+        SetComputeBuffer,
+        SetComputeTexture,
+        DispatchThreads,
+        DispatchThreadgroups
+    };
+
+    // size is the packet's stride in the block, including padding
+    struct Packet
+    {
+        Op op;
+        uint8_t index;
+        uint16_t size;
+    };
+
+    struct StatePacket
+    {
+        Packet header;
+        void* pObject;
+    };
+
+    struct ModePacket
+    {
+        Packet header;
+        uint32_t mode;
+    };
+
+    struct BindPacket
+    {
+        Packet header;
+        void* pObject;
+        uint64_t offset;
+    };
+
+    struct DrawIndexedPacket
+    {
+        Packet header;
+        uint32_t primitiveType;
+        uint32_t indexType;
+        uint32_t indexCount;
+        uint32_t instanceCount;
+        void* pIndexBuffer;
+        uint64_t indexBufferOffset;
+    };
+
+    struct DispatchPacket
+    {
+        Packet header;
+        uint32_t grid[3];
+        uint32_t threadgroup[3];
+    };
+
+    struct Stats
+    {
+        size_t recordedCalls;
+        size_t packets;
+        size_t bytes;
+    };
+
+    // The packet stream shared by render and compute lists
+    class PacketList
+    {
+        public:
+            explicit PacketList( BlockPool* pPool );
+            ~PacketList();
+            PacketList( const PacketList& ) = delete;
+            PacketList& operator=( const PacketList& ) = delete;
+            const Stats& stats() const;
+
+        protected:
+            template< typename T > T* append( Op op, uint8_t index );
+            void countCall();
+            void releaseBlocks();
+            template< typename F > void forEachPacket( F&& visit ) const;
+
+        private:
+            BlockPool* _pPool;
+            Block* _pFirst;
+            Block* _pLast;
+            Stats _stats;
+    };
+
+    // What the encoder has bound, as far as the list knows. A list makes no
+    // assumption about the encoder it will be flushed into, so every binding
+    // starts out unknown.
+    struct BindingState
+    {
+        void* pObjects[ kMaxBindings ];
+        uint64_t offsets[ kMaxBindings ];
+
+        void reset();
+        bool bind( uint32_t index, void* pObject, uint64_t offset );
+    };
+
+    template< typename _Api >
+    class RenderList : public PacketList
+    {
+        public:
+            explicit RenderList( BlockPool* pPool );
+            void setRenderPipelineState( typename _Api::RenderPipelineState* pState );
+            void setDepthStencilState( typename _Api::DepthStencilState* pState );
+            void setCullMode( typename _Api::CullMode cullMode );
+            void setFrontFacingWinding( typename _Api::Winding winding );
+            void setVertexBuffer( typename _Api::Buffer* pBuffer, uint64_t offset, uint32_t index );
+            void setFragmentTexture( typename _Api::Texture* pTexture, uint32_t index );
+            void drawIndexedPrimitives( typename _Api::PrimitiveType primitiveType, uint64_t indexCount, typename _Api::IndexType indexType,
+                                        typename _Api::Buffer* pIndexBuffer, uint64_t indexBufferOffset, uint64_t instanceCount );
+            template< typename _Encoder > void flush( _Encoder* pEncoder ) const;
+            void reset();
+
+        private:
+            void* _pPipelineState;
+            void* _pDepthStencilState;
+            uint32_t _cullMode;
+            uint32_t _winding;
+            BindingState _vertexBuffers;
+            BindingState _fragmentTextures;
+    };
+
+    template< typename _Api >
+    class ComputeList : public PacketList
+    {
+        public:
+            explicit ComputeList( BlockPool* pPool );
+            void setComputePipelineState( typename _Api::ComputePipelineState* pState );
+            void setBuffer( typename _Api::Buffer* pBuffer, uint64_t offset, uint32_t index );
+            void setTexture( typename _Api::Texture* pTexture, uint32_t index );
+            void dispatchThreads( typename _Api::Size threadsPerGrid, typename _Api::Size threadsPerThreadgroup );
+            void dispatchThreadgroups( typename _Api::Size threadgroupsPerGrid, typename _Api::Size threadsPerThreadgroup );
+            template< typename _Encoder > void flush( _Encoder* pEncoder ) const;
+            void reset();
+
+        private:
+            void dispatch( Op op, typename _Api::Size grid, typename _Api::Size threadgroup );
+
+            void* _pPipelineState;
+            BindingState _buffers;
+            BindingState _textures;
+    };
+}
+
+#pragma endregion Declarations }
+
+
+#pragma mark - Command List
+#pragma region Command List {
+
+namespace cmdlist
+{
+    // Marks state the list hasn't seen set yet
+    static void* const kUnknownObject = reinterpret_cast< void* >( UINTPTR_MAX );
+    static constexpr uint32_t kUnknownMode = UINT32_MAX;
+
+    inline BlockPool::BlockPool()
+    : _pFree( nullptr )
+    , _blockCount( 0 )
+    {
+    }
+
+    inline BlockPool::~BlockPool()
+    {
+        while ( _pFree )
+        {
+            Block* pNext = _pFree->pNext;
+            delete _pFree;
+            _pFree = pNext;
+        }
+    }
+
+    inline Block* BlockPool::acquire()
+    {
+        {
+            std::lock_guard< std::mutex > lock( _mutex );
+            if ( _pFree )
+            {
+                Block* pBlock = _pFree;
+                _pFree = pBlock->pNext;
+                pBlock->pNext = nullptr;
+                pBlock->used = 0;
+                return pBlock;
+            }
+            ++_blockCount;
+        }
+        Block* pBlock = new Block;
+        pBlock->pNext = nullptr;
+        pBlock->used = 0;
+        return pBlock;
+    }
+
+    inline void BlockPool::release( Block* pBlocks )
+    {
+        if ( !pBlocks )
+        {
+            return;
+        }
+        Block* pLast = pBlocks;
+        while ( pLast->pNext )
+        {
+            pLast = pLast->pNext;
+        }
+        std::lock_guard< std::mutex > lock( _mutex );
+        pLast->pNext = _pFree;
+        _pFree = pBlocks;
+    }
+
+    inline size_t BlockPool::blockCount() const
+    {
+        std::lock_guard< std::mutex > lock( _mutex );
+        return _blockCount;
+    }
+
+    inline PacketList::PacketList( BlockPool* pPool )
+    : _pPool( pPool )
+    , _pFirst( nullptr )
+    , _pLast( nullptr )
+    , _stats{}
+    {
+    }
+
+    inline PacketList::~PacketList()
+    {
+        releaseBlocks();
+    }
+
+    inline const Stats& PacketList::stats() const
+    {
+        return _stats;
+    }
+
+    template< typename T >
+    inline T* PacketList::append( Op op, uint8_t index )
+    {
+        static_assert( alignof( T ) <= kPacketAlignment, "packets must fit the packet alignment" );
+        constexpr size_t kStride = (sizeof( T ) + kPacketAlignment - 1) & ~(kPacketAlignment - 1);
+
+        if ( !_pLast || _pLast->used + kStride > kBlockSize )
+        {
+            Block* pBlock = _pPool->acquire();
+            if ( _pLast )
+            {
+                _pLast->pNext = pBlock;
+            }
+            else
+            {
+                _pFirst = pBlock;
+            }
+            _pLast = pBlock;
+        }
+
+        T* pPacket = reinterpret_cast< T* >( _pLast->data + _pLast->used );
+        pPacket->header = Packet{ op, index, (uint16_t)kStride };
+        _pLast->used += kStride;
+        _stats.packets += 1;
+        _stats.bytes += kStride;
+        return pPacket;
+    }
+
+    inline void PacketList::countCall()
+    {
+        _stats.recordedCalls += 1;
+    }
+
+    inline void PacketList::releaseBlocks()
+    {
+        _pPool->release( _pFirst );
+        _pFirst = nullptr;
+        _pLast = nullptr;
+        _stats = {};
+    }
+
+    template< typename F >
+    inline void PacketList::forEachPacket( F&& visit ) const
+    {
+        for ( const Block* pBlock = _pFirst; pBlock; pBlock = pBlock->pNext )
+        {
+            const uint8_t* pCursor = pBlock->data;
+            const uint8_t* pEnd = pBlock->data + pBlock->used;
+            while ( pCursor < pEnd )
+            {
+                const Packet* pPacket = reinterpret_cast< const Packet* >( pCursor );
+                visit( pPacket );
+                pCursor += pPacket->size;
+            }
+        }
+    }
+
+    inline void BindingState::reset()
+    {
+        for ( uint32_t i = 0; i < kMaxBindings; ++i )
+        {
+            pObjects[ i ] = kUnknownObject;
+            offsets[ i ] = 0;
+        }
+    }
+
+    // Returns false when the binding is already in place. Indices past
+    // kMaxBindings are never tracked, so they are always recorded.
+    inline bool BindingState::bind( uint32_t index, void* pObject, uint64_t offset )
+    {
+        if ( index >= kMaxBindings )
+        {
+            return true;
+        }
+        if ( pObjects[ index ] == pObject && offsets[ index ] == offset )
+        {
+            return false;
+        }
+        pObjects[ index ] = pObject;
+        offsets[ index ] = offset;
+        return true;
+    }
+
+#pragma mark - RenderList
+
+    template< typename _Api >
+    RenderList< _Api >::RenderList( BlockPool* pPool )
+    : PacketList( pPool )
+    {
+        reset();
+    }
+
+    template< typename _Api >
+    void RenderList< _Api >::reset()
+    {
+        releaseBlocks();
+        _pPipelineState = kUnknownObject;
+        _pDepthStencilState = kUnknownObject;
+        _cullMode = kUnknownMode;
+        _winding = kUnknownMode;
+        _vertexBuffers.reset();
+        _fragmentTextures.reset();
+    }
+
+    template< typename _Api >
+    void RenderList< _Api >::setRenderPipelineState( typename _Api::RenderPipelineState* pState )
+    {
+        countCall();
+        if ( _pPipelineState != pState )
+        {
+            _pPipelineState = pState;
+            append< StatePacket >( Op::SetRenderPipelineState, 0 )->pObject = pState;
+        }
+    }
+
+    template< typename _Api >
+    void RenderList< _Api >::setDepthStencilState( typename _Api::DepthStencilState* pState )
+    {
+        countCall();
+        if ( _pDepthStencilState != pState )
+        {
+            _pDepthStencilState = pState;
+            append< StatePacket >( Op::SetDepthStencilState, 0 )->pObject = pState;
+        }
+    }
+
+    template< typename _Api >
+    void RenderList< _Api >::setCullMode( typename _Api::CullMode cullMode )
+    {
+        countCall();
+        if ( _cullMode != (uint32_t)cullMode )
+        {
+            _cullMode = (uint32_t)cullMode;
+            append< ModePacket >( Op::SetCullMode, 0 )->mode = _cullMode;
+        }
+    }
+
+    template< typename _Api >
+    void RenderList< _Api >::setFrontFacingWinding( typename _Api::Winding winding )
+    {
+        countCall();
+        if ( _winding != (uint32_t)winding )
+        {
+            _winding = (uint32_t)winding;
+            append< ModePacket >( Op::SetFrontFacingWinding, 0 )->mode = _winding;
+        }
+    }
+
+    template< typename _Api >
+    void RenderList< _Api >::setVertexBuffer( typename _Api::Buffer* pBuffer, uint64_t offset, uint32_t index )
+    {
+        countCall();
+        if ( _vertexBuffers.bind( index, pBuffer, offset ) )
+        {
+            BindPacket* pPacket = append< BindPacket >( Op::SetVertexBuffer, (uint8_t)index );
+            pPacket->pObject = pBuffer;
+            pPacket->offset = offset;
+        }
+    }
+
+    template< typename _Api >
+    void RenderList< _Api >::setFragmentTexture( typename _Api::Texture* pTexture, uint32_t index )
+    {
+        countCall();
+        if ( _fragmentTextures.bind( index, pTexture, 0 ) )
+        {
+            BindPacket* pPacket = append< BindPacket >( Op::SetFragmentTexture, (uint8_t)index );
+            pPacket->pObject = pTexture;
+            pPacket->offset = 0;
+        }
+    }
+
+    template< typename _Api >
+    void RenderList< _Api >::drawIndexedPrimitives( typename _Api::PrimitiveType primitiveType, uint64_t indexCount, typename _Api::IndexType indexType,
+                                                    typename _Api::Buffer* pIndexBuffer, uint64_t indexBufferOffset, uint64_t instanceCount )
+    {
+        countCall();
+        DrawIndexedPacket* pPacket = append< DrawIndexedPacket >( Op::DrawIndexedPrimitives, 0 );
+        pPacket->primitiveType = (uint32_t)primitiveType;
+        pPacket->indexType = (uint32_t)indexType;
+        pPacket->indexCount = (uint32_t)indexCount;
+        pPacket->instanceCount = (uint32_t)instanceCount;
+        pPacket->pIndexBuffer = pIndexBuffer;
+        pPacket->indexBufferOffset = indexBufferOffset;
+    }
+
+    template< typename _Api >
+    template< typename _Encoder >
+    void RenderList< _Api >::flush( _Encoder* pEncoder ) const
+    {
+        forEachPacket( [pEncoder]( const Packet* pPacket ) {
+            switch ( pPacket->op )
+            {
+                case Op::SetRenderPipelineState:
+                    pEncoder->setRenderPipelineState( static_cast< typename _Api::RenderPipelineState* >( reinterpret_cast< const StatePacket* >( pPacket )->pObject ) );
+                    break;
+                case Op::SetDepthStencilState:
+                    pEncoder->setDepthStencilState( static_cast< typename _Api::DepthStencilState* >( reinterpret_cast< const StatePacket* >( pPacket )->pObject ) );
+                    break;
+                case Op::SetCullMode:
+                    pEncoder->setCullMode( (typename _Api::CullMode)reinterpret_cast< const ModePacket* >( pPacket )->mode );
+                    break;
+                case Op::SetFrontFacingWinding:
+                    pEncoder->setFrontFacingWinding( (typename _Api::Winding)reinterpret_cast< const ModePacket* >( pPacket )->mode );
+                    break;
+                case Op::SetVertexBuffer:
+                {
+                    const BindPacket* pBind = reinterpret_cast< const BindPacket* >( pPacket );
+                    pEncoder->setVertexBuffer( static_cast< typename _Api::Buffer* >( pBind->pObject ), pBind->offset, pPacket->index );
+                    break;
+                }
+                case Op::SetFragmentTexture:
+                {
+                    const BindPacket* pBind = reinterpret_cast< const BindPacket* >( pPacket );
+                    pEncoder->setFragmentTexture( static_cast< typename _Api::Texture* >( pBind->pObject ), pPacket->index );
+                    break;
+                }
+                case Op::DrawIndexedPrimitives:
+                {
+                    const DrawIndexedPacket* pDraw = reinterpret_cast< const DrawIndexedPacket* >( pPacket );
+                    pEncoder->drawIndexedPrimitives( (typename _Api::PrimitiveType)pDraw->primitiveType, pDraw->indexCount,
+                                                     (typename _Api::IndexType)pDraw->indexType,
+                                                     static_cast< typename _Api::Buffer* >( pDraw->pIndexBuffer ), pDraw->indexBufferOffset,
+                                                     pDraw->instanceCount );
+                    break;
+                }
+                default:
+                    break;
+            }
+        } );
+    }
+
+#pragma mark - ComputeList
+
+    template< typename _Api >
+    ComputeList< _Api >::ComputeList( BlockPool* pPool )
+    : PacketList( pPool )
+    {
+        reset();
+    }
+
+    template< typename _Api >
+    void ComputeList< _Api >::reset()
+    {
+        releaseBlocks();
+        _pPipelineState = kUnknownObject;
+        _buffers.reset();
+        _textures.reset();
+    }
+
+    template< typename _Api >
+    void ComputeList< _Api >::setComputePipelineState( typename _Api::ComputePipelineState* pState )
+    {
+        countCall();
+        if ( _pPipelineState != pState )
+        {
+            _pPipelineState = pState;
+            append< StatePacket >( Op::SetComputePipelineState, 0 )->pObject = pState;
+        }
+    }
+
+    template< typename _Api >
+    void ComputeList< _Api >::setBuffer( typename _Api::Buffer* pBuffer, uint64_t offset, uint32_t index )
+    {
+        countCall();
+        if ( _buffers.bind( index, pBuffer, offset ) )
+        {
+            BindPacket* pPacket = append< BindPacket >( Op::SetComputeBuffer, (uint8_t)index );
+            pPacket->pObject = pBuffer;
+            pPacket->offset = offset;
+        }
+    }
+
+    template< typename _Api >
+    void ComputeList< _Api >::setTexture( typename _Api::Texture* pTexture, uint32_t index )
+    {
+        countCall();
+        if ( _textures.bind( index, pTexture, 0 ) )
+        {
+            BindPacket* pPacket = append< BindPacket >( Op::SetComputeTexture, (uint8_t)index );
+            pPacket->pObject = pTexture;
+            pPacket->offset = 0;
+        }
+    }
+
+    template< typename _Api >
+    void ComputeList< _Api >::dispatchThreads( typename _Api::Size threadsPerGrid, typename _Api::Size threadsPerThreadgroup )
+    {
+        dispatch( Op::DispatchThreads, threadsPerGrid, threadsPerThreadgroup );
+    }
+
+    template< typename _Api >
+    void ComputeList< _Api >::dispatchThreadgroups( typename _Api::Size threadgroupsPerGrid, typename _Api::Size threadsPerThreadgroup )
+    {
+        dispatch( Op::DispatchThreadgroups, threadgroupsPerGrid, threadsPerThreadgroup );
+    }
+
+    template< typename _Api >
+    void ComputeList< _Api >::dispatch( Op op, typename _Api::Size grid, typename _Api::Size threadgroup )
+    {
+        countCall();
+        DispatchPacket* pPacket = append< DispatchPacket >( op, 0 );
+        pPacket->grid[0] = (uint32_t)grid.width;
+        pPacket->grid[1] = (uint32_t)grid.height;
+        pPacket->grid[2] = (uint32_t)grid.depth;
+        pPacket->threadgroup[0] = (uint32_t)threadgroup.width;
+        pPacket->threadgroup[1] = (uint32_t)threadgroup.height;
+        pPacket->threadgroup[2] = (uint32_t)threadgroup.depth;
+    }
+
+    template< typename _Api >
+    template< typename _Encoder >
+    void ComputeList< _Api >::flush( _Encoder* pEncoder ) const
+    {
+        forEachPacket( [pEncoder]( const Packet* pPacket ) {
+            switch ( pPacket->op )
+            {
+                case Op::SetComputePipelineState:
+                    pEncoder->setComputePipelineState( static_cast< typename _Api::ComputePipelineState* >( reinterpret_cast< const StatePacket* >( pPacket )->pObject ) );
+                    break;
+                case Op::SetComputeBuffer:
+                {
+                    const BindPacket* pBind = reinterpret_cast< const BindPacket* >( pPacket );
+                    pEncoder->setBuffer( static_cast< typename _Api::Buffer* >( pBind->pObject ), pBind->offset, pPacket->index );
+                    break;
+                }
+                case Op::SetComputeTexture:
+                {
+                    const BindPacket* pBind = reinterpret_cast< const BindPacket* >( pPacket );
+                    pEncoder->setTexture( static_cast< typename _Api::Texture* >( pBind->pObject ), pPacket->index );
+                    break;
+                }
+                case Op::DispatchThreads:
+                case Op::DispatchThreadgroups:
+                {
+                    const DispatchPacket* pDispatch = reinterpret_cast< const DispatchPacket* >( pPacket );
+                    typename _Api::Size grid( pDispatch->grid[0], pDispatch->grid[1], pDispatch->grid[2] );
+                    typename _Api::Size threadgroup( pDispatch->threadgroup[0], pDispatch->threadgroup[1], pDispatch->threadgroup[2] );
+                    if ( pPacket->op == Op::DispatchThreads )
+                    {
+                        pEncoder->dispatchThreads( grid, threadgroup );
+                    }
+                    else
+                    {
+                        pEncoder->dispatchThreadgroups( grid, threadgroup );
+                    }
+                    break;
+                }
+                default:
+                    break;
+            }
+        } );
+    }
+}
+
+#pragma endregion Command List }
@@ -0,0 +1,290 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Drives completion::Pool with a fake command buffer, completing frames on
+// other threads the way Metal calls completed handlers. It counts heap
+// allocations per frame against a handler held in a std::function, and checks
+// that Submission ordering runs callbacks in the order frames were armed,
+// whichever order they complete in.
+
+#include "../completion-pool/completion-pool.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr uint32_t kFramesInFlight = 3;
+static constexpr size_t kFrames = 200000;
+
+static std::atomic< size_t > s_allocations{ 0 };
+
+void* operator new( size_t size )
+{
+    s_allocations.fetch_add( 1, std::memory_order_relaxed );
+    if ( void* p = malloc( size ) )
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete( void* p ) noexcept
+{
+    free( p );
+}
+
+void operator delete( void* p, size_t ) noexcept
+{
+    free( p );
+}
+
+#pragma region Declarations {
+
+class FakeCommandBuffer
+{
+    public:
+        FakeCommandBuffer* retain() { _retainCount.fetch_add( 1, std::memory_order_relaxed ); return this; }
+        void release() { _retainCount.fetch_sub( 1, std::memory_order_relaxed ); }
+        int retainCount() const { return _retainCount.load( std::memory_order_relaxed ); }
+
+        uint64_t frame;
+
+    private:
+        std::atomic< int > _retainCount{ 0 };
+};
+
+using FramePool = completion::Pool< FakeCommandBuffer, kFramesInFlight >;
+
+// What a renderer keeps for its frames in flight
+struct Frames
+{
+    FakeCommandBuffer commandBuffers[ kFramesInFlight ];
+    std::atomic< uint64_t > completed{ 0 };
+    std::atomic< uint64_t > lastFrame{ 0 };
+    std::atomic< bool > inOrder{ true };
+};
+
+#pragma endregion Declarations }
+
+
+#pragma mark - Benchmark
+#pragma region Benchmark {
+
+static void frameCompleted( void* pContext, uint32_t slot, FakeCommandBuffer* pCmd )
+{
+    Frames* pFrames = static_cast< Frames* >( pContext );
+    if ( pCmd != &pFrames->commandBuffers[ slot ] || pCmd->frame != pFrames->lastFrame.load( std::memory_order_relaxed ) + 1 )
+    {
+        pFrames->inOrder.store( false, std::memory_order_relaxed );
+    }
+    pFrames->lastFrame.store( pCmd->frame, std::memory_order_relaxed );
+    pFrames->completed.fetch_add( 1, std::memory_order_release );
+}
+
+// Arms frames on this thread and completes them on another, with at most
+// kFramesInFlight outstanding, as the frame semaphore would allow.
+static double runPool( FramePool* pPool, Frames* pFrames, size_t* pAllocations )
+{
+    std::atomic< uint64_t > submitted{ 0 };
+    std::thread gpu( [&]() {
+        for ( uint64_t frame = 1; frame <= kFrames; ++frame )
+        {
+            while ( submitted.load( std::memory_order_acquire ) < frame )
+            {
+                std::this_thread::yield();
+            }
+            uint32_t slot = (uint32_t)( frame % kFramesInFlight );
+            pPool->complete( slot, &pFrames->commandBuffers[ slot ] );
+        }
+    } );
+
+    size_t allocationsBefore = s_allocations.load();
+    Clock::time_point start = Clock::now();
+    for ( uint64_t frame = 1; frame <= kFrames; ++frame )
+    {
+        while ( frame > pFrames->completed.load( std::memory_order_acquire ) + kFramesInFlight )
+        {
+            std::this_thread::yield();
+        }
+        uint32_t slot = (uint32_t)( frame % kFramesInFlight );
+        pFrames->commandBuffers[ slot ].frame = frame;
+        pPool->arm( slot, frameCompleted, pFrames );
+        submitted.store( frame, std::memory_order_release );
+    }
+    gpu.join();
+    Clock::time_point end = Clock::now();
+    *pAllocations = s_allocations.load() - allocationsBefore;
+    return (double)std::chrono::duration_cast< std::chrono::nanoseconds >( end - start ).count() / kFrames;
+}
+
+// The same frames with a handler that captures its state, as the
+// std::function overload of addCompletedHandler() does.
+static double runFunction( Frames* pFrames, size_t* pAllocations )
+{
+    std::atomic< uint64_t > submitted{ 0 };
+    std::function< void( FakeCommandBuffer* ) >* handlers[ kFramesInFlight ] = {};
+    std::thread gpu( [&]() {
+        for ( uint64_t frame = 1; frame <= kFrames; ++frame )
+        {
+            while ( submitted.load( std::memory_order_acquire ) < frame )
+            {
+                std::this_thread::yield();
+            }
+            uint32_t slot = (uint32_t)( frame % kFramesInFlight );
+            std::function< void( FakeCommandBuffer* ) >* pHandler = handlers[ slot ];
+            (*pHandler)( &pFrames->commandBuffers[ slot ] );
+            delete pHandler;
+        }
+    } );
+
+    size_t allocationsBefore = s_allocations.load();
+    Clock::time_point start = Clock::now();
+    for ( uint64_t frame = 1; frame <= kFrames; ++frame )
+    {
+        while ( frame > pFrames->completed.load( std::memory_order_acquire ) + kFramesInFlight )
+        {
+            std::this_thread::yield();
+        }
+        uint32_t slot = (uint32_t)( frame % kFramesInFlight );
+        pFrames->commandBuffers[ slot ].frame = frame;
+        double submitTime = 0.0;
+        handlers[ slot ] = new std::function< void( FakeCommandBuffer* ) >( [pFrames, slot, frame, submitTime]( FakeCommandBuffer* pCmd ) {
+            (void)frame;
+            (void)submitTime;
+            frameCompleted( pFrames, slot, pCmd );
+        } );
+        submitted.store( frame, std::memory_order_release );
+    }
+    gpu.join();
+    Clock::time_point end = Clock::now();
+    *pAllocations = s_allocations.load() - allocationsBefore;
+    return (double)std::chrono::duration_cast< std::chrono::nanoseconds >( end - start ).count() / kFrames;
+}
+
+// Completes three frames in every order and checks the callbacks still run
+// in the order the frames were armed, and that held command buffers are
+// released again.
+static bool checkSubmissionOrder()
+{
+    static const uint32_t kOrders[ 6 ][ kFramesInFlight ] = { { 0, 1, 2 }, { 0, 2, 1 }, { 1, 0, 2 }, { 1, 2, 0 }, { 2, 0, 1 }, { 2, 1, 0 } };
+
+    bool ok = true;
+    for ( const uint32_t* pOrder : kOrders )
+    {
+        FramePool pool( completion::Ordering::Submission );
+        Frames frames;
+        for ( uint32_t slot = 0; slot < kFramesInFlight; ++slot )
+        {
+            frames.commandBuffers[ slot ].frame = slot + 1;
+            pool.arm( slot, frameCompleted, &frames );
+        }
+        for ( uint32_t i = 0; i < kFramesInFlight; ++i )
+        {
+            pool.complete( pOrder[ i ], &frames.commandBuffers[ pOrder[ i ] ] );
+        }
+        ok = ok && frames.inOrder.load() && frames.completed.load() == kFramesInFlight;
+        for ( const FakeCommandBuffer& cmd : frames.commandBuffers )
+        {
+            ok = ok && cmd.retainCount() == 0;
+        }
+    }
+    return ok;
+}
+
+// Completes frames from several threads at once, so they arrive out of order
+static bool checkConcurrentCompletion()
+{
+    FramePool pool( completion::Ordering::Submission );
+    Frames frames;
+    std::atomic< uint64_t > submitted{ 0 };
+    std::vector< std::thread > threads;
+    for ( uint32_t t = 0; t < kFramesInFlight; ++t )
+    {
+        threads.emplace_back( [&, t]() {
+            for ( uint64_t frame = 1; frame <= kFrames / 10; ++frame )
+            {
+                if ( frame % kFramesInFlight != t )
+                {
+                    continue;
+                }
+                while ( submitted.load( std::memory_order_acquire ) < frame )
+                {
+                    std::this_thread::yield();
+                }
+                pool.complete( t, &frames.commandBuffers[ t ] );
+            }
+        } );
+    }
+    for ( uint64_t frame = 1; frame <= kFrames / 10; ++frame )
+    {
+        while ( frame > frames.completed.load( std::memory_order_acquire ) + kFramesInFlight )
+        {
+            std::this_thread::yield();
+        }
+        uint32_t slot = (uint32_t)( frame % kFramesInFlight );
+        frames.commandBuffers[ slot ].frame = frame;
+        pool.arm( slot, frameCompleted, &frames );
+        submitted.store( frame, std::memory_order_release );
+    }
+    for ( std::thread& thread : threads )
+    {
+        thread.join();
+    }
+    return frames.inOrder.load() && frames.completed.load() == kFrames / 10;
+}
+
+int main()
+{
+    size_t poolAllocations = 0;
+    size_t functionAllocations = 0;
+
+    FramePool asCompleted( completion::Ordering::AsCompleted );
+    Frames poolFrames;
+    double poolNs = runPool( &asCompleted, &poolFrames, &poolAllocations );
+
+    FramePool submission( completion::Ordering::Submission );
+    Frames orderedFrames;
+    size_t orderedAllocations = 0;
+    double orderedNs = runPool( &submission, &orderedFrames, &orderedAllocations );
+
+    Frames functionFrames;
+    double functionNs = runFunction( &functionFrames, &functionAllocations );
+
+    __builtin_printf( "%zu frames, %u in flight\n", kFrames, kFramesInFlight );
+    __builtin_printf( "  std::function handler:     %.3f allocations, %.1f ns per frame\n", (double)functionAllocations / kFrames, functionNs );
+    __builtin_printf( "  pool, as completed:        %.3f allocations, %.1f ns per frame\n", (double)poolAllocations / kFrames, poolNs );
+    __builtin_printf( "  pool, submission order:    %.3f allocations, %.1f ns per frame\n", (double)orderedAllocations / kFrames, orderedNs );
+
+    bool ok = poolAllocations == 0 && orderedAllocations == 0;
+    ok = ok && poolFrames.inOrder.load() && orderedFrames.inOrder.load() && functionFrames.inOrder.load();
+    bool orderOk = checkSubmissionOrder();
+    bool concurrentOk = checkConcurrentCompletion();
+    __builtin_printf( "  submission order:          %s\n", orderOk ? "ok" : "FAILED" );
+    __builtin_printf( "  concurrent completion:     %s\n", concurrentOk ? "ok" : "FAILED" );
+
+    return ok && orderOk && concurrentOk ? 0 : 1;
+}
+
+#pragma endregion Benchmark }
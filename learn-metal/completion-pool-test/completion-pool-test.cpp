@@ -0,0 +1,225 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tests completion::Pool with a fake command buffer that counts its retains.
+// The tests call complete() directly, in the orders Metal could report
+// completions in, and check which callbacks have run after each one.
+
+#include "../test-support/check.hpp"
+#include "../completion-pool/completion-pool.hpp"
+
+#include <vector>
+
+static constexpr uint32_t kSlotCount = 3;
+
+class FakeCommandBuffer
+{
+    public:
+        FakeCommandBuffer* retain() { ++retainCount; return this; }
+        void release() { --retainCount; }
+
+        uint64_t frame = 0;
+        int retainCount = 0;
+};
+
+using TestPool = completion::Pool< FakeCommandBuffer, kSlotCount >;
+
+struct Frames
+{
+    TestPool* pPool;
+    FakeCommandBuffer commandBuffers[ kSlotCount ];
+    std::vector< uint64_t > completed;
+    bool matchingBuffers = true;
+    bool rearm = false;
+};
+
+static void frameCompleted( void* pContext, uint32_t slot, FakeCommandBuffer* pCmd )
+{
+    Frames* pFrames = static_cast< Frames* >( pContext );
+    pFrames->matchingBuffers = pFrames->matchingBuffers && pCmd == &pFrames->commandBuffers[ slot ];
+    pFrames->completed.push_back( pCmd->frame );
+    if ( pFrames->rearm )
+    {
+        // arm() asserts that the slot is free:
+        pFrames->pPool->arm( slot, frameCompleted, pFrames );
+    }
+}
+
+// Arms frames 1 to kSlotCount, one per slot
+static void armFrames( TestPool* pPool, Frames* pFrames )
+{
+    pFrames->pPool = pPool;
+    for ( uint32_t slot = 0; slot < kSlotCount; ++slot )
+    {
+        pFrames->commandBuffers[ slot ].frame = slot + 1;
+        pPool->arm( slot, frameCompleted, pFrames );
+    }
+}
+
+static void testOrdering()
+{
+    TestPool asCompleted( completion::Ordering::AsCompleted );
+    TestPool submission( completion::Ordering::Submission );
+    CHECK( asCompleted.ordering() == completion::Ordering::AsCompleted );
+    CHECK( submission.ordering() == completion::Ordering::Submission );
+}
+
+static void testSubmissionOrder()
+{
+    static const uint32_t kOrders[ 6 ][ kSlotCount ] = { { 0, 1, 2 }, { 0, 2, 1 }, { 1, 0, 2 }, { 1, 2, 0 }, { 2, 0, 1 }, { 2, 1, 0 } };
+
+    for ( const uint32_t* pOrder : kOrders )
+    {
+        TestPool pool( completion::Ordering::Submission );
+        Frames frames;
+        armFrames( &pool, &frames );
+
+        // After each completion, every frame up to the first one still
+        // outstanding has run, and no other:
+        bool done[ kSlotCount ] = {};
+        for ( uint32_t i = 0; i < kSlotCount; ++i )
+        {
+            pool.complete( pOrder[ i ], &frames.commandBuffers[ pOrder[ i ] ] );
+            done[ pOrder[ i ] ] = true;
+            size_t expected = 0;
+            while ( expected < kSlotCount && done[ expected ] )
+            {
+                ++expected;
+            }
+            CHECK( frames.completed.size() == expected );
+        }
+
+        CHECK( (frames.completed == std::vector< uint64_t >{ 1, 2, 3 }) );
+        CHECK( frames.matchingBuffers );
+    }
+}
+
+static void testAsCompletedOrder()
+{
+    TestPool pool( completion::Ordering::AsCompleted );
+    Frames frames;
+    armFrames( &pool, &frames );
+    pool.complete( 2, &frames.commandBuffers[ 2 ] );
+    pool.complete( 0, &frames.commandBuffers[ 0 ] );
+    pool.complete( 1, &frames.commandBuffers[ 1 ] );
+    CHECK( (frames.completed == std::vector< uint64_t >{ 3, 1, 2 }) );
+    CHECK( frames.matchingBuffers );
+    for ( const FakeCommandBuffer& commandBuffer : frames.commandBuffers )
+    {
+        CHECK( commandBuffer.retainCount == 0 );
+    }
+}
+
+// A command buffer is retained while its callback waits for an earlier
+// frame's, and released once it has run.
+static void testHeldBuffersRetained()
+{
+    TestPool pool( completion::Ordering::Submission );
+    Frames frames;
+    armFrames( &pool, &frames );
+
+    pool.complete( 2, &frames.commandBuffers[ 2 ] );
+    CHECK( frames.completed.empty() );
+    CHECK( frames.commandBuffers[ 2 ].retainCount == 1 );
+
+    pool.complete( 1, &frames.commandBuffers[ 1 ] );
+    CHECK( frames.completed.empty() );
+    CHECK( frames.commandBuffers[ 1 ].retainCount == 1 );
+
+    // The first frame runs as it completes, so it's never retained:
+    pool.complete( 0, &frames.commandBuffers[ 0 ] );
+    CHECK( (frames.completed == std::vector< uint64_t >{ 1, 2, 3 }) );
+    for ( const FakeCommandBuffer& commandBuffer : frames.commandBuffers )
+    {
+        CHECK( commandBuffer.retainCount == 0 );
+    }
+}
+
+// A callback may let the submitting thread arm its slot again, so the slot
+// must be free by the time the callback runs, including for held frames.
+static void testSlotFreeBeforeCallback()
+{
+    for ( completion::Ordering ordering : { completion::Ordering::AsCompleted, completion::Ordering::Submission } )
+    {
+        TestPool pool( ordering );
+        Frames frames;
+        armFrames( &pool, &frames );
+        frames.rearm = true;
+
+        pool.complete( 1, &frames.commandBuffers[ 1 ] );
+        pool.complete( 0, &frames.commandBuffers[ 0 ] );
+        CHECK( frames.completed.size() == 2 );
+
+        // Each callback armed its slot again; completing it runs the callback
+        // once more:
+        frames.rearm = false;
+        pool.complete( 2, &frames.commandBuffers[ 2 ] );
+        pool.complete( 0, &frames.commandBuffers[ 0 ] );
+        pool.complete( 1, &frames.commandBuffers[ 1 ] );
+        CHECK( frames.completed.size() == 5 );
+    }
+}
+
+// Frames keep reusing the slots round robin while the GPU completes them out
+// of order within the frames in flight. Callbacks still run in frame order.
+static void testManyFrames()
+{
+    static const uint32_t kPattern[ kSlotCount ] = { 1, 2, 0 };
+    const uint64_t frameCount = 300;
+
+    TestPool pool( completion::Ordering::Submission );
+    Frames frames;
+    frames.pPool = &pool;
+
+    for ( uint64_t frame = 1; frame <= frameCount; ++frame )
+    {
+        uint32_t slot = (uint32_t)( (frame - 1) % kSlotCount );
+        frames.commandBuffers[ slot ].frame = frame;
+        pool.arm( slot, frameCompleted, &frames );
+
+        // Once all slots are in flight, complete them in a shuffled order
+        if ( frame % kSlotCount == 0 )
+        {
+            for ( uint32_t i = 0; i < kSlotCount; ++i )
+            {
+                pool.complete( kPattern[ i ], &frames.commandBuffers[ kPattern[ i ] ] );
+            }
+        }
+    }
+
+    bool inOrder = frames.completed.size() == frameCount;
+    for ( size_t i = 0; inOrder && i < frames.completed.size(); ++i )
+    {
+        inOrder = frames.completed[ i ] == i + 1;
+    }
+    CHECK( inOrder );
+    for ( const FakeCommandBuffer& commandBuffer : frames.commandBuffers )
+    {
+        CHECK( commandBuffer.retainCount == 0 );
+    }
+}
+
+int main()
+{
+    testOrdering();
+    testSubmissionOrder();
+    testAsCompletedOrder();
+    testHeldBuffersRetained();
+    testSlotFreeBeforeCallback();
+    testManyFrames();
+    return check::finish( "completion-pool-test" );
+}
@@ -0,0 +1,222 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Completion callbacks without per-frame allocations. Adding a block literal
+// that captures state as a completed handler copies it to the heap every
+// frame, and so does the std::function overload. A Pool instead copies one
+// handler block per frame slot when it is created. Each frame arms its slot
+// with a function pointer and a context, and attaches that slot's block. All
+// blocks call complete(), which runs the callback.
+//
+// The pool is a template over the command buffer type. Only attach() needs
+// blocks; without them, complete() can be called directly, which is how the
+// completion benchmark drives the pool with a fake command buffer.
+
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <mutex>
+
+#if defined( __BLOCKS__ )
+#include <Block.h>
+#endif
+
+#pragma region Declarations {
+
+namespace completion
+{
+    enum class Ordering : uint8_t
+    {
+        // Runs each callback on the thread that reports its completion
+        AsCompleted,
+        // Holds back callbacks until those of earlier frames have run
+        Submission
+    };
+
+    template< typename _CommandBuffer, uint32_t _SlotCount >
+    class Pool
+    {
+        public:
+            using Callback = void (*)( void* pContext, uint32_t slot, _CommandBuffer* pCommandBuffer );
+
+            explicit Pool( Ordering ordering );
+            ~Pool();
+            Pool( const Pool& ) = delete;
+            Pool& operator=( const Pool& ) = delete;
+
+            void arm( uint32_t slot, Callback callback, void* pContext );
+            void complete( uint32_t slot, _CommandBuffer* pCommandBuffer );
+#if defined( __BLOCKS__ )
+            void attach( _CommandBuffer* pCommandBuffer, uint32_t slot, Callback callback, void* pContext );
+#endif
+            Ordering ordering() const { return _ordering; }
+
+        private:
+            enum State : uint32_t { Free, Armed, Completed };
+
+            struct Slot
+            {
+                std::atomic< uint32_t > state;
+                uint64_t sequence;
+                Callback callback;
+                void* pContext;
+                _CommandBuffer* pCommandBuffer;
+            };
+
+            void run( uint32_t slot, _CommandBuffer* pCommandBuffer );
+            bool runNextInOrder();
+
+            Slot _slots[ _SlotCount ];
+            Ordering _ordering;
+            uint64_t _armed;
+            uint64_t _nextToRun;
+            std::mutex _mutex;
+#if defined( __BLOCKS__ )
+            void (^_handlers[ _SlotCount ])( _CommandBuffer* );
+#endif
+    };
+}
+
+#pragma endregion Declarations }
+
+
+#pragma mark - Completion Pool
+#pragma region Completion Pool {
+
+namespace completion
+{
+    template< typename _CommandBuffer, uint32_t _SlotCount >
+    Pool< _CommandBuffer, _SlotCount >::Pool( Ordering ordering )
+    : _ordering( ordering )
+    , _armed( 0 )
+    , _nextToRun( 0 )
+    {
+        for ( uint32_t i = 0; i < _SlotCount; ++i )
+        {
+            _slots[ i ].state.store( Free, std::memory_order_relaxed );
+            _slots[ i ].sequence = 0;
+            _slots[ i ].callback = nullptr;
+            _slots[ i ].pContext = nullptr;
+            _slots[ i ].pCommandBuffer = nullptr;
+#if defined( __BLOCKS__ )
+            Pool* pPool = this;
+            _handlers[ i ] = Block_copy( ^void( _CommandBuffer* pCommandBuffer ){
+                pPool->complete( i, pCommandBuffer );
+            });
+#endif
+        }
+    }
+
+    template< typename _CommandBuffer, uint32_t _SlotCount >
+    Pool< _CommandBuffer, _SlotCount >::~Pool()
+    {
+#if defined( __BLOCKS__ )
+        for ( uint32_t i = 0; i < _SlotCount; ++i )
+        {
+            Block_release( _handlers[ i ] );
+        }
+#endif
+    }
+
+    // Called on the submitting thread. The slot must have completed since it
+    // was last armed, which the frame semaphore already ensures.
+    template< typename _CommandBuffer, uint32_t _SlotCount >
+    void Pool< _CommandBuffer, _SlotCount >::arm( uint32_t slot, Callback callback, void* pContext )
+    {
+        assert( slot < _SlotCount );
+        Slot& s = _slots[ slot ];
+        assert( s.state.load( std::memory_order_acquire ) == Free );
+        s.sequence = _armed++;
+        s.callback = callback;
+        s.pContext = pContext;
+        s.pCommandBuffer = nullptr;
+        s.state.store( Armed, std::memory_order_release );
+    }
+
+#if defined( __BLOCKS__ )
+    template< typename _CommandBuffer, uint32_t _SlotCount >
+    void Pool< _CommandBuffer, _SlotCount >::attach( _CommandBuffer* pCommandBuffer, uint32_t slot, Callback callback, void* pContext )
+    {
+        arm( slot, callback, pContext );
+        pCommandBuffer->addCompletedHandler( _handlers[ slot ] );
+    }
+#endif
+
+    // The completed handler of every slot ends up here. Under Submission
+    // ordering, a command buffer whose callback has to wait is retained until
+    // the callback runs.
+    template< typename _CommandBuffer, uint32_t _SlotCount >
+    void Pool< _CommandBuffer, _SlotCount >::complete( uint32_t slot, _CommandBuffer* pCommandBuffer )
+    {
+        assert( slot < _SlotCount );
+        assert( _slots[ slot ].state.load( std::memory_order_acquire ) == Armed );
+        if ( _ordering == Ordering::AsCompleted )
+        {
+            run( slot, pCommandBuffer );
+            return;
+        }
+
+        std::lock_guard< std::mutex > lock( _mutex );
+        Slot& s = _slots[ slot ];
+        if ( s.sequence == _nextToRun )
+        {
+            ++_nextToRun;
+            run( slot, pCommandBuffer );
+            while ( runNextInOrder() )
+            {
+            }
+            return;
+        }
+        s.pCommandBuffer = pCommandBuffer->retain();
+        s.state.store( Completed, std::memory_order_release );
+    }
+
+    template< typename _CommandBuffer, uint32_t _SlotCount >
+    bool Pool< _CommandBuffer, _SlotCount >::runNextInOrder()
+    {
+        for ( uint32_t i = 0; i < _SlotCount; ++i )
+        {
+            Slot& s = _slots[ i ];
+            if ( s.state.load( std::memory_order_acquire ) == Completed && s.sequence == _nextToRun )
+            {
+                _CommandBuffer* pCommandBuffer = s.pCommandBuffer;
+                ++_nextToRun;
+                run( i, pCommandBuffer );
+                pCommandBuffer->release();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Frees the slot before the callback runs, since the callback may let the
+    // submitting thread arm it again.
+    template< typename _CommandBuffer, uint32_t _SlotCount >
+    void Pool< _CommandBuffer, _SlotCount >::run( uint32_t slot, _CommandBuffer* pCommandBuffer )
+    {
+        Slot& s = _slots[ slot ];
+        Callback callback = s.callback;
+        void* pContext = s.pContext;
+        s.pCommandBuffer = nullptr;
+        s.state.store( Free, std::memory_order_release );
+        callback( pContext, slot, pCommandBuffer );
+    }
+}
+
+#pragma endregion Completion Pool }
@@ -0,0 +1,195 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Cost per instance of the culling reference in culling.hpp and of comparing
+// its output with the GPU's, on the sample's 10x10x10 grid and on a larger
+// one, with stand-ins for the simd types. This is the CPU time
+// LEARN_METAL_VALIDATE_CULLING adds to each frame of 08-compute.
+
+#include "../culling/culling.hpp"
+
+#include <chrono>
+#include <cstdio>
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr int kIterations = 50;
+
+#pragma region Declarations {
+
+namespace host
+{
+    struct float4 { float x, y, z, w; };
+    struct float3x3 { float4 columns[3]; };
+    struct float4x4 { float4 columns[4]; };
+
+    float4x4 operator*( const float4x4& a, const float4x4& b );
+
+    struct InstanceSource
+    {
+        float4 offset;
+        uint32_t ix;
+        uint32_t iy;
+        uint32_t mesh;
+        float4 color;
+    };
+
+    struct InstanceData
+    {
+        float4x4 instanceTransform;
+        float3x3 instanceNormalTransform;
+        float4 instanceColor;
+    };
+
+    struct CullUniforms
+    {
+        float4x4 objectTransform;
+        float4 frustumPlanes[6];
+        float scale;
+        float boundingRadius;
+        uint32_t instanceCount;
+        uint32_t rowCount;
+    };
+
+    struct DrawArguments
+    {
+        uint32_t indexCount;
+        uint32_t instanceCount;
+        uint32_t indexStart;
+        int32_t baseVertex;
+        uint32_t baseInstance;
+    };
+
+    struct Types
+    {
+        using float3x3 = host::float3x3;
+        using float4 = host::float4;
+        using float4x4 = host::float4x4;
+        using InstanceSource = host::InstanceSource;
+        using InstanceData = host::InstanceData;
+        using CullUniforms = host::CullUniforms;
+        using DrawArguments = host::DrawArguments;
+
+        static float4 makeFloat4( float x, float y, float z, float w ) { return { x, y, z, w }; }
+        static float4x4 makeMatrix( float4 c0, float4 c1, float4 c2, float4 c3 ) { return { { c0, c1, c2, c3 } }; }
+        static float3x3 discardTranslation( const float4x4& m ) { return { { m.columns[0], m.columns[1], m.columns[2] } }; }
+    };
+}
+
+#pragma endregion Declarations }
+
+
+namespace host
+{
+    float4x4 operator*( const float4x4& a, const float4x4& b )
+    {
+        float4x4 result;
+        for ( int c = 0; c < 4; ++c )
+        {
+            const float4& v = b.columns[ c ];
+            const float4* m = a.columns;
+            result.columns[ c ] = { m[0].x * v.x + m[1].x * v.y + m[2].x * v.z + m[3].x * v.w,
+                                    m[0].y * v.x + m[1].y * v.y + m[2].y * v.z + m[3].y * v.w,
+                                    m[0].z * v.x + m[1].z * v.y + m[2].z * v.z + m[3].z * v.w,
+                                    m[0].w * v.x + m[1].w * v.y + m[2].w * v.z + m[3].w * v.w };
+        }
+        return result;
+    }
+}
+
+using host::Types;
+
+static const host::float4x4 kIdentity = { { { 1, 0, 0, 0 }, { 0, 1, 0, 0 }, { 0, 0, 1, 0 }, { 0, 0, 0, 1 } } };
+
+static host::float4x4 makeZRotate( float angle )
+{
+    return { { { cosf( angle ), sinf( angle ), 0, 0 }, { -sinf( angle ), cosf( angle ), 0, 0 }, { 0, 0, 1, 0 }, { 0, 0, 0, 1 } } };
+}
+
+// Nanoseconds per instance for culling a side x side x side grid, and for
+// comparing the result with a copy whose visible list is reversed
+static void measure( uint32_t side )
+{
+    const uint32_t instanceCount = side * side * side;
+    std::vector< host::InstanceSource > sources( instanceCount );
+    for ( uint32_t i = 0; i < instanceCount; ++i )
+    {
+        uint32_t ix = i % side;
+        uint32_t iy = (i / side) % side;
+        uint32_t iz = i / (side * side);
+        sources[ i ] = { { (float)ix - side / 2.f, (float)iy - side / 2.f, -(float)iz - 2.f, 0 }, ix, iy, 0, { 1, 1, 1, 1 } };
+    }
+
+    std::vector< host::float4x4 > rotations( 2 * side );
+    for ( uint32_t i = 0; i < side; ++i )
+    {
+        rotations[ i ] = makeZRotate( sinf( (float)i ) );
+        rotations[ side + i ] = makeZRotate( cosf( (float)i ) );
+    }
+
+    // A box around the middle of the grid:
+    const float half = side / 4.f;
+    host::CullUniforms uniforms;
+    uniforms.objectTransform = kIdentity;
+    uniforms.frustumPlanes[0] = { 1, 0, 0, half };
+    uniforms.frustumPlanes[1] = { -1, 0, 0, half };
+    uniforms.frustumPlanes[2] = { 0, 1, 0, half };
+    uniforms.frustumPlanes[3] = { 0, -1, 0, half };
+    uniforms.frustumPlanes[4] = { 0, 0, -1, -1.f };
+    uniforms.frustumPlanes[5] = { 0, 0, 1, 2 * half + 2.f };
+    uniforms.scale = 0.2f;
+    uniforms.boundingRadius = 0.5f * 0.2f * sqrtf( 3.f );
+    uniforms.instanceCount = instanceCount;
+    uniforms.rowCount = side;
+
+    uint32_t baseInstance = 0;
+    std::vector< host::InstanceData > instances( instanceCount );
+    std::vector< uint32_t > visible( instanceCount );
+    std::vector< float > margins( instanceCount );
+    host::DrawArguments arguments;
+
+    Clock::time_point start = Clock::now();
+    for ( int i = 0; i < kIterations; ++i )
+    {
+        cull::resetDrawArguments< Types >( &arguments, &baseInstance, 1, 36 );
+        cull::cullInstancesReference< Types >( uniforms, rotations.data(), sources.data(), instances.data(), visible.data(), &arguments, margins.data() );
+    }
+    Clock::time_point end = Clock::now();
+    const double cullTime = std::chrono::duration< double, std::nano >( end - start ).count() / ((double)kIterations * instanceCount);
+
+    std::vector< uint32_t > gpuVisible( visible.rbegin() + (instanceCount - arguments.instanceCount), visible.rend() );
+    gpuVisible.resize( instanceCount );
+    cull::Report report = {};
+    start = Clock::now();
+    for ( int i = 0; i < kIterations; ++i )
+    {
+        report = cull::compareResults< Types >( instances.data(), visible.data(), &arguments, margins.data(),
+                                                instances.data(), gpuVisible.data(), &arguments, instanceCount, 1 );
+    }
+    end = Clock::now();
+    const double compareTime = std::chrono::duration< double, std::nano >( end - start ).count() / ((double)kIterations * instanceCount);
+
+    __builtin_printf( "  %7u instances, %6u visible: cull %6.2f ns, compare %6.2f ns per instance%s\n",
+                      instanceCount, arguments.instanceCount, cullTime, compareTime, report.passed() ? "" : " (MISMATCH)" );
+}
+
+int main()
+{
+    measure( 10 );
+    measure( 50 );
+    return 0;
+}
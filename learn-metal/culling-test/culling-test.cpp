@@ -0,0 +1,323 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tests the culling reference in culling.hpp with stand-ins for the simd
+// types: which instances it keeps, how it fills each mesh's range of the
+// visible list, and what compareResults() accepts as a match for the GPU.
+
+#include "../test-support/check.hpp"
+#include "../culling/culling.hpp"
+
+#include <cstring>
+
+#pragma region Declarations {
+
+namespace host
+{
+    struct float4 { float x, y, z, w; };
+    struct float3x3 { float4 columns[3]; };
+    struct float4x4 { float4 columns[4]; };
+
+    float4x4 operator*( const float4x4& a, const float4x4& b );
+
+    struct InstanceSource
+    {
+        float4 offset;
+        uint32_t ix;
+        uint32_t iy;
+        uint32_t mesh;
+        float4 color;
+    };
+
+    struct InstanceData
+    {
+        float4x4 instanceTransform;
+        float3x3 instanceNormalTransform;
+        float4 instanceColor;
+    };
+
+    struct CullUniforms
+    {
+        float4x4 objectTransform;
+        float4 frustumPlanes[6];
+        float scale;
+        float boundingRadius;
+        uint32_t instanceCount;
+        uint32_t rowCount;
+    };
+
+    struct DrawArguments
+    {
+        uint32_t indexCount;
+        uint32_t instanceCount;
+        uint32_t indexStart;
+        int32_t baseVertex;
+        uint32_t baseInstance;
+    };
+
+    struct Types
+    {
+        using float3x3 = host::float3x3;
+        using float4 = host::float4;
+        using float4x4 = host::float4x4;
+        using InstanceSource = host::InstanceSource;
+        using InstanceData = host::InstanceData;
+        using CullUniforms = host::CullUniforms;
+        using DrawArguments = host::DrawArguments;
+
+        static float4 makeFloat4( float x, float y, float z, float w ) { return { x, y, z, w }; }
+        static float4x4 makeMatrix( float4 c0, float4 c1, float4 c2, float4 c3 ) { return { { c0, c1, c2, c3 } }; }
+        static float3x3 discardTranslation( const float4x4& m ) { return { { m.columns[0], m.columns[1], m.columns[2] } }; }
+    };
+}
+
+#pragma endregion Declarations }
+
+
+namespace host
+{
+    float4x4 operator*( const float4x4& a, const float4x4& b )
+    {
+        float4x4 result;
+        for ( int c = 0; c < 4; ++c )
+        {
+            const float4& v = b.columns[ c ];
+            const float4* m = a.columns;
+            result.columns[ c ] = { m[0].x * v.x + m[1].x * v.y + m[2].x * v.z + m[3].x * v.w,
+                                    m[0].y * v.x + m[1].y * v.y + m[2].y * v.z + m[3].y * v.w,
+                                    m[0].z * v.x + m[1].z * v.y + m[2].z * v.z + m[3].z * v.w,
+                                    m[0].w * v.x + m[1].w * v.y + m[2].w * v.z + m[3].w * v.w };
+        }
+        return result;
+    }
+}
+
+using host::Types;
+
+static constexpr uint32_t kInstanceCount = 21;
+static constexpr uint32_t kIndexCount = 36;
+static constexpr float kRadius = 0.5f;
+
+static const host::float4x4 kIdentity = { { { 1, 0, 0, 0 }, { 0, 1, 0, 0 }, { 0, 0, 1, 0 }, { 0, 0, 0, 1 } } };
+
+// A row of instances at x = -10 to 10, assigned to meshes in turn. The planes
+// keep -4.5 <= x <= 4.5 and leave y and z open. With the radius, x = -5 to 5
+// are visible, and the spheres at -5 and 5 touch the planes.
+struct Scene
+{
+    Scene( uint32_t meshCount )
+    : meshCount( meshCount )
+    , sources( kInstanceCount )
+    , baseInstances( meshCount )
+    , rotations( 2, kIdentity )
+    {
+        for ( uint32_t i = 0; i < kInstanceCount; ++i )
+        {
+            sources[ i ] = { { (float)i - 10.f, 0, -10.f, 0 }, 0, 0, i % meshCount, { 1, 1, 1, 1 } };
+        }
+        uniforms.objectTransform = kIdentity;
+        uniforms.frustumPlanes[0] = { 1, 0, 0, 4.5f };
+        uniforms.frustumPlanes[1] = { -1, 0, 0, 4.5f };
+        uniforms.frustumPlanes[2] = { 0, 1, 0, 100 };
+        uniforms.frustumPlanes[3] = { 0, -1, 0, 100 };
+        uniforms.frustumPlanes[4] = { 0, 0, 1, 100 };
+        uniforms.frustumPlanes[5] = { 0, 0, -1, 100 };
+        uniforms.scale = 1.f;
+        uniforms.boundingRadius = kRadius;
+        uniforms.instanceCount = kInstanceCount;
+        uniforms.rowCount = 1;
+        cull::assignBaseInstances< Types >( sources.data(), kInstanceCount, baseInstances.data(), meshCount );
+    }
+
+    void run( host::InstanceData* pInstances, uint32_t* pVisible, host::DrawArguments* pArguments, float* pMargins ) const
+    {
+        cull::resetDrawArguments< Types >( pArguments, baseInstances.data(), meshCount, kIndexCount );
+        cull::cullInstancesReference< Types >( uniforms, rotations.data(), sources.data(), pInstances, pVisible, pArguments, pMargins );
+    }
+
+    uint32_t meshCount;
+    std::vector< host::InstanceSource > sources;
+    std::vector< uint32_t > baseInstances;
+    std::vector< host::float4x4 > rotations;
+    host::CullUniforms uniforms;
+};
+
+struct Results
+{
+    Results( uint32_t meshCount )
+    : instances( kInstanceCount )
+    , visible( kInstanceCount )
+    , arguments( meshCount )
+    , margins( kInstanceCount )
+    {
+    }
+
+    std::vector< host::InstanceData > instances;
+    std::vector< uint32_t > visible;
+    std::vector< host::DrawArguments > arguments;
+    std::vector< float > margins;
+};
+
+static cull::Report compare( const Results& reference, const Results& gpu, uint32_t meshCount )
+{
+    return cull::compareResults< Types >( reference.instances.data(), reference.visible.data(), reference.arguments.data(), reference.margins.data(),
+                                          gpu.instances.data(), gpu.visible.data(), gpu.arguments.data(), kInstanceCount, meshCount );
+}
+
+static void testCulling()
+{
+    Scene scene( 1 );
+    Results results( 1 );
+    scene.run( results.instances.data(), results.visible.data(), results.arguments.data(), results.margins.data() );
+
+    CHECK( results.arguments[0].indexCount == kIndexCount );
+    CHECK( results.arguments[0].instanceCount == 11 );
+    for ( uint32_t i = 0; i < 11; ++i )
+    {
+        CHECK( results.visible[ i ] == 5 + i );
+    }
+
+    // Transforms are built for every instance, visible or not:
+    CHECK( results.instances[0].instanceTransform.columns[3].x == -10.f );
+    CHECK( results.instances[20].instanceTransform.columns[3].x == 10.f );
+    CHECK( results.margins[5] == 0.f );
+    CHECK( results.margins[10] == 5.f );
+    CHECK( results.margins[0] < 0.f );
+}
+
+static void testMeshRanges()
+{
+    Scene scene( 3 );
+    CHECK( scene.baseInstances[0] == 0 );
+    CHECK( scene.baseInstances[1] == 7 );
+    CHECK( scene.baseInstances[2] == 14 );
+
+    // Every record is reset, not only the first:
+    Results results( 3 );
+    for ( host::DrawArguments& args : results.arguments )
+    {
+        args = { 1, 1000, 1, 1, 1000 };
+    }
+    scene.run( results.instances.data(), results.visible.data(), results.arguments.data(), nullptr );
+
+    uint32_t total = 0;
+    for ( uint32_t mesh = 0; mesh < 3; ++mesh )
+    {
+        const host::DrawArguments& args = results.arguments[ mesh ];
+        CHECK( args.indexCount == kIndexCount );
+        CHECK( args.indexStart == 0 );
+        CHECK( args.baseVertex == 0 );
+        CHECK( args.baseInstance == scene.baseInstances[ mesh ] );
+        for ( uint32_t i = 0; i < args.instanceCount; ++i )
+        {
+            CHECK( scene.sources[ results.visible[ args.baseInstance + i ] ].mesh == mesh );
+        }
+        total += args.instanceCount;
+    }
+    CHECK( total == 11 );
+}
+
+static void testCompareAcceptsGpuOrder()
+{
+    const uint32_t meshCount = 2;
+    Scene scene( meshCount );
+    Results reference( meshCount );
+    scene.run( reference.instances.data(), reference.visible.data(), reference.arguments.data(), reference.margins.data() );
+
+    // The GPU appends in any order and rounds a little differently:
+    Results gpu = reference;
+    for ( const host::DrawArguments& args : gpu.arguments )
+    {
+        std::reverse( gpu.visible.begin() + args.baseInstance, gpu.visible.begin() + args.baseInstance + args.instanceCount );
+    }
+    gpu.instances[3].instanceTransform.columns[3].x *= 1.f + 2e-6f;
+    gpu.instances[4].instanceTransform.columns[0].x += 5e-6f;
+
+    const std::vector< uint32_t > gpuVisible = gpu.visible;
+    cull::Report report = compare( reference, gpu, meshCount );
+    CHECK( report.passed() );
+    CHECK( report.gpuVisible == 11 );
+    CHECK( report.referenceVisible == 11 );
+
+    // The GPU's list is sorted in a copy, not in place:
+    CHECK( gpu.visible == gpuVisible );
+}
+
+static void testCompareFindsMismatches()
+{
+    Scene scene( 1 );
+    Results reference( 1 );
+    scene.run( reference.instances.data(), reference.visible.data(), reference.arguments.data(), reference.margins.data() );
+
+    Results inexact = reference;
+    inexact.instances[7].instanceTransform.columns[3].x += 1e-3f;
+    cull::Report report = compare( reference, inexact, 1 );
+    CHECK( !report.passed() );
+    CHECK( report.inexactTransforms == 1 );
+    CHECK( report.visibilityMismatches == 0 );
+
+    // Instance 10 is far from every plane, so losing it is a mismatch:
+    Results missing = reference;
+    missing.visible[5] = missing.visible[10];
+    missing.arguments[0].instanceCount = 10;
+    report = compare( reference, missing, 1 );
+    CHECK( !report.passed() );
+    CHECK( report.visibilityMismatches == 1 );
+
+    Results duplicate = reference;
+    duplicate.visible[6] = duplicate.visible[7];
+    report = compare( reference, duplicate, 1 );
+    CHECK( report.visibilityMismatches == 2 );
+
+    Results overflow = reference;
+    overflow.arguments[0].instanceCount = kInstanceCount + 1;
+    report = compare( reference, overflow, 1 );
+    CHECK( !report.passed() );
+
+    Results outOfRange = reference;
+    outOfRange.visible[0] = kInstanceCount;
+    report = compare( reference, outOfRange, 1 );
+    CHECK( !report.passed() );
+}
+
+static void testPlaneTolerance()
+{
+    Scene scene( 1 );
+    Results reference( 1 );
+    scene.run( reference.instances.data(), reference.visible.data(), reference.arguments.data(), reference.margins.data() );
+
+    // Instances 5 and 15 touch the planes, so the GPU may drop them:
+    Results gpu = reference;
+    gpu.visible.erase( gpu.visible.begin() + 10 );
+    gpu.visible.erase( gpu.visible.begin() );
+    gpu.visible.resize( kInstanceCount );
+    gpu.arguments[0].instanceCount = 9;
+    cull::Report report = compare( reference, gpu, 1 );
+    CHECK( report.passed() );
+    CHECK( report.gpuVisible == 9 );
+    CHECK( report.referenceVisible == 11 );
+}
+
+int main()
+{
+    testCulling();
+    testMeshRanges();
+    testCompareAcceptsGpuOrder();
+    testCompareFindsMismatches();
+    testPlaneTolerance();
+    return check::finish( "culling-test" );
+}
@@ -0,0 +1,262 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// A CPU reference for the cullInstances kernel in 08-compute, and the checks
+// that compare the GPU's results with it. It's a template over the sample's
+// vector and buffer types, so the culling test and benchmark run it on any
+// platform with stand-ins for the simd types.
+//
+// _Types provides float3x3, float4, float4x4 with operator*, the
+// InstanceSource, InstanceData, CullUniforms and DrawArguments structures,
+// and makeFloat4(), makeMatrix() and discardTranslation().
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#pragma region Declarations {
+
+namespace cull
+{
+    // The kernel is compiled with MathModeSafe, but the two compilers can
+    // still fuse multiplies and adds differently. Transform elements may
+    // differ by this much, relative to the larger of 1 and their magnitude:
+    static constexpr float kTransformTolerance = 1e-5f;
+
+    // An instance whose bounding sphere is this close to a frustum plane may
+    // land on either side of it, in scene units:
+    static constexpr float kPlaneTolerance = 1e-3f;
+
+    // The visible totals are for the log. Instances near a plane can make
+    // them differ without a mismatch.
+    struct Report
+    {
+        uint32_t gpuVisible;
+        uint32_t referenceVisible;
+        size_t visibilityMismatches;
+        size_t inexactTransforms;
+
+        bool passed() const;
+    };
+
+    template< typename _Types >
+    void assignBaseInstances( const typename _Types::InstanceSource* pSources, uint32_t instanceCount,
+                              uint32_t* pBaseInstances, uint32_t meshCount );
+
+    template< typename _Types >
+    void resetDrawArguments( typename _Types::DrawArguments* pDrawArguments, const uint32_t* pBaseInstances,
+                             uint32_t meshCount, uint32_t indexCount );
+
+    template< typename _Types >
+    void cullInstancesReference( const typename _Types::CullUniforms& uniforms, const typename _Types::float4x4* pRotations,
+                                 const typename _Types::InstanceSource* pSources, typename _Types::InstanceData* pInstances,
+                                 uint32_t* pVisibleInstances, typename _Types::DrawArguments* pDrawArguments, float* pMargins );
+
+    template< typename _Types >
+    Report compareResults( const typename _Types::InstanceData* pReferenceInstances, const uint32_t* pReferenceVisible,
+                           const typename _Types::DrawArguments* pReferenceArguments, const float* pMargins,
+                           const typename _Types::InstanceData* pGpuInstances, const uint32_t* pGpuVisible,
+                           const typename _Types::DrawArguments* pGpuArguments, uint32_t instanceCount, uint32_t meshCount );
+}
+
+#pragma endregion Declarations }
+
+
+#pragma mark - Culling
+#pragma region Culling {
+
+namespace cull
+{
+    inline bool Report::passed() const
+    {
+        return visibilityMismatches == 0 && inexactTransforms == 0;
+    }
+
+    // Gives each mesh a range of the visible list as long as its instance
+    // count, in mesh order. Instances don't change mesh, so this runs once.
+    template< typename _Types >
+    void assignBaseInstances( const typename _Types::InstanceSource* pSources, uint32_t instanceCount,
+                              uint32_t* pBaseInstances, uint32_t meshCount )
+    {
+        std::vector< uint32_t > counts( meshCount, 0 );
+        for ( uint32_t i = 0; i < instanceCount; ++i )
+        {
+            ++counts[ pSources[ i ].mesh ];
+        }
+
+        uint32_t base = 0;
+        for ( uint32_t mesh = 0; mesh < meshCount; ++mesh )
+        {
+            pBaseInstances[ mesh ] = base;
+            base += counts[ mesh ];
+        }
+    }
+
+    // Clears every mesh's instance count before the kernel appends to it:
+    template< typename _Types >
+    void resetDrawArguments( typename _Types::DrawArguments* pDrawArguments, const uint32_t* pBaseInstances,
+                             uint32_t meshCount, uint32_t indexCount )
+    {
+        for ( uint32_t mesh = 0; mesh < meshCount; ++mesh )
+        {
+            pDrawArguments[ mesh ] = { indexCount, /* instanceCount */ 0, 0, 0, pBaseInstances[ mesh ] };
+        }
+    }
+
+    // A C++ port of the cullInstances kernel that performs the same operations
+    // in the same order. Threads here run in index order, so the visible list
+    // comes out sorted. If pMargins isn't null, it receives each instance's
+    // smallest distance past a plane, plus the radius, for compareResults().
+    template< typename _Types >
+    void cullInstancesReference( const typename _Types::CullUniforms& uniforms, const typename _Types::float4x4* pRotations,
+                                 const typename _Types::InstanceSource* pSources, typename _Types::InstanceData* pInstances,
+                                 uint32_t* pVisibleInstances, typename _Types::DrawArguments* pDrawArguments, float* pMargins )
+    {
+        using float4 = typename _Types::float4;
+        using float4x4 = typename _Types::float4x4;
+
+        for ( uint32_t index = 0; index < uniforms.instanceCount; ++index )
+        {
+            const auto& source = pSources[ index ];
+            float4x4 translate = _Types::makeMatrix( _Types::makeFloat4( 1, 0, 0, 0 ), _Types::makeFloat4( 0, 1, 0, 0 ), _Types::makeFloat4( 0, 0, 1, 0 ),
+                                                     _Types::makeFloat4( source.offset.x, source.offset.y, source.offset.z, 1 ) );
+            float4x4 scale = _Types::makeMatrix( _Types::makeFloat4( uniforms.scale, 0, 0, 0 ), _Types::makeFloat4( 0, uniforms.scale, 0, 0 ),
+                                                 _Types::makeFloat4( 0, 0, uniforms.scale, 0 ), _Types::makeFloat4( 0, 0, 0, 1 ) );
+            float4x4 zrot = pRotations[ source.ix ];
+            float4x4 yrot = pRotations[ uniforms.rowCount + source.iy ];
+            float4x4 transform = uniforms.objectTransform * translate * yrot * zrot * scale;
+
+            pInstances[ index ].instanceTransform = transform;
+            pInstances[ index ].instanceNormalTransform = _Types::discardTranslation( transform );
+            pInstances[ index ].instanceColor = source.color;
+
+            const float4& center = transform.columns[3];
+            bool visible = true;
+            float margin = INFINITY;
+            for ( int i = 0; i < 6; ++i )
+            {
+                const float4& plane = uniforms.frustumPlanes[ i ];
+                float distance = plane.x * center.x + plane.y * center.y + plane.z * center.z + plane.w;
+                visible = visible && distance >= -uniforms.boundingRadius;
+                margin = std::min( margin, distance + uniforms.boundingRadius );
+            }
+
+            if ( pMargins )
+            {
+                pMargins[ index ] = margin;
+            }
+
+            if ( visible )
+            {
+                auto& args = pDrawArguments[ source.mesh ];
+                pVisibleInstances[ args.baseInstance + args.instanceCount++ ] = index;
+            }
+        }
+    }
+
+    template< typename _Float4 >
+    bool nearlyEqual( const _Float4& a, const _Float4& b )
+    {
+        const float lhs[] = { a.x, a.y, a.z, a.w };
+        const float rhs[] = { b.x, b.y, b.z, b.w };
+        for ( int i = 0; i < 4; ++i )
+        {
+            if ( !(std::fabs( lhs[ i ] - rhs[ i ] ) <= kTransformTolerance * std::max( 1.f, std::fabs( rhs[ i ] ) )) )
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Compares the GPU's results with the reference's. The GPU appends
+    // visible instances in whatever order its threads finish, so each mesh's
+    // list is sorted in a copy. A visibility difference only counts for an
+    // instance further than kPlaneTolerance from every plane it's tested
+    // against.
+    template< typename _Types >
+    Report compareResults( const typename _Types::InstanceData* pReferenceInstances, const uint32_t* pReferenceVisible,
+                           const typename _Types::DrawArguments* pReferenceArguments, const float* pMargins,
+                           const typename _Types::InstanceData* pGpuInstances, const uint32_t* pGpuVisible,
+                           const typename _Types::DrawArguments* pGpuArguments, uint32_t instanceCount, uint32_t meshCount )
+    {
+        Report report = { 0, 0, 0, 0 };
+
+        for ( uint32_t i = 0; i < instanceCount; ++i )
+        {
+            for ( int c = 0; c < 4; ++c )
+            {
+                if ( !nearlyEqual( pGpuInstances[ i ].instanceTransform.columns[ c ], pReferenceInstances[ i ].instanceTransform.columns[ c ] ) )
+                {
+                    ++report.inexactTransforms;
+                    break;
+                }
+            }
+        }
+
+        std::vector< uint8_t > inReference( instanceCount, 0 );
+        std::vector< uint8_t > inGpu( instanceCount, 0 );
+        std::vector< uint32_t > sorted;
+        for ( uint32_t mesh = 0; mesh < meshCount; ++mesh )
+        {
+            const uint32_t base = pReferenceArguments[ mesh ].baseInstance;
+            const uint32_t referenceCount = pReferenceArguments[ mesh ].instanceCount;
+            report.referenceVisible += referenceCount;
+            for ( uint32_t i = 0; i < referenceCount; ++i )
+            {
+                inReference[ pReferenceVisible[ base + i ] ] = 1;
+            }
+
+            // A count past the end of the list is itself a mismatch:
+            const uint32_t gpuCount = pGpuArguments[ mesh ].instanceCount;
+            const uint32_t gpuBase = pGpuArguments[ mesh ].baseInstance;
+            report.gpuVisible += gpuCount;
+            if ( gpuBase != base || gpuBase > instanceCount || gpuCount > instanceCount - gpuBase )
+            {
+                ++report.visibilityMismatches;
+                continue;
+            }
+
+            sorted.assign( pGpuVisible + gpuBase, pGpuVisible + gpuBase + gpuCount );
+            std::sort( sorted.begin(), sorted.end() );
+            for ( size_t i = 0; i < sorted.size(); ++i )
+            {
+                if ( sorted[ i ] >= instanceCount || (i > 0 && sorted[ i ] == sorted[ i - 1 ]) )
+                {
+                    ++report.visibilityMismatches;
+                    continue;
+                }
+                inGpu[ sorted[ i ] ] = 1;
+            }
+        }
+
+        for ( uint32_t i = 0; i < instanceCount; ++i )
+        {
+            if ( inGpu[ i ] != inReference[ i ] && !(std::fabs( pMargins[ i ] ) <= kPlaneTolerance) )
+            {
+                ++report.visibilityMismatches;
+            }
+        }
+        return report;
+    }
+}
+
+#pragma endregion Culling }
@@ -0,0 +1,203 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Compares the cost of sending an encoder-style message through objc_msgSend
+// with calling the IMP found by NS::Private::MethodCache, which metal-cpp uses
+// for its hot encoder calls when METALCPP_IMP_CACHING is defined. The receiver
+// is a class registered at runtime, so only dispatch is measured. It also
+// checks that the cache follows a receiver whose class changes and a method
+// that is replaced.
+
+#define OBJC_STUB_IMPLEMENTATION
+
+#include <Foundation/NSMethodCache.hpp>
+
+#include <objc/message.h>
+#include <objc/runtime.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr size_t kIterations = 20000000;
+
+
+#pragma region Declarations {
+
+namespace bench
+{
+    struct Encoder
+    {
+        Class cls;
+        Class validationCls;
+        id obj;
+        SEL setVertexBuffer;
+        SEL drawPrimitives;
+    };
+
+    Encoder makeEncoder();
+    double msgSendNanoseconds( const Encoder& encoder, size_t iterations );
+    double cachedNanoseconds( const Encoder& encoder, size_t iterations );
+    bool checkClassChanges( Encoder& encoder );
+}
+
+#pragma endregion Declarations }
+
+
+int main( int argc, char* argv[] )
+{
+    bench::Encoder encoder = bench::makeEncoder();
+
+    // Each path runs twice and keeps the faster run, to leave out warm-up
+    double msgSend = std::min( bench::msgSendNanoseconds( encoder, kIterations ), bench::msgSendNanoseconds( encoder, kIterations ) );
+    double cached = std::min( bench::cachedNanoseconds( encoder, kIterations ), bench::cachedNanoseconds( encoder, kIterations ) );
+
+#ifdef OBJC_STUB_RUNTIME
+    __builtin_printf( "dispatch (objc stub runtime)\n" );
+#else
+    __builtin_printf( "dispatch (Objective-C runtime)\n" );
+#endif // OBJC_STUB_RUNTIME
+    __builtin_printf( "  objc_msgSend: %6.2f ns per call\n", msgSend );
+    __builtin_printf( "  cached IMP:   %6.2f ns per call\n", cached );
+
+    if ( !bench::checkClassChanges( encoder ) )
+    {
+        __builtin_printf( "  class changes: FAILED\n" );
+        return 1;
+    }
+    __builtin_printf( "  class changes: ok\n" );
+
+    return 0;
+}
+
+
+#pragma mark - Bench
+#pragma region Bench {
+
+namespace
+{
+    uintptr_t g_driverCalls = 0;
+    uintptr_t g_validationCalls = 0;
+    uintptr_t g_replacedCalls = 0;
+
+    // Stand-ins for a driver's encoder methods, doing as little as possible
+    void setVertexBuffer( id self, SEL cmd, const void* pBuffer, uintptr_t offset, uintptr_t index )
+    {
+        g_driverCalls += offset + index + 1;
+    }
+
+    void drawPrimitives( id self, SEL cmd, uintptr_t primitiveType, uintptr_t vertexStart, uintptr_t vertexCount )
+    {
+        g_driverCalls += vertexCount;
+    }
+
+    void validateSetVertexBuffer( id self, SEL cmd, const void* pBuffer, uintptr_t offset, uintptr_t index )
+    {
+        g_validationCalls += 1;
+    }
+
+    void replacedSetVertexBuffer( id self, SEL cmd, const void* pBuffer, uintptr_t offset, uintptr_t index )
+    {
+        g_replacedCalls += 1;
+    }
+}
+
+bench::Encoder bench::makeEncoder()
+{
+    Encoder encoder;
+    encoder.setVertexBuffer = sel_registerName( "setVertexBuffer:offset:atIndex:" );
+    encoder.drawPrimitives = sel_registerName( "drawPrimitives:vertexStart:vertexCount:" );
+
+    encoder.cls = objc_allocateClassPair( objc_getClass( "NSObject" ), "LMBenchRenderEncoder", 0 );
+    class_addMethod( encoder.cls, encoder.setVertexBuffer, reinterpret_cast< IMP >( &setVertexBuffer ), "v@:^vQQ" );
+    class_addMethod( encoder.cls, encoder.drawPrimitives, reinterpret_cast< IMP >( &drawPrimitives ), "v@:QQQ" );
+    objc_registerClassPair( encoder.cls );
+
+    // A subclass that intercepts one method, as a validation layer does
+    encoder.validationCls = objc_allocateClassPair( encoder.cls, "LMBenchValidationRenderEncoder", 0 );
+    class_addMethod( encoder.validationCls, encoder.setVertexBuffer, reinterpret_cast< IMP >( &validateSetVertexBuffer ), "v@:^vQQ" );
+    objc_registerClassPair( encoder.validationCls );
+
+    encoder.obj = class_createInstance( encoder.cls, 0 );
+    return encoder;
+}
+
+double bench::msgSendNanoseconds( const Encoder& encoder, size_t iterations )
+{
+    using SetVertexBufferProc = void (*)( const void*, SEL, const void*, uintptr_t, uintptr_t );
+    using DrawPrimitivesProc = void (*)( const void*, SEL, uintptr_t, uintptr_t, uintptr_t );
+
+    const SetVertexBufferProc pSetVertexBuffer = reinterpret_cast< SetVertexBufferProc >( &objc_msgSend );
+    const DrawPrimitivesProc pDrawPrimitives = reinterpret_cast< DrawPrimitivesProc >( &objc_msgSend );
+
+    Clock::time_point start = Clock::now();
+    for ( size_t i = 0; i < iterations; i += 2 )
+    {
+        ( *pSetVertexBuffer )( encoder.obj, encoder.setVertexBuffer, nullptr, 0, 0 );
+        ( *pDrawPrimitives )( encoder.obj, encoder.drawPrimitives, 3, 0, 3 );
+    }
+    return std::chrono::duration< double, std::nano >( Clock::now() - start ).count() / iterations;
+}
+
+double bench::cachedNanoseconds( const Encoder& encoder, size_t iterations )
+{
+    // One cache per call site, as in the encoder headers
+    static const NS::Private::MethodCache setVertexBufferCache;
+    static const NS::Private::MethodCache drawPrimitivesCache;
+
+    Clock::time_point start = Clock::now();
+    for ( size_t i = 0; i < iterations; i += 2 )
+    {
+        setVertexBufferCache.send< void >( encoder.obj, encoder.setVertexBuffer, static_cast< const void* >( nullptr ), uintptr_t( 0 ), uintptr_t( 0 ) );
+        drawPrimitivesCache.send< void >( encoder.obj, encoder.drawPrimitives, uintptr_t( 3 ), uintptr_t( 0 ), uintptr_t( 3 ) );
+    }
+    return std::chrono::duration< double, std::nano >( Clock::now() - start ).count() / iterations;
+}
+
+bool bench::checkClassChanges( Encoder& encoder )
+{
+    static const NS::Private::MethodCache cache;
+    auto send = [&]() {
+        cache.send< void >( encoder.obj, encoder.setVertexBuffer, static_cast< const void* >( nullptr ), uintptr_t( 0 ), uintptr_t( 0 ) );
+    };
+
+    uintptr_t driverCalls = g_driverCalls;
+    send();
+    bool ok = ( g_driverCalls == driverCalls + 1 );
+
+    // The receiver's class changes under the cache
+    object_setClass( encoder.obj, encoder.validationCls );
+    send();
+    ok = ok && ( g_validationCalls == 1 );
+
+    // Swizzling a class the cache has seen needs an explicit invalidation
+    class_replaceMethod( encoder.validationCls, encoder.setVertexBuffer, reinterpret_cast< IMP >( &replacedSetVertexBuffer ), "v@:^vQQ" );
+    NS::Private::MethodCache::invalidateAll();
+    send();
+    ok = ok && ( g_replacedCalls == 1 );
+
+    // Messages to nil do nothing
+    cache.send< void >( nullptr, encoder.setVertexBuffer, static_cast< const void* >( nullptr ), uintptr_t( 0 ), uintptr_t( 0 ) );
+
+    object_setClass( encoder.obj, encoder.cls );
+    return ok;
+}
+
+#pragma endregion Bench }
@@ -0,0 +1,45 @@
+# Copyright 2022 Apple Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Prints the MSL in a sample's raw string literal, so it can be compiled
+# ahead of time. Usage: awk -v name=shaderSrc -f extract-shader.awk sample.cpp
+#
+# The literal must open with `name = R"(` at the end of a line and close
+# with `)"` on a later line.
+
+index( $0, name " = R\"(" ) {
+    inside = 1
+    found = 1
+    next
+}
+
+inside && index( $0, ")\"" ) {
+    line = $0
+    sub( /\)".*/, "", line )
+    print line
+    inside = 0
+    next
+}
+
+inside {
+    print
+}
+
+END {
+    if ( !found || inside )
+    {
+        print "extract-shader.awk: no complete raw string named " name > "/dev/stderr"
+        exit 1
+    }
+}
@@ -0,0 +1,263 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tests fg::FrameGraph::compile() on stand-in types: culling of passes whose
+// outputs nobody reads, ordering, memoryless and heap placement of the
+// transients, attachment actions, and the fences between passes that hand
+// off heap memory. Then executes one compiled graph several times.
+
+#include "../test-support/check.hpp"
+#include "../frame-graph/frame-graph.hpp"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+struct TestApi
+{
+    struct Texture {};
+    using PixelFormat = uint32_t;
+    struct ComputeCommandEncoder { std::vector< std::string >* pLog; };
+    struct RenderCommandEncoder { std::vector< std::string >* pLog; };
+};
+
+using Graph = fg::FrameGraph< TestApi >;
+
+static Graph::TextureDesc desc( uint32_t width, uint32_t height, uint64_t size )
+{
+    return { width, height, 0, 4, size, 256 };
+}
+
+static void encodeCompute( void* pContext, TestApi::ComputeCommandEncoder* pEncoder )
+{
+    pEncoder->pLog->push_back( static_cast< const char* >( pContext ) );
+}
+
+static void encodeRender( void* pContext, TestApi::RenderCommandEncoder* pEncoder )
+{
+    pEncoder->pLog->push_back( static_cast< const char* >( pContext ) );
+}
+
+// Runs the compiled passes in order, as the sample's executor does with Metal
+static void execute( const Graph& graph, std::vector< std::string >* pLog )
+{
+    for ( uint32_t index : graph.order() )
+    {
+        const Graph::Pass& pass = graph.pass( index );
+        if ( pass.type == fg::PassType::Compute )
+        {
+            TestApi::ComputeCommandEncoder encoder = { pLog };
+            pass.encodeCompute( pass.pContext, &encoder );
+        }
+        else
+        {
+            TestApi::RenderCommandEncoder encoder = { pLog };
+            pass.encodeRender( pass.pContext, &encoder );
+        }
+    }
+}
+
+static bool waits( const Graph& graph, uint32_t consumer, uint32_t producer )
+{
+    const Graph::Pass& p = graph.pass( producer );
+    const std::vector< uint32_t >& fences = graph.pass( consumer ).waitFences;
+    return p.fence != fg::kInvalid && std::find( fences.begin(), fences.end(), p.fence ) != fences.end();
+}
+
+static void testCulling()
+{
+    TestApi::Texture drawable;
+    Graph graph;
+    graph.reset( false );
+    uint32_t target = graph.importTexture( "drawable", desc( 64, 64, 0 ), &drawable, false );
+    uint32_t unused = graph.createTexture( "unused", desc( 64, 64, 16384 ) );
+    uint32_t feed = graph.createTexture( "feeds unused", desc( 64, 64, 16384 ) );
+
+    uint32_t present = graph.addRenderPass( "present", &encodeRender, (void*)"present" );
+    graph.setColorAttachment( present, target, true );
+
+    // A chain that ends in a texture nobody reads goes away as a whole:
+    uint32_t first = graph.addComputePass( "first", &encodeCompute, (void*)"first" );
+    graph.write( first, feed );
+    uint32_t second = graph.addComputePass( "second", &encodeCompute, (void*)"second" );
+    graph.read( second, feed );
+    graph.write( second, unused );
+    graph.addComputePass( "writes nothing", &encodeCompute, (void*)"writes nothing" );
+    graph.compile();
+
+    CHECK( graph.report().passCount == 1 );
+    CHECK( graph.report().culledPassCount == 3 );
+    CHECK( graph.pass( first ).culled && graph.pass( second ).culled );
+    CHECK( graph.order().size() == 1 && graph.order()[0] == present );
+    CHECK( graph.report().transientBytes == 0 && graph.report().fenceCount == 0 );
+}
+
+static void testOrderingAndFences()
+{
+    TestApi::Texture drawable;
+    Graph graph;
+    graph.reset( false );
+    uint32_t target = graph.importTexture( "drawable", desc( 64, 64, 0 ), &drawable, false );
+    uint32_t depth = graph.createTexture( "depth", desc( 64, 64, 8192 ) );
+    uint32_t gbuffer = graph.createTexture( "gbuffer", desc( 64, 64, 16384 ) );
+    uint32_t bloom = graph.createTexture( "bloom", desc( 64, 64, 16384 ) );
+
+    // Declared consumers first; compile() puts each producer before them:
+    uint32_t compose = graph.addRenderPass( "compose", &encodeRender, (void*)"compose" );
+    graph.read( compose, bloom );
+    graph.setColorAttachment( compose, target, true );
+    uint32_t blur = graph.addComputePass( "blur", &encodeCompute, (void*)"blur" );
+    graph.read( blur, gbuffer );
+    graph.write( blur, bloom );
+    uint32_t geometry = graph.addRenderPass( "geometry", &encodeRender, (void*)"geometry" );
+    graph.setColorAttachment( geometry, gbuffer, true );
+    graph.setDepthAttachment( geometry, depth, true );
+    graph.compile();
+
+    CHECK( (graph.order() == std::vector< uint32_t >{ geometry, blur, compose }) );
+
+    // Producer to consumer hand-offs of heap textures are fenced. Imported
+    // textures are tracked by Metal and need none:
+    CHECK( waits( graph, blur, geometry ) );
+    CHECK( waits( graph, compose, blur ) );
+    CHECK( graph.pass( geometry ).waitFences.empty() );
+
+    // Depth is only written and never read, so it isn't stored. The drawable
+    // is stored for presentation; nothing is loaded:
+    CHECK( graph.pass( geometry ).depth.store == fg::StoreAction::DontCare );
+    CHECK( graph.pass( geometry ).color.store == fg::StoreAction::Store );
+    CHECK( graph.pass( compose ).color.store == fg::StoreAction::Store );
+    CHECK( graph.pass( compose ).color.load == fg::LoadAction::Clear );
+
+    // Blur reads the gbuffer and writes bloom, so the two are live together
+    // and must not overlap:
+    const Graph::Resource& g = graph.resource( gbuffer );
+    const Graph::Resource& b = graph.resource( bloom );
+    CHECK( g.heapOffset + g.desc.size <= b.heapOffset || b.heapOffset + b.desc.size <= g.heapOffset );
+
+    // Every placement is aligned and lies within the heap:
+    for ( uint32_t i = 0; i < graph.resourceCount(); ++i )
+    {
+        const Graph::Resource& r = graph.resource( i );
+        if ( !r.imported )
+        {
+            CHECK( r.heapOffset % r.desc.align == 0 );
+            CHECK( r.heapOffset + r.desc.size <= graph.report().heapBytes );
+        }
+    }
+}
+
+static void testAliasing()
+{
+    TestApi::Texture drawable;
+    Graph graph;
+    graph.reset( false );
+    uint32_t target = graph.importTexture( "drawable", desc( 64, 64, 0 ), &drawable, false );
+    uint32_t a = graph.createTexture( "a", desc( 64, 64, 16384 ) );
+    uint32_t b = graph.createTexture( "b", desc( 64, 64, 16384 ) );
+    uint32_t c = graph.createTexture( "c", desc( 64, 64, 16384 ) );
+
+    // a is dead once b is written, so c can reuse a's bytes:
+    uint32_t p0 = graph.addComputePass( "p0", &encodeCompute, (void*)"p0" );
+    graph.write( p0, a );
+    uint32_t p1 = graph.addComputePass( "p1", &encodeCompute, (void*)"p1" );
+    graph.read( p1, a );
+    graph.write( p1, b );
+    uint32_t p2 = graph.addComputePass( "p2", &encodeCompute, (void*)"p2" );
+    graph.read( p2, b );
+    graph.write( p2, c );
+    uint32_t p3 = graph.addRenderPass( "p3", &encodeRender, (void*)"p3" );
+    graph.read( p3, c );
+    graph.setColorAttachment( p3, target, true );
+    graph.compile();
+
+    const fg::Report& report = graph.report();
+    CHECK( report.transientBytes == 3 * 16384 );
+    CHECK( report.heapBytes == 2 * 16384 );
+    CHECK( graph.resource( a ).heapOffset == graph.resource( c ).heapOffset );
+
+    // The first user of c waits for the last user of a, as well as for the
+    // producer of b:
+    CHECK( waits( graph, p2, p1 ) );
+    CHECK( graph.resource( a ).lastUse == 1 && graph.resource( c ).firstUse == 2 );
+    CHECK( report.fenceCount == 3 );
+    CHECK( waits( graph, p1, p0 ) && waits( graph, p3, p2 ) );
+}
+
+static void testMemoryless()
+{
+    TestApi::Texture drawable;
+    for ( bool supported : { false, true } )
+    {
+        Graph graph;
+        graph.reset( supported );
+        uint32_t target = graph.importTexture( "drawable", desc( 64, 64, 0 ), &drawable, false );
+        uint32_t depth = graph.createTexture( "depth", desc( 64, 64, 8192 ) );
+        uint32_t pass = graph.addRenderPass( "render", &encodeRender, (void*)"render" );
+        graph.setColorAttachment( pass, target, true );
+        graph.setDepthAttachment( pass, depth, true );
+        graph.compile();
+
+        // Depth lives and dies in one render pass, so it can stay in tile memory:
+        CHECK( graph.resource( depth ).memoryless == supported );
+        CHECK( graph.report().memorylessBytes == (supported ? 8192u : 0u) );
+        CHECK( graph.report().heapBytes == (supported ? 0u : 8192u) );
+        CHECK( graph.report().storeBytesSaved == 64 * 64 * 4 );
+    }
+}
+
+static void testReexecute()
+{
+    // One compiled graph serves every frame. Only the imported texture changes:
+    TestApi::Texture drawables[3];
+    TestApi::Texture cache;
+    Graph graph;
+    graph.reset( false );
+    uint32_t target = graph.importTexture( "drawable", desc( 64, 64, 0 ), &drawables[0], false );
+    uint32_t tiles = graph.importTexture( "tile cache", desc( 256, 256, 0 ), &cache, true );
+    uint32_t render = graph.addRenderPass( "render", &encodeRender, (void*)"render" );
+    graph.setColorAttachment( render, target, true );
+    graph.read( render, tiles );
+    uint32_t generate = graph.addComputePass( "generate", &encodeCompute, (void*)"generate" );
+    graph.write( generate, tiles );
+    CHECK( !graph.compiled() );
+    graph.compile();
+    CHECK( graph.compiled() );
+
+    std::vector< std::string > log;
+    for ( TestApi::Texture& drawable : drawables )
+    {
+        graph.setTexture( target, &drawable );
+        CHECK( graph.texture( target ) == &drawable );
+        execute( graph, &log );
+    }
+    CHECK( (log == std::vector< std::string >{ "generate", "render", "generate", "render", "generate", "render" }) );
+    CHECK( graph.report().fenceCount == 0 );
+
+    graph.reset( false );
+    CHECK( !graph.compiled() && graph.order().empty() );
+}
+
+int main()
+{
+    testCulling();
+    testOrderingAndFences();
+    testAliasing();
+    testMemoryless();
+    testReexecute();
+    return check::finish( "frame-graph-test" );
+}
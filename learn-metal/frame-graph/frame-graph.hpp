@@ -0,0 +1,633 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// A frame graph. Passes declare the textures they read and write; compile()
+// culls the passes nobody consumes, orders the rest, finds each transient
+// texture's lifetime, places transients that are never live together over
+// the same heap bytes, picks attachment load and store actions, and inserts
+// the fences that Metal needs between passes sharing heap memory.
+//
+// A compiled graph is executed every frame until its inputs change. Passes
+// encode through a function pointer and a context, so executing builds
+// nothing; per-frame textures such as the drawable are swapped in with
+// setTexture().
+//
+// _Api names the texture, pixel format and encoder types. 09-compute-to-render
+// passes Metal's types and executes the graph with Metal; the frame graph
+// test passes stand-ins, so compile() builds and runs without Metal.
+
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+#pragma region Declarations {
+
+namespace fg
+{
+    static constexpr uint32_t kInvalid = 0xFFFFFFFF;
+
+    enum class PassType : uint8_t { Compute, Render };
+    // Values match MTL::LoadAction and MTL::StoreAction:
+    enum class LoadAction : uint8_t { DontCare, Load, Clear };
+    enum class StoreAction : uint8_t { DontCare, Store };
+
+    struct Report
+    {
+        size_t passCount;
+        size_t culledPassCount;
+        uint64_t transientBytes;
+        uint64_t heapBytes;
+        uint64_t memorylessBytes;
+        uint64_t loadBytesSaved;
+        uint64_t storeBytesSaved;
+        size_t fenceCount;
+    };
+
+    template< typename _Api >
+    class FrameGraph
+    {
+        public:
+            using Texture = typename _Api::Texture;
+            using ComputeEncodeFunction = void (*)( void* pContext, typename _Api::ComputeCommandEncoder* pEncoder );
+            using RenderEncodeFunction = void (*)( void* pContext, typename _Api::RenderCommandEncoder* pEncoder );
+
+            // Heap size and alignment come from the device when the texture
+            // is declared, which keeps compile() free of Metal calls:
+            struct TextureDesc
+            {
+                uint32_t width;
+                uint32_t height;
+                typename _Api::PixelFormat pixelFormat;
+                uint32_t bytesPerPixel;
+                uint64_t size;
+                uint64_t align;
+            };
+
+            struct Resource
+            {
+                const char* name;
+                TextureDesc desc;
+                Texture* pTexture;
+                bool imported;
+                bool persistent;
+                bool attachment;
+                bool shaderRead;
+                bool shaderWrite;
+                uint32_t writer;
+                uint32_t readCount;
+                uint32_t firstUse;
+                uint32_t lastUse;
+                bool memoryless;
+                uint64_t heapOffset;
+            };
+
+            struct Attachment
+            {
+                uint32_t resource;
+                bool clear;
+                LoadAction load;
+                StoreAction store;
+            };
+
+            struct Pass
+            {
+                const char* name;
+                PassType type;
+                std::vector< uint32_t > reads;
+                std::vector< uint32_t > writes;
+                Attachment color;
+                Attachment depth;
+                ComputeEncodeFunction encodeCompute;
+                RenderEncodeFunction encodeRender;
+                void* pContext;
+                bool culled;
+                uint32_t fence;
+                std::vector< uint32_t > waitFences;
+            };
+
+            FrameGraph();
+            void reset( bool memorylessSupported );
+            uint32_t createTexture( const char* name, const TextureDesc& desc );
+            uint32_t importTexture( const char* name, const TextureDesc& desc, Texture* pTexture, bool persistent );
+            uint32_t addComputePass( const char* name, ComputeEncodeFunction encode, void* pContext );
+            uint32_t addRenderPass( const char* name, RenderEncodeFunction encode, void* pContext );
+            void read( uint32_t pass, uint32_t resource );
+            void write( uint32_t pass, uint32_t resource );
+            void setColorAttachment( uint32_t pass, uint32_t resource, bool clear );
+            void setDepthAttachment( uint32_t pass, uint32_t resource, bool clear );
+            void compile();
+            bool compiled() const;
+            void printReport() const;
+
+            // Imported textures may change between executions, and the
+            // executor creates the transients each time:
+            void setTexture( uint32_t resource, Texture* pTexture );
+
+            const Report& report() const { return _report; }
+            const std::vector< uint32_t >& order() const { return _order; }
+            const Pass& pass( uint32_t index ) const { return _passes[ index ]; }
+            const Resource& resource( uint32_t index ) const { return _resources[ index ]; }
+            size_t resourceCount() const { return _resources.size(); }
+            Texture* texture( uint32_t resource ) const { return _resources[ resource ].pTexture; }
+
+        private:
+            uint32_t addPass( const char* name, PassType type );
+            void cullPasses();
+            void orderPasses();
+            void computeLifetimes();
+            void placeTransients();
+            void inferAttachmentActions();
+            void insertFences();
+
+            std::vector< Resource > _resources;
+            std::vector< Pass > _passes;
+            std::vector< uint32_t > _order;
+            Report _report;
+            bool _memorylessSupported;
+            bool _compiled;
+    };
+}
+
+#pragma endregion Declarations }
+
+
+#pragma mark - FrameGraph
+#pragma region FrameGraph {
+
+namespace fg
+{
+    inline uint64_t alignUp( uint64_t value, uint64_t align )
+    {
+        return (value + align - 1) / align * align;
+    }
+
+    template< typename _TextureDesc >
+    inline uint64_t attachmentBytes( const _TextureDesc& desc )
+    {
+        return (uint64_t)desc.width * desc.height * desc.bytesPerPixel;
+    }
+
+    template< typename _Api >
+    FrameGraph< _Api >::FrameGraph()
+    : _report{}
+    , _memorylessSupported( false )
+    , _compiled( false )
+    {
+    }
+
+    template< typename _Api >
+    void FrameGraph< _Api >::reset( bool memorylessSupported )
+    {
+        _resources.clear();
+        _passes.clear();
+        _order.clear();
+        _report = Report{};
+        _memorylessSupported = memorylessSupported;
+        _compiled = false;
+    }
+
+    template< typename _Api >
+    uint32_t FrameGraph< _Api >::createTexture( const char* name, const TextureDesc& desc )
+    {
+        assert( !_compiled );
+        Resource r = {};
+        r.name = name;
+        r.desc = desc;
+        r.writer = kInvalid;
+        r.firstUse = kInvalid;
+        _resources.push_back( r );
+        return (uint32_t)_resources.size() - 1;
+    }
+
+    template< typename _Api >
+    uint32_t FrameGraph< _Api >::importTexture( const char* name, const TextureDesc& desc, Texture* pTexture, bool persistent )
+    {
+        uint32_t index = createTexture( name, desc );
+        _resources[ index ].pTexture = pTexture;
+        _resources[ index ].imported = true;
+        _resources[ index ].persistent = persistent;
+        return index;
+    }
+
+    template< typename _Api >
+    uint32_t FrameGraph< _Api >::addPass( const char* name, PassType type )
+    {
+        assert( !_compiled );
+        Pass p = {};
+        p.name = name;
+        p.type = type;
+        p.color = { kInvalid, false, LoadAction::DontCare, StoreAction::DontCare };
+        p.depth = { kInvalid, false, LoadAction::DontCare, StoreAction::DontCare };
+        p.fence = kInvalid;
+        _passes.push_back( p );
+        return (uint32_t)_passes.size() - 1;
+    }
+
+    template< typename _Api >
+    uint32_t FrameGraph< _Api >::addComputePass( const char* name, ComputeEncodeFunction encode, void* pContext )
+    {
+        uint32_t index = addPass( name, PassType::Compute );
+        _passes[ index ].encodeCompute = encode;
+        _passes[ index ].pContext = pContext;
+        return index;
+    }
+
+    template< typename _Api >
+    uint32_t FrameGraph< _Api >::addRenderPass( const char* name, RenderEncodeFunction encode, void* pContext )
+    {
+        uint32_t index = addPass( name, PassType::Render );
+        _passes[ index ].encodeRender = encode;
+        _passes[ index ].pContext = pContext;
+        return index;
+    }
+
+    template< typename _Api >
+    void FrameGraph< _Api >::read( uint32_t pass, uint32_t resource )
+    {
+        _passes[ pass ].reads.push_back( resource );
+        _resources[ resource ].readCount++;
+        _resources[ resource ].shaderRead = true;
+    }
+
+    template< typename _Api >
+    void FrameGraph< _Api >::write( uint32_t pass, uint32_t resource )
+    {
+        // Every resource has a single producer, which makes the graph acyclic
+        // by construction and lets readers find their producer directly:
+        Resource& r = _resources[ resource ];
+        if ( r.writer != kInvalid && r.writer != pass )
+        {
+            __builtin_printf( "%s is written by both %s and %s\n", r.name, _passes[ r.writer ].name, _passes[ pass ].name );
+            assert( false );
+        }
+        if ( r.writer != pass )
+        {
+            _passes[ pass ].writes.push_back( resource );
+            r.writer = pass;
+        }
+        if ( _passes[ pass ].type == PassType::Compute )
+        {
+            r.shaderWrite = true;
+        }
+    }
+
+    template< typename _Api >
+    void FrameGraph< _Api >::setColorAttachment( uint32_t pass, uint32_t resource, bool clear )
+    {
+        assert( _passes[ pass ].type == PassType::Render );
+        _passes[ pass ].color.resource = resource;
+        _passes[ pass ].color.clear = clear;
+        _resources[ resource ].attachment = true;
+        write( pass, resource );
+    }
+
+    template< typename _Api >
+    void FrameGraph< _Api >::setDepthAttachment( uint32_t pass, uint32_t resource, bool clear )
+    {
+        assert( _passes[ pass ].type == PassType::Render );
+        _passes[ pass ].depth.resource = resource;
+        _passes[ pass ].depth.clear = clear;
+        _resources[ resource ].attachment = true;
+        write( pass, resource );
+    }
+
+    template< typename _Api >
+    void FrameGraph< _Api >::compile()
+    {
+        // Compiling consumes the declared reads, so a graph compiles once
+        // per reset():
+        assert( !_compiled );
+        cullPasses();
+        orderPasses();
+        computeLifetimes();
+        placeTransients();
+        inferAttachmentActions();
+        insertFences();
+        _compiled = true;
+    }
+
+    template< typename _Api >
+    bool FrameGraph< _Api >::compiled() const
+    {
+        return _compiled;
+    }
+
+    template< typename _Api >
+    void FrameGraph< _Api >::setTexture( uint32_t resource, Texture* pTexture )
+    {
+        _resources[ resource ].pTexture = pTexture;
+    }
+
+    template< typename _Api >
+    void FrameGraph< _Api >::cullPasses()
+    {
+        // A pass survives while something consumes one of its outputs.
+        // Imported textures are consumed outside the graph:
+        std::vector< uint32_t > passRefs( _passes.size() );
+        std::vector< uint32_t > resourceRefs( _resources.size() );
+        std::vector< uint32_t > unreferenced;
+
+        for ( uint32_t i = 0; i < _resources.size(); ++i )
+        {
+            resourceRefs[ i ] = _resources[ i ].readCount + (_resources[ i ].imported ? 1 : 0);
+            if ( resourceRefs[ i ] == 0 && _resources[ i ].writer != kInvalid )
+            {
+                unreferenced.push_back( i );
+            }
+        }
+
+        std::vector< uint32_t > culled;
+        for ( uint32_t i = 0; i < _passes.size(); ++i )
+        {
+            passRefs[ i ] = (uint32_t)_passes[ i ].writes.size();
+            if ( passRefs[ i ] == 0 )
+            {
+                culled.push_back( i );
+            }
+        }
+
+        while ( !unreferenced.empty() || !culled.empty() )
+        {
+            if ( !unreferenced.empty() )
+            {
+                uint32_t writer = _resources[ unreferenced.back() ].writer;
+                unreferenced.pop_back();
+                if ( --passRefs[ writer ] == 0 )
+                {
+                    culled.push_back( writer );
+                }
+                continue;
+            }
+
+            Pass& p = _passes[ culled.back() ];
+            culled.pop_back();
+            p.culled = true;
+            _report.culledPassCount++;
+            for ( uint32_t r : p.reads )
+            {
+                _resources[ r ].readCount--;
+                if ( --resourceRefs[ r ] == 0 && _resources[ r ].writer != kInvalid )
+                {
+                    unreferenced.push_back( r );
+                }
+            }
+        }
+    }
+
+    template< typename _Api >
+    void FrameGraph< _Api >::orderPasses()
+    {
+        // Topological sort on producer -> consumer edges. Among the passes
+        // that are ready, the one declared first goes first:
+        std::vector< bool > scheduled( _passes.size(), false );
+        size_t live = _passes.size() - _report.culledPassCount;
+
+        while ( _order.size() < live )
+        {
+            uint32_t next = kInvalid;
+            for ( uint32_t i = 0; i < _passes.size() && next == kInvalid; ++i )
+            {
+                if ( _passes[ i ].culled || scheduled[ i ] )
+                {
+                    continue;
+                }
+
+                bool ready = true;
+                for ( uint32_t r : _passes[ i ].reads )
+                {
+                    uint32_t writer = _resources[ r ].writer;
+                    if ( writer == kInvalid && !_resources[ r ].imported )
+                    {
+                        __builtin_printf( "%s reads %s, which nothing writes\n", _passes[ i ].name, _resources[ r ].name );
+                        assert( false );
+                    }
+                    if ( writer != kInvalid && writer != i && !scheduled[ writer ] )
+                    {
+                        ready = false;
+                    }
+                }
+                if ( ready )
+                {
+                    next = i;
+                }
+            }
+
+            assert( next != kInvalid );
+            scheduled[ next ] = true;
+            _order.push_back( next );
+        }
+
+        _report.passCount = _order.size();
+    }
+
+    template< typename _Api >
+    void FrameGraph< _Api >::computeLifetimes()
+    {
+        for ( uint32_t slot = 0; slot < _order.size(); ++slot )
+        {
+            const Pass& p = _passes[ _order[ slot ] ];
+            for ( const std::vector< uint32_t >* pList : { &p.reads, &p.writes } )
+            {
+                for ( uint32_t r : *pList )
+                {
+                    Resource& res = _resources[ r ];
+                    res.firstUse = std::min( res.firstUse, slot );
+                    res.lastUse = std::max( res.lastUse, slot );
+                }
+            }
+        }
+
+        // An attachment that lives and dies inside one render pass never has
+        // to leave tile memory:
+        for ( Resource& r : _resources )
+        {
+            r.memoryless = _memorylessSupported && !r.imported && r.firstUse != kInvalid
+                && r.firstUse == r.lastUse && r.attachment && !r.shaderRead && !r.shaderWrite;
+        }
+    }
+
+    template< typename _Api >
+    void FrameGraph< _Api >::placeTransients()
+    {
+        // Greedy placement, largest first: each texture goes at the lowest
+        // offset that doesn't overlap a texture whose lifetime overlaps its own.
+        std::vector< uint32_t > transients;
+        for ( uint32_t i = 0; i < _resources.size(); ++i )
+        {
+            const Resource& r = _resources[ i ];
+            if ( r.imported || r.firstUse == kInvalid )
+            {
+                continue;
+            }
+            if ( r.memoryless )
+            {
+                _report.memorylessBytes += r.desc.size;
+                continue;
+            }
+            _report.transientBytes += r.desc.size;
+            transients.push_back( i );
+        }
+
+        std::stable_sort( transients.begin(), transients.end(), [this]( uint32_t a, uint32_t b ){
+            return _resources[ a ].desc.size > _resources[ b ].desc.size;
+        });
+
+        std::vector< uint32_t > placed;
+        for ( uint32_t i : transients )
+        {
+            Resource& r = _resources[ i ];
+            uint64_t offset = 0;
+            bool moved = true;
+            while ( moved )
+            {
+                moved = false;
+                offset = alignUp( offset, r.desc.align );
+                for ( uint32_t j : placed )
+                {
+                    const Resource& other = _resources[ j ];
+                    bool liveTogether = r.firstUse <= other.lastUse && other.firstUse <= r.lastUse;
+                    bool overlaps = offset < other.heapOffset + other.desc.size && other.heapOffset < offset + r.desc.size;
+                    if ( liveTogether && overlaps )
+                    {
+                        offset = other.heapOffset + other.desc.size;
+                        moved = true;
+                    }
+                }
+            }
+            r.heapOffset = offset;
+            _report.heapBytes = std::max( _report.heapBytes, offset + r.desc.size );
+            placed.push_back( i );
+        }
+    }
+
+    template< typename _Api >
+    void FrameGraph< _Api >::inferAttachmentActions()
+    {
+        for ( uint32_t index : _order )
+        {
+            Pass& p = _passes[ index ];
+            for ( Attachment* pAttachment : { &p.color, &p.depth } )
+            {
+                if ( pAttachment->resource == kInvalid )
+                {
+                    continue;
+                }
+
+                // Only persistent textures carry contents into the pass, and
+                // only textures that someone reads afterwards must be stored:
+                const Resource& r = _resources[ pAttachment->resource ];
+                if ( pAttachment->clear )
+                {
+                    pAttachment->load = LoadAction::Clear;
+                }
+                else
+                {
+                    pAttachment->load = r.persistent ? LoadAction::Load : LoadAction::DontCare;
+                }
+                pAttachment->store = (r.imported || r.readCount > 0) ? StoreAction::Store : StoreAction::DontCare;
+
+                uint64_t bytes = attachmentBytes( r.desc );
+                if ( pAttachment->load != LoadAction::Load )
+                {
+                    _report.loadBytesSaved += bytes;
+                }
+                if ( pAttachment->store == StoreAction::DontCare )
+                {
+                    _report.storeBytesSaved += bytes;
+                }
+            }
+        }
+    }
+
+    template< typename _Api >
+    void FrameGraph< _Api >::insertFences()
+    {
+        // Metal doesn't track hazards on heap textures. Fence every hand-off
+        // of heap memory: producer to consumer, and last user of a texture to
+        // the first user of a later texture placed over the same bytes.
+        auto depend = [this]( uint32_t producer, uint32_t consumer ){
+            if ( producer == consumer )
+            {
+                return;
+            }
+            Pass& p = _passes[ producer ];
+            if ( p.fence == kInvalid )
+            {
+                p.fence = (uint32_t)_report.fenceCount++;
+            }
+            std::vector< uint32_t >& waits = _passes[ consumer ].waitFences;
+            if ( std::find( waits.begin(), waits.end(), p.fence ) == waits.end() )
+            {
+                waits.push_back( p.fence );
+            }
+        };
+
+        for ( uint32_t index : _order )
+        {
+            for ( uint32_t r : _passes[ index ].reads )
+            {
+                const Resource& res = _resources[ r ];
+                if ( !res.imported && !res.memoryless && res.writer != kInvalid )
+                {
+                    depend( res.writer, index );
+                }
+            }
+        }
+
+        for ( uint32_t i = 0; i < _resources.size(); ++i )
+        {
+            const Resource& a = _resources[ i ];
+            if ( a.imported || a.memoryless || a.firstUse == kInvalid )
+            {
+                continue;
+            }
+            for ( uint32_t j = 0; j < _resources.size(); ++j )
+            {
+                const Resource& b = _resources[ j ];
+                if ( b.imported || b.memoryless || b.firstUse == kInvalid || a.lastUse >= b.firstUse )
+                {
+                    continue;
+                }
+                if ( a.heapOffset < b.heapOffset + b.desc.size && b.heapOffset < a.heapOffset + a.desc.size )
+                {
+                    depend( _order[ a.lastUse ], _order[ b.firstUse ] );
+                }
+            }
+        }
+    }
+
+    template< typename _Api >
+    void FrameGraph< _Api >::printReport() const
+    {
+        const double mb = 1.0 / (1024.0 * 1024.0);
+        __builtin_printf( "frame graph: %zu passes (%zu culled), %zu fences\n",
+                          _report.passCount, _report.culledPassCount, _report.fenceCount );
+        for ( uint32_t index : _order )
+        {
+            __builtin_printf( "  %s\n", _passes[ index ].name );
+        }
+        __builtin_printf( "  transient heap: %.2f MB for %.2f MB of textures, %.2f MB memoryless\n",
+                          _report.heapBytes * mb, _report.transientBytes * mb, _report.memorylessBytes * mb );
+        __builtin_printf( "  attachment traffic saved per frame: %.2f MB load, %.2f MB store\n",
+                          _report.loadBytesSaved * mb, _report.storeBytesSaved * mb );
+    }
+}
+
+#pragma endregion FrameGraph }
@@ -0,0 +1,186 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tests FramePacer against a simulated timeline. Each frame spends cpuTime on
+// the CPU, then runs for gpuTime on a GPU that works through frames in order.
+// The CPU can't start a frame until the one that many frames in flight back
+// has finished on the GPU. The samples fed back are what 10-frame-debugging
+// measures: CPU time, time spent waiting, GPU time, and the latency from
+// commit to completion.
+
+#include "../test-support/check.hpp"
+#include "../frame-pacer/frame-pacer.hpp"
+
+#include <deque>
+
+static constexpr double kBudget = 1.0 / 60.0;
+static constexpr double kMs = 1e-3;
+
+class Timeline
+{
+    public:
+        explicit Timeline( FramePacer* pPacer )
+        : _pPacer( pPacer )
+        , _cpuClock( 0.0 )
+        , _gpuClock( 0.0 )
+        {
+        }
+
+        // Runs one frame and returns the frames in flight the pacer asks for next.
+        size_t frame( double cpuTime, double gpuTime )
+        {
+            const size_t framesInFlight = _pPacer->framesInFlight();
+            double waitTime = 0.0;
+            while ( _completions.size() >= framesInFlight )
+            {
+                waitTime = std::max( waitTime, _completions.front() - _cpuClock );
+                _completions.pop_front();
+            }
+            _cpuClock += waitTime + cpuTime;
+
+            const double gpuStart = std::max( _cpuClock, _gpuClock );
+            _gpuClock = gpuStart + gpuTime;
+            _completions.push_back( _gpuClock );
+
+            return _pPacer->update( { cpuTime, waitTime, gpuTime, _gpuClock - _cpuClock } );
+        }
+
+        // Runs frames until the pacer changes its mind, up to a limit, and
+        // returns how many it took.
+        size_t framesUntilChange( double cpuTime, double gpuTime, size_t limit )
+        {
+            const size_t start = _pPacer->framesInFlight();
+            for ( size_t i = 1; i <= limit; ++i )
+            {
+                if ( frame( cpuTime, gpuTime ) != start )
+                {
+                    return i;
+                }
+            }
+            return limit + 1;
+        }
+
+    private:
+        FramePacer* _pPacer;
+        std::deque< double > _completions;
+        double _cpuClock;
+        double _gpuClock;
+};
+
+static void testLightLoadDropsToTwo()
+{
+    // With plenty of headroom, the third frame only adds latency. The pacer
+    // gives it up only after a sustained period of 60 frames.
+    FramePacer pacer( 3 );
+    pacer.setFrameBudget( kBudget );
+    Timeline timeline( &pacer );
+    CHECK( pacer.framesInFlight() == 3 );
+    size_t frames = timeline.framesUntilChange( 3 * kMs, 4 * kMs, 200 );
+    CHECK( frames >= 60 && frames <= 70 );
+    CHECK( pacer.framesInFlight() == 2 );
+    CHECK( timeline.framesUntilChange( 3 * kMs, 4 * kMs, 300 ) == 301 );
+}
+
+static void testLowLatencyDropsToOne()
+{
+    // In low-latency mode a frame that fits in the budget end to end runs
+    // alone, after two sustained periods of 60 frames.
+    FramePacer pacer( 3 );
+    pacer.setFrameBudget( kBudget );
+    pacer.setLowLatencyMode( true );
+    Timeline timeline( &pacer );
+    for ( int i = 0; i < 200; ++i )
+    {
+        timeline.frame( 3 * kMs, 4 * kMs );
+    }
+    CHECK( pacer.framesInFlight() == 1 );
+
+    // CPU and GPU that only fit the budget when they overlap need two:
+    CHECK( timeline.framesUntilChange( 9 * kMs, 9 * kMs, 60 ) <= 30 );
+    CHECK( pacer.framesInFlight() == 2 );
+}
+
+static void testOverlapNeedsTwo()
+{
+    // 12 ms on each side misses the budget in series but not overlapped:
+    FramePacer pacer( 3 );
+    pacer.setFrameBudget( kBudget );
+    Timeline timeline( &pacer );
+    for ( int i = 0; i < 300; ++i )
+    {
+        timeline.frame( 12 * kMs, 12 * kMs );
+    }
+    CHECK( pacer.framesInFlight() == 2 );
+}
+
+static void testGPUBoundKeepsTwo()
+{
+    // A GPU that can't make the budget keeps the CPU waiting. A third frame
+    // would only queue more latency behind it.
+    FramePacer pacer( 3 );
+    pacer.setFrameBudget( kBudget );
+    Timeline timeline( &pacer );
+    for ( int i = 0; i < 300; ++i )
+    {
+        timeline.frame( 4 * kMs, 22 * kMs );
+    }
+    CHECK( pacer.framesInFlight() == 2 );
+}
+
+static void testMissedFramesRaiseRightAway()
+{
+    // Once settled at two, a CPU-bound load near the budget with jitter asks
+    // for the third frame within a few frames, not after 60.
+    FramePacer pacer( 3 );
+    pacer.setFrameBudget( kBudget );
+    Timeline timeline( &pacer );
+    for ( int i = 0; i < 200; ++i )
+    {
+        timeline.frame( 3 * kMs, 4 * kMs );
+    }
+    CHECK( pacer.framesInFlight() == 2 );
+
+    size_t frames = 0;
+    for ( ; frames < 60 && pacer.framesInFlight() == 2; ++frames )
+    {
+        timeline.frame( (frames & 1 ? 17 : 12) * kMs, 6 * kMs );
+    }
+    CHECK( pacer.framesInFlight() == 3 );
+    CHECK( frames < 20 );
+}
+
+static void testRespectsMaximum()
+{
+    FramePacer pacer( 2 );
+    pacer.setFrameBudget( kBudget );
+    Timeline timeline( &pacer );
+    for ( int i = 0; i < 200; ++i )
+    {
+        CHECK( timeline.frame( 30 * kMs, 30 * kMs ) <= 2 );
+    }
+}
+
+int main()
+{
+    testLightLoadDropsToTwo();
+    testLowLatencyDropsToOne();
+    testOverlapNeedsTwo();
+    testGPUBoundKeepsTwo();
+    testMissedFramesRaiseRightAway();
+    testRespectsMaximum();
+    return check::finish( "frame-pacer-test" );
+}
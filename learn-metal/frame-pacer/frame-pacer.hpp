@@ -0,0 +1,152 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Chooses how many frames 10-frame-debugging keeps in flight from measured
+// CPU and GPU frame times. It makes no Metal calls, so the frame pacer test
+// drives it with a simulated timeline on any platform.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+#pragma region Declarations {
+
+struct FrameSample
+{
+    double cpuTime;
+    double waitTime;
+    double gpuTime;
+    double gpuLatency;
+};
+
+class FramePacer
+{
+    public:
+        FramePacer( size_t maxFramesInFlight );
+        void setLowLatencyMode( bool enabled );
+        void setFrameBudget( double seconds );
+        size_t update( const FrameSample& sample );
+        size_t framesInFlight() const;
+
+    private:
+        size_t _maxFramesInFlight;
+        size_t _framesInFlight;
+        size_t _framesBelowTarget;
+        double _frameBudget;
+        bool _lowLatency;
+        bool _hasSamples;
+        FrameSample _average;
+        double _jitter;
+};
+
+#pragma endregion Declarations }
+
+
+#pragma mark - FramePacer
+#pragma region FramePacer {
+
+inline FramePacer::FramePacer( size_t maxFramesInFlight )
+: _maxFramesInFlight( maxFramesInFlight )
+, _framesInFlight( maxFramesInFlight )
+, _framesBelowTarget( 0 )
+, _frameBudget( 1.0 / 60.0 )
+, _lowLatency( false )
+, _hasSamples( false )
+, _average{ 0.0, 0.0, 0.0, 0.0 }
+, _jitter( 0.0 )
+{
+}
+
+inline void FramePacer::setLowLatencyMode( bool enabled )
+{
+    _lowLatency = enabled;
+}
+
+inline void FramePacer::setFrameBudget( double seconds )
+{
+    _frameBudget = seconds;
+}
+
+inline size_t FramePacer::framesInFlight() const
+{
+    return _framesInFlight;
+}
+
+inline size_t FramePacer::update( const FrameSample& sample )
+{
+    // Smooth the measurements so that a single slow frame does not flip the decision:
+    constexpr double kSmoothing = 0.1;
+    constexpr double kHeadroom = 0.9;
+    constexpr size_t kFramesBeforeDecrease = 60;
+
+    if ( !_hasSamples )
+    {
+        _average = sample;
+        _hasSamples = true;
+    }
+
+    double busiest = std::max( sample.cpuTime, sample.gpuTime );
+    _jitter += kSmoothing * (fabs( busiest - std::max( _average.cpuTime, _average.gpuTime ) ) - _jitter);
+    _average.cpuTime += kSmoothing * (sample.cpuTime - _average.cpuTime);
+    _average.waitTime += kSmoothing * (sample.waitTime - _average.waitTime);
+    _average.gpuTime += kSmoothing * (sample.gpuTime - _average.gpuTime);
+    _average.gpuLatency += kSmoothing * (sample.gpuLatency - _average.gpuLatency);
+
+    // With one frame in flight the CPU waits for the full GPU latency of the
+    // previous frame. With two, CPU and GPU overlap and the slower one sets
+    // the pace. A third frame only absorbs hitches, at the cost of latency.
+    const double budget = _frameBudget * kHeadroom;
+    size_t wanted = _maxFramesInFlight;
+    if ( _lowLatency && _average.cpuTime + _average.gpuLatency <= budget )
+    {
+        wanted = 1;
+    }
+    else if ( std::max( _average.cpuTime, _average.gpuTime ) + 2.0 * _jitter <= budget )
+    {
+        wanted = 2;
+    }
+    else if ( _average.waitTime > 0.0 && _average.cpuTime + 2.0 * _jitter < _average.gpuTime )
+    {
+        // GPU bound: the CPU is already waiting, so a third frame would
+        // only queue up more latency.
+        wanted = 2;
+    }
+    wanted = std::min( wanted, _lowLatency ? std::min< size_t >( 2, _maxFramesInFlight ) : _maxFramesInFlight );
+
+    if ( wanted > _framesInFlight )
+    {
+        // React to missed frames right away:
+        _framesInFlight = wanted;
+        _framesBelowTarget = 0;
+    }
+    else if ( wanted < _framesInFlight && ++_framesBelowTarget >= kFramesBeforeDecrease )
+    {
+        // Only give up throughput after a sustained period with time to spare:
+        --_framesInFlight;
+        _framesBelowTarget = 0;
+    }
+    else if ( wanted == _framesInFlight )
+    {
+        _framesBelowTarget = 0;
+    }
+
+    return _framesInFlight;
+}
+
+#pragma endregion FramePacer }
@@ -0,0 +1,250 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Checks TimingHistogram percentiles against distributions with known
+// answers, the eviction of samples older than the window, reset(), samples
+// that aren't finite, and percentile() reads while several threads record.
+
+#include "../test-support/check.hpp"
+#include "../frame-stats/frame-stats.hpp"
+
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <thread>
+#include <vector>
+
+// A percentile is the upper bound of the bucket that holds the sample at its
+// rank, so it is at most one bucket, 1/kBucketsPerOctave octaves, above it:
+static bool inBucketOf( double percentile, double sample )
+{
+    return percentile >= sample * (1.0 - 1e-9) && percentile < sample * exp2( 1.0 / TimingHistogram::kBucketsPerOctave );
+}
+
+static void testUniform()
+{
+    TimingHistogram histogram;
+    CHECK( histogram.count() == 0 );
+    CHECK( histogram.percentile( 0.5 ) == 0.0 );
+
+    // 1ms to 100ms, out of order:
+    for ( int i = 0; i < 100; ++i )
+    {
+        histogram.record( ((i * 37) % 100 + 1) * 1e-3 );
+    }
+    CHECK( histogram.count() == 100 );
+    CHECK( inBucketOf( histogram.percentile( 0.50 ), 50e-3 ) );
+    CHECK( inBucketOf( histogram.percentile( 0.95 ), 95e-3 ) );
+    CHECK( inBucketOf( histogram.percentile( 0.99 ), 99e-3 ) );
+    CHECK( inBucketOf( histogram.percentile( 0.0 ), 1e-3 ) );
+    CHECK( inBucketOf( histogram.percentile( 1.0 ), 100e-3 ) );
+}
+
+static void testLongTail()
+{
+    // Mostly 4ms frames with a few 40ms hitches, the shape of a stutter:
+    TimingHistogram histogram;
+    for ( int i = 0; i < 200; ++i )
+    {
+        histogram.record( i % 20 == 0 ? 40e-3 : 4e-3 );
+    }
+    CHECK( inBucketOf( histogram.percentile( 0.50 ), 4e-3 ) );
+    CHECK( inBucketOf( histogram.percentile( 0.95 ), 4e-3 ) );
+    CHECK( inBucketOf( histogram.percentile( 0.96 ), 40e-3 ) );
+    CHECK( inBucketOf( histogram.percentile( 0.99 ), 40e-3 ) );
+
+    // Below 1us everything shares the first bucket:
+    TimingHistogram fast;
+    fast.record( 0.0 );
+    fast.record( -1.0 );
+    fast.record( 1e-7 );
+    CHECK( fast.count() == 3 );
+    CHECK( fast.percentile( 0.0 ) == fast.percentile( 1.0 ) && fast.percentile( 1.0 ) < 2e-6 );
+}
+
+static void testEviction()
+{
+    TimingHistogram histogram;
+    for ( size_t i = 0; i < TimingHistogram::kWindowSize; ++i )
+    {
+        histogram.record( 1e-3 );
+    }
+    CHECK( histogram.count() == TimingHistogram::kWindowSize );
+    CHECK( inBucketOf( histogram.percentile( 0.99 ), 1e-3 ) );
+
+    // Half of the window is replaced: the oldest 1ms samples go first.
+    for ( size_t i = 0; i < TimingHistogram::kWindowSize / 2; ++i )
+    {
+        histogram.record( 10e-3 );
+    }
+    CHECK( histogram.count() == TimingHistogram::kWindowSize );
+    CHECK( inBucketOf( histogram.percentile( 0.50 ), 1e-3 ) );
+    CHECK( inBucketOf( histogram.percentile( 0.51 ), 10e-3 ) );
+
+    // One sample short of a full window leaves a single 1ms sample:
+    for ( size_t i = 0; i < TimingHistogram::kWindowSize / 2 - 1; ++i )
+    {
+        histogram.record( 10e-3 );
+    }
+    CHECK( inBucketOf( histogram.percentile( 0.0 ), 1e-3 ) );
+    CHECK( inBucketOf( histogram.percentile( 1.0 / TimingHistogram::kWindowSize + 1e-6 ), 10e-3 ) );
+    histogram.record( 10e-3 );
+    CHECK( inBucketOf( histogram.percentile( 0.0 ), 10e-3 ) );
+    CHECK( histogram.count() == TimingHistogram::kWindowSize );
+}
+
+static void testReset()
+{
+    TimingHistogram histogram;
+    for ( size_t i = 0; i < TimingHistogram::kWindowSize + 10; ++i )
+    {
+        histogram.record( 5e-3 );
+    }
+    histogram.reset();
+    CHECK( histogram.count() == 0 );
+    CHECK( histogram.percentile( 0.5 ) == 0.0 );
+
+    // The window starts over: nothing recorded before the reset is evicted
+    // from the counts a second time.
+    for ( size_t i = 0; i < TimingHistogram::kWindowSize; ++i )
+    {
+        histogram.record( 2e-3 );
+    }
+    CHECK( histogram.count() == TimingHistogram::kWindowSize );
+    CHECK( inBucketOf( histogram.percentile( 0.0 ), 2e-3 ) );
+    CHECK( inBucketOf( histogram.percentile( 1.0 ), 2e-3 ) );
+
+    FrameStats stats;
+    stats.record( TimingPhase::Encode, 1e-3 );
+    stats.record( TimingPhase::GpuFrame, 8e-3 );
+    CHECK( inBucketOf( stats.percentile( TimingPhase::Encode, 0.5 ), 1e-3 ) );
+    CHECK( inBucketOf( stats.percentile( TimingPhase::GpuFrame, 0.5 ), 8e-3 ) );
+    CHECK( stats.percentile( TimingPhase::Wait, 0.5 ) == 0.0 );
+    stats.reset();
+    CHECK( stats.percentile( TimingPhase::Encode, 0.5 ) == 0.0 );
+    CHECK( stats.percentile( TimingPhase::GpuFrame, 0.5 ) == 0.0 );
+}
+
+static void testNonFinite()
+{
+    const double nan = std::numeric_limits< double >::quiet_NaN();
+    const double inf = std::numeric_limits< double >::infinity();
+
+    TimingHistogram histogram;
+    histogram.record( nan );
+    histogram.record( inf );
+    histogram.record( -inf );
+    CHECK( histogram.count() == 0 );
+    CHECK( histogram.percentile( 0.5 ) == 0.0 );
+
+    histogram.record( 3e-3 );
+    histogram.record( nan );
+    CHECK( histogram.count() == 1 );
+    CHECK( inBucketOf( histogram.percentile( 0.99 ), 3e-3 ) );
+
+    // Fractions outside [0, 1] are clamped, and NaN reads the minimum:
+    CHECK( inBucketOf( histogram.percentile( nan ), 3e-3 ) );
+    CHECK( inBucketOf( histogram.percentile( 2.0 ), 3e-3 ) );
+    CHECK( inBucketOf( histogram.percentile( -inf ), 3e-3 ) );
+}
+
+static void testConcurrent()
+{
+    // Several threads record samples between 1ms and 2ms while this one
+    // reads. Every read must land in that range, or be 0 before the first
+    // sample arrives.
+    static constexpr int kThreads = 4;
+    static constexpr int kSamplesPerThread = 20000;
+
+    TimingHistogram histogram;
+    std::atomic< int > running( kThreads );
+    std::vector< std::thread > threads;
+    for ( int t = 0; t < kThreads; ++t )
+    {
+        threads.emplace_back( [&histogram, &running, t](){
+            for ( int i = 0; i < kSamplesPerThread; ++i )
+            {
+                histogram.record( 1e-3 * (1.0 + ((i * 7 + t) % 100) / 100.0) );
+            }
+            --running;
+        });
+    }
+
+    bool inRange = true;
+    size_t reads = 0;
+    while ( running > 0 || reads == 0 )
+    {
+        for ( double fraction : { 0.5, 0.95, 0.99 } )
+        {
+            double p = histogram.percentile( fraction );
+            inRange &= p == 0.0 || (p >= 1e-3 && p < 2e-3 * exp2( 1.0 / TimingHistogram::kBucketsPerOctave ));
+        }
+        ++reads;
+    }
+    for ( std::thread& thread : threads )
+    {
+        thread.join();
+    }
+    CHECK( inRange );
+
+    // Every sample beyond the window was evicted exactly once:
+    CHECK( histogram.count() == TimingHistogram::kWindowSize );
+    CHECK( inBucketOf( histogram.percentile( 0.0 ), 1e-3 ) );
+    CHECK( histogram.percentile( 1.0 ) < 2e-3 * exp2( 1.0 / TimingHistogram::kBucketsPerOctave ) );
+
+    // A window of new samples replaces all of them, so no count was left
+    // behind by a racing eviction:
+    for ( size_t i = 0; i < TimingHistogram::kWindowSize; ++i )
+    {
+        histogram.record( 50e-3 );
+    }
+    CHECK( inBucketOf( histogram.percentile( 0.0 ), 50e-3 ) );
+}
+
+static void testJson()
+{
+    FrameStats stats;
+    for ( int i = 0; i < 3; ++i )
+    {
+        stats.record( TimingPhase::Wait, 2e-3 );
+    }
+
+    char buffer[4096] = {};
+    FILE* pFile = fmemopen( buffer, sizeof( buffer ) - 1, "w" );
+    CHECK( pFile != nullptr );
+    if ( pFile )
+    {
+        stats.writeJson( pFile );
+        fclose( pFile );
+    }
+    CHECK( strstr( buffer, "\"wait\": { \"samples\": 3," ) != nullptr );
+    CHECK( strstr( buffer, "\"flush\": { \"samples\": 0," ) != nullptr );
+    CHECK( !strcmp( FrameStats::name( TimingPhase::FrameInterval ), "frame" ) );
+}
+
+int main()
+{
+    testUniform();
+    testLongTail();
+    testEviction();
+    testReset();
+    testNonFinite();
+    testConcurrent();
+    testJson();
+    return check::finish( "frame-stats-test" );
+}
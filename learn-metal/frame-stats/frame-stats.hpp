@@ -0,0 +1,275 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Percentiles of the timings 10-frame-debugging measures. A TimingHistogram
+// keeps the last kWindowSize samples in logarithmic buckets, and FrameStats
+// keeps one per TimingPhase. Nothing in here calls Metal, so the frame stats
+// test checks the percentiles, the window and concurrent recording on Linux.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+#pragma region Declarations {
+
+class TimingHistogram
+{
+    public:
+        static constexpr size_t kWindowSize = 512;
+        static constexpr size_t kBucketsPerOctave = 8;
+        static constexpr size_t kBucketCount = 24 * kBucketsPerOctave;
+
+        TimingHistogram();
+
+        // Drops samples that aren't finite, such as a NaN from a clock that
+        // hasn't reported yet:
+        void record( double seconds );
+        double percentile( double fraction ) const;
+        size_t count() const;
+        void reset();
+
+    private:
+        static bool bucketFor( double seconds, uint32_t* pBucket );
+        static double bucketUpperBound( uint32_t bucket );
+
+        std::atomic< size_t > _next;
+        std::atomic< uint32_t > _window[ kWindowSize ];
+        std::atomic< uint32_t > _counts[ kBucketCount ];
+};
+
+enum class TimingPhase : size_t
+{
+    Wait,
+    InstanceUpdate,
+    CameraUpdate,
+    Encode,
+    CpuFrame,
+    GpuFrame,
+    FrameInterval,
+    ComputePass,
+    RenderPass,
+    Record,
+    Flush,
+    Count
+};
+
+class FrameStats
+{
+    public:
+        void record( TimingPhase phase, double seconds );
+        double percentile( TimingPhase phase, double fraction ) const;
+        void print() const;
+        void writeJson( FILE* pFile ) const;
+        void reset();
+        static const char* name( TimingPhase phase );
+
+    private:
+        TimingHistogram _histograms[ (size_t)TimingPhase::Count ];
+};
+
+#pragma endregion Declarations }
+
+
+#pragma mark - FrameStats
+#pragma region FrameStats {
+
+// The histogram keeps the bucket of each of the last kWindowSize samples in a
+// ring, so evicting the oldest sample is a single exchange plus two counter
+// updates. Readers only ever see the counters, which makes percentiles cheap
+// to query from any thread while frames keep recording.
+
+inline TimingHistogram::TimingHistogram()
+: _next( 0 )
+{
+    for ( std::atomic< uint32_t >& slot : _window )
+    {
+        slot.store( 0, std::memory_order_relaxed );
+    }
+    for ( std::atomic< uint32_t >& count : _counts )
+    {
+        count.store( 0, std::memory_order_relaxed );
+    }
+}
+
+inline bool TimingHistogram::bucketFor( double seconds, uint32_t* pBucket )
+{
+    // std::min and std::max pass NaN through to the integer cast below, so
+    // reject what isn't finite first:
+    if ( !std::isfinite( seconds ) )
+    {
+        return false;
+    }
+
+    // Logarithmic buckets starting at 1us, kBucketsPerOctave per doubling:
+    double microseconds = seconds * 1e6;
+    if ( microseconds <= 1.0 )
+    {
+        *pBucket = 0;
+        return true;
+    }
+    double bucket = ceil( log2( microseconds ) * kBucketsPerOctave ) - 1.0;
+    *pBucket = (uint32_t)std::min( std::max( bucket, 0.0 ), (double)(kBucketCount - 1) );
+    return true;
+}
+
+inline double TimingHistogram::bucketUpperBound( uint32_t bucket )
+{
+    return exp2( (double)(bucket + 1) / kBucketsPerOctave ) * 1e-6;
+}
+
+inline void TimingHistogram::record( double seconds )
+{
+    uint32_t bucket;
+    if ( !bucketFor( seconds, &bucket ) )
+    {
+        return;
+    }
+    size_t slot = _next.fetch_add( 1, std::memory_order_relaxed ) % kWindowSize;
+
+    _counts[ bucket ].fetch_add( 1, std::memory_order_relaxed );
+    uint32_t evicted = _window[ slot ].exchange( bucket + 1, std::memory_order_relaxed );
+    if ( evicted != 0 )
+    {
+        _counts[ evicted - 1 ].fetch_sub( 1, std::memory_order_relaxed );
+    }
+}
+
+inline size_t TimingHistogram::count() const
+{
+    return std::min( _next.load( std::memory_order_relaxed ), kWindowSize );
+}
+
+inline void TimingHistogram::reset()
+{
+    // Only valid while nothing records, e.g. between benchmark phases:
+    _next.store( 0, std::memory_order_relaxed );
+    for ( std::atomic< uint32_t >& slot : _window )
+    {
+        slot.store( 0, std::memory_order_relaxed );
+    }
+    for ( std::atomic< uint32_t >& count : _counts )
+    {
+        count.store( 0, std::memory_order_relaxed );
+    }
+}
+
+inline double TimingHistogram::percentile( double fraction ) const
+{
+    uint32_t counts[ kBucketCount ];
+    uint64_t total = 0;
+    for ( size_t i = 0; i < kBucketCount; ++i )
+    {
+        counts[ i ] = _counts[ i ].load( std::memory_order_relaxed );
+        total += counts[ i ];
+    }
+    if ( total == 0 )
+    {
+        return 0.0;
+    }
+
+    fraction = std::isnan( fraction ) ? 0.0 : std::min( std::max( fraction, 0.0 ), 1.0 );
+    uint64_t rank = std::max< uint64_t >( 1, (uint64_t)ceil( fraction * total ) );
+    uint64_t seen = 0;
+    for ( uint32_t i = 0; i < kBucketCount; ++i )
+    {
+        seen += counts[ i ];
+        if ( seen >= rank )
+        {
+            return bucketUpperBound( i );
+        }
+    }
+    return bucketUpperBound( kBucketCount - 1 );
+}
+
+inline void FrameStats::record( TimingPhase phase, double seconds )
+{
+    _histograms[ (size_t)phase ].record( seconds );
+}
+
+inline double FrameStats::percentile( TimingPhase phase, double fraction ) const
+{
+    return _histograms[ (size_t)phase ].percentile( fraction );
+}
+
+inline const char* FrameStats::name( TimingPhase phase )
+{
+    switch ( phase )
+    {
+        case TimingPhase::Wait: return "wait";
+        case TimingPhase::InstanceUpdate: return "instance update";
+        case TimingPhase::CameraUpdate: return "camera update";
+        case TimingPhase::Encode: return "encode";
+        case TimingPhase::CpuFrame: return "cpu frame";
+        case TimingPhase::GpuFrame: return "gpu frame";
+        case TimingPhase::FrameInterval: return "frame";
+        case TimingPhase::ComputePass: return "compute pass";
+        case TimingPhase::RenderPass: return "render pass";
+        case TimingPhase::Record: return "record";
+        case TimingPhase::Flush: return "flush";
+        case TimingPhase::Count: break;
+    }
+    return "unknown";
+}
+
+inline void FrameStats::print() const
+{
+    __builtin_printf( "%-16s %9s %9s %9s\n", "phase (ms)", "p50", "p95", "p99" );
+    for ( size_t i = 0; i < (size_t)TimingPhase::Count; ++i )
+    {
+        if ( _histograms[ i ].count() == 0 )
+        {
+            continue;
+        }
+        TimingPhase phase = (TimingPhase)i;
+        __builtin_printf( "%-16s %9.3f %9.3f %9.3f\n", name( phase ),
+                          percentile( phase, 0.50 ) * 1e3,
+                          percentile( phase, 0.95 ) * 1e3,
+                          percentile( phase, 0.99 ) * 1e3 );
+    }
+}
+
+inline void FrameStats::writeJson( FILE* pFile ) const
+{
+    fprintf( pFile, "{" );
+    const char* separator = "";
+    for ( size_t i = 0; i < (size_t)TimingPhase::Count; ++i )
+    {
+        TimingPhase phase = (TimingPhase)i;
+        fprintf( pFile, "%s\n    \"%s\": { \"samples\": %zu, \"p50Ms\": %.4f, \"p95Ms\": %.4f, \"p99Ms\": %.4f }",
+                 separator, name( phase ), _histograms[ i ].count(),
+                 percentile( phase, 0.50 ) * 1e3,
+                 percentile( phase, 0.95 ) * 1e3,
+                 percentile( phase, 0.99 ) * 1e3 );
+        separator = ",";
+    }
+    fprintf( pFile, "\n  }" );
+}
+
+inline void FrameStats::reset()
+{
+    for ( TimingHistogram& histogram : _histograms )
+    {
+        histogram.reset();
+    }
+}
+
+#pragma endregion FrameStats }
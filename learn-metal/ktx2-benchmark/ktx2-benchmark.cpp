@@ -0,0 +1,114 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Load throughput of KTX2 files: writes a 4096x4096 RGBA8 file with a full
+// mip chain to a temporary file, then times map() and parse() on their own
+// and followed by a copy of every level into a staging buffer, as
+// 07-texturing does before its blits.
+
+#include "../ktx2/ktx2.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr uint32_t kSize = 4096;
+static constexpr uint32_t kLevels = 13;
+static constexpr int kIterations = 20;
+
+template< typename T >
+static void write( std::vector< uint8_t >* pFile, size_t offset, T value )
+{
+    memcpy( pFile->data() + offset, &value, sizeof( T ) );
+}
+
+static bool writeFile( int fd )
+{
+    std::vector< uint8_t > file( ktx2::kHeaderSize + kLevels * ktx2::kLevelIndexEntrySize );
+    memcpy( file.data(), ktx2::kIdentifier, sizeof( ktx2::kIdentifier ) );
+    write( &file, 12, 37u );
+    write( &file, 16, 1u );
+    write( &file, 20, kSize );
+    write( &file, 24, kSize );
+    write( &file, 36, 1u );
+    write( &file, 40, kLevels );
+    for ( uint32_t i = 0; i < kLevels; ++i )
+    {
+        uint64_t length = (uint64_t)(kSize >> i) * (kSize >> i) * 4;
+        size_t entry = ktx2::kHeaderSize + i * ktx2::kLevelIndexEntrySize;
+        write< uint64_t >( &file, entry, file.size() );
+        write< uint64_t >( &file, entry + 8, length );
+        write< uint64_t >( &file, entry + 16, length );
+        file.resize( file.size() + length, (uint8_t)i );
+    }
+    return ::write( fd, file.data(), file.size() ) == (ssize_t)file.size();
+}
+
+int main()
+{
+    char path[] = "/tmp/ktx2-benchmark-XXXXXX";
+    int fd = mkstemp( path );
+    if ( fd < 0 || !writeFile( fd ) )
+    {
+        __builtin_printf( "error: can't write %s\n", path );
+        return 1;
+    }
+    close( fd );
+
+    ktx2::File file;
+    std::vector< uint8_t > staging;
+    double mapNs = 0.0;
+    double loadNs = 0.0;
+    size_t bytes = 0;
+    for ( int i = 0; i < kIterations; ++i )
+    {
+        Clock::time_point start = Clock::now();
+        if ( !ktx2::map( path, &file ) )
+        {
+            __builtin_printf( "error: %s doesn't parse\n", path );
+            unlink( path );
+            return 1;
+        }
+        Clock::time_point mapped = Clock::now();
+
+        bytes = 0;
+        for ( const ktx2::Level& level : file.levels )
+        {
+            bytes += level.byteLength;
+        }
+        staging.resize( bytes );
+        size_t offset = 0;
+        for ( const ktx2::Level& level : file.levels )
+        {
+            memcpy( staging.data() + offset, file.pData + level.byteOffset, level.byteLength );
+            offset += level.byteLength;
+        }
+        ktx2::unmap( &file );
+        Clock::time_point end = Clock::now();
+
+        mapNs += std::chrono::duration< double, std::nano >( mapped - start ).count();
+        loadNs += std::chrono::duration< double, std::nano >( end - start ).count();
+    }
+    unlink( path );
+
+    __builtin_printf( "%ux%u RGBA8, %u levels, %.1f MB\n", kSize, kSize, kLevels, bytes / 1e6 );
+    __builtin_printf( "  map and parse:     %8.1f us\n", mapNs / kIterations / 1e3 );
+    __builtin_printf( "  load into staging: %8.1f us, %.2f GB/s\n", loadNs / kIterations / 1e3, bytes * kIterations / loadNs );
+    return 0;
+}
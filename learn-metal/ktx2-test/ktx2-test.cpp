@@ -0,0 +1,223 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tests ktx2::parse() with well-formed files and with malformed headers and
+// level indices, which it must reject before anything reads the level data
+
+#include "../test-support/check.hpp"
+#include "../ktx2/ktx2.hpp"
+
+#include <cstdint>
+#include <vector>
+
+struct Header
+{
+    uint32_t vkFormat = 37;
+    uint32_t width = 16;
+    uint32_t height = 16;
+    uint32_t depth = 0;
+    uint32_t layerCount = 0;
+    uint32_t faceCount = 1;
+    uint32_t levelCount = 0;
+    uint32_t supercompressionScheme = 0;
+};
+
+template< typename T >
+static void write( std::vector< uint8_t >* pFile, size_t offset, T value )
+{
+    memcpy( pFile->data() + offset, &value, sizeof( T ) );
+}
+
+// Builds a file with a full mip chain (or levelCount levels) stored after the
+// level index, each level sized as the header implies.
+static std::vector< uint8_t > makeFile( const Header& header, uint32_t bytesPerTexel = 4 )
+{
+    const uint32_t levels = std::max( 1u, header.levelCount );
+    const uint32_t images = std::max( 1u, header.layerCount ) * header.faceCount;
+    std::vector< uint8_t > file( ktx2::kHeaderSize + levels * ktx2::kLevelIndexEntrySize );
+    memcpy( file.data(), ktx2::kIdentifier, sizeof( ktx2::kIdentifier ) );
+    write( &file, 12, header.vkFormat );
+    write( &file, 16, 1u );
+    write( &file, 20, header.width );
+    write( &file, 24, header.height );
+    write( &file, 28, header.depth );
+    write( &file, 32, header.layerCount );
+    write( &file, 36, header.faceCount );
+    write( &file, 40, header.levelCount );
+    write( &file, 44, header.supercompressionScheme );
+
+    for ( uint32_t i = 0; i < levels; ++i )
+    {
+        uint64_t w = std::max( 1u, header.width >> i );
+        uint64_t h = std::max( 1u, header.height >> i );
+        uint64_t length = w * h * bytesPerTexel * images;
+        size_t entry = ktx2::kHeaderSize + i * ktx2::kLevelIndexEntrySize;
+        write< uint64_t >( &file, entry, file.size() );
+        write< uint64_t >( &file, entry + 8, length );
+        write< uint64_t >( &file, entry + 16, length );
+        file.resize( file.size() + length, (uint8_t)i );
+    }
+    return file;
+}
+
+static bool parses( const std::vector< uint8_t >& bytes, ktx2::File* pFile = nullptr )
+{
+    ktx2::File file;
+    return ktx2::parse( bytes.data(), bytes.size(), pFile ? pFile : &file );
+}
+
+static void testValidFiles()
+{
+    ktx2::File file;
+    Header header;
+    header.width = 32;
+    header.height = 8;
+    header.levelCount = 6;
+    const std::vector< uint8_t > bytes = makeFile( header );
+    CHECK( parses( bytes, &file ) );
+    CHECK( file.width == 32 && file.height == 8 );
+    CHECK( file.layerCount == 1 && file.faceCount == 1 && file.levelCount == 6 );
+    CHECK( file.levels[5].byteLength == 4 );
+    CHECK( ktx2::levelBytesPerRow( file, 0 ) == 128 );
+    CHECK( ktx2::levelImageSize( file, 3 ) == 16 );
+    CHECK( file.pData[ file.levels[2].byteOffset ] == 2 );
+
+    // A level count of zero asks for a single level:
+    header.levelCount = 0;
+    CHECK( parses( makeFile( header ), &file ) && file.levelCount == 1 );
+
+    // Arrays and cube maps store every layer and face in each level:
+    Header cube;
+    cube.faceCount = 6;
+    cube.layerCount = 2;
+    CHECK( parses( makeFile( cube ), &file ) );
+    CHECK( file.layerCount == 2 && file.faceCount == 6 );
+    CHECK( file.levels[0].byteLength == 16 * 16 * 4 * 12 );
+
+    // Block-compressed levels round partial blocks up. ASTC 6x6 at 10x10 is
+    // 2x2 blocks of 16 bytes:
+    Header astc;
+    astc.vkFormat = 165;
+    astc.width = 10;
+    astc.height = 10;
+    std::vector< uint8_t > blocks = makeFile( astc );
+    write< uint64_t >( &blocks, ktx2::kHeaderSize + 8, 64 );
+    blocks.resize( ktx2::kHeaderSize + ktx2::kLevelIndexEntrySize + 64 );
+    CHECK( parses( blocks, &file ) );
+}
+
+static void testMalformedHeaders()
+{
+    Header header;
+    std::vector< uint8_t > bytes = makeFile( header );
+
+    CHECK( !parses( std::vector< uint8_t >( bytes.begin(), bytes.begin() + ktx2::kHeaderSize - 1 ) ) );
+
+    std::vector< uint8_t > badIdentifier = bytes;
+    badIdentifier[5] = '1';
+    CHECK( !parses( badIdentifier ) );
+
+    auto rejects = []( void (*change)( Header* ) ) {
+        Header h;
+        change( &h );
+        return !parses( makeFile( h ) );
+    };
+    CHECK( rejects( []( Header* h ) { h->vkFormat = 23; } ) );              // R8G8B8_UNORM isn't supported
+    CHECK( rejects( []( Header* h ) { h->width = 0; } ) );
+    CHECK( rejects( []( Header* h ) { h->height = 0; } ) );
+    CHECK( rejects( []( Header* h ) { h->depth = 2; } ) );
+    CHECK( rejects( []( Header* h ) { h->faceCount = 0; } ) );
+    CHECK( rejects( []( Header* h ) { h->faceCount = 3; } ) );
+    CHECK( rejects( []( Header* h ) { h->faceCount = 6; h->height = 8; } ) );
+    CHECK( rejects( []( Header* h ) { h->levelCount = 6; } ) );             // 16x16 has 5 levels
+    CHECK( rejects( []( Header* h ) { h->width = ktx2::kMaxDimension + 1; h->height = 1; } ) );
+
+    // Oversized counts are rejected from the header alone, before any sizes
+    // are computed from them:
+    std::vector< uint8_t > huge = bytes;
+    write< uint32_t >( &huge, 20, 0xFFFFFFFF );
+    write< uint32_t >( &huge, 24, 0xFFFFFFFF );
+    CHECK( !parses( huge ) );
+
+    std::vector< uint8_t > layers = bytes;
+    write< uint32_t >( &layers, 32, ktx2::kMaxLayerCount + 1 );
+    CHECK( !parses( layers ) );
+    write< uint32_t >( &layers, 32, 0xFFFFFFFF );
+    CHECK( !parses( layers ) );
+}
+
+static void testMalformedLevelIndex()
+{
+    Header header;
+    header.levelCount = 5;
+    const std::vector< uint8_t > bytes = makeFile( header );
+    CHECK( parses( bytes ) );
+
+    // The index itself runs past the end of the file:
+    CHECK( !parses( std::vector< uint8_t >( bytes.begin(), bytes.begin() + ktx2::kHeaderSize + 4 * ktx2::kLevelIndexEntrySize ) ) );
+
+    // The last level runs past the end of the file:
+    CHECK( !parses( std::vector< uint8_t >( bytes.begin(), bytes.end() - 1 ) ) );
+
+    // Offsets and lengths whose sum wraps around:
+    std::vector< uint8_t > wrapped = bytes;
+    write< uint64_t >( &wrapped, ktx2::kHeaderSize, UINT64_MAX - 8 );
+    CHECK( !parses( wrapped ) );
+    wrapped = bytes;
+    write< uint64_t >( &wrapped, ktx2::kHeaderSize + 8, UINT64_MAX );
+    CHECK( !parses( wrapped ) );
+
+    // A level whose length doesn't match its dimensions:
+    std::vector< uint8_t > shortLevel = bytes;
+    write< uint64_t >( &shortLevel, ktx2::kHeaderSize + 8, 16 * 16 * 4 - 4 );
+    CHECK( !parses( shortLevel ) );
+
+    // Supercompressed levels are checked by their uncompressed length:
+    Header zstd;
+    zstd.supercompressionScheme = 2;
+    std::vector< uint8_t > compressed = makeFile( zstd );
+    write< uint64_t >( &compressed, ktx2::kHeaderSize + 8, 100 );
+    CHECK( parses( compressed ) );
+    write< uint64_t >( &compressed, ktx2::kHeaderSize + 16, 100 );
+    CHECK( !parses( compressed ) );
+}
+
+static void testTruncations()
+{
+    // No prefix of a valid file parses, whatever the cut:
+    Header header;
+    header.width = 8;
+    header.height = 4;
+    header.levelCount = 4;
+    const std::vector< uint8_t > bytes = makeFile( header );
+    bool anyParsed = false;
+    for ( size_t size = 0; size < bytes.size(); ++size )
+    {
+        ktx2::File file;
+        anyParsed |= ktx2::parse( bytes.data(), size, &file );
+    }
+    CHECK( !anyParsed );
+}
+
+int main()
+{
+    testValidFiles();
+    testMalformedHeaders();
+    testMalformedLevelIndex();
+    testTruncations();
+    return check::finish( "ktx2-test" );
+}
@@ -0,0 +1,260 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Parsing of KTX2 texture files. map() memory-maps a file and parse() checks
+// its header and level index against the file size, so that every level it
+// accepts can be read from the mapping without further checks. The sizes are
+// computed in checked 64-bit arithmetic. 07-texturing uploads the parsed
+// levels to Metal; the ktx2 test feeds parse() malformed files on any
+// platform.
+
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#pragma region Declarations {
+
+namespace ktx2
+{
+    struct FormatInfo
+    {
+        uint32_t vkFormat;
+        uint32_t blockWidth;
+        uint32_t blockHeight;
+        uint32_t bytesPerBlock;
+    };
+
+    struct Level
+    {
+        uint64_t byteOffset;
+        uint64_t byteLength;
+        uint64_t uncompressedByteLength;
+    };
+
+    struct File
+    {
+        const uint8_t* pData;
+        size_t size;
+        const FormatInfo* pFormat;
+        uint32_t width;
+        uint32_t height;
+        uint32_t layerCount;
+        uint32_t faceCount;
+        uint32_t levelCount;
+        uint32_t supercompressionScheme;
+        std::vector< Level > levels;
+    };
+
+    // Limits of the textures parse() accepts, which are Metal's limits for
+    // 2D textures, arrays and cube maps
+    constexpr uint32_t kMaxDimension = 16384;
+    constexpr uint32_t kMaxLayerCount = 2048;
+
+    // Expands one supercompressed mip level into pDst. Returns false on failure.
+    using SupercompressionDecoder = bool (*)( uint32_t scheme, const uint8_t* pSrc, size_t srcLength, uint8_t* pDst, size_t dstLength );
+
+    bool parse( const uint8_t* pData, size_t size, File* pFile );
+    bool map( const char* path, File* pFile );
+    void unmap( File* pFile );
+    uint64_t levelBytesPerRow( const File& file, uint32_t level );
+    uint64_t levelImageSize( const File& file, uint32_t level );
+}
+
+#pragma endregion Declarations }
+
+
+#pragma mark - KTX2
+#pragma region KTX2 {
+
+namespace ktx2
+{
+    constexpr FormatInfo kFormats[] = {
+        {  37, 1, 1,  4 },  // R8G8B8A8_UNORM
+        {  43, 1, 1,  4 },  // R8G8B8A8_SRGB
+        {  44, 1, 1,  4 },  // B8G8R8A8_UNORM
+        {  50, 1, 1,  4 },  // B8G8R8A8_SRGB
+        { 133, 4, 4,  8 },  // BC1_RGBA_UNORM
+        { 134, 4, 4,  8 },  // BC1_RGBA_SRGB
+        { 137, 4, 4, 16 },  // BC3_UNORM
+        { 138, 4, 4, 16 },  // BC3_SRGB
+        { 145, 4, 4, 16 },  // BC7_UNORM
+        { 146, 4, 4, 16 },  // BC7_SRGB
+        { 147, 4, 4,  8 },  // ETC2_R8G8B8_UNORM
+        { 148, 4, 4,  8 },  // ETC2_R8G8B8_SRGB
+        { 157, 4, 4, 16 },  // ASTC_4x4_UNORM
+        { 158, 4, 4, 16 },  // ASTC_4x4_SRGB
+        { 165, 6, 6, 16 },  // ASTC_6x6_UNORM
+        { 166, 6, 6, 16 },  // ASTC_6x6_SRGB
+        { 171, 8, 8, 16 },  // ASTC_8x8_UNORM
+        { 172, 8, 8, 16 },  // ASTC_8x8_SRGB
+    };
+
+    constexpr uint8_t kIdentifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+    constexpr size_t kHeaderSize = 80;
+    constexpr size_t kLevelIndexEntrySize = 24;
+
+    template< typename T >
+    inline T read( const uint8_t* p )
+    {
+        T value;
+        memcpy( &value, p, sizeof( T ) );
+        return value;
+    }
+
+    // With the dimensions bounded by kMaxDimension, neither product can
+    // overflow: a level is at most 16384 x 16384 texels of 16 bytes.
+    inline uint64_t levelBytesPerRow( const File& file, uint32_t level )
+    {
+        uint64_t w = std::max( 1u, file.width >> level );
+        return ((w + file.pFormat->blockWidth - 1) / file.pFormat->blockWidth) * file.pFormat->bytesPerBlock;
+    }
+
+    inline uint64_t levelImageSize( const File& file, uint32_t level )
+    {
+        uint64_t h = std::max( 1u, file.height >> level );
+        return levelBytesPerRow( file, level ) * ((h + file.pFormat->blockHeight - 1) / file.pFormat->blockHeight);
+    }
+
+    inline bool parse( const uint8_t* pData, size_t size, File* pFile )
+    {
+        if ( size < kHeaderSize || memcmp( pData, kIdentifier, sizeof( kIdentifier ) ) != 0 )
+        {
+            return false;
+        }
+
+        uint32_t vkFormat = read< uint32_t >( pData + 12 );
+        pFile->pData = pData;
+        pFile->size = size;
+        pFile->pFormat = nullptr;
+        for ( const FormatInfo& info : kFormats )
+        {
+            if ( info.vkFormat == vkFormat )
+            {
+                pFile->pFormat = &info;
+            }
+        }
+
+        pFile->width = read< uint32_t >( pData + 20 );
+        pFile->height = read< uint32_t >( pData + 24 );
+        uint32_t depth = read< uint32_t >( pData + 28 );
+        uint32_t layerCount = read< uint32_t >( pData + 32 );
+        pFile->layerCount = std::max( 1u, layerCount );
+        pFile->faceCount = read< uint32_t >( pData + 36 );
+        uint32_t levelCount = read< uint32_t >( pData + 40 );
+        pFile->levelCount = std::max( 1u, levelCount );
+        pFile->supercompressionScheme = read< uint32_t >( pData + 44 );
+
+        // Only 2D textures, arrays and cube maps of known formats can be
+        // uploaded. Cube faces must be square:
+        if ( !pFile->pFormat || pFile->width == 0 || pFile->height == 0 ||
+             pFile->width > kMaxDimension || pFile->height > kMaxDimension || depth > 1 ||
+             pFile->layerCount > kMaxLayerCount || (pFile->faceCount != 1 && pFile->faceCount != 6) ||
+             (pFile->faceCount == 6 && pFile->width != pFile->height) )
+        {
+            return false;
+        }
+
+        uint32_t maxLevelCount = 1;
+        while ( (std::max( pFile->width, pFile->height ) >> maxLevelCount) > 0 )
+        {
+            ++maxLevelCount;
+        }
+        if ( pFile->levelCount > maxLevelCount )
+        {
+            return false;
+        }
+
+        if ( size < kHeaderSize + pFile->levelCount * kLevelIndexEntrySize )
+        {
+            return false;
+        }
+
+        pFile->levels.resize( pFile->levelCount );
+        for ( uint32_t i = 0; i < pFile->levelCount; ++i )
+        {
+            const uint8_t* pEntry = pData + kHeaderSize + i * kLevelIndexEntrySize;
+            Level& level = pFile->levels[ i ];
+            level.byteOffset = read< uint64_t >( pEntry );
+            level.byteLength = read< uint64_t >( pEntry + 8 );
+            level.uncompressedByteLength = read< uint64_t >( pEntry + 16 );
+
+            if ( level.byteOffset > size || level.byteLength > size - level.byteOffset )
+            {
+                return false;
+            }
+
+            uint64_t expected = 0;
+            if ( __builtin_mul_overflow( levelImageSize( *pFile, i ), (uint64_t)pFile->layerCount * pFile->faceCount, &expected ) )
+            {
+                return false;
+            }
+            uint64_t uncompressed = pFile->supercompressionScheme ? level.uncompressedByteLength : level.byteLength;
+            if ( uncompressed != expected )
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    inline bool map( const char* path, File* pFile )
+    {
+        int fd = open( path, O_RDONLY );
+        if ( fd < 0 )
+        {
+            return false;
+        }
+
+        struct stat st;
+        void* pMapping = MAP_FAILED;
+        if ( fstat( fd, &st ) == 0 && st.st_size > 0 )
+        {
+            pMapping = mmap( nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+        }
+        close( fd );
+
+        if ( pMapping == MAP_FAILED )
+        {
+            return false;
+        }
+
+        if ( !parse( reinterpret_cast< const uint8_t* >( pMapping ), st.st_size, pFile ) )
+        {
+            munmap( pMapping, st.st_size );
+            return false;
+        }
+
+        return true;
+    }
+
+    inline void unmap( File* pFile )
+    {
+        munmap( const_cast< uint8_t* >( pFile->pData ), pFile->size );
+        pFile->pData = nullptr;
+        pFile->size = 0;
+    }
+}
+
+#pragma endregion KTX2 }
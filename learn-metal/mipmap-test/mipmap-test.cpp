@@ -0,0 +1,87 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tests the mip chain sizes and the reference downsampler in mipmap.hpp
+
+#include "../test-support/check.hpp"
+#include "../mipmap/mipmap.hpp"
+
+static constexpr uint32_t rgba( uint32_t r, uint32_t g, uint32_t b, uint32_t a )
+{
+    return r | (g << 8) | (b << 16) | (a << 24);
+}
+
+static void testLevelCount()
+{
+    static_assert( mipmap::levelCount( 128, 128 ) == 8, "128x128 has 8 levels" );
+    CHECK( mipmap::levelCount( 1, 1 ) == 1 );
+    CHECK( mipmap::levelCount( 2, 1 ) == 2 );
+    CHECK( mipmap::levelCount( 5, 3 ) == 3 );
+    CHECK( mipmap::levelCount( 17, 256 ) == 9 );
+    CHECK( mipmap::levelCount( 1920, 1080 ) == 11 );
+    CHECK( mipmap::levelSize( 5, 2 ) == 1 );
+    CHECK( mipmap::levelSize( 5, 7 ) == 1 );
+}
+
+static void testBoxFilter()
+{
+    // Each channel averages its 2x2 block and rounds to nearest:
+    const uint32_t src[ 4 ] = { rgba( 0, 10, 255, 255 ), rgba( 1, 20, 255, 255 ),
+                                rgba( 2, 30, 0, 255 ), rgba( 3, 41, 0, 0 ) };
+    uint32_t dst = 0;
+    mipmap::downsample( src, 2, 2, &dst );
+    CHECK( dst == rgba( 2, 25, 128, 191 ) );
+
+    // A single row halves along x only, and an odd last column is left out:
+    const uint32_t row[ 3 ] = { rgba( 100, 0, 0, 0 ), rgba( 200, 0, 0, 0 ), rgba( 255, 255, 255, 255 ) };
+    CHECK( mipmap::levelSize( 3, 1 ) == 1 );
+    mipmap::downsample( row, 3, 1, &dst );
+    CHECK( dst == rgba( 150, 0, 0, 0 ) );
+}
+
+static void testChain()
+{
+    // A one-texel checkerboard becomes uniform gray at level 1 and stays so:
+    const uint32_t width = 16, height = 8;
+    std::vector< std::vector< uint32_t > > levels( 1 );
+    for ( uint32_t y = 0; y < height; ++y )
+    {
+        for ( uint32_t x = 0; x < width; ++x )
+        {
+            levels[0].push_back( ((x ^ y) & 1) ? rgba( 255, 255, 255, 255 ) : rgba( 0, 0, 0, 255 ) );
+        }
+    }
+    mipmap::generateChain( &levels, width, height );
+    CHECK( levels.size() == 5 );
+    CHECK( levels.back().size() == 1 );
+    for ( size_t level = 1; level < levels.size(); ++level )
+    {
+        CHECK( levels[ level ].size() == mipmap::levelSize( width, level ) * mipmap::levelSize( height, level ) );
+        for ( uint32_t texel : levels[ level ] )
+        {
+            CHECK( texel == rgba( 128, 128, 128, 255 ) );
+        }
+    }
+}
+
+int main()
+{
+    testLevelCount();
+    testBoxFilter();
+    testChain();
+    return check::finish( "mipmap-test" );
+}
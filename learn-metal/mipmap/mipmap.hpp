@@ -0,0 +1,106 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Mip chains on the CPU. levelCount() sizes the chains the samples create for
+// their generated textures, and downsample() is a reference for the blit
+// encoder's generateMipmaps(): a 2x2 box filter over RGBA8 texels. The
+// software rasterizer in 10-frame-debugging builds its mip chains with it, and
+// the mipmap test checks it on any platform.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#pragma region Declarations {
+
+namespace mipmap
+{
+    constexpr uint32_t levelCount( uint32_t width, uint32_t height );
+    constexpr uint32_t levelSize( uint32_t size, uint32_t level );
+    void downsample( const uint32_t* pSrc, uint32_t srcWidth, uint32_t srcHeight, uint32_t* pDst );
+    void generateChain( std::vector< std::vector< uint32_t > >* pLevels, uint32_t width, uint32_t height );
+}
+
+#pragma endregion Declarations }
+
+
+#pragma mark - Mipmap
+#pragma region Mipmap {
+
+namespace mipmap
+{
+    // floor( log2( max( width, height ) ) ) + 1, down to a 1x1 level
+    constexpr uint32_t levelCount( uint32_t width, uint32_t height )
+    {
+        uint32_t size = std::max( width, height );
+        uint32_t count = 1;
+        while ( size > 1 )
+        {
+            size >>= 1;
+            ++count;
+        }
+        return count;
+    }
+
+    constexpr uint32_t levelSize( uint32_t size, uint32_t level )
+    {
+        return std::max( size >> level, 1u );
+    }
+
+    // Writes the next level of a srcWidth x srcHeight RGBA8 image. Each texel
+    // averages a 2x2 block with rounding. An odd last row or column is left
+    // out, and a dimension of 1 reuses its single texel.
+    inline void downsample( const uint32_t* pSrc, uint32_t srcWidth, uint32_t srcHeight, uint32_t* pDst )
+    {
+        const uint32_t width = levelSize( srcWidth, 1 );
+        const uint32_t height = levelSize( srcHeight, 1 );
+        for ( uint32_t y = 0; y < height; ++y )
+        {
+            const uint32_t* pRow0 = pSrc + std::min( 2 * y, srcHeight - 1 ) * srcWidth;
+            const uint32_t* pRow1 = pSrc + std::min( 2 * y + 1, srcHeight - 1 ) * srcWidth;
+            for ( uint32_t x = 0; x < width; ++x )
+            {
+                const uint32_t x0 = std::min( 2 * x, srcWidth - 1 );
+                const uint32_t x1 = std::min( 2 * x + 1, srcWidth - 1 );
+                uint32_t texel = 0;
+                for ( uint32_t shift = 0; shift < 32; shift += 8 )
+                {
+                    uint32_t sum = ((pRow0[ x0 ] >> shift) & 0xFF) + ((pRow0[ x1 ] >> shift) & 0xFF)
+                                 + ((pRow1[ x0 ] >> shift) & 0xFF) + ((pRow1[ x1 ] >> shift) & 0xFF);
+                    texel |= ((sum + 2) >> 2) << shift;
+                }
+                pDst[ y * width + x ] = texel;
+            }
+        }
+    }
+
+    // Sizes the chain to its full length and fills every level from level 0
+    inline void generateChain( std::vector< std::vector< uint32_t > >* pLevels, uint32_t width, uint32_t height )
+    {
+        pLevels->resize( levelCount( width, height ) );
+        for ( uint32_t level = 1; level < pLevels->size(); ++level )
+        {
+            (*pLevels)[ level ].resize( levelSize( width, level ) * levelSize( height, level ) );
+            downsample( (*pLevels)[ level - 1 ].data(), levelSize( width, level - 1 ), levelSize( height, level - 1 ),
+                        (*pLevels)[ level ].data() );
+        }
+    }
+}
+
+#pragma endregion Mipmap }
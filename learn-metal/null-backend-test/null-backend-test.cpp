@@ -0,0 +1,283 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tests the null command queue through objc_msgSend, as metal-cpp sends its
+// messages: encoder calls are counted, commit() signals events and then runs
+// the completed handlers, and each command buffer completes once. Then it
+// creates a frame's resources and states on the null device and encodes the
+// calls 10-frame-debugging makes for one frame. Without Metal it builds
+// against the stand-in runtime in objc-stub.
+
+#define OBJC_STUB_IMPLEMENTATION
+
+#include "../test-support/check.hpp"
+#include "../null-backend/null-backend.hpp"
+
+#include <cstring>
+#include <utility>
+
+using nullbackend::send;
+
+// Stands in for MTL::SharedEvent, which is all commit() needs of one
+static uint64_t g_signaledValue = 0;
+
+static void setSignaledValue( id self, SEL cmd, uint64_t value )
+{
+    g_signaledValue = value;
+}
+
+static id newEvent()
+{
+    Class cls = objc_allocateClassPair( objc_getClass( "NSObject" ), "LMTestSharedEvent", 0 );
+    class_addMethod( cls, sel_registerName( "setSignaledValue:" ), reinterpret_cast< IMP >( &setSignaledValue ), "v@:Q" );
+    objc_registerClassPair( cls );
+    return class_createInstance( cls, 0 );
+}
+
+// Marks a block as global, so _Block_copy() leaves it in place
+constexpr int kBlockIsGlobal = 1 << 28;
+
+// A handler with the layout of a block, which commit() invokes the way the
+// runtime would
+struct Handler
+{
+    nullbackend::BlockLayout layout;
+    id* pCompleted;
+    uint64_t* pSignaledWhenRun;
+    int* pRuns;
+};
+
+static void runHandler( void* pBlock, id commandBuffer )
+{
+    Handler* pHandler = static_cast< Handler* >( pBlock );
+    *pHandler->pCompleted = commandBuffer;
+    *pHandler->pSignaledWhenRun = g_signaledValue;
+    ++*pHandler->pRuns;
+}
+
+static void testEncoding()
+{
+    nullbackend::resetStats();
+    id queue = nullbackend::newCommandQueue();
+    id commandBuffer = send< id >( queue, "commandBuffer" );
+    CHECK( commandBuffer != nullptr );
+    CHECK( send< uintptr_t >( commandBuffer, "status" ) == 0 );
+
+    id encoder = send< id >( commandBuffer, "renderCommandEncoderWithDescriptor:", static_cast< id >( nullptr ) );
+    CHECK( encoder != nullptr );
+    send< void >( encoder, "setRenderPipelineState:", static_cast< id >( nullptr ) );
+    for ( uintptr_t i = 0; i < 10; ++i )
+    {
+        send< void >( encoder, "setVertexBuffer:offset:atIndex:", static_cast< id >( nullptr ), i * 256, uintptr_t( 0 ) );
+        send< void >( encoder, "drawIndexedPrimitives:indexCount:indexType:indexBuffer:indexBufferOffset:instanceCount:",
+                      uintptr_t( 3 ), uintptr_t( 36 ), uintptr_t( 0 ), static_cast< id >( nullptr ), uintptr_t( 0 ), uintptr_t( 100 ) );
+    }
+    send< void >( encoder, "endEncoding" );
+
+    id compute = send< id >( commandBuffer, "computeCommandEncoder" );
+    send< void >( compute, "setComputePipelineState:", static_cast< id >( nullptr ) );
+    send< void >( compute, "endEncoding" );
+
+    nullbackend::Stats stats = nullbackend::stats();
+    CHECK( stats.commandBuffers == 1 );
+    CHECK( stats.encoders == 2 );
+    CHECK( stats.encoderCalls == 24 );
+    CHECK( stats.commits == 0 );
+    CHECK( nullbackend::callCount( "setVertexBuffer:offset:atIndex:" ) == 10 );
+    CHECK( nullbackend::callCount( "endEncoding" ) == 2 );
+    CHECK( nullbackend::callCount( "setBytes:length:atIndex:" ) == 0 );
+    CHECK( nullbackend::callCount( "notAnEncoderMethod" ) == 0 );
+}
+
+static void testCommit()
+{
+    nullbackend::resetStats();
+    id queue = nullbackend::newCommandQueue();
+    id event = newEvent();
+
+    id commandBuffer = send< id >( queue, "commandBuffer" );
+    id completed = nullptr;
+    uint64_t signaledWhenRun = 0;
+    int runs = 0;
+    Handler handler = { { nullptr, kBlockIsGlobal, 0, &runHandler }, &completed, &signaledWhenRun, &runs };
+    send< void >( commandBuffer, "addCompletedHandler:", static_cast< void* >( &handler ) );
+    send< void >( commandBuffer, "encodeWaitForEvent:value:", event, uint64_t( 6 ) );
+    send< void >( commandBuffer, "encodeSignalEvent:value:", event, uint64_t( 7 ) );
+    CHECK( runs == 0 && g_signaledValue == 0 );
+
+    send< void >( commandBuffer, "commit" );
+    CHECK( runs == 1 );
+    CHECK( completed == commandBuffer );
+    CHECK( signaledWhenRun == 7 );
+    CHECK( send< uintptr_t >( commandBuffer, "status" ) == 4 );
+    CHECK( send< double >( commandBuffer, "GPUEndTime" ) - send< double >( commandBuffer, "GPUStartTime" ) == 0.0 );
+
+    // A second commit is ignored, as Metal rejects it:
+    send< void >( commandBuffer, "commit" );
+    CHECK( runs == 1 );
+
+    // Buffers that are never committed never complete:
+    id dropped = send< id >( queue, "commandBuffer" );
+    int droppedRuns = 0;
+    Handler droppedHandler = { { nullptr, kBlockIsGlobal, 0, &runHandler }, &completed, &signaledWhenRun, &droppedRuns };
+    send< void >( dropped, "addCompletedHandler:", static_cast< void* >( &droppedHandler ) );
+
+    nullbackend::Stats stats = nullbackend::stats();
+    CHECK( stats.commandBuffers == 2 );
+    CHECK( stats.commits == 1 );
+    CHECK( droppedRuns == 0 );
+}
+
+// Stands in for MTL::TextureDescriptor: 2D, RGBA8Unorm, 128x128 with a full
+// mip chain, shader read and write
+static const uintptr_t kDescriptorProperties[] = { 2, 70, 128, 128, 1, 8, 1, 3 };
+static const char* kDescriptorSelectors[] = { "textureType", "pixelFormat", "width", "height", "depth", "mipmapLevelCount", "arrayLength", "usage" };
+
+template< size_t Index >
+static uintptr_t descriptorProperty( id self, SEL cmd )
+{
+    return kDescriptorProperties[ Index ];
+}
+
+template< size_t... Indices >
+static id newTextureDescriptor( std::index_sequence< Indices... > )
+{
+    Class cls = objc_allocateClassPair( objc_getClass( "NSObject" ), "LMTestTextureDescriptor", 0 );
+    ( class_addMethod( cls, sel_registerName( kDescriptorSelectors[ Indices ] ), reinterpret_cast< IMP >( &descriptorProperty< Indices > ), "Q@:" ), ... );
+    objc_registerClassPair( cls );
+    return class_createInstance( cls, 0 );
+}
+
+// A pipeline state completion handler with the layout of a block
+struct StateHandler
+{
+    nullbackend::StateBlockLayout layout;
+    id state;
+    id error;
+    int runs;
+};
+
+static void runStateHandler( void* pBlock, id state, id reflection, id error )
+{
+    StateHandler* pHandler = static_cast< StateHandler* >( pBlock );
+    pHandler->state = state;
+    pHandler->error = error;
+    ++pHandler->runs;
+}
+
+struct MtlSize
+{
+    uintptr_t width, height, depth;
+};
+
+static void testDeviceFrame()
+{
+    nullbackend::resetStats();
+    id device = nullbackend::newDevice();
+    CHECK( device != nullptr );
+    CHECK( !send< bool >( device, "supportsFamily:", intptr_t( 1001 ) ) );
+
+    // Buffers are host memory, zeroed, that the CPU writes as it would a
+    // shared Metal buffer:
+    id instanceBuffer = send< id >( device, "newBufferWithLength:options:", uintptr_t( 4096 ), uintptr_t( 0 ) );
+    CHECK( send< uintptr_t >( instanceBuffer, "length" ) == 4096 );
+    uint8_t* pInstances = send< uint8_t* >( instanceBuffer, "contents" );
+    CHECK( pInstances != nullptr && reinterpret_cast< uintptr_t >( pInstances ) % 16 == 0 );
+    CHECK( pInstances[0] == 0 && pInstances[4095] == 0 );
+    memset( pInstances, 0x5a, 4096 );
+    CHECK( send< uint8_t* >( instanceBuffer, "contents" )[100] == 0x5a );
+
+    const uint16_t indices[] = { 0, 1, 2, 2, 3, 0 };
+    id indexBuffer = send< id >( device, "newBufferWithBytes:length:options:", static_cast< const void* >( indices ), uintptr_t( sizeof( indices ) ), uintptr_t( 0 ) );
+    CHECK( !memcmp( send< void* >( indexBuffer, "contents" ), indices, sizeof( indices ) ) );
+
+    id texture = send< id >( device, "newTextureWithDescriptor:", newTextureDescriptor( std::make_index_sequence< 8 >() ) );
+    CHECK( send< uintptr_t >( texture, "width" ) == 128 && send< uintptr_t >( texture, "height" ) == 128 );
+    CHECK( send< uintptr_t >( texture, "mipmapLevelCount" ) == 8 );
+    CHECK( send< uintptr_t >( texture, "pixelFormat" ) == 70 );
+
+    // States, including those built asynchronously, as the pipeline builder does:
+    id error = reinterpret_cast< id >( uintptr_t( 1 ) );
+    id renderState = send< id >( device, "newRenderPipelineStateWithDescriptor:error:", static_cast< id >( nullptr ), &error );
+    CHECK( renderState != nullptr && error == nullptr );
+    StateHandler handler = { { nullptr, kBlockIsGlobal, 0, &runStateHandler }, nullptr, nullptr, 0 };
+    send< void >( device, "newComputePipelineStateWithDescriptor:options:completionHandler:", static_cast< id >( nullptr ), uintptr_t( 0 ),
+                  static_cast< void* >( &handler ) );
+    CHECK( handler.runs == 1 && handler.state != nullptr && handler.error == nullptr );
+    CHECK( send< uintptr_t >( handler.state, "maxTotalThreadsPerThreadgroup" ) > 0 );
+    id depthState = send< id >( device, "newDepthStencilStateWithDescriptor:", static_cast< id >( nullptr ) );
+    CHECK( depthState != nullptr );
+
+    id event = send< id >( device, "newSharedEvent" );
+    CHECK( send< uint64_t >( event, "signaledValue" ) == 0 );
+
+    // One frame: the Mandelbrot dispatch, the mip chain, then the instanced
+    // cubes, signaling the event the next frame waits on.
+    id queue = send< id >( device, "newCommandQueue" );
+    id commandBuffer = send< id >( queue, "commandBuffer" );
+
+    id compute = send< id >( commandBuffer, "computeCommandEncoder" );
+    send< void >( compute, "setComputePipelineState:", handler.state );
+    send< void >( compute, "setTexture:atIndex:", texture, uintptr_t( 0 ) );
+    send< void >( compute, "setBuffer:offset:atIndex:", instanceBuffer, uintptr_t( 0 ), uintptr_t( 0 ) );
+    send< void >( compute, "dispatchThreads:threadsPerThreadgroup:", MtlSize{ 128, 128, 1 }, MtlSize{ 32, 32, 1 } );
+    send< void >( compute, "endEncoding" );
+
+    id blit = send< id >( commandBuffer, "blitCommandEncoder" );
+    send< void >( blit, "generateMipmapsForTexture:", texture );
+    send< void >( blit, "endEncoding" );
+
+    id render = send< id >( commandBuffer, "renderCommandEncoderWithDescriptor:", static_cast< id >( nullptr ) );
+    send< void >( render, "setRenderPipelineState:", renderState );
+    send< void >( render, "setDepthStencilState:", depthState );
+    send< void >( render, "setVertexBuffer:offset:atIndex:", instanceBuffer, uintptr_t( 0 ), uintptr_t( 1 ) );
+    send< void >( render, "setFragmentTexture:atIndex:", texture, uintptr_t( 0 ) );
+    send< void >( render, "setCullMode:", uintptr_t( 2 ) );
+    send< void >( render, "setFrontFacingWinding:", uintptr_t( 1 ) );
+    send< void >( render, "drawIndexedPrimitives:indexCount:indexType:indexBuffer:indexBufferOffset:instanceCount:",
+                  uintptr_t( 3 ), uintptr_t( 6 ), uintptr_t( 0 ), indexBuffer, uintptr_t( 0 ), uintptr_t( 1000 ) );
+    send< void >( render, "endEncoding" );
+
+    id completed = nullptr;
+    uint64_t signaledWhenRun = 0;
+    int runs = 0;
+    Handler frameHandler = { { nullptr, kBlockIsGlobal, 0, &runHandler }, &completed, &signaledWhenRun, &runs };
+    send< void >( commandBuffer, "addCompletedHandler:", static_cast< void* >( &frameHandler ) );
+    send< void >( commandBuffer, "encodeSignalEvent:value:", event, uint64_t( 1 ) );
+    send< void >( commandBuffer, "commit" );
+
+    CHECK( runs == 1 && completed == commandBuffer );
+    CHECK( send< uint64_t >( event, "signaledValue" ) == 1 );
+
+    nullbackend::Stats stats = nullbackend::stats();
+    CHECK( stats.buffers == 2 );
+    CHECK( stats.textures == 1 );
+    CHECK( stats.states == 3 );
+    CHECK( stats.commandBuffers == 1 && stats.commits == 1 );
+    CHECK( stats.encoders == 3 );
+    CHECK( stats.encoderCalls == 15 );
+    CHECK( nullbackend::callCount( "dispatchThreads:threadsPerThreadgroup:" ) == 1 );
+    CHECK( nullbackend::callCount( "drawIndexedPrimitives:indexCount:indexType:indexBuffer:indexBufferOffset:instanceCount:" ) == 1 );
+}
+
+int main()
+{
+    testEncoding();
+    testCommit();
+    testDeviceFrame();
+    return check::finish( "null-backend-test" );
+}
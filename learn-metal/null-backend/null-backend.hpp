@@ -0,0 +1,638 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// A command queue that accepts everything the renderers encode and sends
+// none of it to a GPU. Its command buffers and encoders are classes
+// registered with the Objective-C runtime, so metal-cpp talks to them as it
+// would to Metal's, and the renderers run their full CPU path unchanged.
+// commit() completes a command buffer on the spot: it signals the shared
+// events it was asked to, then runs the completed handlers. The queue counts
+// command buffers, encoders and every encoder call by selector, so tests and
+// benchmarks can see what was encoded.
+//
+// newDevice() returns a device to go with the queues. Its buffers live in
+// host memory, so the CPU can write them. Its textures take their size from
+// the descriptor and have no contents. Its pipeline states, depth stencil
+// states, samplers and shared events are placeholders. Pipeline states
+// created with a completion handler run the handler before returning. The
+// device doesn't compile libraries or keep archives, so 10-frame-debugging
+// still creates those on a real device.
+//
+// On platforms without Metal, the null backend test builds this header
+// against the stand-in runtime in objc-stub. That runtime has no reference
+// counting, so there these objects are never freed.
+
+#pragma once
+
+#include <objc/message.h>
+#include <objc/runtime.h>
+
+#if !defined( OBJC_STUB_RUNTIME )
+#include <Block.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#pragma region Declarations {
+
+namespace nullbackend
+{
+    // What the null queues and devices received since the last resetStats()
+    struct Stats
+    {
+        size_t commandBuffers;
+        size_t commits;
+        size_t encoders;
+        size_t encoderCalls;
+        size_t buffers;
+        size_t textures;
+        size_t states;
+    };
+
+    // Return retained objects, as MTL::CreateSystemDefaultDevice() and
+    // MTL::Device::newCommandQueue() do
+    id newDevice();
+    id newCommandQueue();
+
+    Stats stats();
+    size_t callCount( const char* selector );
+    void resetStats();
+}
+
+#pragma endregion Declarations }
+
+
+#pragma mark - Null Backend
+#pragma region Null Backend {
+
+namespace nullbackend
+{
+    // Command buffer handlers are blocks taking the command buffer. Calling
+    // through the block's layout works without compiler support for blocks.
+    struct BlockLayout
+    {
+        void* isa;
+        int flags;
+        int reserved;
+        void (*invoke)( void* pBlock, id commandBuffer );
+    };
+
+    // The same layout for the handlers of pipeline states created with a
+    // completion handler
+    struct StateBlockLayout
+    {
+        void* isa;
+        int flags;
+        int reserved;
+        void (*invoke)( void* pBlock, id state, id reflection, id error );
+    };
+
+    struct CommandBufferState
+    {
+        std::vector< void* > scheduledHandlers;
+        std::vector< void* > completedHandlers;
+        std::vector< std::pair< id, uint64_t > > signals;
+        bool committed = false;
+    };
+
+    struct BufferState
+    {
+        void* pContents;
+        uintptr_t length;
+    };
+
+    struct TextureState
+    {
+        uintptr_t textureType;
+        uintptr_t pixelFormat;
+        uintptr_t width;
+        uintptr_t height;
+        uintptr_t depth;
+        uintptr_t mipmapLevelCount;
+        uintptr_t arrayLength;
+        uintptr_t usage;
+    };
+
+    // The encoder methods the samples call. Each one is counted on its own;
+    // on Apple platforms, any other message to an encoder is also accepted,
+    // and counted only in the total.
+    constexpr const char* kEncoderSelectors[] = {
+        "setRenderPipelineState:",
+        "setDepthStencilState:",
+        "setCullMode:",
+        "setFrontFacingWinding:",
+        "setVertexBuffer:offset:atIndex:",
+        "setVertexBytes:length:atIndex:",
+        "setFragmentBuffer:offset:atIndex:",
+        "setFragmentTexture:atIndex:",
+        "setFragmentSamplerState:atIndex:",
+        "drawPrimitives:vertexStart:vertexCount:",
+        "drawPrimitives:vertexStart:vertexCount:instanceCount:",
+        "drawIndexedPrimitives:indexCount:indexType:indexBuffer:indexBufferOffset:",
+        "drawIndexedPrimitives:indexCount:indexType:indexBuffer:indexBufferOffset:instanceCount:",
+        "setComputePipelineState:",
+        "setBuffer:offset:atIndex:",
+        "setBytes:length:atIndex:",
+        "setTexture:atIndex:",
+        "dispatchThreads:threadsPerThreadgroup:",
+        "dispatchThreadgroups:threadsPerThreadgroup:",
+        "generateMipmapsForTexture:",
+        "copyFromBuffer:sourceOffset:toBuffer:destinationOffset:size:",
+        "useResource:usage:",
+        "memoryBarrierWithScope:",
+        "setLabel:",
+        "pushDebugGroup:",
+        "popDebugGroup",
+        "insertDebugSignpost:",
+        "endEncoding",
+    };
+
+    struct Backend
+    {
+        Class deviceClass;
+        Class queueClass;
+        Class commandBufferClass;
+        Class encoderClass;
+        Class bufferClass;
+        Class textureClass;
+        Class stateClass;
+        Class eventClass;
+
+        // Filled in once when the classes are registered, so counting a call
+        // only reads the map
+        std::unordered_map< SEL, std::atomic< size_t > > calls;
+        std::atomic< size_t > commandBuffers { 0 };
+        std::atomic< size_t > commits { 0 };
+        std::atomic< size_t > encoders { 0 };
+        std::atomic< size_t > encoderCalls { 0 };
+        std::atomic< size_t > buffers { 0 };
+        std::atomic< size_t > textures { 0 };
+        std::atomic< size_t > states { 0 };
+
+        Backend();
+    };
+
+    inline Backend& backend()
+    {
+        static Backend s_backend;
+        return s_backend;
+    }
+
+    template< typename _Ret, typename... _Args >
+    inline _Ret send( id obj, const char* selector, _Args... args )
+    {
+        return reinterpret_cast< _Ret (*)( id, SEL, _Args... ) >( &objc_msgSend )( obj, sel_registerName( selector ), args... );
+    }
+
+    // Objects are autoreleased where the runtime has pools, as Metal's are
+    inline id newObject( Class cls, size_t extraBytes )
+    {
+        id obj = class_createInstance( cls, extraBytes );
+#if !defined( OBJC_STUB_RUNTIME )
+        send< id >( obj, "autorelease" );
+#endif
+        return obj;
+    }
+
+    inline CommandBufferState* commandBufferState( id self )
+    {
+        return static_cast< CommandBufferState* >( object_getIndexedIvars( self ) );
+    }
+
+    // Arguments past the selector are ignored, which every calling
+    // convention the runtime supports allows.
+    inline uintptr_t ignoreMessage( id self, SEL cmd )
+    {
+        return 0;
+    }
+
+    inline uintptr_t countEncoderCall( id self, SEL cmd )
+    {
+        Backend& b = backend();
+        auto it = b.calls.find( cmd );
+        if ( it != b.calls.end() )
+        {
+            it->second.fetch_add( 1, std::memory_order_relaxed );
+        }
+        b.encoderCalls.fetch_add( 1, std::memory_order_relaxed );
+        return 0;
+    }
+
+    inline double zeroTime( id self, SEL cmd )
+    {
+        return 0.0;
+    }
+
+    inline id newEncoder( id self, SEL cmd )
+    {
+        Backend& b = backend();
+        b.encoders.fetch_add( 1, std::memory_order_relaxed );
+        return newObject( b.encoderClass, 0 );
+    }
+
+    inline id newCommandBuffer( id self, SEL cmd )
+    {
+        Backend& b = backend();
+        b.commandBuffers.fetch_add( 1, std::memory_order_relaxed );
+        id commandBuffer = newObject( b.commandBufferClass, sizeof( CommandBufferState ) );
+        new ( commandBufferState( commandBuffer ) ) CommandBufferState();
+        return commandBuffer;
+    }
+
+    inline void addHandler( std::vector< void* >* pHandlers, void* pBlock )
+    {
+#if !defined( OBJC_STUB_RUNTIME )
+        pBlock = _Block_copy( pBlock );
+#endif
+        pHandlers->push_back( pBlock );
+    }
+
+    inline void addScheduledHandler( id self, SEL cmd, void* pBlock )
+    {
+        addHandler( &commandBufferState( self )->scheduledHandlers, pBlock );
+    }
+
+    inline void addCompletedHandler( id self, SEL cmd, void* pBlock )
+    {
+        addHandler( &commandBufferState( self )->completedHandlers, pBlock );
+    }
+
+    inline void encodeSignalEvent( id self, SEL cmd, id event, uint64_t value )
+    {
+        commandBufferState( self )->signals.emplace_back( event, value );
+    }
+
+    inline void runHandlers( id self, std::vector< void* >* pHandlers )
+    {
+        for ( void* pBlock : *pHandlers )
+        {
+            static_cast< BlockLayout* >( pBlock )->invoke( pBlock, self );
+#if !defined( OBJC_STUB_RUNTIME )
+            _Block_release( pBlock );
+#endif
+        }
+        pHandlers->clear();
+        pHandlers->shrink_to_fit();
+    }
+
+    // Nothing runs on a GPU, so the work is scheduled and complete at once.
+    // Events are signaled before the completed handlers run, as on a GPU.
+    inline void commit( id self, SEL cmd )
+    {
+        CommandBufferState* pState = commandBufferState( self );
+        if ( pState->committed )
+        {
+            return;
+        }
+        pState->committed = true;
+        backend().commits.fetch_add( 1, std::memory_order_relaxed );
+
+        runHandlers( self, &pState->scheduledHandlers );
+        for ( const auto& signal : pState->signals )
+        {
+            send< void >( signal.first, "setSignaledValue:", signal.second );
+        }
+        pState->signals.clear();
+        pState->signals.shrink_to_fit();
+        runHandlers( self, &pState->completedHandlers );
+    }
+
+    inline uintptr_t status( id self, SEL cmd )
+    {
+        // MTL::CommandBufferStatusNotEnqueued and MTL::CommandBufferStatusCompleted
+        return commandBufferState( self )->committed ? 4 : 0;
+    }
+
+    inline id newQueue( id self, SEL cmd )
+    {
+        return class_createInstance( backend().queueClass, 0 );
+    }
+
+    inline id newQueueWithCount( id self, SEL cmd, uintptr_t maxCommandBufferCount )
+    {
+        return newQueue( self, cmd );
+    }
+
+    inline BufferState* bufferState( id self )
+    {
+        return static_cast< BufferState* >( object_getIndexedIvars( self ) );
+    }
+
+    // Zeroed, as new Metal buffers are, and aligned for any vector type
+    inline id newBuffer( id self, SEL cmd, uintptr_t length, uintptr_t options )
+    {
+        Backend& b = backend();
+        b.buffers.fetch_add( 1, std::memory_order_relaxed );
+        id buffer = class_createInstance( b.bufferClass, sizeof( BufferState ) );
+        bufferState( buffer )->pContents = ::operator new( std::max< uintptr_t >( length, 1 ), std::align_val_t( 64 ) );
+        bufferState( buffer )->length = length;
+        memset( bufferState( buffer )->pContents, 0, length );
+        return buffer;
+    }
+
+    inline id newBufferWithBytes( id self, SEL cmd, const void* pBytes, uintptr_t length, uintptr_t options )
+    {
+        id buffer = newBuffer( self, cmd, length, options );
+        if ( pBytes )
+        {
+            memcpy( bufferState( buffer )->pContents, pBytes, length );
+        }
+        return buffer;
+    }
+
+    inline void* bufferContents( id self, SEL cmd )
+    {
+        return bufferState( self )->pContents;
+    }
+
+    inline uintptr_t bufferLength( id self, SEL cmd )
+    {
+        return bufferState( self )->length;
+    }
+
+    inline TextureState* textureState( id self )
+    {
+        return static_cast< TextureState* >( object_getIndexedIvars( self ) );
+    }
+
+    inline id newTexture( id self, SEL cmd, id descriptor )
+    {
+        Backend& b = backend();
+        b.textures.fetch_add( 1, std::memory_order_relaxed );
+        id texture = class_createInstance( b.textureClass, sizeof( TextureState ) );
+        *textureState( texture ) = { send< uintptr_t >( descriptor, "textureType" ), send< uintptr_t >( descriptor, "pixelFormat" ),
+                                     send< uintptr_t >( descriptor, "width" ), send< uintptr_t >( descriptor, "height" ),
+                                     send< uintptr_t >( descriptor, "depth" ), send< uintptr_t >( descriptor, "mipmapLevelCount" ),
+                                     send< uintptr_t >( descriptor, "arrayLength" ), send< uintptr_t >( descriptor, "usage" ) };
+        return texture;
+    }
+
+    template< uintptr_t TextureState::*Property >
+    inline uintptr_t textureProperty( id self, SEL cmd )
+    {
+        return textureState( self )->*Property;
+    }
+
+    inline id newState( id self, SEL cmd, id descriptor )
+    {
+        Backend& b = backend();
+        b.states.fetch_add( 1, std::memory_order_relaxed );
+        return class_createInstance( b.stateClass, 0 );
+    }
+
+    inline id newStateWithError( id self, SEL cmd, id descriptor, id* pError )
+    {
+        if ( pError )
+        {
+            *pError = nullptr;
+        }
+        return newState( self, cmd, descriptor );
+    }
+
+    // The handler gets the state without a reference, as from Metal
+    inline void newStateWithHandler( id self, SEL cmd, id descriptor, uintptr_t options, void* pBlock )
+    {
+        id state = newState( self, cmd, descriptor );
+#if !defined( OBJC_STUB_RUNTIME )
+        send< id >( state, "autorelease" );
+#endif
+        static_cast< StateBlockLayout* >( pBlock )->invoke( pBlock, state, nullptr, nullptr );
+    }
+
+    // Pipeline properties the samples size their dispatches with
+    inline uintptr_t maxThreadsPerThreadgroup( id self, SEL cmd )
+    {
+        return 1024;
+    }
+
+    inline uintptr_t threadExecutionWidth( id self, SEL cmd )
+    {
+        return 32;
+    }
+
+    inline id newEvent( id self, SEL cmd )
+    {
+        id event = class_createInstance( backend().eventClass, sizeof( std::atomic< uint64_t > ) );
+        new ( object_getIndexedIvars( event ) ) std::atomic< uint64_t >( 0 );
+        return event;
+    }
+
+    inline uint64_t signaledValue( id self, SEL cmd )
+    {
+        return static_cast< std::atomic< uint64_t >* >( object_getIndexedIvars( self ) )->load();
+    }
+
+    inline void setSignaledValue( id self, SEL cmd, uint64_t value )
+    {
+        static_cast< std::atomic< uint64_t >* >( object_getIndexedIvars( self ) )->store( value );
+    }
+
+    inline bool supportsNothing( id self, SEL cmd, uintptr_t feature )
+    {
+        return false;
+    }
+
+#if !defined( OBJC_STUB_RUNTIME )
+    inline void deallocCommandBuffer( id self, SEL cmd )
+    {
+        CommandBufferState* pState = commandBufferState( self );
+        for ( void* pBlock : pState->scheduledHandlers )
+        {
+            _Block_release( pBlock );
+        }
+        for ( void* pBlock : pState->completedHandlers )
+        {
+            _Block_release( pBlock );
+        }
+        pState->~CommandBufferState();
+
+        objc_super super = { self, class_getSuperclass( object_getClass( self ) ) };
+        reinterpret_cast< void (*)( objc_super*, SEL ) >( &objc_msgSendSuper )( &super, cmd );
+    }
+
+    inline void deallocBuffer( id self, SEL cmd )
+    {
+        ::operator delete( bufferState( self )->pContents, std::align_val_t( 64 ) );
+
+        objc_super super = { self, class_getSuperclass( object_getClass( self ) ) };
+        reinterpret_cast< void (*)( objc_super*, SEL ) >( &objc_msgSendSuper )( &super, cmd );
+    }
+
+    // Accepts messages the classes don't implement, such as setLabel:
+    inline bool resolveIgnored( id cls, SEL cmd, SEL selector )
+    {
+        return class_addMethod( reinterpret_cast< Class >( cls ), selector, reinterpret_cast< IMP >( &ignoreMessage ), "Q@:" );
+    }
+
+    inline bool resolveEncoderCall( id cls, SEL cmd, SEL selector )
+    {
+        return class_addMethod( reinterpret_cast< Class >( cls ), selector, reinterpret_cast< IMP >( &countEncoderCall ), "Q@:" );
+    }
+#endif // !OBJC_STUB_RUNTIME
+
+    inline Backend::Backend()
+    {
+        auto add = []( Class cls, const char* selector, auto pFunction, const char* types ) {
+            class_addMethod( cls, sel_registerName( selector ), reinterpret_cast< IMP >( pFunction ), types );
+        };
+
+        Class nsObject = objc_getClass( "NSObject" );
+        encoderClass = objc_allocateClassPair( nsObject, "LMNullCommandEncoder", 0 );
+        for ( const char* selector : kEncoderSelectors )
+        {
+            SEL sel = sel_registerName( selector );
+            calls[ sel ].store( 0, std::memory_order_relaxed );
+            class_addMethod( encoderClass, sel, reinterpret_cast< IMP >( &countEncoderCall ), "Q@:" );
+        }
+
+        commandBufferClass = objc_allocateClassPair( nsObject, "LMNullCommandBuffer", 0 );
+        add( commandBufferClass, "renderCommandEncoderWithDescriptor:", &newEncoder, "@@:@" );
+        add( commandBufferClass, "computeCommandEncoder", &newEncoder, "@@:" );
+        add( commandBufferClass, "computeCommandEncoderWithDescriptor:", &newEncoder, "@@:@" );
+        add( commandBufferClass, "computeCommandEncoderWithDispatchType:", &newEncoder, "@@:Q" );
+        add( commandBufferClass, "blitCommandEncoder", &newEncoder, "@@:" );
+        add( commandBufferClass, "blitCommandEncoderWithDescriptor:", &newEncoder, "@@:@" );
+        add( commandBufferClass, "addScheduledHandler:", &addScheduledHandler, "v@:@?" );
+        add( commandBufferClass, "addCompletedHandler:", &addCompletedHandler, "v@:@?" );
+        add( commandBufferClass, "encodeSignalEvent:value:", &encodeSignalEvent, "v@:@Q" );
+        add( commandBufferClass, "encodeWaitForEvent:value:", &ignoreMessage, "v@:@Q" );
+        add( commandBufferClass, "presentDrawable:", &ignoreMessage, "v@:@" );
+        add( commandBufferClass, "enqueue", &ignoreMessage, "v@:" );
+        add( commandBufferClass, "commit", &commit, "v@:" );
+        add( commandBufferClass, "waitUntilScheduled", &ignoreMessage, "v@:" );
+        add( commandBufferClass, "waitUntilCompleted", &ignoreMessage, "v@:" );
+        add( commandBufferClass, "status", &status, "Q@:" );
+        add( commandBufferClass, "error", &ignoreMessage, "@@:" );
+        add( commandBufferClass, "GPUStartTime", &zeroTime, "d@:" );
+        add( commandBufferClass, "GPUEndTime", &zeroTime, "d@:" );
+        add( commandBufferClass, "kernelStartTime", &zeroTime, "d@:" );
+        add( commandBufferClass, "kernelEndTime", &zeroTime, "d@:" );
+
+        queueClass = objc_allocateClassPair( nsObject, "LMNullCommandQueue", 0 );
+        add( queueClass, "commandBuffer", &newCommandBuffer, "@@:" );
+        add( queueClass, "commandBufferWithUnretainedReferences", &newCommandBuffer, "@@:" );
+        add( queueClass, "commandBufferWithDescriptor:", &newCommandBuffer, "@@:@" );
+
+        bufferClass = objc_allocateClassPair( nsObject, "LMNullBuffer", 0 );
+        add( bufferClass, "contents", &bufferContents, "^v@:" );
+        add( bufferClass, "length", &bufferLength, "Q@:" );
+        add( bufferClass, "didModifyRange:", &ignoreMessage, "v@:{_NSRange=QQ}" );
+
+        textureClass = objc_allocateClassPair( nsObject, "LMNullTexture", 0 );
+        add( textureClass, "textureType", &textureProperty< &TextureState::textureType >, "Q@:" );
+        add( textureClass, "pixelFormat", &textureProperty< &TextureState::pixelFormat >, "Q@:" );
+        add( textureClass, "width", &textureProperty< &TextureState::width >, "Q@:" );
+        add( textureClass, "height", &textureProperty< &TextureState::height >, "Q@:" );
+        add( textureClass, "depth", &textureProperty< &TextureState::depth >, "Q@:" );
+        add( textureClass, "mipmapLevelCount", &textureProperty< &TextureState::mipmapLevelCount >, "Q@:" );
+        add( textureClass, "arrayLength", &textureProperty< &TextureState::arrayLength >, "Q@:" );
+        add( textureClass, "usage", &textureProperty< &TextureState::usage >, "Q@:" );
+        add( textureClass, "replaceRegion:mipmapLevel:withBytes:bytesPerRow:", &ignoreMessage, "v@:{MTLRegion={MTLOrigin=QQQ}{MTLSize=QQQ}}Q^vQ" );
+
+        stateClass = objc_allocateClassPair( nsObject, "LMNullState", 0 );
+        add( stateClass, "maxTotalThreadsPerThreadgroup", &maxThreadsPerThreadgroup, "Q@:" );
+        add( stateClass, "threadExecutionWidth", &threadExecutionWidth, "Q@:" );
+
+        eventClass = objc_allocateClassPair( nsObject, "LMNullSharedEvent", 0 );
+        add( eventClass, "signaledValue", &signaledValue, "Q@:" );
+        add( eventClass, "setSignaledValue:", &setSignaledValue, "v@:Q" );
+
+        deviceClass = objc_allocateClassPair( nsObject, "LMNullDevice", 0 );
+        add( deviceClass, "newCommandQueue", &newQueue, "@@:" );
+        add( deviceClass, "newCommandQueueWithMaxCommandBufferCount:", &newQueueWithCount, "@@:Q" );
+        add( deviceClass, "newBufferWithLength:options:", &newBuffer, "@@:QQ" );
+        add( deviceClass, "newBufferWithBytes:length:options:", &newBufferWithBytes, "@@:^vQQ" );
+        add( deviceClass, "newTextureWithDescriptor:", &newTexture, "@@:@" );
+        add( deviceClass, "newDepthStencilStateWithDescriptor:", &newState, "@@:@" );
+        add( deviceClass, "newSamplerStateWithDescriptor:", &newState, "@@:@" );
+        add( deviceClass, "newRenderPipelineStateWithDescriptor:error:", &newStateWithError, "@@:@^@" );
+        add( deviceClass, "newComputePipelineStateWithFunction:error:", &newStateWithError, "@@:@^@" );
+        add( deviceClass, "newRenderPipelineStateWithDescriptor:options:completionHandler:", &newStateWithHandler, "v@:@Q@?" );
+        add( deviceClass, "newComputePipelineStateWithDescriptor:options:completionHandler:", &newStateWithHandler, "v@:@Q@?" );
+        add( deviceClass, "newSharedEvent", &newEvent, "@@:" );
+        add( deviceClass, "supportsFamily:", &supportsNothing, "B@:q" );
+        add( deviceClass, "supportsCounterSampling:", &supportsNothing, "B@:Q" );
+
+#if !defined( OBJC_STUB_RUNTIME )
+        add( commandBufferClass, "dealloc", &deallocCommandBuffer, "v@:" );
+        add( object_getClass( reinterpret_cast< id >( encoderClass ) ), "resolveInstanceMethod:", &resolveEncoderCall, "B@::" );
+        add( object_getClass( reinterpret_cast< id >( commandBufferClass ) ), "resolveInstanceMethod:", &resolveIgnored, "B@::" );
+        add( object_getClass( reinterpret_cast< id >( queueClass ) ), "resolveInstanceMethod:", &resolveIgnored, "B@::" );
+        add( bufferClass, "dealloc", &deallocBuffer, "v@:" );
+        for ( Class cls : { bufferClass, textureClass, stateClass, eventClass, deviceClass } )
+        {
+            add( object_getClass( reinterpret_cast< id >( cls ) ), "resolveInstanceMethod:", &resolveIgnored, "B@::" );
+        }
+#endif
+
+        for ( Class cls : { encoderClass, commandBufferClass, queueClass, bufferClass, textureClass, stateClass, eventClass, deviceClass } )
+        {
+            objc_registerClassPair( cls );
+        }
+    }
+
+    inline id newDevice()
+    {
+        return class_createInstance( backend().deviceClass, 0 );
+    }
+
+    inline id newCommandQueue()
+    {
+        return newQueue( nullptr, nullptr );
+    }
+
+    inline Stats stats()
+    {
+        const Backend& b = backend();
+        return { b.commandBuffers.load( std::memory_order_relaxed ), b.commits.load( std::memory_order_relaxed ),
+                 b.encoders.load( std::memory_order_relaxed ), b.encoderCalls.load( std::memory_order_relaxed ),
+                 b.buffers.load( std::memory_order_relaxed ), b.textures.load( std::memory_order_relaxed ),
+                 b.states.load( std::memory_order_relaxed ) };
+    }
+
+    inline size_t callCount( const char* selector )
+    {
+        const Backend& b = backend();
+        auto it = b.calls.find( sel_registerName( selector ) );
+        return it != b.calls.end() ? it->second.load( std::memory_order_relaxed ) : 0;
+    }
+
+    inline void resetStats()
+    {
+        Backend& b = backend();
+        for ( auto& call : b.calls )
+        {
+            call.second.store( 0, std::memory_order_relaxed );
+        }
+        b.commandBuffers.store( 0, std::memory_order_relaxed );
+        b.commits.store( 0, std::memory_order_relaxed );
+        b.encoders.store( 0, std::memory_order_relaxed );
+        b.encoderCalls.store( 0, std::memory_order_relaxed );
+        b.buffers.store( 0, std::memory_order_relaxed );
+        b.textures.store( 0, std::memory_order_relaxed );
+        b.states.store( 0, std::memory_order_relaxed );
+    }
+}
+
+#pragma endregion Null Backend }
@@ -0,0 +1,135 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// objc_msgSend for the stand-in runtime. Like the real one, it finds the IMP
+// for the receiver's class and jumps to it with the caller's arguments intact.
+// It looks the IMP up in C++ rather than in a hand-tuned assembly cache, so it
+// is slower than the real objc_msgSend; compare the two dispatch paths on one
+// platform, not across platforms.
+
+#pragma once
+
+#include <objc/runtime.h>
+
+#include <cstdint>
+
+extern "C" void objc_msgSend( void );
+
+#if defined( __x86_64__ )
+// Declared so metal-cpp's x86_64 paths compile; the stub does not implement them
+extern "C" void objc_msgSend_fpret( void );
+extern "C" void objc_msgSend_stret( void );
+#endif // __x86_64__
+
+#if defined( OBJC_STUB_IMPLEMENTATION )
+
+extern "C" uintptr_t objc_stub_nil()
+{
+    return 0;
+}
+
+extern "C" IMP objc_stub_lookUpImp( id self, SEL name )
+{
+    return self ? class_getMethodImplementation( self->isa, name ) : reinterpret_cast< IMP >( &objc_stub_nil );
+}
+
+#if defined( __x86_64__ )
+
+// Saves the argument registers around the lookup, then tail-jumps to the IMP
+__asm__(
+    ".text\n"
+    ".globl objc_msgSend\n"
+    ".type objc_msgSend, @function\n"
+    "objc_msgSend:\n"
+    "    pushq %rbp\n"
+    "    movq %rsp, %rbp\n"
+    "    subq $192, %rsp\n"
+    "    movq %rdi, 0(%rsp)\n"
+    "    movq %rsi, 8(%rsp)\n"
+    "    movq %rdx, 16(%rsp)\n"
+    "    movq %rcx, 24(%rsp)\n"
+    "    movq %r8, 32(%rsp)\n"
+    "    movq %r9, 40(%rsp)\n"
+    "    movq %rax, 48(%rsp)\n"
+    "    movdqu %xmm0, 64(%rsp)\n"
+    "    movdqu %xmm1, 80(%rsp)\n"
+    "    movdqu %xmm2, 96(%rsp)\n"
+    "    movdqu %xmm3, 112(%rsp)\n"
+    "    movdqu %xmm4, 128(%rsp)\n"
+    "    movdqu %xmm5, 144(%rsp)\n"
+    "    movdqu %xmm6, 160(%rsp)\n"
+    "    movdqu %xmm7, 176(%rsp)\n"
+    "    call objc_stub_lookUpImp\n"
+    "    movq %rax, %r11\n"
+    "    movq 0(%rsp), %rdi\n"
+    "    movq 8(%rsp), %rsi\n"
+    "    movq 16(%rsp), %rdx\n"
+    "    movq 24(%rsp), %rcx\n"
+    "    movq 32(%rsp), %r8\n"
+    "    movq 40(%rsp), %r9\n"
+    "    movq 48(%rsp), %rax\n"
+    "    movdqu 64(%rsp), %xmm0\n"
+    "    movdqu 80(%rsp), %xmm1\n"
+    "    movdqu 96(%rsp), %xmm2\n"
+    "    movdqu 112(%rsp), %xmm3\n"
+    "    movdqu 128(%rsp), %xmm4\n"
+    "    movdqu 144(%rsp), %xmm5\n"
+    "    movdqu 160(%rsp), %xmm6\n"
+    "    movdqu 176(%rsp), %xmm7\n"
+    "    movq %rbp, %rsp\n"
+    "    popq %rbp\n"
+    "    jmp *%r11\n"
+);
+
+#elif defined( __aarch64__ )
+
+__asm__(
+    ".text\n"
+    ".globl objc_msgSend\n"
+    ".type objc_msgSend, %function\n"
+    "objc_msgSend:\n"
+    "    stp x29, x30, [sp, #-224]!\n"
+    "    mov x29, sp\n"
+    "    stp x0, x1, [sp, #16]\n"
+    "    stp x2, x3, [sp, #32]\n"
+    "    stp x4, x5, [sp, #48]\n"
+    "    stp x6, x7, [sp, #64]\n"
+    "    str x8, [sp, #80]\n"
+    "    stp q0, q1, [sp, #96]\n"
+    "    stp q2, q3, [sp, #128]\n"
+    "    stp q4, q5, [sp, #160]\n"
+    "    stp q6, q7, [sp, #192]\n"
+    "    bl objc_stub_lookUpImp\n"
+    "    mov x16, x0\n"
+    "    ldp x0, x1, [sp, #16]\n"
+    "    ldp x2, x3, [sp, #32]\n"
+    "    ldp x4, x5, [sp, #48]\n"
+    "    ldp x6, x7, [sp, #64]\n"
+    "    ldr x8, [sp, #80]\n"
+    "    ldp q0, q1, [sp, #96]\n"
+    "    ldp q2, q3, [sp, #128]\n"
+    "    ldp q4, q5, [sp, #160]\n"
+    "    ldp q6, q7, [sp, #192]\n"
+    "    ldp x29, x30, [sp], #224\n"
+    "    br x16\n"
+);
+
+#else
+#error "objc stub: objc_msgSend is only implemented for x86_64 and arm64"
+#endif
+
+#endif // OBJC_STUB_IMPLEMENTATION
@@ -0,0 +1,216 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// A stand-in for the Objective-C runtime, so metal-cpp's runtime code builds
+// and can be timed on platforms without libobjc. Like the real runtime, names
+// are interned in a locked table and every registration is counted. Classes
+// hold their methods in a table that is replaced, never modified, so lookups
+// take no lock. Define OBJC_STUB_IMPLEMENTATION in one translation unit to
+// get objc_msgSend (see message.h).
+
+#pragma once
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#define OBJC_STUB_RUNTIME 1
+
+typedef struct objc_selector* SEL;
+typedef struct objc_class* Class;
+typedef struct objc_object* id;
+typedef struct objc_object Protocol;
+typedef void ( *IMP )( void );
+
+struct objc_object
+{
+    Class isa;
+};
+
+struct objc_class
+{
+    Class superclass;
+    std::string name;
+    size_t instanceSize;
+    std::atomic< const std::unordered_map< SEL, IMP >* > methods;
+};
+
+namespace objc_stub
+{
+    using MethodTable = std::unordered_map< SEL, IMP >;
+
+    struct Table
+    {
+        std::mutex mutex;
+        std::unordered_map< std::string, std::string* > names;
+        std::unordered_map< std::string, Class > classes;
+        std::atomic< size_t > lookups { 0 };
+    };
+
+    inline Table& table()
+    {
+        static Table table;
+        return table;
+    }
+
+    inline void* intern( const char* name )
+    {
+        Table& t = table();
+        std::lock_guard< std::mutex > lock( t.mutex );
+        t.lookups.fetch_add( 1, std::memory_order_relaxed );
+        std::string*& pName = t.names[ name ];
+        if ( !pName )
+        {
+            pName = new std::string( name );
+        }
+        return pName;
+    }
+
+    inline Class newClass( Class superclass, const char* name )
+    {
+        Class cls = new objc_class { superclass, name, sizeof( objc_object ), {} };
+        cls->methods.store( new MethodTable(), std::memory_order_release );
+        return cls;
+    }
+
+    // Every class the headers ask for exists, as it would on a device
+    inline Class lookUpClass( const char* name )
+    {
+        Table& t = table();
+        std::lock_guard< std::mutex > lock( t.mutex );
+        t.lookups.fetch_add( 1, std::memory_order_relaxed );
+        Class& cls = t.classes[ name ];
+        if ( !cls )
+        {
+            cls = newClass( nullptr, name );
+        }
+        return cls;
+    }
+
+    // Old tables are leaked, since a lookup on another thread may still hold one
+    inline IMP setMethod( Class cls, SEL name, IMP imp, bool replace )
+    {
+        std::lock_guard< std::mutex > lock( table().mutex );
+        const MethodTable* pOld = cls->methods.load( std::memory_order_acquire );
+        auto it = pOld->find( name );
+        IMP previous = ( it != pOld->end() ) ? it->second : nullptr;
+        if ( previous && !replace )
+        {
+            return previous;
+        }
+        MethodTable* pNew = new MethodTable( *pOld );
+        ( *pNew )[ name ] = imp;
+        cls->methods.store( pNew, std::memory_order_release );
+        return previous;
+    }
+
+    inline void unrecognizedSelector()
+    {
+        __builtin_printf( "objc stub: unrecognized selector\n" );
+        std::abort();
+    }
+
+    inline size_t lookupCount()
+    {
+        return table().lookups.load( std::memory_order_relaxed );
+    }
+}
+
+inline SEL sel_registerName( const char* name )
+{
+    return static_cast< SEL >( objc_stub::intern( name ) );
+}
+
+inline Class objc_lookUpClass( const char* name )
+{
+    return objc_stub::lookUpClass( name );
+}
+
+inline Class objc_getClass( const char* name )
+{
+    return objc_stub::lookUpClass( name );
+}
+
+inline Protocol* objc_getProtocol( const char* name )
+{
+    return static_cast< Protocol* >( objc_stub::intern( name ) );
+}
+
+inline Class objc_allocateClassPair( Class superclass, const char* name, size_t extraBytes )
+{
+    Class cls = objc_stub::newClass( superclass, name );
+    cls->instanceSize = ( superclass ? superclass->instanceSize : sizeof( objc_object ) ) + extraBytes;
+    return cls;
+}
+
+inline void objc_registerClassPair( Class cls )
+{
+    std::lock_guard< std::mutex > lock( objc_stub::table().mutex );
+    objc_stub::table().classes[ cls->name ] = cls;
+}
+
+inline bool class_addMethod( Class cls, SEL name, IMP imp, const char* types )
+{
+    return objc_stub::setMethod( cls, name, imp, false ) == nullptr;
+}
+
+inline IMP class_replaceMethod( Class cls, SEL name, IMP imp, const char* types )
+{
+    return objc_stub::setMethod( cls, name, imp, true );
+}
+
+inline IMP class_getMethodImplementation( Class cls, SEL name )
+{
+    for ( ; cls; cls = cls->superclass )
+    {
+        const objc_stub::MethodTable* pMethods = cls->methods.load( std::memory_order_acquire );
+        auto it = pMethods->find( name );
+        if ( it != pMethods->end() )
+        {
+            return it->second;
+        }
+    }
+    return reinterpret_cast< IMP >( &objc_stub::unrecognizedSelector );
+}
+
+inline id class_createInstance( Class cls, size_t extraBytes )
+{
+    id obj = static_cast< id >( std::calloc( 1, cls->instanceSize + extraBytes ) );
+    obj->isa = cls;
+    return obj;
+}
+
+inline Class object_getClass( id obj )
+{
+    return obj ? obj->isa : nullptr;
+}
+
+inline Class object_setClass( id obj, Class cls )
+{
+    Class previous = obj->isa;
+    obj->isa = cls;
+    return previous;
+}
+
+// Extra bytes given to class_createInstance() follow the class's own instance
+inline void* object_getIndexedIvars( id obj )
+{
+    return reinterpret_cast< char* >( obj ) + obj->isa->instanceSize;
+}
@@ -0,0 +1,169 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tests the pipeline cache keys and index file in pipeline-cache.hpp. Every
+// input to a pipeline build must change its key, inputs that only differ in
+// order must not, and the index must reject files it can't fully trust.
+
+#include "../test-support/check.hpp"
+#include "../pipeline-cache/pipeline-cache.hpp"
+
+#include <unistd.h>
+
+using namespace pipeline_cache;
+
+static PipelineKey makeRenderKey()
+{
+    PipelineKey key = {};
+    key.kind = PipelineKind::Render;
+    key.device = "Test GPU";
+    key.source = "vertex float4 vertexMain() { return 0; }";
+    key.compileOptions = { 0, 0, 0, false, { { "FOO", "1" }, { "BAR", "2" } } };
+    key.functions = { "vertexMain", "fragmentMain" };
+    key.pixelFormats = { 81, 250, 0 };
+    key.blendStates = { { false, 0, 0, 1, 1, 0, 0, 0xf } };
+    key.vertexDescriptor = { { { 0, 30, 0, 0 }, { 1, 30, 12, 0 } }, { { 0, 24, 1, 1 } } };
+    key.sampleCount = 1;
+    key.constants = 0x1234567890abcdefull;
+    return key;
+}
+
+static void testEveryInputChangesTheKey()
+{
+    const PipelineKey base = makeRenderKey();
+    const uint64_t hash = hashKey( base );
+    CHECK( hashKey( makeRenderKey() ) == hash );
+
+    auto differs = [&]( void (*change)( PipelineKey* ) ){
+        PipelineKey key = base;
+        change( &key );
+        return hashKey( key ) != hash;
+    };
+
+    CHECK( differs( []( PipelineKey* k ){ k->kind = PipelineKind::Compute; } ) );
+    CHECK( differs( []( PipelineKey* k ){ k->device = "Other GPU"; } ) );
+    CHECK( differs( []( PipelineKey* k ){ k->source += " "; } ) );
+    CHECK( differs( []( PipelineKey* k ){ k->compileOptions.languageVersion = 0x30000; } ) );
+    CHECK( differs( []( PipelineKey* k ){ k->compileOptions.mathMode = 1; } ) );
+    CHECK( differs( []( PipelineKey* k ){ k->compileOptions.optimizationLevel = 1; } ) );
+    CHECK( differs( []( PipelineKey* k ){ k->compileOptions.preserveInvariance = true; } ) );
+    CHECK( differs( []( PipelineKey* k ){ k->compileOptions.macros[0].second = "0"; } ) );
+    CHECK( differs( []( PipelineKey* k ){ k->compileOptions.macros.pop_back(); } ) );
+    CHECK( differs( []( PipelineKey* k ){ k->functions[1] = "fragmentOther"; } ) );
+    CHECK( differs( []( PipelineKey* k ){ k->pixelFormats[0] = 80; } ) );
+    CHECK( differs( []( PipelineKey* k ){ k->blendStates[0].blendingEnabled = true; } ) );
+    CHECK( differs( []( PipelineKey* k ){ k->blendStates[0].destinationRGBBlendFactor = 5; } ) );
+    CHECK( differs( []( PipelineKey* k ){ k->blendStates[0].writeMask = 0x7; } ) );
+    CHECK( differs( []( PipelineKey* k ){ k->blendStates.push_back( k->blendStates[0] ); } ) );
+    CHECK( differs( []( PipelineKey* k ){ k->vertexDescriptor.attributes[1].offset = 16; } ) );
+    CHECK( differs( []( PipelineKey* k ){ k->vertexDescriptor.attributes[1].format = 29; } ) );
+    CHECK( differs( []( PipelineKey* k ){ k->vertexDescriptor.attributes.pop_back(); } ) );
+    CHECK( differs( []( PipelineKey* k ){ k->vertexDescriptor.layouts[0].stride = 32; } ) );
+    CHECK( differs( []( PipelineKey* k ){ k->vertexDescriptor.layouts[0].stepFunction = 2; } ) );
+    CHECK( differs( []( PipelineKey* k ){ k->sampleCount = 4; } ) );
+    CHECK( differs( []( PipelineKey* k ){ k->constants ^= 1ull << 40; } ) );
+}
+
+static void testBoundaries()
+{
+    // Moving bytes between neighbouring strings changes the key:
+    PipelineKey a = makeRenderKey();
+    PipelineKey b = a;
+    a.functions = { "ab", "c" };
+    b.functions = { "a", "bc" };
+    CHECK( hashKey( a ) != hashKey( b ) );
+
+    a.compileOptions.macros = { { "AB", "" } };
+    b.compileOptions.macros = { { "A", "B" } };
+    CHECK( hashKey( a ) != hashKey( b ) );
+}
+
+static void testMacroOrder()
+{
+    // The options hold the macros in a dictionary, which has no order:
+    PipelineKey a = makeRenderKey();
+    PipelineKey b = a;
+    std::swap( b.compileOptions.macros[0], b.compileOptions.macros[1] );
+    CHECK( hashKey( a ) == hashKey( b ) );
+}
+
+static void testKnownValues()
+{
+    // Keys go in an index file that must stay valid on every platform:
+    CHECK( hashBytes( kHashOffset, "a", 1 ) == 0xaf63dc4c8601ec8cull );
+    CHECK( hashValue( kHashOffset, 0x04030201 ) == hashBytes( kHashOffset, "\x01\x02\x03\x04", 4 ) );
+}
+
+static std::string tempPath()
+{
+    char path[] = "/tmp/pipeline-cache-test-XXXXXX";
+    int fd = mkstemp( path );
+    if ( fd >= 0 )
+    {
+        close( fd );
+    }
+    return path;
+}
+
+static void writeFile( const std::string& path, const char* contents )
+{
+    FILE* pFile = fopen( path.c_str(), "w" );
+    fputs( contents, pFile );
+    fclose( pFile );
+}
+
+static void testIndex()
+{
+    const std::string path = tempPath();
+    CacheIndex index;
+    index.insert( 0x0123456789abcdefull, "render.00000001" );
+    index.insert( 42, "mandelbrot_set.00000002" );
+    CHECK( index.save( path.c_str() ) );
+
+    CacheIndex loaded;
+    CHECK( loaded.load( path.c_str() ) );
+    CHECK( loaded.size() == 2 );
+    CHECK( loaded.contains( 0x0123456789abcdefull ) );
+    CHECK( loaded.contains( 42 ) );
+    CHECK( !loaded.contains( 43 ) );
+
+    // An index from another version keys pipelines differently:
+    writeFile( path, "learn-metal pipeline index 2\n000000000000002a render\n" );
+    CHECK( !loaded.load( path.c_str() ) );
+    CHECK( loaded.size() == 0 );
+
+    // So does a damaged one, which may list pipelines the archive never got:
+    writeFile( path, "learn-metal pipeline index 3\n000000000000002a render\nnot a key\n" );
+    CHECK( !loaded.load( path.c_str() ) );
+    CHECK( loaded.size() == 0 );
+
+    writeFile( path, "" );
+    CHECK( !loaded.load( path.c_str() ) );
+
+    unlink( path.c_str() );
+    CHECK( !loaded.load( path.c_str() ) );
+}
+
+int main()
+{
+    testEveryInputChangesTheKey();
+    testBoundaries();
+    testMacroOrder();
+    testKnownValues();
+    testIndex();
+    return check::finish( "pipeline-cache-test" );
+}
@@ -0,0 +1,311 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Keys pipelines by a hash of everything that goes into building them, and
+// remembers which keys the binary archive of 10-frame-debugging holds.
+// Nothing in here calls Metal, so the keys and the index file are the same
+// on any platform, and the pipeline cache test checks them on Linux.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#pragma region Declarations {
+
+namespace pipeline_cache
+{
+    static constexpr uint32_t kIndexVersion = 3;
+    static constexpr uint64_t kHashOffset = 0xcbf29ce484222325ull;
+    static constexpr uint64_t kHashPrime = 0x100000001b3ull;
+
+    enum class PipelineKind : uint8_t { Render, Compute };
+
+    // The MTL::CompileOptions the source was compiled with. Zero means the
+    // default for each value.
+    struct CompileOptions
+    {
+        uint32_t languageVersion;
+        uint32_t mathMode;
+        uint32_t optimizationLevel;
+        bool preserveInvariance;
+        std::vector< std::pair< std::string, std::string > > macros;
+    };
+
+    // The enabled attributes and layouts of an MTL::VertexDescriptor, with
+    // their indices:
+    struct VertexAttribute
+    {
+        uint32_t index;
+        uint32_t format;
+        uint32_t offset;
+        uint32_t bufferIndex;
+    };
+
+    struct VertexLayout
+    {
+        uint32_t index;
+        uint32_t stride;
+        uint32_t stepFunction;
+        uint32_t stepRate;
+    };
+
+    struct VertexDescriptor
+    {
+        std::vector< VertexAttribute > attributes;
+        std::vector< VertexLayout > layouts;
+    };
+
+    // One color attachment's blending, as the pipeline descriptor sets it:
+    struct BlendState
+    {
+        bool blendingEnabled;
+        uint32_t rgbBlendOperation;
+        uint32_t alphaBlendOperation;
+        uint32_t sourceRGBBlendFactor;
+        uint32_t sourceAlphaBlendFactor;
+        uint32_t destinationRGBBlendFactor;
+        uint32_t destinationAlphaBlendFactor;
+        uint32_t writeMask;
+    };
+
+    struct PipelineKey
+    {
+        PipelineKind kind;
+        std::string device;
+        std::string source;
+        CompileOptions compileOptions;
+        std::vector< std::string > functions;
+        std::vector< uint32_t > pixelFormats;
+        std::vector< BlendState > blendStates;
+        VertexDescriptor vertexDescriptor;
+        uint32_t sampleCount;
+        uint64_t constants;
+    };
+
+    struct Metrics
+    {
+        size_t hits;
+        size_t misses;
+        size_t staleHits;
+    };
+
+    uint64_t hashBytes( uint64_t hash, const void* pData, size_t size );
+    uint64_t hashValue( uint64_t hash, uint32_t value );
+    uint64_t hashString( uint64_t hash, const std::string& str );
+    uint64_t hashKey( const PipelineKey& key );
+
+    class CacheIndex
+    {
+        public:
+            bool load( const char* path );
+            bool save( const char* path ) const;
+            bool contains( uint64_t key ) const;
+            void insert( uint64_t key, const std::string& name );
+            void clear();
+            size_t size() const;
+
+        private:
+            std::unordered_map< uint64_t, std::string > _entries;
+    };
+}
+
+#pragma endregion Declarations }
+
+
+#pragma mark - Pipeline Cache
+#pragma region Pipeline Cache {
+
+namespace pipeline_cache
+{
+    // FNV-1a, which is simple enough to stay identical on every platform:
+    inline uint64_t hashBytes( uint64_t hash, const void* pData, size_t size )
+    {
+        const uint8_t* pBytes = static_cast< const uint8_t* >( pData );
+        for ( size_t i = 0; i < size; ++i )
+        {
+            hash ^= pBytes[ i ];
+            hash *= kHashPrime;
+        }
+        return hash;
+    }
+
+    inline uint64_t hashValue( uint64_t hash, uint32_t value )
+    {
+        // Spell out the byte order, so keys don't depend on the host:
+        uint8_t bytes[4] = { (uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16), (uint8_t)(value >> 24) };
+        return hashBytes( hash, bytes, sizeof( bytes ) );
+    }
+
+    inline uint64_t hashString( uint64_t hash, const std::string& str )
+    {
+        // Hashing the length keeps { "ab", "c" } apart from { "a", "bc" }:
+        hash = hashValue( hash, (uint32_t)str.size() );
+        return hashBytes( hash, str.data(), str.size() );
+    }
+
+    inline uint64_t hashCompileOptions( uint64_t hash, const CompileOptions& options )
+    {
+        hash = hashValue( hash, options.languageVersion );
+        hash = hashValue( hash, options.mathMode );
+        hash = hashValue( hash, options.optimizationLevel );
+        hash = hashValue( hash, options.preserveInvariance );
+
+        // Dictionaries have no order, so sort the macros by name:
+        std::vector< std::pair< std::string, std::string > > macros = options.macros;
+        std::sort( macros.begin(), macros.end() );
+        hash = hashValue( hash, (uint32_t)macros.size() );
+        for ( const auto& macro : macros )
+        {
+            hash = hashString( hash, macro.first );
+            hash = hashString( hash, macro.second );
+        }
+        return hash;
+    }
+
+    inline uint64_t hashVertexDescriptor( uint64_t hash, const VertexDescriptor& descriptor )
+    {
+        hash = hashValue( hash, (uint32_t)descriptor.attributes.size() );
+        for ( const VertexAttribute& attribute : descriptor.attributes )
+        {
+            hash = hashValue( hash, attribute.index );
+            hash = hashValue( hash, attribute.format );
+            hash = hashValue( hash, attribute.offset );
+            hash = hashValue( hash, attribute.bufferIndex );
+        }
+        hash = hashValue( hash, (uint32_t)descriptor.layouts.size() );
+        for ( const VertexLayout& layout : descriptor.layouts )
+        {
+            hash = hashValue( hash, layout.index );
+            hash = hashValue( hash, layout.stride );
+            hash = hashValue( hash, layout.stepFunction );
+            hash = hashValue( hash, layout.stepRate );
+        }
+        return hash;
+    }
+
+    inline uint64_t hashBlendState( uint64_t hash, const BlendState& blend )
+    {
+        hash = hashValue( hash, blend.blendingEnabled );
+        hash = hashValue( hash, blend.rgbBlendOperation );
+        hash = hashValue( hash, blend.alphaBlendOperation );
+        hash = hashValue( hash, blend.sourceRGBBlendFactor );
+        hash = hashValue( hash, blend.sourceAlphaBlendFactor );
+        hash = hashValue( hash, blend.destinationRGBBlendFactor );
+        hash = hashValue( hash, blend.destinationAlphaBlendFactor );
+        return hashValue( hash, blend.writeMask );
+    }
+
+    inline uint64_t hashKey( const PipelineKey& key )
+    {
+        uint64_t hash = hashValue( kHashOffset, kIndexVersion );
+        hash = hashValue( hash, (uint32_t)key.kind );
+        hash = hashString( hash, key.device );
+        hash = hashString( hash, key.source );
+        hash = hashCompileOptions( hash, key.compileOptions );
+        hash = hashValue( hash, (uint32_t)key.functions.size() );
+        for ( const std::string& function : key.functions )
+        {
+            hash = hashString( hash, function );
+        }
+        hash = hashValue( hash, (uint32_t)key.pixelFormats.size() );
+        for ( uint32_t pixelFormat : key.pixelFormats )
+        {
+            hash = hashValue( hash, pixelFormat );
+        }
+        hash = hashValue( hash, (uint32_t)key.blendStates.size() );
+        for ( const BlendState& blend : key.blendStates )
+        {
+            hash = hashBlendState( hash, blend );
+        }
+        hash = hashVertexDescriptor( hash, key.vertexDescriptor );
+        hash = hashValue( hash, key.sampleCount );
+        hash = hashValue( hash, (uint32_t)key.constants );
+        return hashValue( hash, (uint32_t)(key.constants >> 32) );
+    }
+
+    inline bool CacheIndex::load( const char* path )
+    {
+        _entries.clear();
+        FILE* pFile = fopen( path, "r" );
+        if ( !pFile )
+        {
+            return false;
+        }
+
+        unsigned version = 0;
+        bool valid = fscanf( pFile, "learn-metal pipeline index %u\n", &version ) == 1 && version == kIndexVersion;
+        unsigned long long key = 0;
+        char name[256];
+        while ( valid && fscanf( pFile, "%llx %255s\n", &key, name ) == 2 )
+        {
+            _entries[ key ] = name;
+        }
+        valid = valid && feof( pFile );
+        fclose( pFile );
+
+        // A partial index could claim pipelines the archive never got:
+        if ( !valid )
+        {
+            _entries.clear();
+        }
+        return valid;
+    }
+
+    inline bool CacheIndex::save( const char* path ) const
+    {
+        FILE* pFile = fopen( path, "w" );
+        if ( !pFile )
+        {
+            return false;
+        }
+
+        fprintf( pFile, "learn-metal pipeline index %u\n", kIndexVersion );
+        for ( const auto& entry : _entries )
+        {
+            fprintf( pFile, "%016llx %s\n", (unsigned long long)entry.first, entry.second.c_str() );
+        }
+        return fclose( pFile ) == 0;
+    }
+
+    inline bool CacheIndex::contains( uint64_t key ) const
+    {
+        return _entries.find( key ) != _entries.end();
+    }
+
+    inline void CacheIndex::insert( uint64_t key, const std::string& name )
+    {
+        _entries[ key ] = name;
+    }
+
+    inline void CacheIndex::clear()
+    {
+        _entries.clear();
+    }
+
+    inline size_t CacheIndex::size() const
+    {
+        return _entries.size();
+    }
+}
+
+#pragma endregion Pipeline Cache }
@@ -0,0 +1,333 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Rasterizes a small checked-in command stream, three textured cubes over a
+// Mandelbrot texture, and compares the image with a checked-in golden PNG:
+// every channel within softraster::kGoldenTolerance levels on all but
+// softraster::kGoldenMismatchFraction of the pixels. Run from the top of the
+// repository. After a deliberate change to the rasterizer or the stream
+// format, run it with --update to write both fixtures again, and look at the
+// new golden image before committing it.
+
+#include "../test-support/check.hpp"
+#include "../softraster/softraster.hpp"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+using cmdstream::Op;
+using softraster::float3;
+using softraster::float4;
+using softraster::float4x4;
+
+static const char* kStreamPath = "learn-metal/softraster-test/cubes.lmcs";
+static const char* kGoldenPath = "learn-metal/softraster-test/cubes.png";
+static constexpr uint32_t kWidth = 128;
+static constexpr uint32_t kHeight = 96;
+
+class Stream
+{
+    public:
+        Stream()
+        {
+            cmdstream::Header header = { cmdstream::kMagic, cmdstream::kVersion };
+            append( &header, sizeof( header ) );
+        }
+
+        void op( Op op, const void* pPayload, uint32_t size )
+        {
+            bytes.push_back( (uint8_t)op );
+            append( &size, sizeof( size ) );
+            append( pPayload, size );
+        }
+
+        void op( Op op )
+        {
+            this->op( op, nullptr, 0 );
+        }
+
+        template< typename T >
+        void op( Op op, const T& payload )
+        {
+            this->op( op, &payload, sizeof( T ) );
+        }
+
+        void state( uint32_t id, const std::string& name, const specialization::VariantKey& constants = {} )
+        {
+            std::vector< uint8_t > payload = cmdstream::stateDeclaration( id, { name, constants } );
+            op( Op::DeclareState, payload.data(), (uint32_t)payload.size() );
+        }
+
+        void bufferData( uint32_t id, const void* pData, uint32_t length )
+        {
+            std::vector< uint8_t > payload( cmdstream::kBufferDataHeaderSize + length );
+            uint32_t offset = 0;
+            memcpy( &payload[0], &id, sizeof( id ) );
+            memcpy( &payload[4], &offset, sizeof( offset ) );
+            memcpy( &payload[ cmdstream::kBufferDataHeaderSize ], pData, length );
+            op( Op::BufferData, payload.data(), (uint32_t)payload.size() );
+        }
+
+        std::vector< uint8_t > bytes;
+
+    private:
+        void append( const void* pData, size_t size )
+        {
+            bytes.insert( bytes.end(), (const uint8_t*)pData, (const uint8_t*)pData + size );
+        }
+};
+
+static float4x4 transform( float3 position, float angleX, float angleY, float scale )
+{
+    // Rotates about x, then y, then scales and moves into place:
+    const float cx = cosf( angleX ), sx = sinf( angleX ), cy = cosf( angleY ), sy = sinf( angleY );
+    float4x4 m = { { { cy, 0.f, -sy, 0.f }, { sx * sy, cx, sx * cy, 0.f }, { cx * sy, -sx, cx * cy, 0.f }, { 0.f, 0.f, 0.f, 1.f } } };
+    for ( int i = 0; i < 3; ++i )
+    {
+        m.columns[ i ] = m.columns[ i ] * scale;
+    }
+    m.columns[3] = { position.x, position.y, position.z, 1.f };
+    return m;
+}
+
+static softraster::float3x3 upperLeft( const float4x4& m )
+{
+    softraster::float3x3 result;
+    for ( int i = 0; i < 3; ++i )
+    {
+        result.columns[ i ] = { m.columns[ i ].x, m.columns[ i ].y, m.columns[ i ].z };
+    }
+    return result;
+}
+
+// One frame as 10-frame-debugging records it, with a cheaper Mandelbrot
+// variant and a light from the upper left, so the test also covers the
+// recorded function constants.
+static Stream cubeStream()
+{
+    const float s = 0.5f;
+    softraster::VertexData vertices[] = {
+        { { -s, -s, +s }, {  0.f,  0.f,  1.f }, { 0.f, 1.f } },
+        { { +s, -s, +s }, {  0.f,  0.f,  1.f }, { 1.f, 1.f } },
+        { { +s, +s, +s }, {  0.f,  0.f,  1.f }, { 1.f, 0.f } },
+        { { -s, +s, +s }, {  0.f,  0.f,  1.f }, { 0.f, 0.f } },
+
+        { { +s, -s, +s }, {  1.f,  0.f,  0.f }, { 0.f, 1.f } },
+        { { +s, -s, -s }, {  1.f,  0.f,  0.f }, { 1.f, 1.f } },
+        { { +s, +s, -s }, {  1.f,  0.f,  0.f }, { 1.f, 0.f } },
+        { { +s, +s, +s }, {  1.f,  0.f,  0.f }, { 0.f, 0.f } },
+
+        { { +s, -s, -s }, {  0.f,  0.f, -1.f }, { 0.f, 1.f } },
+        { { -s, -s, -s }, {  0.f,  0.f, -1.f }, { 1.f, 1.f } },
+        { { -s, +s, -s }, {  0.f,  0.f, -1.f }, { 1.f, 0.f } },
+        { { +s, +s, -s }, {  0.f,  0.f, -1.f }, { 0.f, 0.f } },
+
+        { { -s, -s, -s }, { -1.f,  0.f,  0.f }, { 0.f, 1.f } },
+        { { -s, -s, +s }, { -1.f,  0.f,  0.f }, { 1.f, 1.f } },
+        { { -s, +s, +s }, { -1.f,  0.f,  0.f }, { 1.f, 0.f } },
+        { { -s, +s, -s }, { -1.f,  0.f,  0.f }, { 0.f, 0.f } },
+
+        { { -s, +s, +s }, {  0.f,  1.f,  0.f }, { 0.f, 1.f } },
+        { { +s, +s, +s }, {  0.f,  1.f,  0.f }, { 1.f, 1.f } },
+        { { +s, +s, -s }, {  0.f,  1.f,  0.f }, { 1.f, 0.f } },
+        { { -s, +s, -s }, {  0.f,  1.f,  0.f }, { 0.f, 0.f } },
+
+        { { -s, -s, -s }, {  0.f, -1.f,  0.f }, { 0.f, 1.f } },
+        { { +s, -s, -s }, {  0.f, -1.f,  0.f }, { 1.f, 1.f } },
+        { { +s, -s, +s }, {  0.f, -1.f,  0.f }, { 1.f, 0.f } },
+        { { -s, -s, +s }, {  0.f, -1.f,  0.f }, { 0.f, 0.f } }
+    };
+    uint16_t indices[] = {
+         0,  1,  2,  2,  3,  0,
+         4,  5,  6,  6,  7,  4,
+         8,  9, 10, 10, 11,  8,
+        12, 13, 14, 14, 15, 12,
+        16, 17, 18, 18, 19, 16,
+        20, 21, 22, 22, 23, 20,
+    };
+
+    softraster::InstanceData instances[3];
+    const float3 positions[3] = { { -1.1f, 0.2f, -3.2f }, { 0.f, -0.15f, -2.4f }, { 1.1f, 0.25f, -3.6f } };
+    const float4 colors[3] = { { 1.f, 0.4f, 0.3f, 1.f }, { 0.9f, 0.9f, 0.9f, 1.f }, { 0.3f, 0.6f, 1.f, 1.f } };
+    for ( int i = 0; i < 3; ++i )
+    {
+        instances[ i ].instanceTransform = transform( positions[ i ], 0.45f + 0.3f * i, 0.6f - 0.5f * i, 0.9f );
+        instances[ i ].instanceNormalTransform = upperLeft( transform( {}, 0.45f + 0.3f * i, 0.6f - 0.5f * i, 1.f ) );
+        instances[ i ].instanceColor = colors[ i ];
+    }
+
+    // The sample's makePerspective( 45 degrees, 4:3, 0.03, 500 ), looking
+    // down -z:
+    softraster::CameraData camera = {};
+    const float ys = 1.f / tanf( 0.25f * (float)M_PI * 0.5f );
+    const float zs = 500.f / (0.03f - 500.f);
+    camera.perspectiveTransform = { { { ys * 0.75f, 0.f, 0.f, 0.f }, { 0.f, ys, 0.f, 0.f }, { 0.f, 0.f, zs, -1.f }, { 0.f, 0.f, 0.03f * zs, 0.f } } };
+    camera.worldTransform = transform( {}, 0.f, 0.f, 1.f );
+    camera.worldNormalTransform = upperLeft( camera.worldTransform );
+
+    const uint32_t frameIndex = 0;
+    Stream stream;
+    stream.op( Op::BeginFrame );
+    stream.op( Op::BeginCompute );
+    stream.state( 1, "mandelbrot_set", specialization::VariantKey().set( shader_constants::kMaxIteration, 48u ) );
+    stream.op( Op::SetComputePipelineState, uint32_t( 1 ) );
+    stream.op( Op::DeclareBuffer, cmdstream::BufferDecl{ 2, 0, sizeof( frameIndex ) } );
+    stream.op( Op::SetComputeBuffer, cmdstream::Binding{ 2, 0, 0 } );
+    stream.op( Op::DeclareTexture, cmdstream::TextureDecl{ 3, 64, 64, mipmap::levelCount( 64, 64 ), 70, 3 } );
+    stream.op( Op::SetComputeTexture, cmdstream::Binding{ 3, 0, 0 } );
+    stream.op( Op::DispatchThreadgroups, cmdstream::Dispatch{ { 8, 8, 1 }, { 8, 8, 1 } } );
+    stream.op( Op::EndEncoding );
+    stream.op( Op::BeginBlit );
+    stream.op( Op::GenerateMipmaps, uint32_t( 3 ) );
+    stream.op( Op::EndEncoding );
+    stream.op( Op::BeginRender );
+    stream.state( 4, "render", specialization::VariantKey().set( shader_constants::kLightDirection, float3{ -1.f, 1.f, 0.6f } ) );
+    stream.op( Op::SetRenderPipelineState, uint32_t( 4 ) );
+    stream.state( 5, "depth less" );
+    stream.op( Op::SetDepthStencilState, uint32_t( 5 ) );
+    stream.op( Op::DeclareBuffer, cmdstream::BufferDecl{ 6, 0, sizeof( vertices ) } );
+    stream.op( Op::DeclareBuffer, cmdstream::BufferDecl{ 7, 0, sizeof( instances ) } );
+    stream.op( Op::DeclareBuffer, cmdstream::BufferDecl{ 8, 0, sizeof( camera ) } );
+    stream.op( Op::DeclareBuffer, cmdstream::BufferDecl{ 9, 0, sizeof( indices ) } );
+    stream.op( Op::SetVertexBuffer, cmdstream::Binding{ 6, 0, 0 } );
+    stream.op( Op::SetVertexBuffer, cmdstream::Binding{ 7, 0, 1 } );
+    stream.op( Op::SetVertexBuffer, cmdstream::Binding{ 8, 0, 2 } );
+    stream.op( Op::SetFragmentTexture, cmdstream::Binding{ 3, 0, 0 } );
+    stream.op( Op::SetCullMode, softraster::kCullModeBack );
+    stream.op( Op::SetFrontFacingWinding, softraster::kWindingCounterClockwise );
+    stream.op( Op::DrawIndexedPrimitives, cmdstream::DrawIndexed{ softraster::kPrimitiveTypeTriangle, 36, softraster::kIndexTypeUInt16, 9, 0, 3 } );
+    stream.op( Op::EndEncoding );
+    stream.bufferData( 2, &frameIndex, sizeof( frameIndex ) );
+    stream.bufferData( 6, vertices, sizeof( vertices ) );
+    stream.bufferData( 7, instances, sizeof( instances ) );
+    stream.bufferData( 8, &camera, sizeof( camera ) );
+    stream.bufferData( 9, indices, sizeof( indices ) );
+    stream.op( Op::EndFrame );
+    return stream;
+}
+
+static bool rasterize( softraster::Rasterizer* pRasterizer )
+{
+    if ( !pRasterizer->load( kStreamPath ) || pRasterizer->frameCount() != 1 )
+    {
+        return false;
+    }
+    pRasterizer->executeFrame( 0 );
+    return true;
+}
+
+static bool update()
+{
+    std::vector< uint8_t > bytes = cubeStream().bytes;
+    FILE* pFile = fopen( kStreamPath, "wb" );
+    if ( !pFile || fwrite( bytes.data(), 1, bytes.size(), pFile ) != bytes.size() || fclose( pFile ) != 0 )
+    {
+        return false;
+    }
+    softraster::Rasterizer rasterizer( kWidth, kHeight );
+    return rasterize( &rasterizer ) && rasterizer.writePng( kGoldenPath );
+}
+
+static void testGolden()
+{
+    softraster::Rasterizer rasterizer( kWidth, kHeight );
+    CHECK( rasterize( &rasterizer ) );
+
+    uint32_t width = 0, height = 0;
+    std::vector< uint32_t > golden;
+    CHECK( softraster::readPng( kGoldenPath, &width, &height, &golden ) );
+    CHECK( width == kWidth && height == kHeight );
+    CHECK( softraster::matchesGolden( rasterizer.color(), golden ) );
+
+    // The image is more than the clear color: the cubes cover a good part
+    // of it, textured and lit.
+    const uint32_t clear = rasterizer.color()[0];
+    size_t covered = std::count_if( rasterizer.color().begin(), rasterizer.color().end(), [&]( uint32_t c ){ return c != clear; } );
+    CHECK( covered > kWidth * kHeight / 8 );
+}
+
+static void testMismatches()
+{
+    std::vector< uint32_t > golden( 1000, 0xff808080 );
+    std::vector< uint32_t > image = golden;
+    CHECK( softraster::countMismatches( image, golden, 0 ) == 0 );
+
+    image[0] = 0xff808082;
+    image[1] = 0xff7d8080;
+    CHECK( softraster::countMismatches( image, golden, softraster::kGoldenTolerance ) == 1 );
+    CHECK( softraster::matchesGolden( image, golden ) );
+
+    for ( size_t i = 0; i < 10; ++i )
+    {
+        image[ i ] = 0xff000000;
+    }
+    CHECK( !softraster::matchesGolden( image, golden ) );
+    CHECK( !softraster::matchesGolden( std::vector< uint32_t >( 999, 0xff808080 ), golden ) );
+}
+
+// A texture whose levels have one color each, so the sampled color names
+// the level:
+static softraster::Texture levelTexture()
+{
+    softraster::Texture texture;
+    texture.width = 4;
+    texture.height = 4;
+    const uint32_t colors[3] = { 0xff0000ff, 0xff00ff00, 0xffff0000 };
+    for ( uint32_t level = 0; level < 3; ++level )
+    {
+        texture.levels.emplace_back( mipmap::levelSize( 4, level ) * mipmap::levelSize( 4, level ), colors[ level ] );
+    }
+    return texture;
+}
+
+static void testNonFiniteLod()
+{
+    const softraster::Texture texture = levelTexture();
+    const float inf = std::numeric_limits< float >::infinity();
+    const float nan = std::numeric_limits< float >::quiet_NaN();
+
+    float3 c = softraster::sample( texture, { 0.3f, 0.6f }, 0.5f );
+    CHECK( fabsf( c.x - 0.5f ) < 1e-5f && fabsf( c.y - 0.5f ) < 1e-5f && c.z == 0.f );
+
+    // A zero derivative gives -inf, an infinite one +inf, and 0 / 0 NaN:
+    c = softraster::sample( texture, { 0.3f, 0.6f }, -inf );
+    CHECK( c.x == 1.f && c.y == 0.f && c.z == 0.f );
+    c = softraster::sample( texture, { 0.3f, 0.6f }, inf );
+    CHECK( c.x == 0.f && c.y == 0.f && c.z == 1.f );
+    c = softraster::sample( texture, { 0.3f, 0.6f }, nan );
+    CHECK( c.x == 1.f && c.y == 0.f && c.z == 0.f );
+    c = softraster::sample( texture, { nan, inf }, nan );
+    CHECK( c.x == 1.f && c.y == 0.f && c.z == 0.f );
+}
+
+int main( int argc, char* argv[] )
+{
+    if ( argc > 1 && !strcmp( argv[1], "--update" ) )
+    {
+        bool written = update();
+        __builtin_printf( "%s \"%s\" and \"%s\"\n", written ? "Wrote" : "Failed to write", kStreamPath, kGoldenPath );
+        return written ? 0 : 1;
+    }
+
+    testGolden();
+    testMismatches();
+    testNonFiniteLod();
+    return check::finish( "softraster-test" );
+}
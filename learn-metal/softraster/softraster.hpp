@@ -0,0 +1,1116 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// A tiled, multithreaded CPU implementation of the passes in a command
+// stream 10-frame-debugging recorded. It runs C++ ports of the sample's
+// shaders, so it can produce reference images to compare GPU output against.
+// It reads the recorded buffers through plain copies of the sample's shader
+// types and records Metal enums by value, so nothing in here needs Metal or
+// simd: the softraster test rasterizes a checked-in stream on any platform
+// and compares the image with a checked-in golden PNG.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "../cmdstream/cmdstream.hpp"
+#include "../mipmap/mipmap.hpp"
+#include "../specialization/specialization.hpp"
+
+#pragma region Declarations {
+
+namespace softraster
+{
+    // Laid out like the simd types of the same names: a float3 takes 16
+    // bytes, and the matrices are arrays of columns.
+    struct float2 { float x, y; };
+    struct alignas( 16 ) float3 { float x, y, z; };
+    struct alignas( 16 ) float4 { float x, y, z, w; };
+    struct float3x3 { float3 columns[3]; };
+    struct float4x4 { float4 columns[4]; };
+
+    float2 operator+( float2 a, float2 b );
+    float2 operator-( float2 a, float2 b );
+    float2 operator*( float2 a, float2 b );
+    float2 operator*( float2 a, float s );
+    float2 operator*( float s, float2 a );
+    float2 operator/( float2 a, float s );
+    float3 operator+( float3 a, float3 b );
+    float3 operator-( float3 a, float3 b );
+    float3 operator*( float3 a, float3 b );
+    float3 operator*( float3 a, float s );
+    float3 operator*( float s, float3 a );
+    float4 operator+( float4 a, float4 b );
+    float4 operator-( float4 a, float4 b );
+    float4 operator*( float4 a, float s );
+    float4& operator+=( float4& a, float4 b );
+    float4 operator*( const float4x4& m, float4 v );
+    float4x4 operator*( const float4x4& a, const float4x4& b );
+    float3 operator*( const float3x3& m, float3 v );
+    float dot( float3 a, float3 b );
+    float length( float2 v );
+    float3 normalize( float3 v );
+
+    // The buffer layouts of the sample's shader_types:
+    struct VertexData
+    {
+        float3 position;
+        float3 normal;
+        float2 texcoord;
+    };
+
+    struct InstanceData
+    {
+        float4x4 instanceTransform;
+        float3x3 instanceNormalTransform;
+        float4 instanceColor;
+    };
+
+    struct CameraData
+    {
+        float4x4 perspectiveTransform;
+        float4x4 worldTransform;
+        float3x3 worldNormalTransform;
+    };
+
+    // The values of the Metal enums a stream records:
+    static constexpr uint32_t kCullModeNone = 0;
+    static constexpr uint32_t kCullModeFront = 1;
+    static constexpr uint32_t kCullModeBack = 2;
+    static constexpr uint32_t kWindingClockwise = 0;
+    static constexpr uint32_t kWindingCounterClockwise = 1;
+    static constexpr uint32_t kPrimitiveTypeTriangle = 3;
+    static constexpr uint32_t kIndexTypeUInt16 = 0;
+
+    // Golden images match when every channel of all but a few pixels is
+    // within kGoldenTolerance levels. The few are edge pixels and Mandelbrot
+    // escape counts that rounding differences between compilers can flip.
+    static constexpr uint32_t kGoldenTolerance = 2;
+    static constexpr double kGoldenMismatchFraction = 0.005;
+
+    static constexpr uint32_t kTileSize = 64;
+
+    struct Texture
+    {
+        uint32_t width;
+        uint32_t height;
+        std::vector< std::vector< uint32_t > > levels;
+    };
+
+    struct Vertex
+    {
+        float4 position;
+        float3 normal;
+        float3 color;
+        float2 texcoord;
+    };
+
+    struct Triangle
+    {
+        float2 screen[3];
+        float depth[3];
+        float invW[3];
+        float3 normal[3];
+        float3 color[3];
+        float2 texcoord[3];
+        float invArea;
+        int minX, minY, maxX, maxY;
+    };
+
+    struct BufferBinding
+    {
+        uint32_t id;
+        uint32_t offset;
+    };
+
+    // Port of sampler( address::repeat, filter::linear, mip_filter::linear ).
+    // A lod that isn't finite, from a degenerate derivative, picks the base
+    // level, or the last level for +inf.
+    float3 sample( const Texture& texture, float2 texcoord, float lod );
+
+    // RGBA8 images, stored without compression. readPng() reads back what
+    // writePng() wrote and rejects anything else.
+    bool writePng( const char* path, uint32_t width, uint32_t height, const std::vector< uint32_t >& pixels );
+    bool readPng( const char* path, uint32_t* pWidth, uint32_t* pHeight, std::vector< uint32_t >* pPixels );
+
+    // The number of pixels with a channel more than tolerance levels apart:
+    size_t countMismatches( const std::vector< uint32_t >& image, const std::vector< uint32_t >& golden, uint32_t tolerance );
+    bool matchesGolden( const std::vector< uint32_t >& image, const std::vector< uint32_t >& golden );
+
+    class Rasterizer
+    {
+        public:
+            Rasterizer( uint32_t width, uint32_t height );
+            bool load( const char* path );
+            size_t frameCount() const;
+            void executeFrame( size_t frame );
+            uint32_t width() const;
+            uint32_t height() const;
+            const std::vector< uint32_t >& color() const;
+            bool writePng( const char* path ) const;
+
+        private:
+            template< typename T > const T* bufferContents( const BufferBinding& binding, size_t count ) const;
+            void clear();
+            void dispatchMandelbrot( uint32_t gridWidth, uint32_t gridHeight, const specialization::VariantKey& constants );
+            void generateMipmaps( Texture* pTexture );
+            void drawIndexed( uint32_t indexCount, uint32_t indexBufferId, uint32_t indexBufferOffset, uint32_t instanceCount );
+            void setupTriangle( const Vertex& v0, const Vertex& v1, const Vertex& v2 );
+            void rasterizeTile( uint32_t tileX, uint32_t tileY );
+
+            cmdstream::Reader _reader;
+            uint32_t _width;
+            uint32_t _height;
+            uint32_t _tilesX;
+            uint32_t _tilesY;
+            std::vector< uint32_t > _color;
+            std::vector< float > _depth;
+            std::unordered_map< uint32_t, std::vector< uint8_t > > _buffers;
+            std::unordered_map< uint32_t, Texture > _textures;
+            std::unordered_map< uint32_t, cmdstream::StateDecl > _states;
+            BufferBinding _computeBuffers[4];
+            BufferBinding _vertexBuffers[4];
+            uint32_t _computeTexture;
+            uint32_t _fragmentTexture;
+            uint32_t _computePipeline;
+            uint32_t _renderPipeline;
+            float3 _lightDirection;
+            uint32_t _depthStencilState;
+            uint32_t _cullMode;
+            uint32_t _winding;
+            std::vector< Triangle > _triangles;
+            std::vector< std::vector< uint32_t > > _bins;
+    };
+}
+
+namespace specialization
+{
+    template<> struct ConstantTraits< softraster::float3 > { static constexpr ConstantType type = ConstantType::Float3; static constexpr size_t size = 12; };
+}
+
+// The function constants of the sample's shaders, with the values they used
+// to hard-code:
+namespace shader_constants
+{
+    static const specialization::Constant< uint32_t > kMaxIteration = { 0, "kMaxIteration", 1000 };
+    static const specialization::Constant< float > kAnimationFrequency = { 1, "kAnimationFrequency", 0.01f };
+    static const specialization::Constant< float > kAnimationSpeed = { 2, "kAnimationSpeed", 4.0f };
+    static const specialization::Constant< float > kAnimationScaleLow = { 3, "kAnimationScaleLow", 0.62f };
+    static const specialization::Constant< float > kAnimationScale = { 4, "kAnimationScale", 0.38f };
+    static const specialization::Constant< float > kPaletteFrequency = { 5, "kPaletteFrequency", 0.15f };
+    static const specialization::Constant< float > kPalettePhase = { 6, "kPalettePhase", 3.0f };
+    static const specialization::Constant< softraster::float3 > kLightDirection = { 10, "kLightDirection", { 1.0f, 1.0f, 0.8f } };
+}
+
+#pragma endregion Declarations }
+
+
+#pragma mark - Vectors
+#pragma region Vectors {
+
+namespace softraster
+{
+    inline float2 operator+( float2 a, float2 b ) { return { a.x + b.x, a.y + b.y }; }
+    inline float2 operator-( float2 a, float2 b ) { return { a.x - b.x, a.y - b.y }; }
+    inline float2 operator*( float2 a, float2 b ) { return { a.x * b.x, a.y * b.y }; }
+    inline float2 operator*( float2 a, float s ) { return { a.x * s, a.y * s }; }
+    inline float2 operator*( float s, float2 a ) { return a * s; }
+    inline float2 operator/( float2 a, float s ) { return { a.x / s, a.y / s }; }
+    inline float3 operator+( float3 a, float3 b ) { return { a.x + b.x, a.y + b.y, a.z + b.z }; }
+    inline float3 operator-( float3 a, float3 b ) { return { a.x - b.x, a.y - b.y, a.z - b.z }; }
+    inline float3 operator*( float3 a, float3 b ) { return { a.x * b.x, a.y * b.y, a.z * b.z }; }
+    inline float3 operator*( float3 a, float s ) { return { a.x * s, a.y * s, a.z * s }; }
+    inline float3 operator*( float s, float3 a ) { return a * s; }
+    inline float4 operator+( float4 a, float4 b ) { return { a.x + b.x, a.y + b.y, a.z + b.z, a.w + b.w }; }
+    inline float4 operator-( float4 a, float4 b ) { return { a.x - b.x, a.y - b.y, a.z - b.z, a.w - b.w }; }
+    inline float4 operator*( float4 a, float s ) { return { a.x * s, a.y * s, a.z * s, a.w * s }; }
+    inline float4& operator+=( float4& a, float4 b ) { return a = a + b; }
+
+    inline float4 operator*( const float4x4& m, float4 v )
+    {
+        return m.columns[0] * v.x + m.columns[1] * v.y + m.columns[2] * v.z + m.columns[3] * v.w;
+    }
+
+    inline float4x4 operator*( const float4x4& a, const float4x4& b )
+    {
+        return { { a * b.columns[0], a * b.columns[1], a * b.columns[2], a * b.columns[3] } };
+    }
+
+    inline float3 operator*( const float3x3& m, float3 v )
+    {
+        return m.columns[0] * v.x + m.columns[1] * v.y + m.columns[2] * v.z;
+    }
+
+    inline float dot( float3 a, float3 b ) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+    inline float length( float2 v ) { return sqrtf( v.x * v.x + v.y * v.y ); }
+    inline float3 normalize( float3 v ) { return v * (1.f / sqrtf( dot( v, v ) )); }
+}
+
+#pragma endregion Vectors }
+
+
+#pragma mark - Software Rasterizer
+#pragma region Software Rasterizer {
+
+namespace softraster
+{
+    template< typename F >
+    inline void parallelFor( size_t count, F fn )
+    {
+        size_t threadCount = std::min< size_t >( std::max( std::thread::hardware_concurrency(), 1u ), count );
+        std::atomic< size_t > next( 0 );
+        auto worker = [&](){
+            for ( size_t i = next++; i < count; i = next++ )
+            {
+                fn( i );
+            }
+        };
+
+        std::vector< std::thread > threads;
+        for ( size_t i = 1; i < threadCount; ++i )
+        {
+            threads.emplace_back( worker );
+        }
+        worker();
+        for ( std::thread& thread : threads )
+        {
+            thread.join();
+        }
+    }
+
+    template< typename T >
+    inline T lerp( T a, T b, float t )
+    {
+        return a + (b - a) * t;
+    }
+
+    inline uint32_t packRGBA8( float4 c )
+    {
+        auto channel = []( float v ){ return (uint32_t)lrintf( std::min( std::max( v, 0.f ), 1.f ) * 255.f ); };
+        return channel( c.x ) | (channel( c.y ) << 8) | (channel( c.z ) << 16) | (channel( c.w ) << 24);
+    }
+
+    inline float4 unpackRGBA8( uint32_t c )
+    {
+        return float4{ (float)(c & 0xff), (float)((c >> 8) & 0xff), (float)((c >> 16) & 0xff), (float)(c >> 24) } * (1.f / 255.f);
+    }
+
+    inline float linearToSRGB( float c )
+    {
+        c = std::min( std::max( c, 0.f ), 1.f );
+        return c <= 0.0031308f ? c * 12.92f : 1.055f * powf( c, 1.f / 2.4f ) - 0.055f;
+    }
+
+    // Twice the signed area of (a, b, p); positive when p is to the right of
+    // a->b in the y-down screen space:
+    inline float edge( float2 a, float2 b, float2 p )
+    {
+        return (b.x - a.x) * (p.y - a.y) - (b.y - a.y) * (p.x - a.x);
+    }
+
+    // Pixels exactly on an edge shared by two triangles belong to just one
+    // of them, since the two triangles walk the edge in opposite directions:
+    inline bool ownsEdge( float2 a, float2 b )
+    {
+        return b.y > a.y || (b.y == a.y && b.x < a.x);
+    }
+
+    inline float3 sample( const Texture& texture, float2 texcoord, float lod )
+    {
+        // std::min and std::max pass NaN through, and casting it to an
+        // integer is undefined, so settle non-finite values first:
+        const float lastLevel = (float)(texture.levels.size() - 1);
+        lod = std::isfinite( lod ) ? std::min( std::max( lod, 0.f ), lastLevel ) : (lod > 0.f ? lastLevel : 0.f);
+        if ( !std::isfinite( texcoord.x ) || !std::isfinite( texcoord.y ) )
+        {
+            texcoord = { 0.f, 0.f };
+        }
+        uint32_t baseLevel = (uint32_t)lod;
+        float levelBlend = lod - baseLevel;
+
+        float4 result = { 0.f, 0.f, 0.f, 0.f };
+        for ( uint32_t level = baseLevel; level <= std::min< uint32_t >( baseLevel + 1, texture.levels.size() - 1 ); ++level )
+        {
+            int width = std::max( texture.width >> level, 1u );
+            int height = std::max( texture.height >> level, 1u );
+            float u = (texcoord.x - floorf( texcoord.x )) * width - 0.5f;
+            float v = (texcoord.y - floorf( texcoord.y )) * height - 0.5f;
+            int x0 = (int)floorf( u );
+            int y0 = (int)floorf( v );
+            float fx = u - x0;
+            float fy = v - y0;
+            int x1 = (x0 + 1) % width, y1 = (y0 + 1) % height;
+            x0 = (x0 + width) % width;
+            y0 = (y0 + height) % height;
+
+            const std::vector< uint32_t >& texels = texture.levels[ level ];
+            float4 top = lerp( unpackRGBA8( texels[ y0 * width + x0 ] ), unpackRGBA8( texels[ y0 * width + x1 ] ), fx );
+            float4 bottom = lerp( unpackRGBA8( texels[ y1 * width + x0 ] ), unpackRGBA8( texels[ y1 * width + x1 ] ), fx );
+            float weight = level == baseLevel ? 1.f - levelBlend : levelBlend;
+            result += lerp( top, bottom, fy ) * weight;
+        }
+        return { result.x, result.y, result.z };
+    }
+
+    inline Rasterizer::Rasterizer( uint32_t width, uint32_t height )
+    : _width( width )
+    , _height( height )
+    , _tilesX( (width + kTileSize - 1) / kTileSize )
+    , _tilesY( (height + kTileSize - 1) / kTileSize )
+    , _color( width * height )
+    , _depth( width * height )
+    , _computeBuffers{}
+    , _vertexBuffers{}
+    , _computeTexture( 0 )
+    , _fragmentTexture( 0 )
+    , _computePipeline( 0 )
+    , _renderPipeline( 0 )
+    , _lightDirection( normalize( shader_constants::kLightDirection.defaultValue ) )
+    , _depthStencilState( 0 )
+    , _cullMode( kCullModeNone )
+    , _winding( kWindingClockwise )
+    , _bins( _tilesX * _tilesY )
+    {
+        clear();
+    }
+
+    inline bool Rasterizer::load( const char* path )
+    {
+        if ( !_reader.load( path ) )
+        {
+            __builtin_printf( "Invalid command stream \"%s\": %s\n", path, _reader.error() );
+            return false;
+        }
+
+        // Allocate everything the stream declares, zeroed like new Metal
+        // resources, so that every id a frame refers to exists:
+        for ( const auto& entry : _reader.buffers() )
+        {
+            _buffers[ entry.first ].assign( entry.second.length, 0 );
+        }
+        for ( const auto& entry : _reader.textures() )
+        {
+            const cmdstream::TextureDecl& decl = entry.second;
+            Texture& texture = _textures[ entry.first ];
+            texture.width = decl.width;
+            texture.height = decl.height;
+            texture.levels.resize( decl.mipmapLevelCount );
+            for ( uint32_t level = 0; level < decl.mipmapLevelCount; ++level )
+            {
+                texture.levels[ level ].assign( mipmap::levelSize( decl.width, level ) * mipmap::levelSize( decl.height, level ), 0 );
+            }
+        }
+        _states = _reader.states();
+        return true;
+    }
+
+    inline size_t Rasterizer::frameCount() const
+    {
+        return _reader.frameCount();
+    }
+
+    inline uint32_t Rasterizer::width() const
+    {
+        return _width;
+    }
+
+    inline uint32_t Rasterizer::height() const
+    {
+        return _height;
+    }
+
+    inline const std::vector< uint32_t >& Rasterizer::color() const
+    {
+        return _color;
+    }
+
+    // Returns null unless count elements of T fit in the buffer at the
+    // binding's offset, and the offset is aligned for T:
+    template< typename T >
+    const T* Rasterizer::bufferContents( const BufferBinding& binding, size_t count ) const
+    {
+        auto it = _buffers.find( binding.id );
+        if ( it == _buffers.end() || binding.offset % alignof( T ) != 0 || binding.offset > it->second.size() ||
+             count > (it->second.size() - binding.offset) / sizeof( T ) )
+        {
+            return nullptr;
+        }
+        return reinterpret_cast< const T* >( it->second.data() + binding.offset );
+    }
+
+    inline void Rasterizer::clear()
+    {
+        // Same clear values as the view, stored in the sRGB render target format:
+        float clear = linearToSRGB( 0.1f );
+        std::fill( _color.begin(), _color.end(), packRGBA8( float4{ clear, clear, clear, 1.f } ) );
+        std::fill( _depth.begin(), _depth.end(), 1.f );
+    }
+    inline void Rasterizer::executeFrame( size_t frame )
+    {
+        using cmdstream::Op;
+
+        Op op;
+        const uint8_t* pPayload;
+        uint32_t size;
+        uint32_t value;
+
+        // The GPU executes a frame after its buffer writes are complete, so
+        // apply all of the frame's resource updates before running its passes:
+        size_t cursor = _reader.frameOffset( frame );
+        while ( _reader.next( &cursor, &op, &pPayload, &size ) && op != Op::EndFrame )
+        {
+            if ( op == Op::BufferData )
+            {
+                // The reader has checked the write against the declared
+                // length; check it against the allocation as well:
+                uint32_t header[2];
+                memcpy( header, pPayload, sizeof( header ) );
+                size_t length = size - sizeof( header );
+                auto it = _buffers.find( header[0] );
+                if ( it == _buffers.end() || header[1] > it->second.size() || length > it->second.size() - header[1] )
+                {
+                    continue;
+                }
+                memcpy( it->second.data() + header[1], pPayload + sizeof( header ), length );
+            }
+        }
+
+        cursor = _reader.frameOffset( frame );
+        cmdstream::Binding binding;
+        cmdstream::Dispatch dispatch;
+        while ( _reader.next( &cursor, &op, &pPayload, &size ) && op != Op::EndFrame )
+        {
+            switch ( op )
+            {
+                case Op::BeginRender:
+                    clear();
+                    break;
+                case Op::SetComputePipelineState:
+                    memcpy( &_computePipeline, pPayload, sizeof( _computePipeline ) );
+                    break;
+                case Op::SetComputeBuffer:
+                    memcpy( &binding, pPayload, sizeof( binding ) );
+                    _computeBuffers[ binding.index & 3 ] = { binding.id, binding.offset };
+                    break;
+                case Op::SetComputeTexture:
+                    memcpy( &binding, pPayload, sizeof( binding ) );
+                    _computeTexture = binding.id;
+                    break;
+                case Op::DispatchThreads:
+                case Op::DispatchThreadgroups:
+                    memcpy( &dispatch, pPayload, sizeof( dispatch ) );
+                    if ( op == Op::DispatchThreadgroups )
+                    {
+                        dispatch.grid[0] *= dispatch.threadgroup[0];
+                        dispatch.grid[1] *= dispatch.threadgroup[1];
+                    }
+                    if ( _states[ _computePipeline ].name == "mandelbrot_set" )
+                    {
+                        dispatchMandelbrot( dispatch.grid[0], dispatch.grid[1], _states[ _computePipeline ].constants );
+                    }
+                    break;
+                case Op::GenerateMipmaps:
+                    memcpy( &value, pPayload, sizeof( value ) );
+                    if ( _textures.count( value ) )
+                    {
+                        generateMipmaps( &_textures[ value ] );
+                    }
+                    break;
+                case Op::SetRenderPipelineState:
+                    memcpy( &_renderPipeline, pPayload, sizeof( _renderPipeline ) );
+                    break;
+                case Op::SetDepthStencilState:
+                    memcpy( &_depthStencilState, pPayload, sizeof( _depthStencilState ) );
+                    break;
+                case Op::SetVertexBuffer:
+                    memcpy( &binding, pPayload, sizeof( binding ) );
+                    _vertexBuffers[ binding.index & 3 ] = { binding.id, binding.offset };
+                    break;
+                case Op::SetFragmentTexture:
+                    memcpy( &binding, pPayload, sizeof( binding ) );
+                    _fragmentTexture = binding.id;
+                    break;
+                case Op::SetCullMode:
+                    memcpy( &_cullMode, pPayload, sizeof( _cullMode ) );
+                    break;
+                case Op::SetFrontFacingWinding:
+                    memcpy( &_winding, pPayload, sizeof( _winding ) );
+                    break;
+                case Op::DrawIndexedPrimitives:
+                {
+                    cmdstream::DrawIndexed draw;
+                    memcpy( &draw, pPayload, sizeof( draw ) );
+                    if ( draw.primitiveType == kPrimitiveTypeTriangle && draw.indexType == kIndexTypeUInt16 &&
+                         _states[ _renderPipeline ].name == "render" )
+                    {
+                        _lightDirection = normalize( _states[ _renderPipeline ].constants.get( shader_constants::kLightDirection ) );
+                        drawIndexed( draw.indexCount, draw.indexBufferId, draw.indexBufferOffset, draw.instanceCount );
+                    }
+                    break;
+                }
+                default:
+                    break;
+            }
+        }
+    }
+
+    // Port of the mandelbrot_set kernel:
+    inline void Rasterizer::dispatchMandelbrot( uint32_t gridWidth, uint32_t gridHeight, const specialization::VariantKey& constants )
+    {
+        auto textureIt = _textures.find( _computeTexture );
+        const uint32_t* pFrame = bufferContents< uint32_t >( _computeBuffers[0], 1 );
+        if ( textureIt == _textures.end() || !pFrame )
+        {
+            return;
+        }
+        Texture& texture = textureIt->second;
+        const uint32_t frame = *pFrame;
+
+        // Runs the variant the stream recorded:
+        const uint32_t kMaxIteration = constants.get( shader_constants::kMaxIteration );
+        const float kAnimationFrequency = constants.get( shader_constants::kAnimationFrequency );
+        const float kAnimationSpeed = constants.get( shader_constants::kAnimationSpeed );
+        const float kAnimationScaleLow = constants.get( shader_constants::kAnimationScaleLow );
+        const float kAnimationScale = constants.get( shader_constants::kAnimationScale );
+        const float kPaletteFrequency = constants.get( shader_constants::kPaletteFrequency );
+        const float kPalettePhase = constants.get( shader_constants::kPalettePhase );
+
+        constexpr float2 kMandelbrotPixelOffset = {-0.2, -0.35};
+        constexpr float2 kMandelbrotOrigin = {-1.2, -0.32};
+        constexpr float2 kMandelbrotScale = {2.2, 2.0};
+
+        float zoom = kAnimationScaleLow + kAnimationScale * cosf( kAnimationFrequency * frame );
+        zoom = powf( zoom, kAnimationSpeed );
+
+        parallelFor( std::min( gridHeight, texture.height ), [&]( size_t y ){
+            for ( uint32_t x = 0; x < std::min( gridWidth, texture.width ); ++x )
+            {
+                float x0 = zoom * kMandelbrotScale.x * ((float)x / gridWidth + kMandelbrotPixelOffset.x) + kMandelbrotOrigin.x;
+                float y0 = zoom * kMandelbrotScale.y * ((float)y / gridHeight + kMandelbrotPixelOffset.y) + kMandelbrotOrigin.y;
+
+                float px = 0.0;
+                float py = 0.0;
+                uint32_t iteration = 0;
+                while ( px * px + py * py <= 4 && iteration < kMaxIteration )
+                {
+                    float xtmp = px * px - py * py + x0;
+                    py = 2 * px * py + y0;
+                    px = xtmp;
+                    iteration += 1;
+                }
+
+                float color = 0.5 + 0.5 * cosf( kPalettePhase + iteration * kPaletteFrequency );
+                texture.levels[0][ y * texture.width + x ] = packRGBA8( float4{ color, color, color, 1.f } );
+            }
+        });
+    }
+
+    inline void Rasterizer::generateMipmaps( Texture* pTexture )
+    {
+        for ( uint32_t level = 1; level < pTexture->levels.size(); ++level )
+        {
+            mipmap::downsample( pTexture->levels[ level - 1 ].data(),
+                                mipmap::levelSize( pTexture->width, level - 1 ), mipmap::levelSize( pTexture->height, level - 1 ),
+                                pTexture->levels[ level ].data() );
+        }
+    }
+
+    inline void Rasterizer::drawIndexed( uint32_t indexCount, uint32_t indexBufferId, uint32_t indexBufferOffset, uint32_t instanceCount )
+    {
+        // Skip draws that would read past the end of a buffer, where the GPU
+        // would read zeros or fault:
+        const auto* pIndices = bufferContents< uint16_t >( { indexBufferId, indexBufferOffset }, indexCount );
+        if ( !pIndices || indexCount == 0 || instanceCount == 0 )
+        {
+            return;
+        }
+        uint32_t vertexCount = *std::max_element( pIndices, pIndices + indexCount ) + 1;
+        const auto* pVertexData = bufferContents< VertexData >( _vertexBuffers[0], vertexCount );
+        const auto* pInstanceData = bufferContents< InstanceData >( _vertexBuffers[1], instanceCount );
+        const auto* pCameraData = bufferContents< CameraData >( _vertexBuffers[2], 1 );
+        if ( !pVertexData || !pInstanceData || !pCameraData )
+        {
+            return;
+        }
+
+        // Port of vertexMain, run once per vertex and instance:
+        std::vector< Vertex > vertices( vertexCount * instanceCount );
+        const float4x4 viewProjection = pCameraData->perspectiveTransform * pCameraData->worldTransform;
+        parallelFor( instanceCount, [&]( size_t instance ){
+            const InstanceData& instanceData = pInstanceData[ instance ];
+            for ( uint32_t i = 0; i < vertexCount; ++i )
+            {
+                const VertexData& vd = pVertexData[ i ];
+                Vertex& out = vertices[ instance * vertexCount + i ];
+                float4 pos = float4{ vd.position.x, vd.position.y, vd.position.z, 1.f };
+                out.position = viewProjection * (instanceData.instanceTransform * pos);
+                out.normal = pCameraData->worldNormalTransform * (instanceData.instanceNormalTransform * vd.normal);
+                out.texcoord = vd.texcoord;
+                out.color = { instanceData.instanceColor.x, instanceData.instanceColor.y, instanceData.instanceColor.z };
+            }
+        });
+
+        _triangles.clear();
+        for ( uint32_t instance = 0; instance < instanceCount; ++instance )
+        {
+            const Vertex* pInstanceVertices = &vertices[ instance * vertexCount ];
+            for ( uint32_t i = 0; i + 2 < indexCount; i += 3 )
+            {
+                Vertex clipped[4];
+                const Vertex* in[3] = { &pInstanceVertices[ pIndices[ i ] ], &pInstanceVertices[ pIndices[ i + 1 ] ], &pInstanceVertices[ pIndices[ i + 2 ] ] };
+
+                // Clip against the near plane, z = 0 in Metal's clip space:
+                size_t count = 0;
+                for ( int j = 0; j < 3; ++j )
+                {
+                    const Vertex& a = *in[ j ];
+                    const Vertex& b = *in[ (j + 1) % 3 ];
+                    if ( a.position.z >= 0.f )
+                    {
+                        clipped[ count++ ] = a;
+                    }
+                    if ( (a.position.z >= 0.f) != (b.position.z >= 0.f) )
+                    {
+                        float t = a.position.z / (a.position.z - b.position.z);
+                        clipped[ count++ ] = { lerp( a.position, b.position, t ), lerp( a.normal, b.normal, t ),
+                                               lerp( a.color, b.color, t ), lerp( a.texcoord, b.texcoord, t ) };
+                    }
+                }
+                for ( size_t j = 2; j < count; ++j )
+                {
+                    setupTriangle( clipped[0], clipped[ j - 1 ], clipped[ j ] );
+                }
+            }
+        }
+
+        for ( std::vector< uint32_t >& bin : _bins )
+        {
+            bin.clear();
+        }
+        for ( uint32_t t = 0; t < _triangles.size(); ++t )
+        {
+            const Triangle& tri = _triangles[ t ];
+            for ( int ty = tri.minY / (int)kTileSize; ty <= tri.maxY / (int)kTileSize; ++ty )
+            {
+                for ( int tx = tri.minX / (int)kTileSize; tx <= tri.maxX / (int)kTileSize; ++tx )
+                {
+                    _bins[ ty * _tilesX + tx ].push_back( t );
+                }
+            }
+        }
+
+        parallelFor( _bins.size(), [&]( size_t tile ){
+            rasterizeTile( tile % _tilesX, tile / _tilesX );
+        });
+    }
+
+    inline void Rasterizer::setupTriangle( const Vertex& v0, const Vertex& v1, const Vertex& v2 )
+    {
+        const Vertex* v[3] = { &v0, &v1, &v2 };
+        float2 ndc[3];
+        for ( int i = 0; i < 3; ++i )
+        {
+            ndc[ i ] = float2{ v[ i ]->position.x, v[ i ]->position.y } / v[ i ]->position.w;
+        }
+
+        // Winding is decided in normalized device coordinates, where y is up:
+        float ndcArea = (ndc[1].x - ndc[0].x) * (ndc[2].y - ndc[0].y) - (ndc[2].x - ndc[0].x) * (ndc[1].y - ndc[0].y);
+        bool frontFacing = (_winding == kWindingCounterClockwise) ? ndcArea > 0.f : ndcArea < 0.f;
+        if ( ndcArea == 0.f ||
+             (_cullMode == kCullModeBack && !frontFacing) ||
+             (_cullMode == kCullModeFront && frontFacing) )
+        {
+            return;
+        }
+
+        Triangle tri;
+        for ( int i = 0; i < 3; ++i )
+        {
+            tri.screen[ i ] = float2{ (ndc[ i ].x * 0.5f + 0.5f) * _width, (0.5f - ndc[ i ].y * 0.5f) * _height };
+            tri.invW[ i ] = 1.f / v[ i ]->position.w;
+            tri.depth[ i ] = v[ i ]->position.z * tri.invW[ i ];
+            tri.normal[ i ] = v[ i ]->normal * tri.invW[ i ];
+            tri.color[ i ] = v[ i ]->color * tri.invW[ i ];
+            tri.texcoord[ i ] = v[ i ]->texcoord * tri.invW[ i ];
+        }
+
+        // Keep a positive area so that the same edge test works for both windings:
+        float area = edge( tri.screen[0], tri.screen[1], tri.screen[2] );
+        if ( area < 0.f )
+        {
+            std::swap( tri.screen[1], tri.screen[2] );
+            std::swap( tri.depth[1], tri.depth[2] );
+            std::swap( tri.invW[1], tri.invW[2] );
+            std::swap( tri.normal[1], tri.normal[2] );
+            std::swap( tri.color[1], tri.color[2] );
+            std::swap( tri.texcoord[1], tri.texcoord[2] );
+            area = -area;
+        }
+        tri.invArea = 1.f / area;
+
+        const float2* s = tri.screen;
+        tri.minX = std::max( (int)floorf( std::min( { s[0].x, s[1].x, s[2].x } ) ), 0 );
+        tri.minY = std::max( (int)floorf( std::min( { s[0].y, s[1].y, s[2].y } ) ), 0 );
+        tri.maxX = std::min( (int)ceilf( std::max( { s[0].x, s[1].x, s[2].x } ) ), (int)_width - 1 );
+        tri.maxY = std::min( (int)ceilf( std::max( { s[0].y, s[1].y, s[2].y } ) ), (int)_height - 1 );
+        if ( tri.minX <= tri.maxX && tri.minY <= tri.maxY )
+        {
+            _triangles.push_back( tri );
+        }
+    }
+
+    inline void Rasterizer::rasterizeTile( uint32_t tileX, uint32_t tileY )
+    {
+        const Texture* pTexture = _textures.count( _fragmentTexture ) ? &_textures.at( _fragmentTexture ) : nullptr;
+        const bool depthTest = _states.count( _depthStencilState ) && _states.at( _depthStencilState ).name == "depth less";
+        const float3 l = _lightDirection;
+
+        const int tileMinX = tileX * kTileSize;
+        const int tileMinY = tileY * kTileSize;
+        const int tileMaxX = std::min( tileMinX + (int)kTileSize, (int)_width ) - 1;
+        const int tileMaxY = std::min( tileMinY + (int)kTileSize, (int)_height ) - 1;
+
+        for ( uint32_t t : _bins[ tileY * _tilesX + tileX ] )
+        {
+            const Triangle& tri = _triangles[ t ];
+            const float2* s = tri.screen;
+            const bool owns[3] = { ownsEdge( s[1], s[2] ), ownsEdge( s[2], s[0] ), ownsEdge( s[0], s[1] ) };
+
+            // Barycentric steps in x and y, for the texture coordinate derivatives:
+            const float3 stepX = float3{ s[1].y - s[2].y, s[2].y - s[0].y, s[0].y - s[1].y } * tri.invArea;
+            const float3 stepY = float3{ s[2].x - s[1].x, s[0].x - s[2].x, s[1].x - s[0].x } * tri.invArea;
+
+            auto texcoordAt = [&]( float3 b ){
+                float invW = b.x * tri.invW[0] + b.y * tri.invW[1] + b.z * tri.invW[2];
+                return (b.x * tri.texcoord[0] + b.y * tri.texcoord[1] + b.z * tri.texcoord[2]) / invW;
+            };
+
+            for ( int y = std::max( tri.minY, tileMinY ); y <= std::min( tri.maxY, tileMaxY ); ++y )
+            {
+                for ( int x = std::max( tri.minX, tileMinX ); x <= std::min( tri.maxX, tileMaxX ); ++x )
+                {
+                    float2 p = { x + 0.5f, y + 0.5f };
+                    float w0 = edge( s[1], s[2], p );
+                    float w1 = edge( s[2], s[0], p );
+                    float w2 = edge( s[0], s[1], p );
+                    if ( w0 < 0.f || w1 < 0.f || w2 < 0.f ||
+                         (w0 == 0.f && !owns[0]) || (w1 == 0.f && !owns[1]) || (w2 == 0.f && !owns[2]) )
+                    {
+                        continue;
+                    }
+
+                    float3 b = float3{ w0, w1, w2 } * tri.invArea;
+                    float depth = b.x * tri.depth[0] + b.y * tri.depth[1] + b.z * tri.depth[2];
+                    size_t pixel = (size_t)y * _width + x;
+                    if ( depth < 0.f || depth > 1.f || (depthTest && !(depth < _depth[ pixel ])) )
+                    {
+                        continue;
+                    }
+                    if ( depthTest )
+                    {
+                        _depth[ pixel ] = depth;
+                    }
+
+                    // Port of fragmentMain:
+                    float invW = 1.f / (b.x * tri.invW[0] + b.y * tri.invW[1] + b.z * tri.invW[2]);
+                    float3 normal = (b.x * tri.normal[0] + b.y * tri.normal[1] + b.z * tri.normal[2]) * invW;
+                    float3 color = (b.x * tri.color[0] + b.y * tri.color[1] + b.z * tri.color[2]) * invW;
+                    float2 texcoord = (b.x * tri.texcoord[0] + b.y * tri.texcoord[1] + b.z * tri.texcoord[2]) * invW;
+
+                    float3 texel = { 1.f, 1.f, 1.f };
+                    if ( pTexture )
+                    {
+                        float2 size = { (float)pTexture->width, (float)pTexture->height };
+                        float2 ddx = (texcoordAt( b + stepX ) - texcoord) * size;
+                        float2 ddy = (texcoordAt( b + stepY ) - texcoord) * size;
+                        float lod = log2f( std::max( length( ddx ), length( ddy ) ) );
+                        texel = sample( *pTexture, texcoord, lod );
+                    }
+
+                    float ndotl = std::min( std::max( dot( normalize( normal ), l ), 0.f ), 1.f );
+                    float3 illum = (color * texel * 0.1f) + (color * texel * ndotl);
+
+                    _color[ pixel ] = packRGBA8( float4{ linearToSRGB( illum.x ), linearToSRGB( illum.y ), linearToSRGB( illum.z ), 1.f } );
+                }
+            }
+        }
+    }
+
+    inline uint32_t crc32( uint32_t crc, const uint8_t* pData, size_t length )
+    {
+        struct Table
+        {
+            uint32_t entries[256];
+            Table()
+            {
+                for ( uint32_t i = 0; i < 256; ++i )
+                {
+                    uint32_t c = i;
+                    for ( int k = 0; k < 8; ++k )
+                    {
+                        c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+                    }
+                    entries[ i ] = c;
+                }
+            }
+        };
+        static const Table table;
+        crc = ~crc;
+        for ( size_t i = 0; i < length; ++i )
+        {
+            crc = table.entries[ (crc ^ pData[ i ]) & 0xff ] ^ (crc >> 8);
+        }
+        return ~crc;
+    }
+
+    inline void writeChunk( FILE* pFile, const char* type, const std::vector< uint8_t >& data )
+    {
+        uint8_t header[8] = { (uint8_t)(data.size() >> 24), (uint8_t)(data.size() >> 16), (uint8_t)(data.size() >> 8), (uint8_t)data.size(),
+                              (uint8_t)type[0], (uint8_t)type[1], (uint8_t)type[2], (uint8_t)type[3] };
+        uint32_t crc = crc32( crc32( 0, header + 4, 4 ), data.data(), data.size() );
+        uint8_t footer[4] = { (uint8_t)(crc >> 24), (uint8_t)(crc >> 16), (uint8_t)(crc >> 8), (uint8_t)crc };
+        fwrite( header, 1, sizeof( header ), pFile );
+        if ( !data.empty() )
+        {
+            fwrite( data.data(), 1, data.size(), pFile );
+        }
+        fwrite( footer, 1, sizeof( footer ), pFile );
+    }
+
+
+    inline bool writePng( const char* path, uint32_t width, uint32_t height, const std::vector< uint32_t >& pixels )
+    {
+        FILE* pFile = fopen( path, "wb" );
+        if ( !pFile )
+        {
+            return false;
+        }
+
+        // Golden images are compared with readPng(), so store the pixels
+        // uncompressed rather than pulling in a deflate implementation:
+        std::vector< uint8_t > raw;
+        raw.reserve( (size_t)height * (width * 4 + 1) );
+        for ( uint32_t y = 0; y < height; ++y )
+        {
+            raw.push_back( 0 );
+            const uint8_t* pRow = reinterpret_cast< const uint8_t* >( &pixels[ (size_t)y * width ] );
+            raw.insert( raw.end(), pRow, pRow + width * 4 );
+        }
+
+        std::vector< uint8_t > zlib = { 0x78, 0x01 };
+        uint32_t a = 1, b = 0;
+        for ( size_t offset = 0; offset < raw.size() || offset == 0; offset += 65535 )
+        {
+            uint16_t length = (uint16_t)std::min< size_t >( 65535, raw.size() - offset );
+            bool last = offset + length >= raw.size();
+            zlib.insert( zlib.end(), { (uint8_t)last, (uint8_t)length, (uint8_t)(length >> 8), (uint8_t)~length, (uint8_t)(~length >> 8) } );
+            zlib.insert( zlib.end(), raw.begin() + offset, raw.begin() + offset + length );
+        }
+        for ( uint8_t byte : raw )
+        {
+            a = (a + byte) % 65521;
+            b = (b + a) % 65521;
+        }
+        uint32_t adler = (b << 16) | a;
+        zlib.insert( zlib.end(), { (uint8_t)(adler >> 24), (uint8_t)(adler >> 16), (uint8_t)(adler >> 8), (uint8_t)adler } );
+
+        static const uint8_t kSignature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+        fwrite( kSignature, 1, sizeof( kSignature ), pFile );
+        writeChunk( pFile, "IHDR", { (uint8_t)(width >> 24), (uint8_t)(width >> 16), (uint8_t)(width >> 8), (uint8_t)width,
+                                     (uint8_t)(height >> 24), (uint8_t)(height >> 16), (uint8_t)(height >> 8), (uint8_t)height,
+                                     8, 6, 0, 0, 0 } );
+        writeChunk( pFile, "IDAT", zlib );
+        writeChunk( pFile, "IEND", {} );
+        return fclose( pFile ) == 0;
+    }
+
+    inline uint32_t readBigEndian( const uint8_t* pData )
+    {
+        return ((uint32_t)pData[0] << 24) | ((uint32_t)pData[1] << 16) | ((uint32_t)pData[2] << 8) | pData[3];
+    }
+
+    inline bool readPng( const char* path, uint32_t* pWidth, uint32_t* pHeight, std::vector< uint32_t >* pPixels )
+    {
+        FILE* pFile = fopen( path, "rb" );
+        if ( !pFile )
+        {
+            return false;
+        }
+        std::vector< uint8_t > file;
+        uint8_t chunk[4096];
+        for ( size_t read; (read = fread( chunk, 1, sizeof( chunk ), pFile )) > 0; )
+        {
+            file.insert( file.end(), chunk, chunk + read );
+        }
+        fclose( pFile );
+
+        static const uint8_t kSignature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+        if ( file.size() < sizeof( kSignature ) || memcmp( file.data(), kSignature, sizeof( kSignature ) ) != 0 )
+        {
+            return false;
+        }
+
+        // Walk the chunks, checking each CRC, and gather the image data:
+        uint32_t width = 0, height = 0;
+        std::vector< uint8_t > zlib;
+        bool ended = false;
+        for ( size_t offset = sizeof( kSignature ); !ended; )
+        {
+            if ( file.size() - offset < 12 )
+            {
+                return false;
+            }
+            uint32_t length = readBigEndian( &file[ offset ] );
+            if ( length > file.size() - offset - 12 )
+            {
+                return false;
+            }
+            const uint8_t* pType = &file[ offset + 4 ];
+            const uint8_t* pData = pType + 4;
+            if ( crc32( 0, pType, length + 4 ) != readBigEndian( pData + length ) )
+            {
+                return false;
+            }
+
+            if ( !memcmp( pType, "IHDR", 4 ) )
+            {
+                // 8-bit RGBA, deflate, standard filters, not interlaced:
+                static const uint8_t kFormat[5] = { 8, 6, 0, 0, 0 };
+                if ( length != 13 || memcmp( pData + 8, kFormat, sizeof( kFormat ) ) != 0 )
+                {
+                    return false;
+                }
+                width = readBigEndian( pData );
+                height = readBigEndian( pData + 4 );
+            }
+            else if ( !memcmp( pType, "IDAT", 4 ) )
+            {
+                zlib.insert( zlib.end(), pData, pData + length );
+            }
+            ended = !memcmp( pType, "IEND", 4 );
+            offset += 12 + length;
+        }
+        if ( width == 0 || height == 0 || width > cmdstream::kMaxTextureDimension || height > cmdstream::kMaxTextureDimension )
+        {
+            return false;
+        }
+
+        // Only stored deflate blocks: each starts on a byte, with a header
+        // byte and the length and its complement.
+        if ( zlib.size() < 6 || (zlib[0] & 0x0f) != 8 || (zlib[1] & 0x20) || ((zlib[0] << 8) | zlib[1]) % 31 != 0 )
+        {
+            return false;
+        }
+        std::vector< uint8_t > raw;
+        size_t offset = 2;
+        for ( bool last = false; !last; )
+        {
+            if ( zlib.size() - offset < 5 || (zlib[ offset ] & 0x06) != 0 )
+            {
+                return false;
+            }
+            last = zlib[ offset ] & 1;
+            uint16_t length = zlib[ offset + 1 ] | (zlib[ offset + 2 ] << 8);
+            uint16_t complement = zlib[ offset + 3 ] | (zlib[ offset + 4 ] << 8);
+            offset += 5;
+            if ( (uint16_t)~length != complement || length > zlib.size() - offset )
+            {
+                return false;
+            }
+            raw.insert( raw.end(), zlib.begin() + offset, zlib.begin() + offset + length );
+            offset += length;
+        }
+        if ( zlib.size() - offset != 4 )
+        {
+            return false;
+        }
+        uint32_t a = 1, b = 0;
+        for ( uint8_t byte : raw )
+        {
+            a = (a + byte) % 65521;
+            b = (b + a) % 65521;
+        }
+        if ( readBigEndian( &zlib[ offset ] ) != ((b << 16) | a) )
+        {
+            return false;
+        }
+
+        // Scanlines with no filter, as writePng() writes them:
+        const size_t stride = (size_t)width * 4 + 1;
+        if ( raw.size() != stride * height )
+        {
+            return false;
+        }
+        pPixels->resize( (size_t)width * height );
+        for ( uint32_t y = 0; y < height; ++y )
+        {
+            if ( raw[ y * stride ] != 0 )
+            {
+                return false;
+            }
+            memcpy( &(*pPixels)[ (size_t)y * width ], &raw[ y * stride + 1 ], (size_t)width * 4 );
+        }
+        *pWidth = width;
+        *pHeight = height;
+        return true;
+    }
+
+    inline size_t countMismatches( const std::vector< uint32_t >& image, const std::vector< uint32_t >& golden, uint32_t tolerance )
+    {
+        if ( image.size() != golden.size() )
+        {
+            return std::max( image.size(), golden.size() );
+        }
+        size_t mismatches = 0;
+        for ( size_t i = 0; i < image.size(); ++i )
+        {
+            for ( uint32_t shift = 0; shift < 32; shift += 8 )
+            {
+                int delta = (int)((image[ i ] >> shift) & 0xff) - (int)((golden[ i ] >> shift) & 0xff);
+                if ( (uint32_t)std::abs( delta ) > tolerance )
+                {
+                    ++mismatches;
+                    break;
+                }
+            }
+        }
+        return mismatches;
+    }
+
+    inline bool matchesGolden( const std::vector< uint32_t >& image, const std::vector< uint32_t >& golden )
+    {
+        return image.size() == golden.size() &&
+               countMismatches( image, golden, kGoldenTolerance ) <= (size_t)(golden.size() * kGoldenMismatchFraction);
+    }
+
+    inline bool Rasterizer::writePng( const char* path ) const
+    {
+        return softraster::writePng( path, _width, _height, _color );
+    }
+}
+
+#pragma endregion Software Rasterizer }
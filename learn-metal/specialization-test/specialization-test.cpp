@@ -0,0 +1,140 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tests the variant keys and the variant cache in specialization.hpp. Keys
+// must not depend on the order constants are set in, must tell every value
+// apart, and the cache must start one build per key.
+
+#include "../test-support/check.hpp"
+#include "../specialization/specialization.hpp"
+
+using namespace specialization;
+
+// Stands in for simd::float3, which is 16 bytes with 12 of them used:
+struct Float3
+{
+    float x, y, z, w;
+};
+
+namespace specialization
+{
+    template<> struct ConstantTraits< Float3 > { static constexpr ConstantType type = ConstantType::Float3; static constexpr size_t size = 12; };
+}
+
+static const Constant< uint32_t > kMaxIteration = { 0, "kMaxIteration", 1000 };
+static const Constant< float > kAnimationFrequency = { 1, "kAnimationFrequency", 0.01f };
+static const Constant< bool > kShadows = { 7, "kShadows", false };
+static const Constant< Float3 > kLightDirection = { 10, "kLightDirection", { 1.0f, 1.0f, 0.8f, 0.0f } };
+
+static void testOrder()
+{
+    VariantKey a, b;
+    a.setDefault( kMaxIteration ).setDefault( kAnimationFrequency ).setDefault( kLightDirection );
+    b.setDefault( kLightDirection ).setDefault( kAnimationFrequency ).setDefault( kMaxIteration );
+    CHECK( a == b );
+    CHECK( a.hash() == b.hash() );
+    CHECK( a.values().size() == 3 );
+    CHECK( a.values()[0].index == 0 && a.values()[1].index == 1 && a.values()[2].index == 10 );
+}
+
+static void testValues()
+{
+    VariantKey base;
+    base.setDefault( kMaxIteration ).setDefault( kAnimationFrequency );
+
+    // Every value, and every constant, gives a different key:
+    VariantKey iterations = base, frequency = base, shadows = base, empty;
+    iterations.set( kMaxIteration, 50u );
+    frequency.set( kAnimationFrequency, 0.02f );
+    shadows.setDefault( kShadows );
+    const VariantKey* keys[] = { &base, &iterations, &frequency, &shadows, &empty };
+    for ( const VariantKey* pA : keys )
+    {
+        for ( const VariantKey* pB : keys )
+        {
+            CHECK( (*pA == *pB) == (pA == pB) );
+            CHECK( (pA->hash() == pB->hash()) == (pA == pB) );
+        }
+    }
+
+    // Setting a constant again replaces its value:
+    iterations.set( kMaxIteration, 1000u );
+    CHECK( iterations == base );
+
+    // The same bits under another type are another key:
+    Value asFloat = base.values()[0];
+    asFloat.type = ConstantType::Float;
+    VariantKey retyped = base;
+    retyped.set( asFloat );
+    CHECK( retyped != base );
+}
+
+static void testGet()
+{
+    VariantKey key;
+    key.set( kMaxIteration, 50u ).set( kShadows, true ).set( kLightDirection, { 0.0f, 1.0f, 0.0f, 0.0f } );
+    CHECK( key.get( kMaxIteration ) == 50 );
+    CHECK( key.get( kShadows ) );
+    Float3 light = key.get( kLightDirection );
+    CHECK( light.x == 0.0f && light.y == 1.0f && light.z == 0.0f );
+
+    // Constants the key doesn't hold, or holds with another type, read as
+    // their default:
+    CHECK( key.get( kAnimationFrequency ) == 0.01f );
+    const Constant< float > kMisTyped = { 0, "kMisTyped", 2.0f };
+    CHECK( key.get( kMisTyped ) == 2.0f );
+}
+
+static void testCache()
+{
+    VariantCache< int > cache;
+    std::promise< int > first, second;
+    int builds = 0;
+    auto build = [&]( std::promise< int >* pPromise ){
+        return [&, pPromise](){
+            ++builds;
+            return pPromise->get_future().share();
+        };
+    };
+
+    VariantKey a, b;
+    a.setDefault( kMaxIteration );
+    b.set( kMaxIteration, 50u );
+    std::shared_future< int > fa = cache.get( a, build( &first ) );
+    std::shared_future< int > fb = cache.get( b, build( &second ) );
+    std::shared_future< int > fa2 = cache.get( VariantKey().setDefault( kMaxIteration ), build( &second ) );
+    CHECK( builds == 2 );
+    CHECK( cache.size() == 2 );
+
+    // Later requests share the first build's result:
+    first.set_value( 1 );
+    second.set_value( 2 );
+    CHECK( fa.get() == 1 && fa2.get() == 1 && fb.get() == 2 );
+
+    int sum = 0;
+    cache.forEach( [&]( const VariantKey&, std::shared_future< int > variant ){ sum += variant.get(); } );
+    CHECK( sum == 3 );
+}
+
+int main()
+{
+    testOrder();
+    testValues();
+    testGet();
+    testCache();
+    return check::finish( "specialization-test" );
+}
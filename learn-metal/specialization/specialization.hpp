@@ -0,0 +1,227 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Typed descriptions of the function constants the shaders of
+// 10-frame-debugging declare. A VariantKey holds a value for each constant
+// and names one compiled variant of a pipeline; the command streams record
+// it with each pipeline state. Nothing in here calls Metal, so the
+// specialization test checks the keys and the variant cache on Linux.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "../pipeline-cache/pipeline-cache.hpp"
+
+#pragma region Declarations {
+
+namespace specialization
+{
+    enum class ConstantType : uint8_t { Bool, UInt, Float, Float3 };
+
+    // Specialized for each type a constant can have. The vector types are
+    // specialized where their definition is available.
+    template< typename T > struct ConstantTraits;
+    template<> struct ConstantTraits< bool > { static constexpr ConstantType type = ConstantType::Bool; static constexpr size_t size = 1; };
+    template<> struct ConstantTraits< uint32_t > { static constexpr ConstantType type = ConstantType::UInt; static constexpr size_t size = 4; };
+    template<> struct ConstantTraits< float > { static constexpr ConstantType type = ConstantType::Float; static constexpr size_t size = 4; };
+
+    template< typename T >
+    struct Constant
+    {
+        uint32_t index;
+        const char* name;
+        T defaultValue;
+    };
+
+    // Values are kept as bytes, so keys compare and hash the same way
+    // whatever their type:
+    struct Value
+    {
+        uint32_t index;
+        ConstantType type;
+        uint8_t bytes[16];
+    };
+
+    class VariantKey
+    {
+        public:
+            template< typename T >
+            VariantKey& set( const Constant< T >& constant, T value );
+            template< typename T >
+            VariantKey& setDefault( const Constant< T >& constant );
+            VariantKey& set( const Value& value );
+
+            // The value the key holds for a constant, or its default when
+            // the key holds none of that type:
+            template< typename T >
+            T get( const Constant< T >& constant ) const;
+
+            const std::vector< Value >& values() const;
+            uint64_t hash() const;
+            bool operator==( const VariantKey& other ) const;
+            bool operator!=( const VariantKey& other ) const;
+
+        private:
+            std::vector< Value > _values;
+    };
+
+    struct VariantKeyHash
+    {
+        size_t operator()( const VariantKey& key ) const { return (size_t)key.hash(); }
+    };
+
+    // Builds each variant on first request and keeps it, so switching back
+    // to a variant never compiles it again:
+    template< typename T >
+    class VariantCache
+    {
+        public:
+            std::shared_future< T > get( const VariantKey& key, const std::function< std::shared_future< T >() >& build );
+            template< typename F >
+            void forEach( F function ) const;
+            size_t size() const;
+
+        private:
+            mutable std::mutex _mutex;
+            std::unordered_map< VariantKey, std::shared_future< T >, VariantKeyHash > _variants;
+    };
+}
+
+#pragma endregion Declarations }
+
+
+#pragma mark - Specialization
+#pragma region Specialization {
+
+namespace specialization
+{
+    template< typename T >
+    inline VariantKey& VariantKey::set( const Constant< T >& constant, T value )
+    {
+        Value entry = { constant.index, ConstantTraits< T >::type, {} };
+        memcpy( entry.bytes, &value, ConstantTraits< T >::size );
+        return set( entry );
+    }
+
+    template< typename T >
+    inline VariantKey& VariantKey::setDefault( const Constant< T >& constant )
+    {
+        return set( constant, constant.defaultValue );
+    }
+
+    inline VariantKey& VariantKey::set( const Value& value )
+    {
+        // Keep the values sorted by index, so the order of the calls doesn't
+        // change the key:
+        auto it = std::lower_bound( _values.begin(), _values.end(), value.index,
+                                    []( const Value& entry, uint32_t index ){ return entry.index < index; } );
+        if ( it != _values.end() && it->index == value.index )
+        {
+            *it = value;
+        }
+        else
+        {
+            _values.insert( it, value );
+        }
+        return *this;
+    }
+
+    template< typename T >
+    inline T VariantKey::get( const Constant< T >& constant ) const
+    {
+        auto it = std::lower_bound( _values.begin(), _values.end(), constant.index,
+                                    []( const Value& entry, uint32_t index ){ return entry.index < index; } );
+        if ( it == _values.end() || it->index != constant.index || it->type != ConstantTraits< T >::type )
+        {
+            return constant.defaultValue;
+        }
+        T value = constant.defaultValue;
+        memcpy( &value, it->bytes, ConstantTraits< T >::size );
+        return value;
+    }
+
+    inline const std::vector< Value >& VariantKey::values() const
+    {
+        return _values;
+    }
+
+    inline uint64_t VariantKey::hash() const
+    {
+        uint64_t hash = pipeline_cache::kHashOffset;
+        for ( const Value& value : _values )
+        {
+            hash = pipeline_cache::hashValue( hash, value.index );
+            hash = pipeline_cache::hashValue( hash, (uint32_t)value.type );
+            hash = pipeline_cache::hashBytes( hash, value.bytes, sizeof( value.bytes ) );
+        }
+        return hash;
+    }
+
+    inline bool VariantKey::operator==( const VariantKey& other ) const
+    {
+        return _values.size() == other._values.size()
+            && std::equal( _values.begin(), _values.end(), other._values.begin(), []( const Value& a, const Value& b ){
+                   return a.index == b.index && a.type == b.type && memcmp( a.bytes, b.bytes, sizeof( a.bytes ) ) == 0;
+               });
+    }
+
+    inline bool VariantKey::operator!=( const VariantKey& other ) const
+    {
+        return !(*this == other);
+    }
+
+    template< typename T >
+    inline std::shared_future< T > VariantCache< T >::get( const VariantKey& key, const std::function< std::shared_future< T >() >& build )
+    {
+        // build() only starts the compile, so it can run under the lock:
+        std::lock_guard< std::mutex > lock( _mutex );
+        auto it = _variants.find( key );
+        if ( it == _variants.end() )
+        {
+            it = _variants.emplace( key, build() ).first;
+        }
+        return it->second;
+    }
+
+    template< typename T >
+    template< typename F >
+    inline void VariantCache< T >::forEach( F function ) const
+    {
+        std::lock_guard< std::mutex > lock( _mutex );
+        for ( const auto& entry : _variants )
+        {
+            function( entry.first, entry.second );
+        }
+    }
+
+    template< typename T >
+    inline size_t VariantCache< T >::size() const
+    {
+        std::lock_guard< std::mutex > lock( _mutex );
+        return _variants.size();
+    }
+}
+
+#pragma endregion Specialization }
@@ -0,0 +1,146 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures what metal-cpp's selector and class registration costs at startup.
+// Built twice by `make startup-benchmark`: once eager, where every symbol is
+// resolved during static initialization, and once with
+// METALCPP_LAZY_REGISTRATION, where only the symbols used are resolved.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+using Clock = std::chrono::steady_clock;
+
+// Static initializers in one translation unit run in order of definition, so
+// these two timestamps bracket the registration done by the headers between them.
+static const Clock::time_point kBeforeRegistration = Clock::now();
+
+#define NS_PRIVATE_IMPLEMENTATION
+#define MTL_PRIVATE_IMPLEMENTATION
+#include <Foundation/NSPrivate.hpp>
+#include <Metal/MTLHeaderBridge.hpp>
+
+static const Clock::time_point kAfterRegistration = Clock::now();
+
+#ifdef OBJC_STUB_RUNTIME
+static const size_t kRegisteredBeforeMain = objc_stub::lookupCount();
+#endif // OBJC_STUB_RUNTIME
+
+static constexpr size_t kSteadyStateIterations = 10000000;
+
+
+#pragma region Declarations {
+
+namespace bench
+{
+    double microseconds( Clock::time_point start, Clock::time_point end );
+    size_t touchFirstFrameSymbols();
+    double nanosecondsPerLookup( size_t iterations );
+}
+
+#pragma endregion Declarations }
+
+
+int main( int argc, char* argv[] )
+{
+    const char* mode = "eager";
+#ifdef METALCPP_LAZY_REGISTRATION
+    mode = "lazy";
+#endif // METALCPP_LAZY_REGISTRATION
+
+    Clock::time_point start = Clock::now();
+    size_t symbolCount = bench::touchFirstFrameSymbols();
+    double firstUse = bench::microseconds( start, Clock::now() );
+
+    __builtin_printf( "%s registration\n", mode );
+    __builtin_printf( "  static initialization: %9.1f us\n", bench::microseconds( kBeforeRegistration, kAfterRegistration ) );
+#ifdef OBJC_STUB_RUNTIME
+    __builtin_printf( "  runtime lookups before main: %zu\n", kRegisteredBeforeMain );
+#endif // OBJC_STUB_RUNTIME
+    __builtin_printf( "  first use of %zu symbols: %9.1f us\n", symbolCount, firstUse );
+    __builtin_printf( "  steady-state lookup: %9.2f ns\n", bench::nanosecondsPerLookup( kSteadyStateIterations ) );
+
+    return 0;
+}
+
+
+#pragma mark - Bench
+#pragma region Bench {
+
+double bench::microseconds( Clock::time_point start, Clock::time_point end )
+{
+    return std::chrono::duration< double, std::micro >( end - start ).count();
+}
+
+// The classes and selectors the samples touch to get their first frame on screen
+size_t bench::touchFirstFrameSymbols()
+{
+    const void* symbols[] = {
+        _MTL_PRIVATE_CLS( MTLCompileOptions ),
+        _MTL_PRIVATE_CLS( MTLRenderPipelineDescriptor ),
+        _MTL_PRIVATE_CLS( MTLRenderPassDescriptor ),
+        _MTL_PRIVATE_CLS( MTLTextureDescriptor ),
+        _MTL_PRIVATE_CLS( MTLDepthStencilDescriptor ),
+        _MTL_PRIVATE_SEL( newCommandQueue ),
+        _MTL_PRIVATE_SEL( newLibraryWithSource_options_error_ ),
+        _MTL_PRIVATE_SEL( newFunctionWithName_ ),
+        _MTL_PRIVATE_SEL( newRenderPipelineStateWithDescriptor_error_ ),
+        _MTL_PRIVATE_SEL( newBufferWithLength_options_ ),
+        _MTL_PRIVATE_SEL( contents ),
+        _MTL_PRIVATE_SEL( colorAttachments ),
+        _MTL_PRIVATE_SEL( commandBuffer ),
+        _MTL_PRIVATE_SEL( renderCommandEncoderWithDescriptor_ ),
+        _MTL_PRIVATE_SEL( setRenderPipelineState_ ),
+        _MTL_PRIVATE_SEL( setVertexBuffer_offset_atIndex_ ),
+        _MTL_PRIVATE_SEL( setFragmentBuffer_offset_atIndex_ ),
+        _MTL_PRIVATE_SEL( drawPrimitives_vertexStart_vertexCount_ ),
+        _MTL_PRIVATE_SEL( endEncoding ),
+        _MTL_PRIVATE_SEL( presentDrawable_ ),
+        _MTL_PRIVATE_SEL( commit ),
+    };
+
+    size_t resolved = 0;
+    for ( const void* pSymbol : symbols )
+    {
+        resolved += ( pSymbol != nullptr );
+    }
+    return resolved;
+}
+
+double bench::nanosecondsPerLookup( size_t iterations )
+{
+    uintptr_t checksum = 0;
+    Clock::time_point start = Clock::now();
+    for ( size_t i = 0; i < iterations; ++i )
+    {
+        // Forces the selector to be re-read each iteration, as it would be
+        // across the opaque objc_msgSend calls of real code
+        __asm__ volatile( "" ::: "memory" );
+        checksum += reinterpret_cast< uintptr_t >( _MTL_PRIVATE_SEL( commandBuffer ) );
+    }
+    Clock::time_point end = Clock::now();
+
+    if ( checksum == 0 )
+    {
+        __builtin_printf( "unexpected null selector\n" );
+        std::exit( 1 );
+    }
+    return std::chrono::duration< double, std::nano >( end - start ).count() / iterations;
+}
+
+#pragma endregion Bench }
@@ -0,0 +1,51 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Checks for the tests of the samples' CPU-side code. Each test is a program
+// that runs its checks, prints the ones that fail, and returns nonzero if any
+// did.
+
+#pragma once
+
+#include <cstdio>
+
+#define CHECK( expr ) check::expect( (expr), #expr, __FILE__, __LINE__ )
+
+namespace check
+{
+    inline int& failures()
+    {
+        static int s_failures = 0;
+        return s_failures;
+    }
+
+    inline bool expect( bool passed, const char* expr, const char* file, int line )
+    {
+        if ( !passed )
+        {
+            __builtin_printf( "%s:%d: check failed: %s\n", file, line, expr );
+            ++failures();
+        }
+        return passed;
+    }
+
+    inline int finish( const char* name )
+    {
+        __builtin_printf( "%s: %s\n", name, failures() ? "FAILED" : "ok" );
+        return failures() ? 1 : 0;
+    }
+}
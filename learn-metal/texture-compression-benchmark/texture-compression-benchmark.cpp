@@ -0,0 +1,97 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Throughput of the BC1 and ASTC 4x4 encoders in texture-compression.hpp on a
+// 1024x1024 image of gradients and noise, on one thread and on all of them,
+// with the PSNR of each format's decoded output.
+
+#include "../texture-compression/texture-compression.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr uint32_t kWidth = 1024;
+static constexpr uint32_t kHeight = 1024;
+static constexpr int kIterations = 4;
+
+static std::vector< uint8_t > makeImage()
+{
+    std::mt19937 rng( 42 );
+    std::uniform_int_distribution< int > noise( -12, 12 );
+    std::vector< uint8_t > rgba( kWidth * kHeight * 4 );
+    for ( uint32_t y = 0; y < kHeight; ++y )
+    {
+        for ( uint32_t x = 0; x < kWidth; ++x )
+        {
+            uint8_t* pTexel = &rgba[ (y * kWidth + x) * 4 ];
+            pTexel[0] = (uint8_t)std::clamp( (int)(x / 4) + noise( rng ), 0, 255 );
+            pTexel[1] = (uint8_t)std::clamp( (int)(y / 4) + noise( rng ), 0, 255 );
+            pTexel[2] = (uint8_t)std::clamp( (int)(128 + 100 * sinf( x * 0.02f + y * 0.01f )) + noise( rng ), 0, 255 );
+            pTexel[3] = 255;
+        }
+    }
+    return rgba;
+}
+
+// Megapixels per second over kIterations calls to compress()
+static double measure( texcomp::Format format, const std::vector< uint8_t >& rgba, bool threaded, uint8_t* pOut )
+{
+    Clock::time_point start = Clock::now();
+    for ( int i = 0; i < kIterations; ++i )
+    {
+        if ( threaded )
+        {
+            texcomp::compress( format, rgba.data(), kWidth, kHeight, pOut );
+        }
+        else
+        {
+            texcomp::compressRows( format, rgba.data(), kWidth, kHeight, 0, kHeight / texcomp::kBlockDim, pOut );
+        }
+    }
+    Clock::time_point end = Clock::now();
+    return (double)kWidth * kHeight * kIterations / std::chrono::duration< double, std::micro >( end - start ).count();
+}
+
+int main()
+{
+    const std::vector< uint8_t > rgba = makeImage();
+    const struct { texcomp::Format format; const char* name; } formats[] = {
+        { texcomp::Format::BC1, "BC1" },
+        { texcomp::Format::ASTC4x4, "ASTC 4x4" },
+    };
+
+    __builtin_printf( "%ux%u, %u threads\n", kWidth, kHeight, std::max( 1u, std::thread::hardware_concurrency() ) );
+    for ( const auto& f : formats )
+    {
+        std::vector< uint8_t > blocks( texcomp::compressedSize( f.format, kWidth, kHeight ) );
+        const double serial = measure( f.format, rgba, false, blocks.data() );
+        const double threaded = measure( f.format, rgba, true, blocks.data() );
+
+        std::vector< uint8_t > decoded( rgba.size() );
+        if ( !texcomp::decompress( f.format, blocks.data(), kWidth, kHeight, decoded.data() ) )
+        {
+            __builtin_printf( "error: %s output does not decode\n", f.name );
+            return 1;
+        }
+        __builtin_printf( "  %-9s %7.1f MPix/s on one thread, %7.1f MPix/s threaded, %.2f dB\n",
+                          f.name, serial, threaded, texcomp::psnr( rgba.data(), decoded.data(), kWidth, kHeight ) );
+    }
+    return 0;
+}
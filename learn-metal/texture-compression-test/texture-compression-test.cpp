@@ -0,0 +1,136 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tests the BC1 and ASTC 4x4 encoders in texture-compression.hpp by decoding
+// their output and measuring its PSNR against the source texels
+
+#include "../test-support/check.hpp"
+#include "../texture-compression/texture-compression.hpp"
+
+static constexpr texcomp::Format kFormats[] = { texcomp::Format::BC1, texcomp::Format::ASTC4x4 };
+
+static std::vector< uint8_t > roundTrip( texcomp::Format format, const std::vector< uint8_t >& rgba, uint32_t width, uint32_t height )
+{
+    std::vector< uint8_t > blocks( texcomp::compressedSize( format, width, height ) );
+    texcomp::compress( format, rgba.data(), width, height, blocks.data() );
+
+    std::vector< uint8_t > decoded( rgba.size() );
+    CHECK( texcomp::decompress( format, blocks.data(), width, height, decoded.data() ) );
+    return decoded;
+}
+
+template< typename _Texel >
+static std::vector< uint8_t > makeImage( uint32_t width, uint32_t height, _Texel texel )
+{
+    std::vector< uint8_t > rgba( width * height * 4 );
+    for ( uint32_t y = 0; y < height; ++y )
+    {
+        for ( uint32_t x = 0; x < width; ++x )
+        {
+            uint8_t* pTexel = &rgba[ (y * width + x) * 4 ];
+            texel( x, y, pTexel );
+            pTexel[3] = 255;
+        }
+    }
+    return rgba;
+}
+
+static void testSizes()
+{
+    CHECK( texcomp::compressedBytesPerRow( texcomp::Format::BC1, 128 ) == 256 );
+    CHECK( texcomp::compressedBytesPerRow( texcomp::Format::ASTC4x4, 128 ) == 512 );
+    CHECK( texcomp::compressedSize( texcomp::Format::BC1, 5, 5 ) == 4 * 8 );
+    CHECK( texcomp::compressedSize( texcomp::Format::ASTC4x4, 1, 1 ) == 16 );
+}
+
+static void testTwoColorBlocks()
+{
+    // The sample's checkerboard has two colors per block, which both formats
+    // store exactly at their endpoints. BC1 rounds them to RGB565.
+    auto checkerboard = makeImage( 128, 128, []( uint32_t x, uint32_t y, uint8_t* pTexel ) {
+        uint8_t c = ((x ^ y) & 2) ? 0xFF : 0x00;
+        pTexel[0] = pTexel[1] = pTexel[2] = c;
+    } );
+    for ( texcomp::Format format : kFormats )
+    {
+        CHECK( std::isinf( texcomp::psnr( checkerboard.data(), roundTrip( format, checkerboard, 128, 128 ).data(), 128, 128 ) ) );
+    }
+
+    auto twoColors = makeImage( 16, 16, []( uint32_t x, uint32_t y, uint8_t* pTexel ) {
+        bool first = (x + y) & 1;
+        pTexel[0] = first ? 200 : 17;
+        pTexel[1] = first ? 31 : 140;
+        pTexel[2] = first ? 90 : 250;
+    } );
+    CHECK( std::isinf( texcomp::psnr( twoColors.data(), roundTrip( texcomp::Format::ASTC4x4, twoColors, 16, 16 ).data(), 16, 16 ) ) );
+}
+
+static void testGradientQuality()
+{
+    // Smooth content keeps well above 35 dB in both formats; ASTC's 8-bit
+    // endpoints and eight weights beat BC1's RGB565 endpoints and four colors.
+    auto gradient = makeImage( 256, 256, []( uint32_t x, uint32_t y, uint8_t* pTexel ) {
+        pTexel[0] = (uint8_t)x;
+        pTexel[1] = (uint8_t)y;
+        pTexel[2] = (uint8_t)(128 + 100 * sinf( x * 0.1f + y * 0.05f ));
+    } );
+    const double bc1 = texcomp::psnr( gradient.data(), roundTrip( texcomp::Format::BC1, gradient, 256, 256 ).data(), 256, 256 );
+    const double astc = texcomp::psnr( gradient.data(), roundTrip( texcomp::Format::ASTC4x4, gradient, 256, 256 ).data(), 256, 256 );
+    __builtin_printf( "gradient: BC1 %.2f dB, ASTC 4x4 %.2f dB\n", bc1, astc );
+    CHECK( bc1 > 35.0 );
+    CHECK( astc > 40.0 );
+    CHECK( astc > bc1 );
+}
+
+static void testPartialBlocks()
+{
+    // Edge blocks replicate the last row and column, so a 6x3 image decodes
+    // as well as the full blocks around it. Its colors lie on a line, but with
+    // more shades per block than BC1's four.
+    auto small = makeImage( 6, 3, []( uint32_t x, uint32_t y, uint8_t* pTexel ) {
+        pTexel[0] = (uint8_t)(x * 40 + y * 20);
+        pTexel[1] = (uint8_t)(x * 20 + y * 10);
+        pTexel[2] = 64;
+    } );
+    for ( texcomp::Format format : kFormats )
+    {
+        auto decoded = roundTrip( format, small, 6, 3 );
+        CHECK( texcomp::psnr( small.data(), decoded.data(), 6, 3 ) > 25.0 );
+        for ( size_t i = 3; i < decoded.size(); i += 4 )
+        {
+            CHECK( decoded[ i ] == 255 );
+        }
+    }
+}
+
+static void testRejectsOtherASTCBlocks()
+{
+    // A void-extent block is valid ASTC, but not one this encoder writes:
+    uint8_t block[16] = { 0xFC, 0xFD, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+    uint8_t rgba[16 * 4];
+    CHECK( !texcomp::decompress( texcomp::Format::ASTC4x4, block, 4, 4, rgba ) );
+}
+
+int main()
+{
+    testSizes();
+    testTwoColorBlocks();
+    testGradientQuality();
+    testPartialBlocks();
+    testRejectsOtherASTCBlocks();
+    return check::finish( "texture-compression-test" );
+}
@@ -0,0 +1,493 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// BC1 and ASTC 4x4 compression of RGBA8 texels on the CPU, for the textures
+// 07-texturing generates at startup. The decoders read back exactly what the
+// encoders write, so the texture compression test can measure their quality
+// as PSNR on any platform.
+
+#pragma once
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#pragma region Declarations {
+
+namespace texcomp
+{
+    enum class Format
+    {
+        BC1,
+        ASTC4x4
+    };
+
+    size_t compressedSize( Format format, uint32_t width, uint32_t height );
+    size_t compressedBytesPerRow( Format format, uint32_t width );
+    void compress( Format format, const uint8_t* pRGBA, uint32_t width, uint32_t height, uint8_t* pOut );
+    bool decompress( Format format, const uint8_t* pBlocks, uint32_t width, uint32_t height, uint8_t* pRGBA );
+    double psnr( const uint8_t* pReference, const uint8_t* pRGBA, uint32_t width, uint32_t height );
+}
+
+#pragma endregion Declarations }
+
+
+#pragma mark - Texture Compression
+#pragma region Texture Compression {
+
+namespace texcomp
+{
+    // Both formats store a 4x4 texel block in 8 (BC1) or 16 (ASTC) bytes.
+    constexpr uint32_t kBlockDim = 4;
+
+    // The encoder's ASTC weights are 3 bits, unquantized to 0..64 as the
+    // decoder does:
+    constexpr int kASTCWeightLevels[8] = { 0, 9, 18, 27, 37, 46, 55, 64 };
+
+    inline size_t blockBytes( Format format )
+    {
+        return format == Format::BC1 ? 8 : 16;
+    }
+
+    inline size_t compressedBytesPerRow( Format format, uint32_t width )
+    {
+        return ((width + kBlockDim - 1) / kBlockDim) * blockBytes( format );
+    }
+
+    inline size_t compressedSize( Format format, uint32_t width, uint32_t height )
+    {
+        return compressedBytesPerRow( format, width ) * ((height + kBlockDim - 1) / kBlockDim);
+    }
+
+    // Fits a line through the block's colors and returns its two end points,
+    // ordered so that the first has the smaller sum of components.
+    inline void findEndpoints( const float texels[16][3], float e0[3], float e1[3] )
+    {
+        float mean[3] = { 0.f, 0.f, 0.f };
+        for ( int i = 0; i < 16; ++i )
+        {
+            for ( int c = 0; c < 3; ++c )
+            {
+                mean[ c ] += texels[ i ][ c ] / 16.f;
+            }
+        }
+
+        float cov[6] = { 0.f, 0.f, 0.f, 0.f, 0.f, 0.f };
+        for ( int i = 0; i < 16; ++i )
+        {
+            float d[3] = { texels[ i ][ 0 ] - mean[ 0 ], texels[ i ][ 1 ] - mean[ 1 ], texels[ i ][ 2 ] - mean[ 2 ] };
+            cov[0] += d[0] * d[0]; cov[1] += d[0] * d[1]; cov[2] += d[0] * d[2];
+            cov[3] += d[1] * d[1]; cov[4] += d[1] * d[2]; cov[5] += d[2] * d[2];
+        }
+
+        // A few power iterations are enough to find the principal axis:
+        float axis[3] = { 1.f, 1.f, 1.f };
+        for ( int iter = 0; iter < 4; ++iter )
+        {
+            float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+            float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+            float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+            float len = std::max( std::max( fabsf( x ), fabsf( y ) ), fabsf( z ) );
+            if ( len == 0.f )
+            {
+                break;
+            }
+            axis[0] = x / len; axis[1] = y / len; axis[2] = z / len;
+        }
+
+        float minT = 0.f;
+        float maxT = 0.f;
+        for ( int i = 0; i < 16; ++i )
+        {
+            float t = 0.f;
+            for ( int c = 0; c < 3; ++c )
+            {
+                t += (texels[ i ][ c ] - mean[ c ]) * axis[ c ];
+            }
+            minT = std::min( minT, t );
+            maxT = std::max( maxT, t );
+        }
+
+        float axisDot = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+        if ( axisDot > 0.f )
+        {
+            minT /= axisDot;
+            maxT /= axisDot;
+        }
+
+        for ( int c = 0; c < 3; ++c )
+        {
+            e0[ c ] = std::clamp( mean[ c ] + axis[ c ] * minT, 0.f, 255.f );
+            e1[ c ] = std::clamp( mean[ c ] + axis[ c ] * maxT, 0.f, 255.f );
+        }
+
+        if ( e0[0] + e0[1] + e0[2] > e1[0] + e1[1] + e1[2] )
+        {
+            std::swap_ranges( e0, e0 + 3, e1 );
+        }
+    }
+
+    // Returns the index of the palette entry closest to each texel.
+    inline void selectIndices( const float texels[16][3], const float palette[][3], int paletteSize, uint32_t indices[16] )
+    {
+        for ( int i = 0; i < 16; ++i )
+        {
+            float best = FLT_MAX;
+            for ( int p = 0; p < paletteSize; ++p )
+            {
+                float dr = texels[ i ][ 0 ] - palette[ p ][ 0 ];
+                float dg = texels[ i ][ 1 ] - palette[ p ][ 1 ];
+                float db = texels[ i ][ 2 ] - palette[ p ][ 2 ];
+                float d = dr * dr + dg * dg + db * db;
+                if ( d < best )
+                {
+                    best = d;
+                    indices[ i ] = p;
+                }
+            }
+        }
+    }
+
+    // Expands an RGB565 color to 0..255 per channel.
+    inline void unpack565( uint16_t v, float c[3] )
+    {
+        c[0] = ((v >> 11) & 31) * 255.f / 31.f;
+        c[1] = ((v >> 5) & 63) * 255.f / 63.f;
+        c[2] = (v & 31) * 255.f / 31.f;
+    }
+
+    inline void encodeBC1Block( const float texels[16][3], uint8_t* pOut )
+    {
+        float e0[3], e1[3];
+        findEndpoints( texels, e0, e1 );
+
+        auto to565 = []( const float c[3] ) -> uint16_t {
+            return (uint16_t)( ((uint16_t)lroundf( c[0] * 31.f / 255.f ) << 11) |
+                               ((uint16_t)lroundf( c[1] * 63.f / 255.f ) << 5) |
+                                (uint16_t)lroundf( c[2] * 31.f / 255.f ) );
+        };
+
+        // The four color mode requires color0 > color1:
+        uint16_t c0 = to565( e1 );
+        uint16_t c1 = to565( e0 );
+        if ( c0 < c1 )
+        {
+            std::swap( c0, c1 );
+        }
+
+        uint32_t indices[16] = { 0 };
+        if ( c0 != c1 )
+        {
+            float palette[4][3];
+            unpack565( c0, palette[0] );
+            unpack565( c1, palette[1] );
+            for ( int c = 0; c < 3; ++c )
+            {
+                palette[2][ c ] = (2.f * palette[0][ c ] + palette[1][ c ]) / 3.f;
+                palette[3][ c ] = (palette[0][ c ] + 2.f * palette[1][ c ]) / 3.f;
+            }
+            selectIndices( texels, palette, 4, indices );
+        }
+
+        uint32_t bits = 0;
+        for ( int i = 0; i < 16; ++i )
+        {
+            bits |= indices[ i ] << (2 * i);
+        }
+
+        pOut[0] = c0 & 0xFF; pOut[1] = c0 >> 8;
+        pOut[2] = c1 & 0xFF; pOut[3] = c1 >> 8;
+        pOut[4] = bits & 0xFF; pOut[5] = (bits >> 8) & 0xFF;
+        pOut[6] = (bits >> 16) & 0xFF; pOut[7] = bits >> 24;
+    }
+
+    // Encodes a single-partition ASTC block with a 4x4 grid of 3-bit weights
+    // and RGB endpoints stored at full 8-bit precision (color endpoint mode 8).
+    inline void encodeASTCBlock( const float texels[16][3], uint8_t* pOut )
+    {
+        static constexpr uint32_t kBlockMode = 0x53;    // 4x4 weights, QUANT_8, single plane
+        static constexpr uint32_t kEndpointMode = 8;    // LDR RGB direct
+
+        float e0[3], e1[3];
+        findEndpoints( texels, e0, e1 );
+
+        uint8_t q0[3], q1[3];
+        for ( int c = 0; c < 3; ++c )
+        {
+            q0[ c ] = (uint8_t)lroundf( e0[ c ] );
+            q1[ c ] = (uint8_t)lroundf( e1[ c ] );
+        }
+
+        // The decoder applies blue contraction when the second endpoint has the
+        // smaller sum, so keep the endpoints in ascending order after rounding:
+        if ( q0[0] + q0[1] + q0[2] > q1[0] + q1[1] + q1[2] )
+        {
+            std::swap_ranges( q0, q0 + 3, q1 );
+        }
+
+        float palette[8][3];
+        for ( int w = 0; w < 8; ++w )
+        {
+            for ( int c = 0; c < 3; ++c )
+            {
+                palette[ w ][ c ] = (q0[ c ] * (64 - kASTCWeightLevels[ w ]) + q1[ c ] * kASTCWeightLevels[ w ]) / 64.f;
+            }
+        }
+
+        uint32_t weights[16];
+        selectIndices( texels, palette, 8, weights );
+
+        memset( pOut, 0, 16 );
+        auto writeBits = [pOut]( uint32_t value, uint32_t count, uint32_t offset ) {
+            for ( uint32_t i = 0; i < count; ++i )
+            {
+                uint32_t bit = offset + i;
+                pOut[ bit / 8 ] |= ((value >> i) & 1) << (bit % 8);
+            }
+        };
+
+        writeBits( kBlockMode, 11, 0 );
+        writeBits( 0, 2, 11 );                           // one partition
+        writeBits( kEndpointMode, 4, 13 );
+        const uint8_t endpoints[6] = { q0[0], q1[0], q0[1], q1[1], q0[2], q1[2] };
+        for ( int i = 0; i < 6; ++i )
+        {
+            writeBits( endpoints[ i ], 8, 17 + 8 * i );
+        }
+
+        // Weights are stored bit-reversed, starting from the top of the block:
+        for ( int i = 0; i < 16; ++i )
+        {
+            for ( int b = 0; b < 3; ++b )
+            {
+                writeBits( (weights[ i ] >> b) & 1, 1, 127 - (3 * i + b) );
+            }
+        }
+    }
+
+    inline void compressRows( Format format, const uint8_t* pRGBA, uint32_t width, uint32_t height,
+                              uint32_t firstBlockRow, uint32_t lastBlockRow, uint8_t* pOut )
+    {
+        const uint32_t blocksWide = (width + kBlockDim - 1) / kBlockDim;
+        for ( uint32_t by = firstBlockRow; by < lastBlockRow; ++by )
+        {
+            for ( uint32_t bx = 0; bx < blocksWide; ++bx )
+            {
+                // Gather the block, replicating edge texels for partial blocks:
+                float texels[16][3];
+                for ( uint32_t i = 0; i < 16; ++i )
+                {
+                    uint32_t x = std::min( bx * kBlockDim + i % kBlockDim, width - 1 );
+                    uint32_t y = std::min( by * kBlockDim + i / kBlockDim, height - 1 );
+                    const uint8_t* pTexel = pRGBA + (y * width + x) * 4;
+                    texels[ i ][ 0 ] = pTexel[ 0 ];
+                    texels[ i ][ 1 ] = pTexel[ 1 ];
+                    texels[ i ][ 2 ] = pTexel[ 2 ];
+                }
+
+                uint8_t* pBlock = pOut + (by * blocksWide + bx) * blockBytes( format );
+                if ( format == Format::BC1 )
+                {
+                    encodeBC1Block( texels, pBlock );
+                }
+                else
+                {
+                    encodeASTCBlock( texels, pBlock );
+                }
+            }
+        }
+    }
+
+    // Compresses opaque RGBA8 texels; the alpha channel is not encoded.
+    inline void compress( Format format, const uint8_t* pRGBA, uint32_t width, uint32_t height, uint8_t* pOut )
+    {
+        // Block rows are independent, so split them evenly across worker threads:
+        const uint32_t blockRows = (height + kBlockDim - 1) / kBlockDim;
+        const uint32_t numThreads = std::max( 1u, std::min( std::thread::hardware_concurrency(), blockRows ) );
+
+        std::vector< std::thread > workers;
+        for ( uint32_t t = 1; t < numThreads; ++t )
+        {
+            workers.emplace_back( compressRows, format, pRGBA, width, height,
+                                  blockRows * t / numThreads, blockRows * (t + 1) / numThreads, pOut );
+        }
+        compressRows( format, pRGBA, width, height, 0, blockRows / numThreads, pOut );
+
+        for ( std::thread& worker : workers )
+        {
+            worker.join();
+        }
+    }
+
+    inline void decodeBC1Block( const uint8_t* pBlock, uint8_t texels[16][4] )
+    {
+        const uint16_t c0 = pBlock[0] | (pBlock[1] << 8);
+        const uint16_t c1 = pBlock[2] | (pBlock[3] << 8);
+        const uint32_t bits = pBlock[4] | (pBlock[5] << 8) | (pBlock[6] << 16) | ((uint32_t)pBlock[7] << 24);
+
+        float palette[4][4];
+        unpack565( c0, palette[0] );
+        unpack565( c1, palette[1] );
+        palette[0][3] = palette[1][3] = palette[2][3] = 255.f;
+        for ( int c = 0; c < 3; ++c )
+        {
+            if ( c0 > c1 )
+            {
+                palette[2][ c ] = (2.f * palette[0][ c ] + palette[1][ c ]) / 3.f;
+                palette[3][ c ] = (palette[0][ c ] + 2.f * palette[1][ c ]) / 3.f;
+            }
+            else
+            {
+                palette[2][ c ] = (palette[0][ c ] + palette[1][ c ]) / 2.f;
+                palette[3][ c ] = 0.f;
+            }
+        }
+        palette[3][3] = c0 > c1 ? 255.f : 0.f;
+
+        for ( int i = 0; i < 16; ++i )
+        {
+            const float* pColor = palette[ (bits >> (2 * i)) & 3 ];
+            for ( int c = 0; c < 4; ++c )
+            {
+                texels[ i ][ c ] = (uint8_t)lroundf( pColor[ c ] );
+            }
+        }
+    }
+
+    // Decodes the blocks encodeASTCBlock() writes, following the ASTC
+    // specification for that block mode and endpoint mode, blue contraction
+    // included. Returns false for any other kind of block.
+    inline bool decodeASTCBlock( const uint8_t* pBlock, uint8_t texels[16][4] )
+    {
+        auto readBits = [pBlock]( uint32_t count, uint32_t offset ) -> uint32_t {
+            uint32_t value = 0;
+            for ( uint32_t i = 0; i < count; ++i )
+            {
+                uint32_t bit = offset + i;
+                value |= ((pBlock[ bit / 8 ] >> (bit % 8)) & 1) << i;
+            }
+            return value;
+        };
+
+        if ( readBits( 11, 0 ) != 0x53 || readBits( 2, 11 ) != 0 || readBits( 4, 13 ) != 8 )
+        {
+            return false;
+        }
+
+        int v[6];
+        for ( int i = 0; i < 6; ++i )
+        {
+            v[ i ] = readBits( 8, 17 + 8 * i );
+        }
+
+        int e0[3], e1[3];
+        if ( v[1] + v[3] + v[5] >= v[0] + v[2] + v[4] )
+        {
+            for ( int c = 0; c < 3; ++c )
+            {
+                e0[ c ] = v[ 2 * c ];
+                e1[ c ] = v[ 2 * c + 1 ];
+            }
+        }
+        else
+        {
+            // Blue contraction swaps the endpoints and pulls red and green
+            // toward blue:
+            e0[0] = (v[1] + v[5]) >> 1; e0[1] = (v[3] + v[5]) >> 1; e0[2] = v[5];
+            e1[0] = (v[0] + v[4]) >> 1; e1[1] = (v[2] + v[4]) >> 1; e1[2] = v[4];
+        }
+
+        for ( int i = 0; i < 16; ++i )
+        {
+            uint32_t weight = 0;
+            for ( int b = 0; b < 3; ++b )
+            {
+                weight |= readBits( 1, 127 - (3 * i + b) ) << b;
+            }
+            const int w = kASTCWeightLevels[ weight ];
+
+            // Endpoints expand to 16 bits; UNORM8 keeps the top 8 of the result:
+            for ( int c = 0; c < 3; ++c )
+            {
+                texels[ i ][ c ] = (uint8_t)(((e0[ c ] * 257 * (64 - w) + e1[ c ] * 257 * w + 32) / 64) >> 8);
+            }
+            texels[ i ][ 3 ] = 255;
+        }
+        return true;
+    }
+
+    inline bool decompress( Format format, const uint8_t* pBlocks, uint32_t width, uint32_t height, uint8_t* pRGBA )
+    {
+        const uint32_t blocksWide = (width + kBlockDim - 1) / kBlockDim;
+        const uint32_t blocksHigh = (height + kBlockDim - 1) / kBlockDim;
+        for ( uint32_t by = 0; by < blocksHigh; ++by )
+        {
+            for ( uint32_t bx = 0; bx < blocksWide; ++bx )
+            {
+                const uint8_t* pBlock = pBlocks + (by * blocksWide + bx) * blockBytes( format );
+                uint8_t texels[16][4];
+                if ( format == Format::BC1 )
+                {
+                    decodeBC1Block( pBlock, texels );
+                }
+                else if ( !decodeASTCBlock( pBlock, texels ) )
+                {
+                    return false;
+                }
+
+                // Texels of partial blocks past the edge are dropped:
+                for ( uint32_t i = 0; i < 16; ++i )
+                {
+                    uint32_t x = bx * kBlockDim + i % kBlockDim;
+                    uint32_t y = by * kBlockDim + i / kBlockDim;
+                    if ( x < width && y < height )
+                    {
+                        memcpy( pRGBA + (y * width + x) * 4, texels[ i ], 4 );
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    // Peak signal-to-noise ratio of the RGB channels in dB; infinite when the
+    // images are identical.
+    inline double psnr( const uint8_t* pReference, const uint8_t* pRGBA, uint32_t width, uint32_t height )
+    {
+        double squaredError = 0.0;
+        for ( size_t i = 0; i < (size_t)width * height; ++i )
+        {
+            for ( int c = 0; c < 3; ++c )
+            {
+                double d = (double)pReference[ i * 4 + c ] - pRGBA[ i * 4 + c ];
+                squaredError += d * d;
+            }
+        }
+        if ( squaredError == 0.0 )
+        {
+            return INFINITY;
+        }
+        const double mse = squaredError / ((double)width * height * 3);
+        return 10.0 * log10( 255.0 * 255.0 / mse );
+    }
+}
+
+#pragma endregion Texture Compression }
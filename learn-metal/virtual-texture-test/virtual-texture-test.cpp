@@ -0,0 +1,171 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tests vt::VirtualTexture: page indexing, the order tiles are requested in,
+// eviction from the tile cache, and the fallback entries of the page table.
+
+#include "../test-support/check.hpp"
+#include "../virtual-texture/virtual-texture.hpp"
+
+#include <algorithm>
+#include <vector>
+
+static constexpr uint32_t kCoarsestPage = vt::kNumPages - 1;
+
+static std::vector< uint32_t > feedbackFor( std::initializer_list< uint32_t > pages )
+{
+    std::vector< uint32_t > bits( vt::kFeedbackWords, 0 );
+    for ( uint32_t page : pages )
+    {
+        bits[ page / 32 ] |= 1u << (page % 32);
+    }
+    return bits;
+}
+
+static uint32_t slotOf( uint32_t entry )
+{
+    return (entry & 0xFF) + ((entry >> 8) & 0xFF) * vt::kCacheTilesPerSide;
+}
+
+static void testPageIndex()
+{
+    CHECK( vt::pageIndex( 0, 0, 0 ) == 0 );
+    CHECK( vt::pageIndex( 0, 1, 0 ) == 1 );
+    CHECK( vt::pageIndex( 0, 0, 1 ) == vt::kVirtualTilesPerSide );
+    CHECK( vt::pageIndex( 1, 0, 0 ) == vt::kVirtualTilesPerSide * vt::kVirtualTilesPerSide );
+    CHECK( vt::pageIndex( vt::kVirtualMipCount - 1, 0, 0 ) == kCoarsestPage );
+}
+
+static void testCoarsestTileComesFirst()
+{
+    vt::VirtualTexture texture;
+    std::vector< uint32_t > pageTable( vt::kNumPages );
+    texture.writePageTable( pageTable.data() );
+    CHECK( pageTable[ 0 ] == vt::kInvalidPageEntry );
+
+    vt::TileRequest requests[ 4 ];
+    CHECK( texture.update( requests, 4 ) == 1 );
+    CHECK( requests[ 0 ].mip == vt::kVirtualMipCount - 1 );
+
+    // Every page falls back to the coarsest tile until finer ones arrive:
+    texture.writePageTable( pageTable.data() );
+    for ( uint32_t page = 0; page < vt::kNumPages; ++page )
+    {
+        CHECK( pageTable[ page ] == pageTable[ kCoarsestPage ] );
+    }
+    CHECK( (pageTable[ 0 ] >> 16) == vt::kVirtualMipCount - 1 );
+}
+
+static void testFeedbackRequestsAncestorsCoarseFirst()
+{
+    vt::VirtualTexture texture;
+    vt::TileRequest requests[ vt::kVirtualMipCount ];
+    texture.update( requests, 1 );
+
+    // Sampling a finest tile requests it and every ancestor that isn't
+    // resident yet, coarsest first, up to the per-frame limit:
+    std::vector< uint32_t > feedback = feedbackFor( { vt::pageIndex( 0, 5, 9 ) } );
+    texture.processFeedback( feedback.data() );
+    CHECK( texture.update( requests, 3 ) == 3 );
+    CHECK( requests[ 0 ].mip == 5 && requests[ 1 ].mip == 4 && requests[ 2 ].mip == 3 );
+    CHECK( requests[ 2 ].tileX == 5 >> 3 && requests[ 2 ].tileY == 9 >> 3 );
+
+    // Requests that didn't fit are dropped; feedback asks for them again:
+    texture.processFeedback( feedback.data() );
+    CHECK( texture.update( requests, vt::kVirtualMipCount ) == 3 );
+    CHECK( requests[ 0 ].mip == 2 && requests[ 2 ].mip == 0 );
+    CHECK( requests[ 2 ].tileX == 5 && requests[ 2 ].tileY == 9 );
+
+    std::vector< uint32_t > pageTable( vt::kNumPages );
+    texture.writePageTable( pageTable.data() );
+    CHECK( (pageTable[ vt::pageIndex( 0, 5, 9 ) ] >> 16) == 0 );
+
+    // A neighbor that isn't resident inherits its parent's tile:
+    uint32_t neighbor = pageTable[ vt::pageIndex( 0, 4, 9 ) ];
+    CHECK( neighbor == pageTable[ vt::pageIndex( 1, 2, 4 ) ] );
+    CHECK( (neighbor >> 16) == 1 );
+}
+
+static void testEvictionKeepsCoarsestAndRecentTiles()
+{
+    vt::VirtualTexture texture;
+    vt::TileRequest requests[ vt::kNumSlots ];
+    std::vector< uint32_t > pageTable( vt::kNumPages );
+    texture.update( requests, 1 );
+
+    // Frame 1 loads all of mip 4 and mip 5:
+    std::vector< uint32_t > feedback( vt::kFeedbackWords, 0 );
+    for ( uint32_t i = 0; i < 16; ++i )
+    {
+        uint32_t page = vt::pageIndex( 4, i % 4, i / 4 );
+        feedback[ page / 32 ] |= 1u << (page % 32);
+    }
+    texture.processFeedback( feedback.data() );
+    CHECK( texture.update( requests, vt::kNumSlots ) == 20 );
+
+    // Frame 2 loads the chain down to the finest tile in a corner:
+    std::vector< uint32_t > corner = feedbackFor( { vt::pageIndex( 0, 0, 0 ) } );
+    texture.processFeedback( corner.data() );
+    CHECK( texture.update( requests, vt::kNumSlots ) == 4 );
+
+    // Frame 3 fills the rest of the cache with mip 3 tiles. It uses rows 0
+    // to 2 of mip 4, but not row 3:
+    std::fill( feedback.begin(), feedback.end(), 0 );
+    for ( uint32_t i = 1; i < 40; ++i )
+    {
+        uint32_t page = vt::pageIndex( 3, i % 8, i / 8 );
+        feedback[ page / 32 ] |= 1u << (page % 32);
+    }
+    texture.processFeedback( feedback.data() );
+    CHECK( texture.update( requests, vt::kNumSlots ) == 39 );
+    texture.writePageTable( pageTable.data() );
+    const uint32_t coarsestSlot = slotOf( pageTable[ kCoarsestPage ] );
+
+    // Frame 4 needs four tiles in the opposite corner. Three of them replace
+    // the mip 4 tiles last used in frame 1. Tile (3, 3) of mip 4 is an
+    // ancestor of the new tiles, so it stays:
+    std::vector< uint32_t > opposite = feedbackFor( { vt::pageIndex( 0, 63, 63 ) } );
+    texture.processFeedback( opposite.data() );
+    size_t count = texture.update( requests, vt::kNumSlots );
+    CHECK( count == 4 );
+
+    texture.writePageTable( pageTable.data() );
+    for ( uint32_t x = 0; x < 3; ++x )
+    {
+        CHECK( (pageTable[ vt::pageIndex( 4, x, 3 ) ] >> 16) == 5 );
+    }
+    CHECK( (pageTable[ vt::pageIndex( 4, 3, 3 ) ] >> 16) == 4 );
+    CHECK( (pageTable[ vt::pageIndex( 0, 63, 63 ) ] >> 16) == 0 );
+    for ( uint32_t i = 1; i < 40; ++i )
+    {
+        CHECK( (pageTable[ vt::pageIndex( 3, i % 8, i / 8 ) ] >> 16) == 3 );
+    }
+    CHECK( slotOf( pageTable[ kCoarsestPage ] ) == coarsestSlot );
+    for ( size_t i = 0; i < count; ++i )
+    {
+        CHECK( requests[ i ].slotX + requests[ i ].slotY * vt::kCacheTilesPerSide != coarsestSlot );
+    }
+}
+
+int main()
+{
+    testPageIndex();
+    testCoarsestTileComesFirst();
+    testFeedbackRequestsAncestorsCoarseFirst();
+    testEvictionKeepsCoarsestAndRecentTiles();
+    return check::finish( "virtual-texture-test" );
+}
@@ -0,0 +1,256 @@
+/*
+ *
+ * Copyright 2022 Apple Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// The CPU side of the virtual-textured Mandelbrot set in 09-compute-to-render:
+// the page table, the tile cache and the analysis of sampling feedback. It
+// makes no Metal calls, so the virtual-texture test runs it on any platform.
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#pragma region Declarations {
+
+namespace vt
+{
+    // Tiles include a border of texels shared with their neighbors, so that
+    // filtering at a tile's edge doesn't need the adjacent tile:
+    static constexpr uint32_t kTileSize = 128;
+    static constexpr uint32_t kTileBorder = 1;
+    static constexpr uint32_t kVirtualTilesPerSide = 64;
+    static constexpr uint32_t kVirtualMipCount = 7;
+    static constexpr uint32_t kCacheTilesPerSide = 8;
+
+    static constexpr uint32_t kNumPages = (kVirtualTilesPerSide * kVirtualTilesPerSide * 4 - 1) / 3;
+    static constexpr uint32_t kNumSlots = kCacheTilesPerSide * kCacheTilesPerSide;
+    static constexpr uint32_t kFeedbackWords = (kNumPages + 31) / 32;
+    static constexpr uint32_t kInvalidPageEntry = 0xFFFFFFFF;
+
+    struct TileRequest
+    {
+        uint32_t mip;
+        uint32_t tileX;
+        uint32_t tileY;
+        uint32_t slotX;
+        uint32_t slotY;
+    };
+
+    uint32_t pageIndex( uint32_t mip, uint32_t x, uint32_t y );
+
+    class VirtualTexture
+    {
+        public:
+            VirtualTexture();
+            void processFeedback( const uint32_t* pFeedbackBits );
+            size_t update( TileRequest* pRequests, size_t maxRequests );
+            void writePageTable( uint32_t* pPageTable ) const;
+
+        private:
+            struct Page
+            {
+                uint32_t mip;
+                uint32_t x;
+                uint32_t y;
+            };
+
+            int32_t findSlot() const;
+
+            Page _pages[ kNumPages ];
+            int32_t _pageSlot[ kNumPages ];
+            int32_t _slotPage[ kNumSlots ];
+            uint64_t _slotLastUsed[ kNumSlots ];
+            std::vector< uint32_t > _pendingPages;
+            uint64_t _frameNumber;
+    };
+}
+
+#pragma endregion Declarations }
+
+
+#pragma mark - VirtualTexture
+#pragma region VirtualTexture {
+
+namespace vt
+{
+    inline uint32_t pageIndex( uint32_t mip, uint32_t x, uint32_t y )
+    {
+        uint32_t offset = 0;
+        for ( uint32_t m = 0; m < mip; ++m )
+        {
+            uint32_t n = kVirtualTilesPerSide >> m;
+            offset += n * n;
+        }
+        return offset + y * (kVirtualTilesPerSide >> mip) + x;
+    }
+
+    inline VirtualTexture::VirtualTexture()
+    : _frameNumber( 0 )
+    {
+        for ( uint32_t mip = 0; mip < kVirtualMipCount; ++mip )
+        {
+            uint32_t n = kVirtualTilesPerSide >> mip;
+            for ( uint32_t y = 0; y < n; ++y )
+            {
+                for ( uint32_t x = 0; x < n; ++x )
+                {
+                    uint32_t page = pageIndex( mip, x, y );
+                    _pages[ page ] = { mip, x, y };
+                    _pageSlot[ page ] = -1;
+                }
+            }
+        }
+
+        for ( uint32_t i = 0; i < kNumSlots; ++i )
+        {
+            _slotPage[ i ] = -1;
+            _slotLastUsed[ i ] = 0;
+        }
+
+        // The single tile of the coarsest mip is the fallback for every
+        // other page, so it is requested first and never evicted.
+        _pendingPages.push_back( kNumPages - 1 );
+    }
+
+    inline void VirtualTexture::processFeedback( const uint32_t* pFeedbackBits )
+    {
+        ++_frameNumber;
+
+        for ( uint32_t word = 0; word < kFeedbackWords; ++word )
+        {
+            uint32_t bits = pFeedbackBits[ word ];
+            while ( bits )
+            {
+                uint32_t page = word * 32 + __builtin_ctz( bits );
+                bits &= bits - 1;
+
+                // Keep the sampled page and its ancestors resident, since the
+                // page table falls back to them while finer tiles are pending:
+                const Page& p = _pages[ page ];
+                for ( uint32_t mip = p.mip; mip < kVirtualMipCount; ++mip )
+                {
+                    uint32_t ancestor = pageIndex( mip, p.x >> (mip - p.mip), p.y >> (mip - p.mip) );
+                    int32_t slot = _pageSlot[ ancestor ];
+                    if ( slot >= 0 )
+                    {
+                        _slotLastUsed[ slot ] = _frameNumber;
+                    }
+                    else
+                    {
+                        _pendingPages.push_back( ancestor );
+                    }
+                }
+            }
+        }
+    }
+
+    inline int32_t VirtualTexture::findSlot() const
+    {
+        int32_t lru = -1;
+        for ( uint32_t i = 0; i < kNumSlots; ++i )
+        {
+            if ( _slotPage[ i ] < 0 )
+            {
+                return i;
+            }
+            if ( _slotPage[ i ] == (int32_t)(kNumPages - 1) || _slotLastUsed[ i ] >= _frameNumber )
+            {
+                continue;
+            }
+            if ( lru < 0 || _slotLastUsed[ i ] < _slotLastUsed[ lru ] )
+            {
+                lru = i;
+            }
+        }
+        return lru;
+    }
+
+    inline size_t VirtualTexture::update( TileRequest* pRequests, size_t maxRequests )
+    {
+        // Generate coarse tiles first so that the fallback improves quickly:
+        std::sort( _pendingPages.begin(), _pendingPages.end(), []( uint32_t a, uint32_t b ){ return a > b; } );
+        _pendingPages.erase( std::unique( _pendingPages.begin(), _pendingPages.end() ), _pendingPages.end() );
+
+        size_t count = 0;
+        for ( uint32_t page : _pendingPages )
+        {
+            if ( count == maxRequests )
+            {
+                break;
+            }
+            if ( _pageSlot[ page ] >= 0 )
+            {
+                continue;
+            }
+
+            int32_t slot = findSlot();
+            if ( slot < 0 )
+            {
+                break;
+            }
+            if ( _slotPage[ slot ] >= 0 )
+            {
+                _pageSlot[ _slotPage[ slot ] ] = -1;
+            }
+            _slotPage[ slot ] = page;
+            _slotLastUsed[ slot ] = _frameNumber;
+            _pageSlot[ page ] = slot;
+
+            const Page& p = _pages[ page ];
+            pRequests[ count++ ] = { p.mip, p.x, p.y, slot % kCacheTilesPerSide, slot / kCacheTilesPerSide };
+        }
+
+        _pendingPages.clear();
+        return count;
+    }
+
+    inline void VirtualTexture::writePageTable( uint32_t* pPageTable ) const
+    {
+        // Walk from the coarsest mip down so that pages which are not resident
+        // inherit the entry of their parent:
+        for ( int32_t mip = kVirtualMipCount - 1; mip >= 0; --mip )
+        {
+            uint32_t n = kVirtualTilesPerSide >> mip;
+            for ( uint32_t y = 0; y < n; ++y )
+            {
+                for ( uint32_t x = 0; x < n; ++x )
+                {
+                    uint32_t page = pageIndex( mip, x, y );
+                    int32_t slot = _pageSlot[ page ];
+                    if ( slot >= 0 )
+                    {
+                        uint32_t slotX = slot % kCacheTilesPerSide;
+                        uint32_t slotY = slot / kCacheTilesPerSide;
+                        pPageTable[ page ] = slotX | (slotY << 8) | (mip << 16);
+                    }
+                    else if ( mip + 1 < (int32_t)kVirtualMipCount )
+                    {
+                        pPageTable[ page ] = pPageTable[ pageIndex( mip + 1, x / 2, y / 2 ) ];
+                    }
+                    else
+                    {
+                        pPageTable[ page ] = kInvalidPageEntry;
+                    }
+                }
+            }
+        }
+    }
+}
+
+#pragma endregion VirtualTexture }
@@ -29,9 +29,20 @@
 
 //-------------------------------------------------------------------------------------------------------------------------------------------------------------
 
+#if defined( METALCPP_LAZY_REGISTRATION )
+
+#include <Foundation/NSLazySymbol.hpp>
+
+#define _APPKIT_PRIVATE_CLS( symbol )				   ( Private::Class::s_k ## symbol.get() )
+#define _APPKIT_PRIVATE_SEL( accessor )				 ( Private::Selector::s_k ## accessor.get() )
+
+#else
+
 #define _APPKIT_PRIVATE_CLS( symbol )				   ( Private::Class::s_k ## symbol )
 #define _APPKIT_PRIVATE_SEL( accessor )				 ( Private::Selector::s_k ## accessor )
 
+#endif // METALCPP_LAZY_REGISTRATION
+
 //-------------------------------------------------------------------------------------------------------------------------------------------------------------
 
 #if defined( NS_PRIVATE_IMPLEMENTATION )
@@ -45,16 +56,26 @@
 #define  _APPKIT_PRIVATE_OBJC_LOOKUP_CLASS( symbol  )   objc_lookUpClass( # symbol ) 
 #endif // __OBJC__
 
+#if defined( METALCPP_LAZY_REGISTRATION )
+#define _APPKIT_PRIVATE_DEF_CLS( symbol )				NS::Private::LazyClass		s_k ## symbol 	_NS_PRIVATE_VISIBILITY { # symbol };
+#define _APPKIT_PRIVATE_DEF_SEL( accessor, symbol )	 NS::Private::LazySelector	 s_k ## accessor	_NS_PRIVATE_VISIBILITY { symbol };
+#else
 #define _APPKIT_PRIVATE_DEF_CLS( symbol )				void*				   s_k ## symbol 	_NS_PRIVATE_VISIBILITY = _NS_PRIVATE_OBJC_LOOKUP_CLASS( symbol );
 #define _APPKIT_PRIVATE_DEF_SEL( accessor, symbol )	 SEL					 s_k ## accessor	_NS_PRIVATE_VISIBILITY = sel_registerName( symbol );
+#endif // METALCPP_LAZY_REGISTRATION
 #define _APPKIT_PRIVATE_DEF_CONST( type, symbol )	   _NS_EXTERN type const   NS ## symbol   _NS_PRIVATE_IMPORT; \
 													type const			  NS::symbol	 = ( nullptr != &NS ## symbol ) ? NS ## symbol : nullptr;
 
 
 #else
 
+#if defined( METALCPP_LAZY_REGISTRATION )
+#define _APPKIT_PRIVATE_DEF_CLS( symbol )				extern NS::Private::LazyClass		s_k ## symbol;
+#define _APPKIT_PRIVATE_DEF_SEL( accessor, symbol )	 extern NS::Private::LazySelector	s_k ## accessor;
+#else
 #define _APPKIT_PRIVATE_DEF_CLS( symbol )				extern void*			s_k ## symbol;
 #define _APPKIT_PRIVATE_DEF_SEL( accessor, symbol )	 extern SEL			  s_k ## accessor;
+#endif // METALCPP_LAZY_REGISTRATION
 #define _APPKIT_PRIVATE_DEF_CONST( type, symbol )
 
 
@@ -12,9 +12,20 @@
 
 //-------------------------------------------------------------------------------------------------------------------------------------------------------------
 
+#if defined( METALCPP_LAZY_REGISTRATION )
+
+#include <Foundation/NSLazySymbol.hpp>
+
+#define _UI_PRIVATE_CLS( symbol )   ( Private::Class::s_k ## symbol.get() )
+#define _UI_PRIVATE_SEL( accessor ) ( Private::Selector::s_k ## accessor.get() )
+
+#else
+
 #define _UI_PRIVATE_CLS( symbol )   ( Private::Class::s_k ## symbol )
 #define _UI_PRIVATE_SEL( accessor ) ( Private::Selector::s_k ## accessor )
 
+#endif // METALCPP_LAZY_REGISTRATION
+
 //-------------------------------------------------------------------------------------------------------------------------------------------------------------
 
 #if defined( UI_PRIVATE_IMPLEMENTATION )
@@ -28,15 +39,25 @@
 #define _UI_PRIVATE_OBJC_LOOKUP_CLASS( symbol  ) objc_lookUpClass( # symbol )
 #endif // __OBJC__
 
+#if defined( METALCPP_LAZY_REGISTRATION )
+#define _UI_PRIVATE_DEF_CLS( symbol ) NS::Private::LazyClass s_k ## symbol _UI_PRIVATE_VISIBILITY { # symbol };
+#define _UI_PRIVATE_DEF_SEL( accessor, symbol ) NS::Private::LazySelector s_k ## accessor _UI_PRIVATE_VISIBILITY { symbol };
+#else
 #define _UI_PRIVATE_DEF_CLS( symbol ) void* s_k ## symbol _UI_PRIVATE_VISIBILITY = _UI_PRIVATE_OBJC_LOOKUP_CLASS( symbol );
 #define _UI_PRIVATE_DEF_SEL( accessor, symbol ) SEL s_k ## accessor _UI_PRIVATE_VISIBILITY = sel_registerName( symbol );
+#endif // METALCPP_LAZY_REGISTRATION
 #define _UI_PRIVATE_DEF_CONST( type, symbol ) _NS_EXTERN type const  UI ## symbol _UI_PRIVATE_IMPORT; \
 type const UI::symbol = ( nullptr != &UI ## symbol ) ? UI ## symbol : nullptr;
 
 #else
 
+#if defined( METALCPP_LAZY_REGISTRATION )
+#define _UI_PRIVATE_DEF_CLS( symbol ) extern NS::Private::LazyClass s_k ## symbol;
+#define _UI_PRIVATE_DEF_SEL( accessor, symbol ) extern NS::Private::LazySelector s_k ## accessor;
+#else
 #define _UI_PRIVATE_DEF_CLS( symbol ) extern void* s_k ## symbol;
 #define _UI_PRIVATE_DEF_SEL( accessor, symbol ) extern SEL s_k ## accessor;
+#endif // METALCPP_LAZY_REGISTRATION
 #define _UI_PRIVATE_DEF_CONST( type, symbol )
 
 #endif // UI_PRIVATE_IMPLEMENTATION
@@ -0,0 +1,134 @@
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+//
+// Foundation/NSLazySymbol.hpp
+//
+// Copyright 2020-2024 Apple Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+#pragma once
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+#include "NSDefines.hpp"
+
+#include <objc/runtime.h>
+
+#include <atomic>
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+// With METALCPP_LAZY_REGISTRATION defined, the private headers declare their selectors, classes and protocols as LazySymbols instead of
+// resolving them during static initialization. A LazySymbol is constant-initialized with the symbol name and resolves it through the
+// Objective-C runtime the first time it is used. Threads racing on the first use resolve the same value, so no lock is needed.
+
+namespace NS::Private
+{
+template <typename _Type, _Type (*_Resolve)(const char*)>
+class LazySymbol
+{
+public:
+    constexpr explicit LazySymbol(const char* pName);
+
+    LazySymbol(const LazySymbol&)            = delete;
+    LazySymbol& operator=(const LazySymbol&) = delete;
+
+    _Type       get() const;
+
+private:
+    _Type       resolve() const;
+
+    const char*                 _pName;
+    mutable std::atomic<_Type>  _value;
+};
+
+inline SEL  ResolveSelector(const char* pName);
+inline void* ResolveClass(const char* pName);
+inline void* ResolveProtocol(const char* pName);
+
+using LazySelector = LazySymbol<SEL, ResolveSelector>;
+using LazyClass = LazySymbol<void*, ResolveClass>;
+using LazyProtocol = LazySymbol<void*, ResolveProtocol>;
+} // NS::Private
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+template <typename _Type, _Type (*_Resolve)(const char*)>
+constexpr NS::Private::LazySymbol<_Type, _Resolve>::LazySymbol(const char* pName)
+    : _pName(pName)
+    , _value(nullptr)
+{
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+template <typename _Type, _Type (*_Resolve)(const char*)>
+_NS_INLINE _Type NS::Private::LazySymbol<_Type, _Resolve>::get() const
+{
+    _Type value = _value.load(std::memory_order_acquire);
+
+    if (__builtin_expect(value != nullptr, 1))
+    {
+        return value;
+    }
+
+    return resolve();
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+// Kept out of line so get() inlines to a load and a well-predicted branch. Symbols the runtime does not know (a class from a newer OS)
+// stay nullptr and are looked up again on each use, matching the value the eager definitions would hold.
+
+template <typename _Type, _Type (*_Resolve)(const char*)>
+__attribute__((noinline, cold)) _Type NS::Private::LazySymbol<_Type, _Resolve>::resolve() const
+{
+    _Type value = _Resolve(_pName);
+
+    _value.store(value, std::memory_order_release);
+
+    return value;
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+inline SEL NS::Private::ResolveSelector(const char* pName)
+{
+    return sel_registerName(pName);
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+inline void* NS::Private::ResolveClass(const char* pName)
+{
+#ifdef __OBJC__
+    return (__bridge void*)objc_lookUpClass(pName);
+#else
+    return objc_lookUpClass(pName);
+#endif // __OBJC__
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+inline void* NS::Private::ResolveProtocol(const char* pName)
+{
+#ifdef __OBJC__
+    return (__bridge void*)objc_getProtocol(pName);
+#else
+    return objc_getProtocol(pName);
+#endif // __OBJC__
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,196 @@
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+//
+// Foundation/NSMethodCache.hpp
+//
+// Copyright 2020-2024 Apple Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+#pragma once
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+#include "NSDefines.hpp"
+
+#include <objc/runtime.h>
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <type_traits>
+#include <unordered_map>
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+// With METALCPP_IMP_CACHING defined, the hottest encoder calls keep a MethodCache per call site. It maps the receiver's class to the IMP
+// the runtime would dispatch to, and calls that IMP directly instead of going through objc_msgSend. The class is read on every call, so
+// receivers whose class changes (a validation layer, isa swizzling) pick up the right IMP. Methods replaced on a class the cache has
+// already seen are not noticed; call MethodCache::invalidateAll() after swizzling.
+
+namespace NS::Private
+{
+class MethodCache
+{
+public:
+    constexpr MethodCache();
+
+    MethodCache(const MethodCache&)            = delete;
+    MethodCache& operator=(const MethodCache&) = delete;
+
+    // Only for methods that return void or a scalar; struct returns need objc_msgSend_stret on some architectures.
+    template <typename _Ret, typename... _Args>
+    _Ret        send(const void* pObj, SEL selector, _Args... args) const;
+
+    static void invalidateAll();
+
+private:
+    struct Entry
+    {
+        ::Class  cls;
+        IMP      imp;
+        uint32_t generation;
+    };
+
+    static constexpr size_t kWays = 4;
+
+    IMP                            lookup(::Class cls, SEL selector) const;
+    IMP                            resolve(::Class cls, SEL selector) const;
+
+    static const Entry*            intern(::Class cls, SEL selector, uint32_t generation);
+    static std::atomic<uint32_t>&  generation();
+
+    mutable std::atomic<const Entry*> _entries[kWays];
+    mutable std::atomic<uint32_t>     _next;
+};
+} // NS::Private
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+constexpr NS::Private::MethodCache::MethodCache()
+    : _entries {}
+    , _next(0)
+{
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+template <typename _Ret, typename... _Args>
+_NS_INLINE _Ret NS::Private::MethodCache::send(const void* pObj, SEL selector, _Args... args) const
+{
+    static_assert(!std::is_class<_Ret>(), "MethodCache only dispatches methods returning void or a scalar");
+
+    // Messages to nil return zero, as they would through objc_msgSend
+    if (__builtin_expect(pObj == nullptr, 0))
+    {
+        return _Ret();
+    }
+
+    using MethodProc = _Ret (*)(const void*, SEL, _Args...);
+
+#ifdef __OBJC__
+    const ::Class    cls = object_getClass((__bridge id)pObj);
+#else
+    const ::Class    cls = object_getClass((id)pObj);
+#endif // __OBJC__
+    const MethodProc pProc = reinterpret_cast<MethodProc>(lookup(cls, selector));
+
+    return (*pProc)(pObj, selector, args...);
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+_NS_INLINE IMP NS::Private::MethodCache::lookup(::Class cls, SEL selector) const
+{
+    const uint32_t current = generation().load(std::memory_order_relaxed);
+
+    for (size_t i = 0; i < kWays; ++i)
+    {
+        const Entry* pEntry = _entries[i].load(std::memory_order_acquire);
+
+        if (__builtin_expect(pEntry && pEntry->cls == cls && pEntry->generation == current, 1))
+        {
+            return pEntry->imp;
+        }
+    }
+
+    return resolve(cls, selector);
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+// A miss asks the runtime for the IMP, the same one objc_msgSend would find, including the forwarding trampoline for receivers that
+// forward the message. Entries are interned, so a call site alternating between more classes than it has ways cannot grow memory.
+
+__attribute__((noinline, cold)) inline IMP NS::Private::MethodCache::resolve(::Class cls, SEL selector) const
+{
+    const Entry* pEntry = intern(cls, selector, generation().load(std::memory_order_relaxed));
+
+    _entries[_next.fetch_add(1, std::memory_order_relaxed) % kWays].store(pEntry, std::memory_order_release);
+
+    return pEntry->imp;
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+inline const NS::Private::MethodCache::Entry* NS::Private::MethodCache::intern(::Class cls, SEL selector, uint32_t generation)
+{
+    struct Key
+    {
+        ::Class  cls;
+        SEL      selector;
+        uint32_t generation;
+
+        bool     operator==(const Key& other) const { return cls == other.cls && selector == other.selector && generation == other.generation; }
+    };
+
+    struct KeyHash
+    {
+        size_t operator()(const Key& key) const
+        {
+            return std::hash<const void*>()(key.cls) ^ (std::hash<const void*>()(key.selector) << 1) ^ key.generation;
+        }
+    };
+
+    static std::mutex                                 mutex;
+    static std::unordered_map<Key, const Entry*, KeyHash> entries;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    const Entry*& pEntry = entries[Key { cls, selector, generation }];
+    if (!pEntry)
+    {
+        pEntry = new Entry { cls, class_getMethodImplementation(cls, selector), generation };
+    }
+
+    return pEntry;
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+inline std::atomic<uint32_t>& NS::Private::MethodCache::generation()
+{
+    static std::atomic<uint32_t> generation { 0 };
+
+    return generation;
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+inline void NS::Private::MethodCache::invalidateAll()
+{
+    generation().fetch_add(1, std::memory_order_relaxed);
+}
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
@@ -26,6 +26,10 @@
 #include "NSPrivate.hpp"
 #include "NSTypes.hpp"
 
+#if defined(METALCPP_IMP_CACHING)
+#include "NSMethodCache.hpp"
+#endif // METALCPP_IMP_CACHING
+
 #include <objc/message.h>
 #include <objc/runtime.h>
 
@@ -88,6 +92,10 @@ protected:
     static _Ret sendMessage(const void* pObj, SEL selector, _Args... args);
     template <typename _Ret, typename... _Args>
     static _Ret sendMessageSafe(const void* pObj, SEL selector, _Args... args);
+#if defined(METALCPP_IMP_CACHING)
+    template <typename _Ret, typename... _Args>
+    static _Ret sendMessageCached(const Private::MethodCache& cache, const void* pObj, SEL selector, _Args... args);
+#endif // METALCPP_IMP_CACHING
 
 private:
     Object() = delete;
@@ -249,6 +257,25 @@ _NS_INLINE _Ret NS::Object::sendMessageSafe(const void* pObj, SEL selector, _Arg
 
 //-------------------------------------------------------------------------------------------------------------------------------------------------------------
 
+#if defined(METALCPP_IMP_CACHING)
+
+template <typename _Ret, typename... _Args>
+_NS_INLINE _Ret NS::Object::sendMessageCached(const Private::MethodCache& cache, const void* pObj, SEL selector, _Args... args)
+{
+    if constexpr (std::is_class<_Ret>())
+    {
+        return sendMessage<_Ret>(pObj, selector, args...);
+    }
+    else
+    {
+        return cache.send<_Ret>(pObj, selector, args...);
+    }
+}
+
+#endif // METALCPP_IMP_CACHING
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+
 template <class _Class>
 _NS_INLINE _Class* NS::Object::alloc(const char* pClassName)
 {
@@ -26,9 +26,20 @@
 
 //-------------------------------------------------------------------------------------------------------------------------------------------------------------
 
+#if defined(METALCPP_LAZY_REGISTRATION)
+
+#include "NSLazySymbol.hpp"
+
+#define _NS_PRIVATE_CLS(symbol) (Private::Class::s_k##symbol.get())
+#define _NS_PRIVATE_SEL(accessor) (Private::Selector::s_k##accessor.get())
+
+#else
+
 #define _NS_PRIVATE_CLS(symbol) (Private::Class::s_k##symbol)
 #define _NS_PRIVATE_SEL(accessor) (Private::Selector::s_k##accessor)
 
+#endif // METALCPP_LAZY_REGISTRATION
+
 //-------------------------------------------------------------------------------------------------------------------------------------------------------------
 
 #if defined(NS_PRIVATE_IMPLEMENTATION)
@@ -62,9 +73,15 @@ namespace NS::Private
 #define _NS_PRIVATE_OBJC_GET_PROTOCOL(symbol) objc_getProtocol(#symbol)
 #endif // __OBJC__
 
+#if defined(METALCPP_LAZY_REGISTRATION)
+#define _NS_PRIVATE_DEF_CLS(symbol) NS::Private::LazyClass s_k##symbol _NS_PRIVATE_VISIBILITY { #symbol }
+#define _NS_PRIVATE_DEF_PRO(symbol) NS::Private::LazyProtocol s_k##symbol _NS_PRIVATE_VISIBILITY { #symbol }
+#define _NS_PRIVATE_DEF_SEL(accessor, symbol) NS::Private::LazySelector s_k##accessor _NS_PRIVATE_VISIBILITY { symbol }
+#else
 #define _NS_PRIVATE_DEF_CLS(symbol) void* s_k##symbol _NS_PRIVATE_VISIBILITY = _NS_PRIVATE_OBJC_LOOKUP_CLASS(symbol)
 #define _NS_PRIVATE_DEF_PRO(symbol) void* s_k##symbol _NS_PRIVATE_VISIBILITY = _NS_PRIVATE_OBJC_GET_PROTOCOL(symbol)
 #define _NS_PRIVATE_DEF_SEL(accessor, symbol) SEL s_k##accessor _NS_PRIVATE_VISIBILITY = sel_registerName(symbol)
+#endif // METALCPP_LAZY_REGISTRATION
 
 #if defined(__MAC_26_0) || defined(__IPHONE_26_0) || defined(__TVOS_26_0)
 #define _NS_PRIVATE_DEF_CONST(type, symbol)              \
@@ -78,9 +95,15 @@ namespace NS::Private
 
 #else
 
+#if defined(METALCPP_LAZY_REGISTRATION)
+#define _NS_PRIVATE_DEF_CLS(symbol) extern NS::Private::LazyClass s_k##symbol
+#define _NS_PRIVATE_DEF_PRO(symbol) extern NS::Private::LazyProtocol s_k##symbol
+#define _NS_PRIVATE_DEF_SEL(accessor, symbol) extern NS::Private::LazySelector s_k##accessor
+#else
 #define _NS_PRIVATE_DEF_CLS(symbol) extern void* s_k##symbol
 #define _NS_PRIVATE_DEF_PRO(symbol) extern void* s_k##symbol
 #define _NS_PRIVATE_DEF_SEL(accessor, symbol) extern SEL s_k##accessor
+#endif // METALCPP_LAZY_REGISTRATION
 #define _NS_PRIVATE_DEF_CONST(type, symbol) extern type const NS::symbol
 
 #endif // NS_PRIVATE_IMPLEMENTATION
@@ -130,7 +130,7 @@ public:
 
 _MTL_INLINE void MTL::ComputeCommandEncoder::dispatchThreadgroups(MTL::Size threadgroupsPerGrid, MTL::Size threadsPerThreadgroup)
 {
-    Object::sendMessage<void>(this, _MTL_PRIVATE_SEL(dispatchThreadgroups_threadsPerThreadgroup_), threadgroupsPerGrid, threadsPerThreadgroup);
+    _MTL_PRIVATE_SEND_CACHED(void, dispatchThreadgroups_threadsPerThreadgroup_, threadgroupsPerGrid, threadsPerThreadgroup);
 }
 
 _MTL_INLINE void MTL::ComputeCommandEncoder::dispatchThreadgroups(const MTL::Buffer* indirectBuffer, NS::UInteger indirectBufferOffset, MTL::Size threadsPerThreadgroup)
@@ -140,7 +140,7 @@ _MTL_INLINE void MTL::ComputeCommandEncoder::dispatchThreadgroups(const MTL::Buf
 
 _MTL_INLINE void MTL::ComputeCommandEncoder::dispatchThreads(MTL::Size threadsPerGrid, MTL::Size threadsPerThreadgroup)
 {
-    Object::sendMessage<void>(this, _MTL_PRIVATE_SEL(dispatchThreads_threadsPerThreadgroup_), threadsPerGrid, threadsPerThreadgroup);
+    _MTL_PRIVATE_SEND_CACHED(void, dispatchThreads_threadsPerThreadgroup_, threadsPerGrid, threadsPerThreadgroup);
 }
 
 _MTL_INLINE MTL::DispatchType MTL::ComputeCommandEncoder::dispatchType() const
@@ -180,7 +180,7 @@ _MTL_INLINE void MTL::ComputeCommandEncoder::setAccelerationStructure(const MTL:
 
 _MTL_INLINE void MTL::ComputeCommandEncoder::setBuffer(const MTL::Buffer* buffer, NS::UInteger offset, NS::UInteger index)
 {
-    Object::sendMessage<void>(this, _MTL_PRIVATE_SEL(setBuffer_offset_atIndex_), buffer, offset, index);
+    _MTL_PRIVATE_SEND_CACHED(void, setBuffer_offset_atIndex_, buffer, offset, index);
 }
 
 _MTL_INLINE void MTL::ComputeCommandEncoder::setBuffer(const MTL::Buffer* buffer, NS::UInteger offset, NS::UInteger stride, NS::UInteger index)
@@ -190,7 +190,7 @@ _MTL_INLINE void MTL::ComputeCommandEncoder::setBuffer(const MTL::Buffer* buffer
 
 _MTL_INLINE void MTL::ComputeCommandEncoder::setBufferOffset(NS::UInteger offset, NS::UInteger index)
 {
-    Object::sendMessage<void>(this, _MTL_PRIVATE_SEL(setBufferOffset_atIndex_), offset, index);
+    _MTL_PRIVATE_SEND_CACHED(void, setBufferOffset_atIndex_, offset, index);
 }
 
 _MTL_INLINE void MTL::ComputeCommandEncoder::setBufferOffset(NS::UInteger offset, NS::UInteger stride, NS::UInteger index)
@@ -210,7 +210,7 @@ _MTL_INLINE void MTL::ComputeCommandEncoder::setBuffers(const MTL::Buffer* const
 
 _MTL_INLINE void MTL::ComputeCommandEncoder::setBytes(const void* bytes, NS::UInteger length, NS::UInteger index)
 {
-    Object::sendMessage<void>(this, _MTL_PRIVATE_SEL(setBytes_length_atIndex_), bytes, length, index);
+    _MTL_PRIVATE_SEND_CACHED(void, setBytes_length_atIndex_, bytes, length, index);
 }
 
 _MTL_INLINE void MTL::ComputeCommandEncoder::setBytes(const void* bytes, NS::UInteger length, NS::UInteger stride, NS::UInteger index)
@@ -220,7 +220,7 @@ _MTL_INLINE void MTL::ComputeCommandEncoder::setBytes(const void* bytes, NS::UIn
 
 _MTL_INLINE void MTL::ComputeCommandEncoder::setComputePipelineState(const MTL::ComputePipelineState* state)
 {
-    Object::sendMessage<void>(this, _MTL_PRIVATE_SEL(setComputePipelineState_), state);
+    _MTL_PRIVATE_SEND_CACHED(void, setComputePipelineState_, state);
 }
 
 _MTL_INLINE void MTL::ComputeCommandEncoder::setImageblockWidth(NS::UInteger width, NS::UInteger height)
@@ -270,7 +270,7 @@ _MTL_INLINE void MTL::ComputeCommandEncoder::setStageInRegion(const MTL::Buffer*
 
 _MTL_INLINE void MTL::ComputeCommandEncoder::setTexture(const MTL::Texture* texture, NS::UInteger index)
 {
-    Object::sendMessage<void>(this, _MTL_PRIVATE_SEL(setTexture_atIndex_), texture, index);
+    _MTL_PRIVATE_SEND_CACHED(void, setTexture_atIndex_, texture, index);
 }
 
 _MTL_INLINE void MTL::ComputeCommandEncoder::setTextures(const MTL::Texture* const textures[], NS::Range range)
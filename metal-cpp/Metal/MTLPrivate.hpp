@@ -28,9 +28,38 @@
 
 //-------------------------------------------------------------------------------------------------------------------------------------------------------------
 
+#if defined(METALCPP_LAZY_REGISTRATION)
+
+#include "../Foundation/NSLazySymbol.hpp"
+
+#define _MTL_PRIVATE_CLS(symbol) (MTL::Private::Class::s_k##symbol.get())
+#define _MTL_PRIVATE_SEL(accessor) (MTL::Private::Selector::s_k##accessor.get())
+
+#else
+
 #define _MTL_PRIVATE_CLS(symbol) (MTL::Private::Class::s_k##symbol)
 #define _MTL_PRIVATE_SEL(accessor) (MTL::Private::Selector::s_k##accessor)
 
+#endif // METALCPP_LAZY_REGISTRATION
+
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+// Sends a message from an encoder's hot path. With METALCPP_IMP_CACHING, each call site keeps a cache of the IMP per receiver class.
+
+#if defined(METALCPP_IMP_CACHING)
+
+#include "../Foundation/NSMethodCache.hpp"
+
+#define _MTL_PRIVATE_SEND_CACHED(ret, accessor, ...)         \
+    static const NS::Private::MethodCache s_methodCache;     \
+    return Object::sendMessageCached<ret>(s_methodCache, this, _MTL_PRIVATE_SEL(accessor), __VA_ARGS__)
+
+#else
+
+#define _MTL_PRIVATE_SEND_CACHED(ret, accessor, ...) return Object::sendMessage<ret>(this, _MTL_PRIVATE_SEL(accessor), __VA_ARGS__)
+
+#endif // METALCPP_IMP_CACHING
+
 //-------------------------------------------------------------------------------------------------------------------------------------------------------------
 
 #if defined(MTL_PRIVATE_IMPLEMENTATION)
@@ -51,9 +80,15 @@
 #define _MTL_PRIVATE_OBJC_GET_PROTOCOL(symbol) objc_getProtocol(#symbol)
 #endif // __OBJC__
 
+#if defined(METALCPP_LAZY_REGISTRATION)
+#define _MTL_PRIVATE_DEF_CLS(symbol) NS::Private::LazyClass s_k##symbol _MTL_PRIVATE_VISIBILITY { #symbol }
+#define _MTL_PRIVATE_DEF_PRO(symbol) NS::Private::LazyProtocol s_k##symbol _MTL_PRIVATE_VISIBILITY { #symbol }
+#define _MTL_PRIVATE_DEF_SEL(accessor, symbol) NS::Private::LazySelector s_k##accessor _MTL_PRIVATE_VISIBILITY { symbol }
+#else
 #define _MTL_PRIVATE_DEF_CLS(symbol) void* s_k##symbol _MTL_PRIVATE_VISIBILITY = _MTL_PRIVATE_OBJC_LOOKUP_CLASS(symbol)
 #define _MTL_PRIVATE_DEF_PRO(symbol) void* s_k##symbol _MTL_PRIVATE_VISIBILITY = _MTL_PRIVATE_OBJC_GET_PROTOCOL(symbol)
 #define _MTL_PRIVATE_DEF_SEL(accessor, symbol) SEL s_k##accessor _MTL_PRIVATE_VISIBILITY = sel_registerName(symbol)
+#endif // METALCPP_LAZY_REGISTRATION
 
 #include <dlfcn.h>
 #define MTL_DEF_FUNC( name, signature ) \
@@ -101,9 +136,15 @@ namespace MTL::Private
 
 #else
 
+#if defined(METALCPP_LAZY_REGISTRATION)
+#define _MTL_PRIVATE_DEF_CLS(symbol) extern NS::Private::LazyClass s_k##symbol
+#define _MTL_PRIVATE_DEF_PRO(symbol) extern NS::Private::LazyProtocol s_k##symbol
+#define _MTL_PRIVATE_DEF_SEL(accessor, symbol) extern NS::Private::LazySelector s_k##accessor
+#else
 #define _MTL_PRIVATE_DEF_CLS(symbol) extern void* s_k##symbol
 #define _MTL_PRIVATE_DEF_PRO(symbol) extern void* s_k##symbol
 #define _MTL_PRIVATE_DEF_SEL(accessor, symbol) extern SEL s_k##accessor
+#endif // METALCPP_LAZY_REGISTRATION
 #define _MTL_PRIVATE_DEF_STR(type, symbol) extern type const MTL::symbol
 #define _MTL_PRIVATE_DEF_CONST(type, symbol) extern type const MTL::symbol
 #define _MTL_PRIVATE_DEF_WEAK_CONST(type, symbol) extern type const MTL::symbol
@@ -380,12 +380,12 @@ _MTL_INLINE void MTL::RenderCommandEncoder::drawIndexedPatches(NS::UInteger numb
 
 _MTL_INLINE void MTL::RenderCommandEncoder::drawIndexedPrimitives(MTL::PrimitiveType primitiveType, NS::UInteger indexCount, MTL::IndexType indexType, const MTL::Buffer* indexBuffer, NS::UInteger indexBufferOffset, NS::UInteger instanceCount)
 {
-    Object::sendMessage<void>(this, _MTL_PRIVATE_SEL(drawIndexedPrimitives_indexCount_indexType_indexBuffer_indexBufferOffset_instanceCount_), primitiveType, indexCount, indexType, indexBuffer, indexBufferOffset, instanceCount);
+    _MTL_PRIVATE_SEND_CACHED(void, drawIndexedPrimitives_indexCount_indexType_indexBuffer_indexBufferOffset_instanceCount_, primitiveType, indexCount, indexType, indexBuffer, indexBufferOffset, instanceCount);
 }
 
 _MTL_INLINE void MTL::RenderCommandEncoder::drawIndexedPrimitives(MTL::PrimitiveType primitiveType, NS::UInteger indexCount, MTL::IndexType indexType, const MTL::Buffer* indexBuffer, NS::UInteger indexBufferOffset)
 {
-    Object::sendMessage<void>(this, _MTL_PRIVATE_SEL(drawIndexedPrimitives_indexCount_indexType_indexBuffer_indexBufferOffset_), primitiveType, indexCount, indexType, indexBuffer, indexBufferOffset);
+    _MTL_PRIVATE_SEND_CACHED(void, drawIndexedPrimitives_indexCount_indexType_indexBuffer_indexBufferOffset_, primitiveType, indexCount, indexType, indexBuffer, indexBufferOffset);
 }
 
 _MTL_INLINE void MTL::RenderCommandEncoder::drawIndexedPrimitives(MTL::PrimitiveType primitiveType, NS::UInteger indexCount, MTL::IndexType indexType, const MTL::Buffer* indexBuffer, NS::UInteger indexBufferOffset, NS::UInteger instanceCount, NS::Integer baseVertex, NS::UInteger baseInstance)
@@ -425,12 +425,12 @@ _MTL_INLINE void MTL::RenderCommandEncoder::drawPatches(NS::UInteger numberOfPat
 
 _MTL_INLINE void MTL::RenderCommandEncoder::drawPrimitives(MTL::PrimitiveType primitiveType, NS::UInteger vertexStart, NS::UInteger vertexCount, NS::UInteger instanceCount)
 {
-    Object::sendMessage<void>(this, _MTL_PRIVATE_SEL(drawPrimitives_vertexStart_vertexCount_instanceCount_), primitiveType, vertexStart, vertexCount, instanceCount);
+    _MTL_PRIVATE_SEND_CACHED(void, drawPrimitives_vertexStart_vertexCount_instanceCount_, primitiveType, vertexStart, vertexCount, instanceCount);
 }
 
 _MTL_INLINE void MTL::RenderCommandEncoder::drawPrimitives(MTL::PrimitiveType primitiveType, NS::UInteger vertexStart, NS::UInteger vertexCount)
 {
-    Object::sendMessage<void>(this, _MTL_PRIVATE_SEL(drawPrimitives_vertexStart_vertexCount_), primitiveType, vertexStart, vertexCount);
+    _MTL_PRIVATE_SEND_CACHED(void, drawPrimitives_vertexStart_vertexCount_, primitiveType, vertexStart, vertexCount);
 }
 
 _MTL_INLINE void MTL::RenderCommandEncoder::drawPrimitives(MTL::PrimitiveType primitiveType, NS::UInteger vertexStart, NS::UInteger vertexCount, NS::UInteger instanceCount, NS::UInteger baseInstance)
@@ -490,7 +490,7 @@ _MTL_INLINE void MTL::RenderCommandEncoder::setColorStoreActionOptions(MTL::Stor
 
 _MTL_INLINE void MTL::RenderCommandEncoder::setCullMode(MTL::CullMode cullMode)
 {
-    Object::sendMessage<void>(this, _MTL_PRIVATE_SEL(setCullMode_), cullMode);
+    _MTL_PRIVATE_SEND_CACHED(void, setCullMode_, cullMode);
 }
 
 _MTL_INLINE void MTL::RenderCommandEncoder::setDepthBias(float depthBias, float slopeScale, float clamp)
@@ -505,7 +505,7 @@ _MTL_INLINE void MTL::RenderCommandEncoder::setDepthClipMode(MTL::DepthClipMode
 
 _MTL_INLINE void MTL::RenderCommandEncoder::setDepthStencilState(const MTL::DepthStencilState* depthStencilState)
 {
-    Object::sendMessage<void>(this, _MTL_PRIVATE_SEL(setDepthStencilState_), depthStencilState);
+    _MTL_PRIVATE_SEND_CACHED(void, setDepthStencilState_, depthStencilState);
 }
 
 _MTL_INLINE void MTL::RenderCommandEncoder::setDepthStoreAction(MTL::StoreAction storeAction)
@@ -530,7 +530,7 @@ _MTL_INLINE void MTL::RenderCommandEncoder::setFragmentAccelerationStructure(con
 
 _MTL_INLINE void MTL::RenderCommandEncoder::setFragmentBuffer(const MTL::Buffer* buffer, NS::UInteger offset, NS::UInteger index)
 {
-    Object::sendMessage<void>(this, _MTL_PRIVATE_SEL(setFragmentBuffer_offset_atIndex_), buffer, offset, index);
+    _MTL_PRIVATE_SEND_CACHED(void, setFragmentBuffer_offset_atIndex_, buffer, offset, index);
 }
 
 _MTL_INLINE void MTL::RenderCommandEncoder::setFragmentBufferOffset(NS::UInteger offset, NS::UInteger index)
@@ -545,7 +545,7 @@ _MTL_INLINE void MTL::RenderCommandEncoder::setFragmentBuffers(const MTL::Buffer
 
 _MTL_INLINE void MTL::RenderCommandEncoder::setFragmentBytes(const void* bytes, NS::UInteger length, NS::UInteger index)
 {
-    Object::sendMessage<void>(this, _MTL_PRIVATE_SEL(setFragmentBytes_length_atIndex_), bytes, length, index);
+    _MTL_PRIVATE_SEND_CACHED(void, setFragmentBytes_length_atIndex_, bytes, length, index);
 }
 
 _MTL_INLINE void MTL::RenderCommandEncoder::setFragmentIntersectionFunctionTable(const MTL::IntersectionFunctionTable* intersectionFunctionTable, NS::UInteger bufferIndex)
@@ -560,7 +560,7 @@ _MTL_INLINE void MTL::RenderCommandEncoder::setFragmentIntersectionFunctionTable
 
 _MTL_INLINE void MTL::RenderCommandEncoder::setFragmentSamplerState(const MTL::SamplerState* sampler, NS::UInteger index)
 {
-    Object::sendMessage<void>(this, _MTL_PRIVATE_SEL(setFragmentSamplerState_atIndex_), sampler, index);
+    _MTL_PRIVATE_SEND_CACHED(void, setFragmentSamplerState_atIndex_, sampler, index);
 }
 
 _MTL_INLINE void MTL::RenderCommandEncoder::setFragmentSamplerState(const MTL::SamplerState* sampler, float lodMinClamp, float lodMaxClamp, NS::UInteger index)
@@ -580,7 +580,7 @@ _MTL_INLINE void MTL::RenderCommandEncoder::setFragmentSamplerStates(const MTL::
 
 _MTL_INLINE void MTL::RenderCommandEncoder::setFragmentTexture(const MTL::Texture* texture, NS::UInteger index)
 {
-    Object::sendMessage<void>(this, _MTL_PRIVATE_SEL(setFragmentTexture_atIndex_), texture, index);
+    _MTL_PRIVATE_SEND_CACHED(void, setFragmentTexture_atIndex_, texture, index);
 }
 
 _MTL_INLINE void MTL::RenderCommandEncoder::setFragmentTextures(const MTL::Texture* const textures[], NS::Range range)
@@ -600,7 +600,7 @@ _MTL_INLINE void MTL::RenderCommandEncoder::setFragmentVisibleFunctionTables(con
 
 _MTL_INLINE void MTL::RenderCommandEncoder::setFrontFacingWinding(MTL::Winding frontFacingWinding)
 {
-    Object::sendMessage<void>(this, _MTL_PRIVATE_SEL(setFrontFacingWinding_), frontFacingWinding);
+    _MTL_PRIVATE_SEND_CACHED(void, setFrontFacingWinding_, frontFacingWinding);
 }
 
 _MTL_INLINE void MTL::RenderCommandEncoder::setMeshBuffer(const MTL::Buffer* buffer, NS::UInteger offset, NS::UInteger index)
@@ -710,7 +710,7 @@ _MTL_INLINE void MTL::RenderCommandEncoder::setObjectThreadgroupMemoryLength(NS:
 
 _MTL_INLINE void MTL::RenderCommandEncoder::setRenderPipelineState(const MTL::RenderPipelineState* pipelineState)
 {
-    Object::sendMessage<void>(this, _MTL_PRIVATE_SEL(setRenderPipelineState_), pipelineState);
+    _MTL_PRIVATE_SEND_CACHED(void, setRenderPipelineState_, pipelineState);
 }
 
 _MTL_INLINE void MTL::RenderCommandEncoder::setScissorRect(MTL::ScissorRect rect)
@@ -850,7 +850,7 @@ _MTL_INLINE void MTL::RenderCommandEncoder::setVertexAmplificationCount(NS::UInt
 
 _MTL_INLINE void MTL::RenderCommandEncoder::setVertexBuffer(const MTL::Buffer* buffer, NS::UInteger offset, NS::UInteger index)
 {
-    Object::sendMessage<void>(this, _MTL_PRIVATE_SEL(setVertexBuffer_offset_atIndex_), buffer, offset, index);
+    _MTL_PRIVATE_SEND_CACHED(void, setVertexBuffer_offset_atIndex_, buffer, offset, index);
 }
 
 _MTL_INLINE void MTL::RenderCommandEncoder::setVertexBuffer(const MTL::Buffer* buffer, NS::UInteger offset, NS::UInteger stride, NS::UInteger index)
@@ -860,7 +860,7 @@ _MTL_INLINE void MTL::RenderCommandEncoder::setVertexBuffer(const MTL::Buffer* b
 
 _MTL_INLINE void MTL::RenderCommandEncoder::setVertexBufferOffset(NS::UInteger offset, NS::UInteger index)
 {
-    Object::sendMessage<void>(this, _MTL_PRIVATE_SEL(setVertexBufferOffset_atIndex_), offset, index);
+    _MTL_PRIVATE_SEND_CACHED(void, setVertexBufferOffset_atIndex_, offset, index);
 }
 
 _MTL_INLINE void MTL::RenderCommandEncoder::setVertexBufferOffset(NS::UInteger offset, NS::UInteger stride, NS::UInteger index)
@@ -880,7 +880,7 @@ _MTL_INLINE void MTL::RenderCommandEncoder::setVertexBuffers(const MTL::Buffer*
 
 _MTL_INLINE void MTL::RenderCommandEncoder::setVertexBytes(const void* bytes, NS::UInteger length, NS::UInteger index)
 {
-    Object::sendMessage<void>(this, _MTL_PRIVATE_SEL(setVertexBytes_length_atIndex_), bytes, length, index);
+    _MTL_PRIVATE_SEND_CACHED(void, setVertexBytes_length_atIndex_, bytes, length, index);
 }
 
 _MTL_INLINE void MTL::RenderCommandEncoder::setVertexBytes(const void* bytes, NS::UInteger length, NS::UInteger stride, NS::UInteger index)
@@ -920,7 +920,7 @@ _MTL_INLINE void MTL::RenderCommandEncoder::setVertexSamplerStates(const MTL::Sa
 
 _MTL_INLINE void MTL::RenderCommandEncoder::setVertexTexture(const MTL::Texture* texture, NS::UInteger index)
 {
-    Object::sendMessage<void>(this, _MTL_PRIVATE_SEL(setVertexTexture_atIndex_), texture, index);
+    _MTL_PRIVATE_SEND_CACHED(void, setVertexTexture_atIndex_, texture, index);
 }
 
 _MTL_INLINE void MTL::RenderCommandEncoder::setVertexTextures(const MTL::Texture* const textures[], NS::Range range)
@@ -28,9 +28,20 @@
 
 //-------------------------------------------------------------------------------------------------------------------------------------------------------------
 
+#if defined( METALCPP_LAZY_REGISTRATION )
+
+#include "../Foundation/NSLazySymbol.hpp"
+
+#define _MTLFX_PRIVATE_CLS( symbol )                    ( MTLFX::Private::Class::s_k##symbol.get() )
+#define _MTLFX_PRIVATE_SEL( accessor )                  ( MTLFX::Private::Selector::s_k##accessor.get() )
+
+#else
+
 #define _MTLFX_PRIVATE_CLS( symbol )                    ( MTLFX::Private::Class::s_k##symbol )
 #define _MTLFX_PRIVATE_SEL( accessor )                  ( MTLFX::Private::Selector::s_k##accessor )
 
+#endif // METALCPP_LAZY_REGISTRATION
+
 //-------------------------------------------------------------------------------------------------------------------------------------------------------------
 
 #if defined( MTLFX_PRIVATE_IMPLEMENTATION )
@@ -51,9 +62,15 @@
 #define _MTLFX_PRIVATE_OBJC_GET_PROTOCOL( symbol )      objc_getProtocol(#symbol)
 #endif // __OBJC__
 
+#if defined( METALCPP_LAZY_REGISTRATION )
+#define _MTLFX_PRIVATE_DEF_CLS( symbol )                NS::Private::LazyClass s_k##symbol _MTLFX_PRIVATE_VISIBILITY { #symbol }
+#define _MTLFX_PRIVATE_DEF_PRO( symbol )                NS::Private::LazyProtocol s_k##symbol _MTLFX_PRIVATE_VISIBILITY { #symbol }
+#define _MTLFX_PRIVATE_DEF_SEL( accessor, symbol )      NS::Private::LazySelector s_k##accessor _MTLFX_PRIVATE_VISIBILITY { symbol }
+#else
 #define _MTLFX_PRIVATE_DEF_CLS( symbol )                void* s_k##symbol _MTLFX_PRIVATE_VISIBILITY = _MTLFX_PRIVATE_OBJC_LOOKUP_CLASS( symbol )
 #define _MTLFX_PRIVATE_DEF_PRO( symbol )                void* s_k##symbol _MTLFX_PRIVATE_VISIBILITY = _MTLFX_PRIVATE_OBJC_GET_PROTOCOL( symbol )
 #define _MTLFX_PRIVATE_DEF_SEL( accessor, symbol )       SEL s_k##accessor _MTLFX_PRIVATE_VISIBILITY = sel_registerName( symbol )
+#endif // METALCPP_LAZY_REGISTRATION
 
 #include <dlfcn.h>
 #define MTLFX_DEF_FUNC( name, signature )               using Fn##name = signature; \
@@ -101,9 +118,15 @@ namespace MTLFX::Private
 
 #else
 
+#if defined( METALCPP_LAZY_REGISTRATION )
+#define _MTLFX_PRIVATE_DEF_CLS( symbol )                extern NS::Private::LazyClass s_k##symbol
+#define _MTLFX_PRIVATE_DEF_PRO( symbol )                extern NS::Private::LazyProtocol s_k##symbol
+#define _MTLFX_PRIVATE_DEF_SEL( accessor, symbol )      extern NS::Private::LazySelector s_k##accessor
+#else
 #define _MTLFX_PRIVATE_DEF_CLS( symbol )                extern void* s_k##symbol
 #define _MTLFX_PRIVATE_DEF_PRO( symbol )                extern void* s_k##symbol
 #define _MTLFX_PRIVATE_DEF_SEL( accessor, symbol )      extern SEL s_k##accessor
+#endif // METALCPP_LAZY_REGISTRATION
 #define _MTLFX_PRIVATE_DEF_STR( type, symbol )          extern type const MTLFX::symbol
 #define _MTLFX_PRIVATE_DEF_CONST( type, symbol )        extern type const MTLFX::symbol
 #define _MTLFX_PRIVATE_DEF_WEAK_CONST( type, symbol )   extern type const MTLFX::symbol